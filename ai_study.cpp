@@ -3,6 +3,7 @@
 // - Calls OpenAI's Chat Completions API via libcurl
 // - Summarizes pasted study text
 // - Generates flashcards and lets you flip through them in a terminal UI
+// - Reads study text interactively, from --input FILE, or from a piped stdin
 
 #include <iostream>
 #include <string>
@@ -12,6 +13,53 @@
 #include <limits>
 #include <random>
 #include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <array>
+#include <queue>
+#include <functional>
+#include <cmath>
+#include <sstream>
+
+#include <fcntl.h>              // open()
+#include <unistd.h>             // read(), isatty()
+#include <sys/mman.h>           // mmap() for bulk file ingestion
+#include <sys/stat.h>           // fstat()
+#include <sys/ioctl.h>          // TIOCGWINSZ (terminal width)
+#include <termios.h>            // raw-mode keyboard input
+#include <poll.h>               // poll() for escape-sequence timeouts
+#include <signal.h>             // sigaction() so Ctrl-C cancels requests
+#include <sys/socket.h>         // metrics endpoint
+#include <netinet/in.h>
+#include <sys/un.h>             // daemon mode's Unix socket
+#include <sys/uio.h>            // sendmsg() of frame header + body
+#include <sys/wait.h>           // waitpid() in the daemon benchmark
+#include <spawn.h>              // posix_spawn()
+#include <ftw.h>                // nftw(): benchmark temp-tree cleanup
+#include <sys/resource.h>       // getrusage(): batch memory use
+#include <strings.h>            // strcasecmp()
+
+#if defined(__x86_64__)
+// GCC 12's AVX-512 headers seed some intrinsics with self-initialised
+// "undefined" registers, which -Wuninitialized reports at the header line
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>          // AVX2 / AVX-512 similarity kernels
+#pragma GCC diagnostic pop
+#endif
 
 #include <curl/curl.h>          // HTTP requests to OpenAI
 #include <nlohmann/json.hpp>    // JSON parsing (https://github.com/nlohmann/json)
@@ -31,6 +79,7 @@ struct SummaryResult {
     std::string summary;                 // main summary text
     std::vector<std::string> keyPoints;  // bullet key points
     std::vector<Definition> definitions; // list of definitions found in the text
+    bool offline = false;                // made locally while the API was unreachable
 };
 
 // Represents a single flashcard
@@ -42,6 +91,48 @@ struct Flashcard {
 // Result object for flashcard generation
 struct FlashcardResult {
     std::vector<Flashcard> flashcards;
+    bool offline = false;                // made locally while the API was unreachable
+};
+
+// Command-line options (everything has a sensible interactive default)
+struct AppOptions {
+    std::string inputPath;               // --input FILE ("-" = stdin)
+    int mode = 0;                        // --mode 1/2/3 (0 = ask the user)
+    bool lineMode = false;               // --line-mode: Enter-terminated viewer commands
+    bool showStats = false;              // --stats: print timing statistics to stderr
+    bool prefetch = false;               // --prefetch: generate more cards while studying
+    std::string srsPath;                 // --srs FILE: spaced-repetition review state
+    double dedupThreshold = 0.5;         // --dedup-threshold: near-duplicate Jaccard cutoff (0 = off)
+    std::string embedder = "local";      // --embedder local|openai: model behind "similar"
+    bool combined = false;               // --combined: mode 3 in a single request
+    std::string chunkCacheDir;           // --chunk-cache DIR: memoize results per text chunk
+    std::string journalPath;             // --journal FILE: crash-safe per-chunk results, resumable
+    std::string sharedCachePath;         // --shared-cache FILE: replies shared across processes
+    std::string batchList;               // --batch LIST: study every file named in LIST
+    size_t workers = 4;                  // --workers N: concurrent API requests in --batch
+    bool shed = false;                   // --shed: drop batch chunks when the workers fall behind
+    bool bulk = false;                   // --bulk: send --batch through the Batch API
+    bool bulkDetach = false;             // --bulk-detach: submit the batches and exit
+    std::string bulkResume;              // --bulk-resume IDS: collect batches submitted earlier
+    double bulkPoll = 30;                // --bulk-poll SEC: between batch status checks
+    std::string serveSocket;             // --serve SOCKET: run as a daemon serving study jobs
+    std::string daemonSocket;            // --daemon SOCKET: send the job to a running daemon
+    std::string metricsFile;             // --metrics-file FILE: Prometheus-text dump at exit
+    int metricsPort = 0;                 // --metrics-port N: serve metrics on 127.0.0.1:N
+    std::string routesPath;              // --routes FILE: model routing rules (JSON)
+    std::string routeLogPath;            // --route-log FILE: per-request model/latency log (JSONL)
+    double connectTimeout = 10;          // --connect-timeout SEC
+    double timeout = 120;                // --timeout SEC: whole request (0 = none)
+    double idleTimeout = 0;              // --idle-timeout SEC: no data received (0 = off)
+    bool hedge = false;                  // --hedge: duplicate chat requests slower than p95
+    long hedgeAfterMs = 0;               // --hedge-after MS: fixed hedge delay
+    bool offlineFallback = true;         // --no-fallback: fail instead of answering locally
+    bool offline = false;                // --offline: make everything locally, no API calls
+    bool preview = false;                // --preview: local summary first, then the API's
+    std::string localModel;              // --local-model FILE: answer with a GGUF model on the CPU
+    size_t threads = 0;                  // --threads N: task pool size (0 = one per core)
+    std::string benchName;               // --bench NAME [args...]
+    std::vector<std::string> benchArgs;  // extra args for the benchmark
 };
 
 // ======== HELPER TO EXTRACT JSON FROM MODEL REPLY =========
@@ -63,424 +154,9881 @@ static std::string extract_json_block(const std::string& content) {
     return content.substr(firstBrace, lastBrace - firstBrace + 1);
 }
 
-// ======== TERMINAL UI HELPERS =========
+// ======== TASK EXECUTOR =========
 
-// Clears the terminal screen using ANSI escape codes
-static void clear_screen() {
-    std::cout << "\033[2J\033[H";
-}
+// Work-stealing pool for CPU-bound stages (card signatures, embeddings,
+// parsing and hashing of results). Each worker has its own deque: it pushes
+// and pops its own tasks at the back (LIFO, cache-warm), and idle workers
+// steal the oldest task from the front of someone else's. Threads outside
+// the pool submit through a shared injection queue. Workers that find
+// nothing park on a condition variable until work is submitted.
+//
+// A pool of N threads starts N - 1 workers: the thread waiting on a
+// TaskGroup runs tasks too, so N = 1 runs everything inline.
+class TaskPool {
+public:
+    using Task = std::function<void()>;
 
-// Renders a single flashcard (and optionally the answer) to the terminal
-static void display_card(const Flashcard& card, int index, int total, bool showAnswer) {
-    clear_screen();
-    std::cout << "Flashcard " << (index + 1) << "/" << total << "\n";
-    std::cout << "-------------------------\n";
-    std::cout << "Q: " << card.question << "\n\n";
-    if (showAnswer) {
-        std::cout << "A: " << card.answer << "\n\n";
-    } else {
-        std::cout << "A: [hidden] (press 'f' to flip)\n\n";
+    explicit TaskPool(size_t threads) : queues_(std::max<size_t>(threads, 1)) {
+        for (size_t i = 0; i + 1 < queues_.size(); ++i) {
+            workers_.emplace_back([this, i] { work(i); });
+        }
     }
-    std::cout << "Commands: [f]lip  [n]ext  [p]rev  [r]andom  [j]ump <num>  [q]uit\n";
-}
 
-// Interactive flashcard viewer loop for the terminal
-static void run_flashcard_viewer(const FlashcardResult& deck) {
-    // If no flashcards, just exit
-    if (deck.flashcards.empty()) {
-        std::cout << "No flashcards to view.\n";
-        return;
+    ~TaskPool() {
+        {
+            std::lock_guard<std::mutex> lock(parkMu_);
+            stop_ = true;
+        }
+        parked_.notify_all();
+        for (auto& w : workers_) w.join();
     }
 
-    int idx = 0;                      // current flashcard index
-    bool showAnswer = false;          // whether answer is visible
-    std::string cmd;                  // user command/input line
-    std::mt19937 rng((unsigned)std::random_device{}()); // RNG for random card
+    size_t threads() const { return queues_.size(); }
 
-    while (true) {
-        // Display current card
-        display_card(deck.flashcards[idx], idx, (int)deck.flashcards.size(), showAnswer);
+    void submit(Task task) {
+        // A worker keeps what it spawns; anyone else uses the injection queue
+        Queue& q = t_pool == this ? queues_[t_worker] : queues_.back();
+        {
+            std::lock_guard<std::mutex> lock(q.mu);
+            q.tasks.push_back(std::move(task));
+        }
+        pending_.fetch_add(1);
+        if (idle_.load() > 0) {
+            { std::lock_guard<std::mutex> lock(parkMu_); }  // the parker is waiting or will see pending_
+            parked_.notify_one();
+        }
+    }
 
-        // Read a command line from user
-        if (!std::getline(std::cin, cmd)) break; // if EOF, exit
-        if (cmd.empty()) continue;               // ignore empty lines
+    // Runs one queued task on the calling thread; false if none was found
+    bool run_one() {
+        Task task;
+        if (!take(task)) return false;
+        task();
+        return true;
+    }
 
-        // Trim leading spaces
-        size_t p = cmd.find_first_not_of(" \t");
-        if (p != std::string::npos) cmd = cmd.substr(p);
+private:
+    struct Queue {
+        std::mutex mu;
+        std::deque<Task> tasks;
+    };
 
-        // Handle supported commands
-        if (cmd == "f" || cmd == "flip") {
-            // Toggle answer visibility
-            showAnswer = !showAnswer;
+    // Own queue from the back, then the injection queue and the other
+    // workers from the front
+    bool take(Task& task) {
+        size_t n = queues_.size();
+        size_t self = t_pool == this ? t_worker : n - 1;
+        if (pop(queues_[self], task, true)) return true;
+        size_t start = (size_t)mix_seed() % n;
+        for (size_t k = 0; k < n; ++k) {
+            size_t victim = (start + k) % n;
+            if (victim != self && pop(queues_[victim], task, false)) return true;
+        }
+        return false;
+    }
 
-        } else if (cmd == "n" || cmd == "next") {
-            // Move to next card (wrap around)
-            idx = (idx + 1) % (int)deck.flashcards.size();
-            showAnswer = false;
+    bool pop(Queue& q, Task& task, bool back) {
+        std::lock_guard<std::mutex> lock(q.mu);
+        if (q.tasks.empty()) return false;
+        if (back) {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+        } else {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+        }
+        pending_.fetch_sub(1);
+        return true;
+    }
 
-        } else if (cmd == "p" || cmd == "prev") {
-            // Move to previous card (wrap around)
-            idx = (idx - 1 + (int)deck.flashcards.size()) % (int)deck.flashcards.size();
-            showAnswer = false;
+    void work(size_t index) {
+        t_pool = this;
+        t_worker = index;
+        while (true) {
+            if (run_one()) continue;
+            // Nothing to steal right now: a short spin catches follow-up
+            // tasks without a sleep/wake round trip
+            bool found = false;
+            for (int spin = 0; spin < 64 && !found; ++spin) {
+                std::this_thread::yield();
+                found = pending_.load() > 0;
+            }
+            if (found) continue;
 
-        } else if (cmd == "r" || cmd == "random") {
-            // Jump to random card
-            std::uniform_int_distribution<int> dist(0, (int)deck.flashcards.size() - 1);
-            idx = dist(rng);
-            showAnswer = false;
+            std::unique_lock<std::mutex> lock(parkMu_);
+            idle_.fetch_add(1);
+            parked_.wait(lock, [this] { return stop_ || pending_.load() > 0; });
+            idle_.fetch_sub(1);
+            if (stop_) return;
+        }
+    }
 
-        } else if (cmd.size() > 2 && (cmd[0] == 'j' || cmd.rfind("jump", 0) == 0)) {
-            // "jump" command (e.g., "j 3" or "jump 5")
-            std::string numstr;
-            // Extract digits and optional minus sign from the string
-            for (char c : cmd)
-                if ((c >= '0' && c <= '9') || c == '-')
-                    numstr.push_back(c);
+    // Per-thread victim rotation so thieves don't all hit the same queue
+    static uint32_t mix_seed() {
+        thread_local uint32_t x = (uint32_t)std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return x;
+    }
 
-            if (!numstr.empty()) {
-                try {
-                    int t = std::stoi(numstr);
-                    // Only jump if index is in valid range
-                    if (t >= 1 && t <= (int)deck.flashcards.size()) {
-                        idx = t - 1;
-                        showAnswer = false;
-                    }
-                } catch (...) {
-                    // Ignore invalid numbers
-                }
-            }
+    static thread_local TaskPool* t_pool;
+    static thread_local size_t t_worker;
 
-        } else if (cmd == "q" || cmd == "quit") {
-            // Quit viewer
-            break;
+    std::vector<Queue> queues_;         // one per worker, then the injection queue
+    std::vector<std::thread> workers_;
+    std::atomic<long> pending_{0};      // queued, not yet taken
+    std::atomic<int> idle_{0};
+    std::mutex parkMu_;
+    std::condition_variable parked_;
+    bool stop_ = false;
+};
 
-        } else {
-            // If the command isn't recognized, try to interpret it as a card number
+thread_local TaskPool* TaskPool::t_pool = nullptr;
+thread_local size_t TaskPool::t_worker = 0;
+
+// Tasks that are waited for together. wait() runs queued tasks (its own or
+// anyone's) instead of blocking, so groups can nest inside pool tasks.
+// The first exception thrown by a task is rethrown from wait().
+class TaskGroup {
+public:
+    explicit TaskGroup(TaskPool& pool) : pool_(pool) {}
+    ~TaskGroup() {
+        try {
+            wait();
+        } catch (...) {
+        }
+    }
+
+    void run(std::function<void()> fn) {
+        left_.fetch_add(1);
+        pool_.submit([this, fn] {
             try {
-                int t = std::stoi(cmd);
-                if (t >= 1 && t <= (int)deck.flashcards.size()) {
-                    idx = t - 1;
-                    showAnswer = false;
-                }
+                fn();
             } catch (...) {
-                // Unknown input, ignore
+                std::lock_guard<std::mutex> lock(mu_);
+                if (!error_) error_ = std::current_exception();
             }
+            left_.fetch_sub(1, std::memory_order_release);
+        });
+    }
+
+    void wait() {
+        while (left_.load(std::memory_order_acquire) > 0) {
+            if (!pool_.run_one()) std::this_thread::yield();
+        }
+        std::lock_guard<std::mutex> lock(mu_);
+        if (error_) {
+            std::exception_ptr e = error_;
+            error_ = nullptr;
+            std::rethrow_exception(e);
         }
     }
-    clear_screen();
-}
 
-// ======== CURL RESPONSE CALLBACK =========
+private:
+    TaskPool& pool_;
+    std::atomic<long> left_{0};
+    std::mutex mu_;
+    std::exception_ptr error_;
+};
 
-// Callback that libcurl uses to write incoming HTTP response data into a std::string
-static size_t WriteCallback(void* contents, size_t size, size_t nmemb, void* userp) {
-    size_t totalSize = size * nmemb;
-    std::string* s = static_cast<std::string*>(userp);
-    s->append(static_cast<char*>(contents), totalSize);
-    return totalSize;
+// Calls fn(begin, end) over [0, n) in pieces of at least `grain` items,
+// spread over the pool (inline when there is only one thread or little work)
+static void parallel_for(TaskPool& pool, size_t n, size_t grain,
+                         const std::function<void(size_t, size_t)>& fn) {
+    size_t pieces = std::min(n / std::max<size_t>(grain, 1), pool.threads() * 4);
+    if (pieces <= 1 || pool.threads() == 1) {
+        if (n > 0) fn(0, n);
+        return;
+    }
+    TaskGroup group(pool);
+    for (size_t p = 1; p < pieces; ++p) {
+        group.run([&fn, n, pieces, p] { fn(n * p / pieces, n * (p + 1) / pieces); });
+    }
+    fn(0, n / pieces);  // the first piece on this thread
+    group.wait();
 }
 
-// ======== CORE OPENAI CALLER =========
+// Thread count for task_pool() (0 = one per core); set before first use
+static size_t& task_pool_threads() {
+    static size_t threads = 0;
+    return threads;
+}
 
-// Sends a prompt to OpenAI Chat Completions API and returns the raw JSON response as a string
-std::string call_openai_chat(const std::string& prompt) {
-    // Grab API key from environment variable
-    const char* envKey = std::getenv("OPENAI_API_KEY");
-    if (!envKey) {
-        throw std::runtime_error("OPENAI_API_KEY environment variable not set.");
-    }
-    std::string apiKey = envKey;
+// The process-wide pool the pipeline stages run on
+static TaskPool& task_pool() {
+    static TaskPool pool(task_pool_threads() ? task_pool_threads()
+                                             : std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
 
-    // Initialize CURL handle
-    CURL* curl = curl_easy_init();
-    if (!curl) {
-        throw std::runtime_error("Failed to init curl");
+// Bounded multi-producer/multi-consumer ring buffer (Vyukov). Each cell
+// carries a sequence number saying whether it is ready to be written or
+// read for a given lap, so producers and consumers each claim a position
+// with one CAS and never take a lock. A full queue is how a slow stage
+// pushes back on the stages feeding it.
+template <typename T>
+class MpmcQueue {
+public:
+    explicit MpmcQueue(size_t capacity) {
+        size_t cap = 2;
+        while (cap < capacity) cap <<= 1;
+        mask_ = cap - 1;
+        cells_.reset(new Cell[cap]);
+        for (size_t i = 0; i < cap; ++i) cells_[i].seq.store(i, std::memory_order_relaxed);
     }
 
-    std::string readBuffer;  // will hold full HTTP response
+    size_t capacity() const { return mask_ + 1; }
 
-    const char* url = "https://api.openai.com/v1/chat/completions";
+    // Non-blocking; false when full (the item is left untouched)
+    bool try_push(T& item) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells_[pos & mask_];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(item);
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
 
-    // Build JSON payload to send to OpenAI
-    json body;
-    body["model"] = "gpt-4.1-mini";    // model name
-    body["messages"] = {               // single user message with prompt
-        {
-            {"role", "user"},
-            {"content", prompt}
+    // Non-blocking; false when empty
+    bool try_pop(T& item) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells_[pos & mask_];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    item = std::move(cell.value);
+                    cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
         }
-    };
-    std::string bodyStr = body.dump(); // serialize JSON to string
+    }
 
-    // Set HTTP headers (JSON + Authorization)
-    struct curl_slist* headers = nullptr;
-    std::string authHeader = "Authorization: Bearer " + apiKey;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    headers = curl_slist_append(headers, authHeader.c_str());
+    // Waits while full; false if the queue was closed
+    bool push(T item) {
+        for (int round = 0; !closed_.load(std::memory_order_relaxed); ++round) {
+            if (try_push(item)) return true;
+            back_off(round);
+        }
+        return false;
+    }
 
-    // Configure CURL options
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, bodyStr.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback); // callback for incoming data
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &readBuffer);       // store data in readBuffer
-
-    // Perform the HTTP POST
-    CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
-        throw std::runtime_error(std::string("curl_easy_perform() failed: ") +
-                                 curl_easy_strerror(res));
+    // Waits while empty; false once the queue is closed and drained
+    bool pop(T& item) {
+        for (int round = 0;; ++round) {
+            if (try_pop(item)) return true;
+            if (closed_.load(std::memory_order_acquire)) return try_pop(item);
+            back_off(round);
+        }
     }
 
-    // Check HTTP status code
-    long httpCode = 0;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
-    if (httpCode < 200 || httpCode >= 300) {
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
-        throw std::runtime_error("OpenAI API returned HTTP code " +
-                                 std::to_string(httpCode) +
-                                 "\nResponse: " + readBuffer);
+    // Call once every producer has returned: consumers drain what is
+    // left, then pop() fails
+    void close() { closed_.store(true, std::memory_order_release); }
+
+private:
+    struct alignas(64) Cell {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    // Spin briefly, then yield, then sleep (up to 1 ms): the stages on the
+    // other side of a full or empty queue are usually waiting on the network
+    static void back_off(int round) {
+        if (round < 16) return;
+        if (round < 64) {
+            std::this_thread::yield();
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(std::min(1000, 20 << std::min(round - 64, 6))));
     }
 
-    // Clean up headers and CURL handle
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> tail_{0};   // next position to write
+    alignas(64) std::atomic<size_t> head_{0};   // next position to read
+    std::atomic<bool> closed_{false};
+};
 
-    // Return raw JSON response string
-    return readBuffer;
+// ======== NEAR-DUPLICATE DETECTION =========
+
+// 64-bit FNV-1a hash (stable across runs, used for card identity)
+static uint64_t fnv1a64(const char* data, size_t len, uint64_t h = 1469598103934665603ULL) {
+    for (size_t i = 0; i < len; ++i) {
+        h ^= static_cast<unsigned char>(data[i]);
+        h *= 1099511628211ULL;
+    }
+    return h;
 }
 
-// ======== AI LOGIC: SUMMARY =========
+// Identity of a flashcard: hash of its question and answer
+static uint64_t card_id(const Flashcard& card) {
+    uint64_t h = fnv1a64(card.question.data(), card.question.size());
+    h = fnv1a64("\x1f", 1, h);
+    return fnv1a64(card.answer.data(), card.answer.size(), h);
+}
 
-// Sends text to OpenAI with a prompt asking for:
-// - summary
-// - key points
-// - definitions
-// and parses the JSON result into SummaryResult
-SummaryResult summarize_content(const std::string& text) {
-    // Prompt instructing the model to reply ONLY with JSON in a specific shape
-    std::string prompt = R"(
-You are an AI study assistant.
+// splitmix64 finalizer: cheap, well-mixed 64-bit permutation
+static inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
 
-TASK:
-1. Read the following text.
-2. Write a concise summary (150–250 words) in simple language.
-3. List 3–5 key points.
-4. If there are definitions, include them in your own words.
+// MinHash signature length, and bits kept per entry (b-bit MinHash keeps
+// signatures at 128 bytes per card so millions of cards fit in memory)
+static const int kMinHashSize = 64;
+typedef std::array<uint16_t, kMinHashSize> MinHashSig;
 
-Return ONLY valid JSON with this structure:
-{
-  "summary": "string",
-  "key_points": ["string", "string"],
-  "definitions": [
-    {"term": "string", "definition": "string"}
-  ]
+// Hashes of the word unigrams and bigrams of a card (question + answer),
+// after lowercasing and stripping punctuation
+static void card_shingles(const Flashcard& card, std::vector<uint64_t>& out) {
+    out.clear();
+    uint64_t prev = 0;
+    uint64_t h = 1469598103934665603ULL; // FNV-1a of the word so far
+    bool inWord = false;
+    auto flush_word = [&]() {
+        if (!inWord) return;
+        h = mix64(h);
+        out.push_back(h);
+        if (prev) out.push_back(mix64(prev * 31 + h)); // bigram
+        prev = h;
+        h = 1469598103934665603ULL;
+        inWord = false;
+    };
+    for (const std::string* field : {&card.question, &card.answer}) {
+        for (char ch : *field) {
+            unsigned char c = static_cast<unsigned char>(ch);
+            if (c >= 'A' && c <= 'Z') c |= 0x20; // ASCII lowercase
+            if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80) {
+                h = (h ^ c) * 1099511628211ULL;
+                inWord = true;
+            } else {
+                flush_word();
+            }
+        }
+        flush_word();
+    }
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
 }
 
-TEXT:
-)";
-    // Append user-pasted text after the prompt
-    prompt += text;
+// Per-function seeds for MinHash; hash i of an (already mixed) shingle x is
+// (x ^ seed[i]) * golden, a one-multiply family the compiler vectorizes
+static const std::array<uint64_t, kMinHashSize>& minhash_seeds() {
+    static const std::array<uint64_t, kMinHashSize> seeds = [] {
+        std::array<uint64_t, kMinHashSize> s{};
+        for (int i = 0; i < kMinHashSize; ++i) s[i] = mix64((uint64_t)i + 1);
+        return s;
+    }();
+    return seeds;
+}
 
-    // Call OpenAI
-    std::string rawResponse = call_openai_chat(prompt);
+// MinHash signature: for each of kMinHashSize hash functions, the minimum
+// over all shingles, keeping its top 16 bits. Returns false for empty cards.
+static bool minhash_signature(const Flashcard& card, std::vector<uint64_t>& shingles, MinHashSig& sig) {
+    card_shingles(card, shingles);
+    if (shingles.empty()) return false;
 
-    // Parse top-level API response JSON
-    json resJson = json::parse(rawResponse);
+    const auto& seeds = minhash_seeds();
+    uint64_t mins[kMinHashSize];
+    std::fill(mins, mins + kMinHashSize, UINT64_MAX);
+    for (uint64_t x : shingles) {
+        for (int i = 0; i < kMinHashSize; ++i) {
+            uint64_t v = (x ^ seeds[i]) * 0x9e3779b97f4a7c15ULL;
+            mins[i] = v < mins[i] ? v : mins[i];
+        }
+    }
+    for (int i = 0; i < kMinHashSize; ++i) sig[i] = (uint16_t)(mins[i] >> 48);
+    return true;
+}
 
-    // Extract the assistant's message content
-    std::string content;
-    const auto& msgContent = resJson["choices"][0]["message"]["content"];
+// Estimated Jaccard similarity of two signatures (fraction of equal entries)
+static double minhash_similarity(const MinHashSig& a, const MinHashSig& b) {
+    int same = 0;
+    for (int i = 0; i < kMinHashSize; ++i) same += a[i] == b[i];
+    return (double)same / kMinHashSize;
+}
 
-    if (msgContent.is_string()) {
-        content = msgContent.get<std::string>();
-    } else if (msgContent.is_array()) {
-        // In case the API returns content as an array of parts
-        for (const auto& part : msgContent) {
-            if (part.contains("text") && part["text"].is_string()) {
-                content += part["text"].get<std::string>();
-            }
-        }
-    } else {
-        throw std::runtime_error("Unexpected content format in OpenAI response.");
+// Picks LSH rows-per-band for a similarity threshold: the most selective
+// banding whose S-curve midpoint (1/b)^(1/r) stays comfortably below the
+// threshold, so true duplicates are very likely to share a bucket
+static int lsh_rows_per_band(double threshold) {
+    int best = 1;
+    for (int r = 1; r <= kMinHashSize; r *= 2) {
+        double b = (double)kMinHashSize / r;
+        if (std::pow(1.0 / b, 1.0 / r) <= 0.85 * threshold) best = r;
     }
+    return best;
+}
 
-    // Extract pure JSON block from the content (removes ```json fences, text, etc.)
-    std::string jsonText = extract_json_block(content);
+// Union-find with path halving
+struct DisjointSets {
+    explicit DisjointSets(size_t n) : parent(n) {
+        for (size_t i = 0; i < n; ++i) parent[i] = (uint32_t)i;
+    }
+    uint32_t find(uint32_t x) {
+        while (parent[x] != x) x = parent[x] = parent[parent[x]];
+        return x;
+    }
+    // Joins two sets; the smaller index stays the representative
+    void unite(uint32_t a, uint32_t b) {
+        a = find(a);
+        b = find(b);
+        if (a == b) return;
+        if (b < a) std::swap(a, b);
+        parent[b] = a;
+    }
+    std::vector<uint32_t> parent;
+};
 
-    // Parse the assistant message content as JSON
-    json summaryJson = json::parse(jsonText);
+// Groups near-duplicate cards with MinHash + LSH banding.
+// Each band is handled by sorting (band hash, card) pairs and comparing every
+// card in a run of equal hashes with the run's first card, so the work is
+// O(n log n) per band and memory stays O(n) regardless of bucket skew.
+// Returns, per card, the index of the earliest card in its duplicate group.
+static std::vector<uint32_t> find_near_duplicates(const std::vector<Flashcard>& cards, double threshold) {
+    size_t n = cards.size();
+    std::vector<MinHashSig> sigs(n);
+    std::vector<char> valid(n);
+    parallel_for(task_pool(), n, 256, [&](size_t begin, size_t end) {
+        std::vector<uint64_t> shingles;
+        for (size_t i = begin; i < end; ++i) valid[i] = minhash_signature(cards[i], shingles, sigs[i]);
+    });
 
-    // Fill in the SummaryResult struct
-    SummaryResult result;
-    result.summary = summaryJson.value("summary", "");
+    DisjointSets sets(n);
+    int rows = lsh_rows_per_band(threshold);
+    std::vector<std::pair<uint64_t, uint32_t>> bucket;
+    bucket.reserve(n);
 
-    // Key points list
-    if (summaryJson.contains("key_points") && summaryJson["key_points"].is_array()) {
-        for (auto& kp : summaryJson["key_points"]) {
-            result.keyPoints.push_back(kp.get<std::string>());
+    for (int band = 0; band < kMinHashSize / rows; ++band) {
+        bucket.clear();
+        for (size_t i = 0; i < n; ++i) {
+            if (!valid[i]) continue;
+            const char* p = reinterpret_cast<const char*>(&sigs[i][band * rows]);
+            bucket.emplace_back(fnv1a64(p, rows * sizeof(uint16_t), (uint64_t)band), (uint32_t)i);
         }
-    }
+        std::sort(bucket.begin(), bucket.end());
 
-    // Definitions list
-    if (summaryJson.contains("definitions") && summaryJson["definitions"].is_array()) {
-        for (auto& d : summaryJson["definitions"]) {
-            Definition def;
-            def.term = d.value("term", "");
-            def.definition = d.value("definition", "");
-            result.definitions.push_back(def);
+        for (size_t run = 0; run < bucket.size();) {
+            size_t end = run + 1;
+            while (end < bucket.size() && bucket[end].first == bucket[run].first) ++end;
+            uint32_t head = bucket[run].second;
+            for (size_t k = run + 1; k < end; ++k) {
+                uint32_t other = bucket[k].second;
+                if (sets.find(head) != sets.find(other) &&
+                    minhash_similarity(sigs[head], sigs[other]) >= threshold) {
+                    sets.unite(head, other);
+                }
+            }
+            run = end;
         }
     }
 
-    return result;
+    std::vector<uint32_t> group(n);
+    for (size_t i = 0; i < n; ++i) group[i] = sets.find((uint32_t)i);
+    return group;
 }
 
-// ======== AI LOGIC: FLASHCARDS =========
+// Removes near-duplicates in place, keeping the earliest card of each group
+// (so cards already in a deck win over newly generated ones). Cards before
+// `firstNew` are never removed. Returns the number of cards removed.
+static size_t dedup_flashcards(std::vector<Flashcard>& cards, double threshold, size_t firstNew = 0) {
+    if (threshold <= 0.0 || cards.size() < 2) return 0;
+    std::vector<uint32_t> group = find_near_duplicates(cards, threshold);
 
-// Sends text to OpenAI asking it to generate a JSON list of flashcards
-FlashcardResult generate_flashcards(const std::string& text) {
-    // Prompt instructing the model on how to generate flashcards
-    std::string prompt = R"(
-You are an AI that creates study flashcards.
+    size_t out = firstNew;
+    for (size_t i = firstNew; i < cards.size(); ++i) {
+        if (group[i] != i) continue;
+        if (out != i) cards[out] = std::move(cards[i]);
+        ++out;
+    }
+    size_t removed = cards.size() - out;
+    cards.resize(out);
+    return removed;
+}
 
-Given the TEXT below, create 10–20 flashcards that help a student study.
+// ======== BACKGROUND PREFETCH =========
 
-Rules:
-- Questions should be clear and specific.
-- Answers should be brief (1–3 sentences).
-- Mix definitions, concepts, and reasoning questions.
+FlashcardResult generate_flashcards(const std::string& text,
+                                    const std::vector<std::string>& avoidQuestions = {});
 
-Return ONLY valid JSON with this structure:
-{
-  "flashcards": [
-    {"question": "string", "answer": "string"}
-  ]
-}
+// When set on a thread, call_openai_chat aborts that thread's transfer as
+// soon as the flag becomes true (checked from curl's progress callback)
+static thread_local const std::atomic<bool>* t_cancelFlag = nullptr;
 
-TEXT:
-)";
-    // Attach study text to the prompt
-    prompt += text;
+// Long documents are split into chunks of about this many characters when
+// prefetching, so the first cards arrive quickly and the rest stream in
+static const size_t kPrefetchChunkChars = 12000;
 
-    // Call OpenAI and parse
-    std::string rawResponse = call_openai_chat(prompt);
+// Upper bound on "more cards like these" rounds per session (each one is a paid request)
+static const int kMaxMoreRounds = 5;
 
-    json resJson = json::parse(rawResponse);
+// Splits text into chunks of at most ~maxChars, preferring paragraph breaks,
+// then line breaks, then sentence ends
+static std::vector<std::string> split_into_chunks(const std::string& text, size_t maxChars) {
+    std::vector<std::string> chunks;
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = std::min(text.size(), start + maxChars);
+        if (end < text.size()) {
+            size_t cut = text.rfind("\n\n", end);
+            if (cut == std::string::npos || cut <= start + maxChars / 2) cut = text.rfind('\n', end);
+            if (cut == std::string::npos || cut <= start + maxChars / 2) cut = text.rfind(". ", end);
+            if (cut != std::string::npos && cut > start + maxChars / 2) end = cut + 1;
+        }
+        chunks.push_back(text.substr(start, end - start));
+        start = end;
+    }
+    return chunks;
+}
 
-    // Extract the assistant's message content
-    std::string content;
-    const auto& msgContent = resJson["choices"][0]["message"]["content"];
+// Generates flashcards on a worker thread while the user studies.
+// Work items are the not-yet-processed chunks of a long document, plus
+// on-demand "more cards like these" rounds for short ones. The UI thread
+// only ever polls: take() never blocks, and wake_fd() becomes readable when
+// new cards are ready so a poll() loop can pick them up immediately.
+class DeckPrefetcher {
+public:
+    DeckPrefetcher(std::string text, std::vector<std::string> pendingChunks, double dedupThreshold)
+        : text_(std::move(text)), moreAllowed_(pendingChunks.empty()), dedupThreshold_(dedupThreshold) {
+        if (pipe2(wake_, O_NONBLOCK | O_CLOEXEC) != 0) wake_[0] = wake_[1] = -1;
+        for (auto& c : pendingChunks) jobs_.push_back({std::move(c), {}});
+        thread_ = std::thread(&DeckPrefetcher::worker, this);
+    }
 
-    if (msgContent.is_string()) {
-        content = msgContent.get<std::string>();
-    } else if (msgContent.is_array()) {
-        for (const auto& part : msgContent) {
-            if (part.contains("text") && part["text"].is_string()) {
-                content += part["text"].get<std::string>();
-            }
+    ~DeckPrefetcher() {
+        {
+            std::lock_guard<std::mutex> lk(m_);
+            stop_ = true;
         }
-    } else {
-        throw std::runtime_error("Unexpected content format in OpenAI response.");
+        cancel_ = true; // abandons an in-flight request instead of waiting for it
+        cv_.notify_all();
+        thread_.join();
+        if (wake_[0] >= 0) close(wake_[0]);
+        if (wake_[1] >= 0) close(wake_[1]);
     }
 
-    // Extract and parse the JSON block
-    std::string jsonText = extract_json_block(content);
-    json fcJson = json::parse(jsonText);
+    DeckPrefetcher(const DeckPrefetcher&) = delete;
+    DeckPrefetcher& operator=(const DeckPrefetcher&) = delete;
 
-    FlashcardResult result;
-    // Extract flashcards from JSON array
-    if (fcJson.contains("flashcards") && fcJson["flashcards"].is_array()) {
-        for (auto& fc : fcJson["flashcards"]) {
-            Flashcard card;
-            card.question = fc.value("question", "");
-            card.answer   = fc.value("answer", "");
-            result.flashcards.push_back(card);
-        }
+    // Asks for another round of cards unlike the ones already in the deck.
+    // Ignored while a round is queued/running or once the round budget is spent.
+    void want_more(const std::vector<Flashcard>& deck) {
+        std::lock_guard<std::mutex> lk(m_);
+        if (!moreAllowed_ || busy_ || !jobs_.empty() || moreRounds_ >= kMaxMoreRounds || !error_.empty()) return;
+        Job job;
+        job.text = text_;
+        for (const auto& c : deck) job.avoid.push_back(c.question);
+        jobs_.push_back(std::move(job));
+        ++moreRounds_;
+        cv_.notify_one();
     }
 
-    return result;
-}
+    // Moves finished cards into `deck` without blocking (skips if the worker
+    // holds the lock right now; has_ready() stays true so the caller retries).
+    // Near-duplicates of cards already in the deck are dropped. Returns the
+    // number added.
+    size_t take(std::vector<Flashcard>& deck) {
+        char drain[64];
+        while (wake_[0] >= 0 && read(wake_[0], drain, sizeof(drain)) > 0) {}
 
-// ======== DEMO MAIN =========
+        std::unique_lock<std::mutex> lk(m_, std::try_to_lock);
+        if (!lk.owns_lock() || ready_.empty()) return 0;
 
-int main() {
-    // Global initialization for libcurl (must be paired with curl_global_cleanup)
-    curl_global_init(CURL_GLOBAL_DEFAULT);
+        size_t before = deck.size();
+        for (auto& card : ready_) {
+            if (!card.question.empty()) deck.push_back(std::move(card));
+        }
+        ready_.clear();
+        dedup_flashcards(deck, dedupThreshold_, before);
+        size_t added = deck.size() - before;
+        hasReady_ = false;
+        return added;
+    }
 
-    try {
-        // 1) Ask user what they want the app to do
-        std::cout << "What do you want?\n";
-        std::cout << "1 = Summary only\n";
-        std::cout << "2 = Flashcards only\n";
-        std::cout << "3 = Both summary + flashcards\n";
-        std::cout << "Enter choice (1/2/3): ";
-
-        int choice = 3;  // default to "both" if user input fails
-        std::cin >> choice;
-        // Clear leftover newline from the input buffer before using getline()
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    // True while finished cards are waiting to be taken (lock-free)
+    bool has_ready() const { return hasReady_.load(std::memory_order_relaxed); }
 
-        std::string userText;
+    // One-line description for the viewer footer ("" when idle and healthy)
+    std::string status() {
+        std::unique_lock<std::mutex> lk(m_, std::try_to_lock);
+        if (!lk.owns_lock()) return lastStatus_;
+        if (!error_.empty()) lastStatus_ = "Prefetch stopped: " + error_;
+        else if (busy_ || !jobs_.empty()) lastStatus_ = "Generating more cards in the background...";
+        else lastStatus_.clear();
+        return lastStatus_;
+    }
 
-        {
-            // 2) Read multi-line study text from the user
-            std::cout << "\nPaste your study text below.\n";
-            std::cout << "When you're done, press Enter on an empty line to finish input.\n";
-            std::cout << "Then press Enter.\n\n";
+    // Readable whenever take() has something to hand over
+    int wake_fd() const { return wake_[0]; }
 
-            std::string line;
+private:
+    struct Job {
+        std::string text;                // text to generate cards from
+        std::vector<std::string> avoid;  // questions the model must not repeat
+    };
+
+    void worker() {
+        t_cancelFlag = &cancel_;
+        std::unique_lock<std::mutex> lk(m_);
+        while (true) {
+            cv_.wait(lk, [&] { return stop_ || !jobs_.empty(); });
+            if (stop_) return;
 
-            // Read the first line
-            if (!std::getline(std::cin, line)) {
-                std::cerr << "No input detected. Exiting.\n";
-                curl_global_cleanup();
-                return 0;
+            Job job = std::move(jobs_.front());
+            jobs_.pop_front();
+            busy_ = true;
+            lk.unlock(); // never hold the lock across the network call
+
+            std::vector<Flashcard> cards;
+            std::string err;
+            try {
+                cards = generate_flashcards(job.text, job.avoid).flashcards;
+            } catch (const std::exception& ex) {
+                err = ex.what();
             }
 
-            if (line.empty()) {
-                // If the very first line is empty, treat as no input
-                std::cerr << "No text entered. Exiting.\n";
-                curl_global_cleanup();
-                return 0;
+            lk.lock();
+            busy_ = false;
+            if (stop_) return;
+            if (!err.empty()) {
+                error_ = err.substr(0, err.find('\n'));
+                jobs_.clear();
+                continue;
             }
+            for (auto& c : cards) ready_.push_back(std::move(c));
+            hasReady_ = true;
 
-            // Start building userText with the first line
-            userText += line;
+            // Signal with the lock released so the woken UI thread can take()
+            lk.unlock();
+            if (wake_[1] >= 0 && write(wake_[1], "x", 1) < 0) {} // pipe full = already signalled
+            lk.lock();
+        }
+    }
+
+    std::string text_;                // full study text ("more" rounds)
+    bool moreAllowed_;                // false for chunked documents
+    double dedupThreshold_;           // near-duplicate cutoff for merged cards
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::deque<Job> jobs_;            // pending work (guarded by m_)
+    std::vector<Flashcard> ready_;    // finished cards not yet taken (guarded by m_)
+    bool busy_ = false;               // a job is running (guarded by m_)
+    bool stop_ = false;               // shutting down (guarded by m_)
+    int moreRounds_ = 0;              // "more" rounds queued so far (guarded by m_)
+    std::string error_;               // first failure; stops further rounds (guarded by m_)
+    std::string lastStatus_;          // UI thread only
+    std::atomic<bool> cancel_{false};
+    std::atomic<bool> hasReady_{false};
+    int wake_[2] = {-1, -1};          // self-pipe used to wake the viewer's poll()
+    std::thread thread_;
+};
+
+// ======== SPACED REPETITION =========
+
+// Current time in whole minutes since the Unix epoch (scheduler clock)
+static uint32_t now_minute() {
+    using namespace std::chrono;
+    return (uint32_t)duration_cast<minutes>(system_clock::now().time_since_epoch()).count();
+}
+
+// How well the student recalled a card
+enum Grade { kAgain = 0, kHard = 1, kGood = 2, kEasy = 3 };
+
+// Per-card review state (SM-2). Serialized as 20 bytes per card.
+struct ReviewState {
+    uint64_t cardId = 0;
+    uint32_t dueMinute = 0;       // next review time, minutes since epoch
+    uint16_t intervalDays = 0;    // current interval (0 = learning)
+    uint16_t easePermille = 2500; // SM-2 ease factor * 1000
+    uint16_t reps = 0;            // consecutive successful reviews
+    uint16_t lapses = 0;          // times forgotten
+};
+
+// Indexed binary min-heap of scheduler slots ordered by due time.
+// pos_ maps slot -> heap position, so a reviewed card is re-sifted in
+// place in O(log n) instead of being searched for.
+class DueHeap {
+public:
+    explicit DueHeap(const std::vector<ReviewState>& states) : states_(states) {}
+
+    bool empty() const { return heap_.empty(); }
+    size_t size() const { return heap_.size(); }
+    uint32_t top() const { return heap_.front(); }
+    bool contains(uint32_t slot) const { return slot < pos_.size() && pos_[slot] >= 0; }
+
+    void push(uint32_t slot) {
+        if (slot >= pos_.size()) pos_.resize(slot + 1, -1);
+        if (pos_[slot] >= 0) return;
+        pos_[slot] = (int32_t)heap_.size();
+        heap_.push_back(slot);
+        sift_up(heap_.size() - 1);
+    }
+
+    // Restores heap order after states_[slot].dueMinute changed
+    void update(uint32_t slot) {
+        size_t i = (size_t)pos_[slot];
+        sift_up(i);
+        sift_down((size_t)pos_[slot]);
+    }
+
+private:
+    uint32_t key(size_t i) const { return states_[heap_[i]].dueMinute; }
+
+    void swap_nodes(size_t a, size_t b) {
+        std::swap(heap_[a], heap_[b]);
+        pos_[heap_[a]] = (int32_t)a;
+        pos_[heap_[b]] = (int32_t)b;
+    }
+
+    void sift_up(size_t i) {
+        while (i > 0) {
+            size_t parent = (i - 1) / 2;
+            if (key(parent) <= key(i)) break;
+            swap_nodes(i, parent);
+            i = parent;
+        }
+    }
+
+    void sift_down(size_t i) {
+        while (true) {
+            size_t l = 2 * i + 1, r = l + 1, m = i;
+            if (l < heap_.size() && key(l) < key(m)) m = l;
+            if (r < heap_.size() && key(r) < key(m)) m = r;
+            if (m == i) break;
+            swap_nodes(i, m);
+            i = m;
+        }
+    }
+
+    const std::vector<ReviewState>& states_;
+    std::vector<uint32_t> heap_; // slots, heap-ordered by due time
+    std::vector<int32_t> pos_;   // slot -> index in heap_ (-1 = not queued)
+};
+
+// SM-2 scheduler over a persistent card collection.
+// The whole collection is loaded, but only "activated" cards (the ones the
+// current session can show) are queued in the due heap.
+class SrsScheduler {
+public:
+    SrsScheduler() : heap_(states_) {}
+    SrsScheduler(const SrsScheduler&) = delete;
+    SrsScheduler& operator=(const SrsScheduler&) = delete;
+
+    // Loads a state file written by save(); a missing file is an empty collection
+    void load(const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) return;
+        char magic[4];
+        uint64_t count = 0;
+        in.read(magic, 4);
+        in.read(reinterpret_cast<char*>(&count), sizeof(count));
+        if (!in || std::memcmp(magic, kMagic, 4) != 0) {
+            throw std::runtime_error("Not a review state file: " + path);
+        }
+        // The count is checked against the file before anything is allocated
+        std::streamoff header = in.tellg();
+        in.seekg(0, std::ios::end);
+        std::streamoff size = in.tellg();
+        in.seekg(header);
+        if (!in || size < header || count > (uint64_t)(size - header) / kRecordSize) {
+            throw std::runtime_error("Truncated review state file: " + path);
+        }
+        std::string buf(count * kRecordSize, '\0');
+        in.read(&buf[0], (std::streamsize)buf.size());
+        if (!in) throw std::runtime_error("Truncated review state file: " + path);
+
+        states_.resize(count);
+        index_.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            const char* r = buf.data() + i * kRecordSize;
+            ReviewState& st = states_[i];
+            std::memcpy(&st.cardId, r, 8);
+            std::memcpy(&st.dueMinute, r + 8, 4);
+            std::memcpy(&st.intervalDays, r + 12, 2);
+            std::memcpy(&st.easePermille, r + 14, 2);
+            std::memcpy(&st.reps, r + 16, 2);
+            std::memcpy(&st.lapses, r + 18, 2);
+            index_[st.cardId] = (uint32_t)i;
+        }
+    }
+
+    // Writes all states (20 bytes each) to a temp file and renames it into place
+    void save(const std::string& path) const {
+        std::string buf(12 + states_.size() * kRecordSize, '\0');
+        uint64_t count = states_.size();
+        std::memcpy(&buf[0], kMagic, 4);
+        std::memcpy(&buf[4], &count, 8);
+        for (size_t i = 0; i < states_.size(); ++i) {
+            char* r = &buf[12 + i * kRecordSize];
+            const ReviewState& st = states_[i];
+            std::memcpy(r, &st.cardId, 8);
+            std::memcpy(r + 8, &st.dueMinute, 4);
+            std::memcpy(r + 12, &st.intervalDays, 2);
+            std::memcpy(r + 14, &st.easePermille, 2);
+            std::memcpy(r + 16, &st.reps, 2);
+            std::memcpy(r + 18, &st.lapses, 2);
+        }
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+            out.write(buf.data(), (std::streamsize)buf.size());
+            if (!out) throw std::runtime_error("Cannot write review state: " + tmp);
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("Cannot replace review state: " + path);
+        }
+    }
+
+    // Makes a card schedulable this session (new cards are due immediately).
+    // Returns its slot.
+    uint32_t activate(uint64_t id, uint32_t nowMin) {
+        auto it = index_.find(id);
+        uint32_t slot;
+        if (it != index_.end()) {
+            slot = it->second;
+        } else {
+            slot = (uint32_t)states_.size();
+            ReviewState st;
+            st.cardId = id;
+            st.dueMinute = nowMin;
+            states_.push_back(st);
+            index_[id] = slot;
+        }
+        heap_.push(slot);
+        return slot;
+    }
+
+    // Slot of the most overdue active card, or -1 if nothing is due yet
+    int64_t next_due(uint32_t nowMin) const {
+        if (heap_.empty() || states_[heap_.top()].dueMinute > nowMin) return -1;
+        return heap_.top();
+    }
+
+    // Due time of the earliest active card (0 if none are active)
+    uint32_t earliest_due() const { return heap_.empty() ? 0 : states_[heap_.top()].dueMinute; }
+
+    // Applies one review outcome (SM-2) and reschedules the card
+    void review(uint32_t slot, Grade grade, uint32_t nowMin) {
+        ReviewState& st = states_[slot];
+        int q = grade == kAgain ? 1 : grade == kHard ? 3 : grade == kGood ? 4 : 5;
+
+        int ease = st.easePermille + 100 - (5 - q) * (80 + (5 - q) * 20);
+        st.easePermille = (uint16_t)std::max(1300, std::min(ease, 5000));
+
+        if (grade == kAgain) {
+            st.reps = 0;
+            st.intervalDays = 0;
+            if (st.lapses < UINT16_MAX) ++st.lapses;
+            st.dueMinute = nowMin + 10; // relearn shortly
+        } else {
+            double days;
+            if (st.reps == 0) days = grade == kEasy ? 4 : 1;
+            else if (st.reps == 1) days = grade == kHard ? 3 : 6;
+            else days = st.intervalDays * (grade == kHard ? 1.2 : st.easePermille / 1000.0);
+            if (grade == kEasy && st.reps > 0) days *= 1.3;
+            days = std::max(1.0, std::min(days, 36500.0));
+
+            if (st.reps < UINT16_MAX) ++st.reps;
+            st.intervalDays = (uint16_t)days;
+            st.dueMinute = nowMin + (uint32_t)(days * 24 * 60);
+        }
+        heap_.update(slot);
+    }
+
+    const ReviewState& state(uint32_t slot) const { return states_[slot]; }
+    size_t size() const { return states_.size(); }
+    size_t active() const { return heap_.size(); }
+
+private:
+    static constexpr const char* kMagic = "SRS1";
+    static const size_t kRecordSize = 20;
+
+    std::vector<ReviewState> states_;              // all known cards
+    std::unordered_map<uint64_t, uint32_t> index_; // card id -> slot
+    DueHeap heap_;                                 // active cards by due time
+};
+
+// "3h", "2d" style rendering of a number of minutes
+static std::string format_minutes(uint32_t mins) {
+    if (mins < 60) return std::to_string(mins) + "m";
+    if (mins < 48 * 60) return std::to_string(mins / 60) + "h";
+    return std::to_string(mins / (24 * 60)) + "d";
+}
+
+// ======== SIMD KERNELS =========
+
+// Vector kernels for similarity work (float32 and int8 dot / L2 / cosine)
+// and for the local model (block-quantized dot products). Each has a
+// portable scalar version plus AVX2+FMA and AVX-512 versions on x86-64;
+// the best one the CPU supports is picked once at startup via CPUID
+// (AISTUDY_SIMD=scalar|avx2|avx512 overrides, e.g. for benchmarks).
+
+// GGUF's block quantizations: 32 values share one fp16 scale d.
+// Q8_0 stores q in [-127, 127] (value = d*q); Q4_0 packs 4-bit q with
+// value = d*(q - 8), elements 0-15 in the low nibbles, 16-31 in the high.
+static const size_t kQuantBlock = 32;
+
+struct BlockQ8_0 {
+    uint16_t d;
+    int8_t qs[kQuantBlock];
+};
+
+struct BlockQ4_0 {
+    uint16_t d;
+    uint8_t qs[kQuantBlock / 2];
+};
+
+static_assert(sizeof(BlockQ8_0) == 34 && sizeof(BlockQ4_0) == 18, "GGUF block layout");
+
+// IEEE half to float, through a table (the scales are read once per block)
+static const float* fp16_table() {
+    static const std::vector<float> table = [] {
+        std::vector<float> t(65536);
+        for (uint32_t h = 0; h < 65536; ++h) {
+            uint32_t sign = (h & 0x8000) << 16, exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+            float f;
+            if (exp == 0) {
+                f = std::ldexp((float)mant, -24);  // zero or subnormal
+                if (sign) f = -f;
+            } else {
+                uint32_t bits = sign | (exp == 31 ? 0x7f800000 | (mant << 13) : ((exp + 112) << 23) | (mant << 13));
+                std::memcpy(&f, &bits, sizeof f);
+            }
+            t[h] = f;
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+static inline float fp16_to_f32(uint16_t h) { return fp16_table()[h]; }
+
+// Float to IEEE half, rounding to nearest even
+static uint16_t f32_to_fp16(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof x);
+    uint32_t sign = (x >> 16) & 0x8000, mant = x & 0x7fffff;
+    int32_t exp = (int32_t)((x >> 23) & 0xff) - 127 + 15;
+    if (((x >> 23) & 0xff) == 0xff) return (uint16_t)(sign | 0x7c00 | (mant ? 0x200 : 0));
+    if (exp >= 31) return (uint16_t)(sign | 0x7c00);
+    if (exp <= 0) {
+        if (exp < -10) return (uint16_t)sign;
+        mant |= 0x800000;
+        uint32_t shift = (uint32_t)(14 - exp), h = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1), half = 1u << (shift - 1);
+        if (rem > half || (rem == half && (h & 1))) ++h;
+        return (uint16_t)(sign | h);
+    }
+    uint32_t h = ((uint32_t)exp << 10) | (mant >> 13), rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) ++h;  // a carry rolls into the exponent
+    return (uint16_t)(sign | h);
+}
+
+// n floats (a multiple of 32) to Q8_0 blocks
+static void quantize_q8_0(const float* x, BlockQ8_0* out, size_t n) {
+    for (size_t b = 0; b < n / kQuantBlock; ++b, x += kQuantBlock) {
+        float amax = 0;
+        for (size_t j = 0; j < kQuantBlock; ++j) amax = std::max(amax, std::fabs(x[j]));
+        float d = amax / 127, id = d > 0 ? 1 / d : 0;
+        out[b].d = f32_to_fp16(d);
+        for (size_t j = 0; j < kQuantBlock; ++j) out[b].qs[j] = (int8_t)std::lrintf(x[j] * id);
+    }
+}
+
+struct SimdKernels {
+    const char* name;
+    float   (*dot_f32)(const float* a, const float* b, size_t n);
+    float   (*l2sq_f32)(const float* a, const float* b, size_t n);   // squared L2 distance
+    float   (*cosine_f32)(const float* a, const float* b, size_t n); // cosine similarity
+    int32_t (*dot_i8)(const int8_t* a, const int8_t* b, size_t n);
+    int32_t (*l2sq_i8)(const int8_t* a, const int8_t* b, size_t n);
+    // Quantized weight row . Q8_0 activations, over `blocks` blocks of 32
+    float   (*dot_q8_0)(const BlockQ8_0* w, const BlockQ8_0* x, size_t blocks);
+    float   (*dot_q4_0)(const BlockQ4_0* w, const BlockQ8_0* x, size_t blocks);
+};
+
+static float scalar_dot_f32(const float* a, const float* b, size_t n) {
+    float acc[4] = {0, 0, 0, 0};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (int j = 0; j < 4; ++j) acc[j] += a[i + j] * b[i + j];
+    }
+    float sum = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+    for (; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+
+static float scalar_l2sq_f32(const float* a, const float* b, size_t n) {
+    float sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+static float scalar_cosine_f32(const float* a, const float* b, size_t n) {
+    float ab = 0, aa = 0, bb = 0;
+    for (size_t i = 0; i < n; ++i) {
+        ab += a[i] * b[i];
+        aa += a[i] * a[i];
+        bb += b[i] * b[i];
+    }
+    return (aa > 0 && bb > 0) ? ab / std::sqrt(aa * bb) : 0.0f;
+}
+
+static int32_t scalar_dot_i8(const int8_t* a, const int8_t* b, size_t n) {
+    int32_t sum = 0;
+    for (size_t i = 0; i < n; ++i) sum += (int32_t)a[i] * b[i];
+    return sum;
+}
+
+static int32_t scalar_l2sq_i8(const int8_t* a, const int8_t* b, size_t n) {
+    int32_t sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+        int32_t d = (int32_t)a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+static float scalar_dot_q8_0(const BlockQ8_0* w, const BlockQ8_0* x, size_t blocks) {
+    const float* half = fp16_table();
+    float sum = 0;
+    for (size_t b = 0; b < blocks; ++b) {
+        int32_t s = 0;
+        for (size_t j = 0; j < kQuantBlock; ++j) s += (int32_t)w[b].qs[j] * x[b].qs[j];
+        sum += half[w[b].d] * half[x[b].d] * (float)s;
+    }
+    return sum;
+}
+
+static float scalar_dot_q4_0(const BlockQ4_0* w, const BlockQ8_0* x, size_t blocks) {
+    const float* half = fp16_table();
+    float sum = 0;
+    for (size_t b = 0; b < blocks; ++b) {
+        int32_t s = 0;
+        for (size_t j = 0; j < kQuantBlock / 2; ++j) {
+            s += ((w[b].qs[j] & 0xf) - 8) * x[b].qs[j] + ((w[b].qs[j] >> 4) - 8) * x[b].qs[j + 16];
+        }
+        sum += half[w[b].d] * half[x[b].d] * (float)s;
+    }
+    return sum;
+}
+
+static const SimdKernels kScalarKernels = {
+    "scalar", scalar_dot_f32, scalar_l2sq_f32, scalar_cosine_f32, scalar_dot_i8, scalar_l2sq_i8,
+    scalar_dot_q8_0, scalar_dot_q4_0};
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define AISTUDY_X86_SIMD 1
+
+// ---- AVX2 + FMA ----
+
+__attribute__((target("avx2,fma"))) static inline float avx2_hsum(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma"))) static inline int32_t avx2_hsum_i32(__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+    return _mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("avx2,fma"))) static float avx2_dot_f32(const float* a, const float* b, size_t n) {
+    // four accumulators cover the FMA latency
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+        acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), acc2);
+        acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), acc3);
+    }
+    for (; i + 8 <= n; i += 8) acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    float sum = avx2_hsum(_mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+    for (; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+
+__attribute__((target("avx2,fma"))) static float avx2_l2sq_f32(const float* a, const float* b, size_t n) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc0 = _mm256_fmadd_ps(d, d, acc0);
+    }
+    float sum = avx2_hsum(_mm256_add_ps(acc0, acc1));
+    for (; i < n; ++i) sum += (a[i] - b[i]) * (a[i] - b[i]);
+    return sum;
+}
+
+__attribute__((target("avx2,fma"))) static float avx2_cosine_f32(const float* a, const float* b, size_t n) {
+    __m256 ab = _mm256_setzero_ps(), aa = _mm256_setzero_ps(), bb = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 va = _mm256_loadu_ps(a + i), vb = _mm256_loadu_ps(b + i);
+        ab = _mm256_fmadd_ps(va, vb, ab);
+        aa = _mm256_fmadd_ps(va, va, aa);
+        bb = _mm256_fmadd_ps(vb, vb, bb);
+    }
+    float sab = avx2_hsum(ab), saa = avx2_hsum(aa), sbb = avx2_hsum(bb);
+    for (; i < n; ++i) {
+        sab += a[i] * b[i];
+        saa += a[i] * a[i];
+        sbb += b[i] * b[i];
+    }
+    return (saa > 0 && sbb > 0) ? sab / std::sqrt(saa * sbb) : 0.0f;
+}
+
+// int8: widen 16 lanes to int16, then multiply-add pairs into int32 lanes
+__attribute__((target("avx2,fma"))) static int32_t avx2_dot_i8(const int8_t* a, const int8_t* b, size_t n) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+        __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+    }
+    int32_t sum = avx2_hsum_i32(acc);
+    for (; i < n; ++i) sum += (int32_t)a[i] * b[i];
+    return sum;
+}
+
+__attribute__((target("avx2,fma"))) static int32_t avx2_l2sq_i8(const int8_t* a, const int8_t* b, size_t n) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+        __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+        __m256i d = _mm256_sub_epi16(va, vb); // fits: |d| <= 255
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d, d));
+    }
+    int32_t sum = avx2_hsum_i32(acc);
+    for (; i < n; ++i) sum += ((int32_t)a[i] - b[i]) * ((int32_t)a[i] - b[i]);
+    return sum;
+}
+
+// Signed int8 products via maddubs (unsigned x signed): |w| times x with
+// w's sign moved onto x, then pairs summed into int32 lanes
+__attribute__((target("avx2,fma"))) static inline __m256 avx2_block_dot(__m256i w, __m256i x) {
+    __m256i products = _mm256_maddubs_epi16(_mm256_sign_epi8(w, w), _mm256_sign_epi8(x, w));
+    return _mm256_cvtepi32_ps(_mm256_madd_epi16(products, _mm256_set1_epi16(1)));
+}
+
+__attribute__((target("avx2,fma"))) static float avx2_dot_q8_0(const BlockQ8_0* w, const BlockQ8_0* x, size_t blocks) {
+    const float* half = fp16_table();
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    size_t b = 0;
+    for (; b + 2 <= blocks; b += 2) {
+        __m256i w0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w[b].qs));
+        __m256i x0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x[b].qs));
+        __m256i w1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w[b + 1].qs));
+        __m256i x1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x[b + 1].qs));
+        acc0 = _mm256_fmadd_ps(_mm256_set1_ps(half[w[b].d] * half[x[b].d]), avx2_block_dot(w0, x0), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_set1_ps(half[w[b + 1].d] * half[x[b + 1].d]), avx2_block_dot(w1, x1), acc1);
+    }
+    for (; b < blocks; ++b) {
+        __m256i w0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w[b].qs));
+        __m256i x0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x[b].qs));
+        acc0 = _mm256_fmadd_ps(_mm256_set1_ps(half[w[b].d] * half[x[b].d]), avx2_block_dot(w0, x0), acc0);
+    }
+    return avx2_hsum(_mm256_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx2,fma"))) static float avx2_dot_q4_0(const BlockQ4_0* w, const BlockQ8_0* x, size_t blocks) {
+    const float* half = fp16_table();
+    const __m256i low = _mm256_set1_epi8(0xf), eight = _mm256_set1_epi8(8);
+    __m256 acc = _mm256_setzero_ps();
+    for (size_t b = 0; b < blocks; ++b) {
+        // Low nibbles are elements 0-15, high nibbles 16-31
+        __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(w[b].qs));
+        __m256i q = _mm256_set_m128i(_mm_srli_epi16(packed, 4), packed);
+        q = _mm256_sub_epi8(_mm256_and_si256(q, low), eight);
+        __m256i xq = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x[b].qs));
+        acc = _mm256_fmadd_ps(_mm256_set1_ps(half[w[b].d] * half[x[b].d]), avx2_block_dot(q, xq), acc);
+    }
+    return avx2_hsum(acc);
+}
+
+static const SimdKernels kAvx2Kernels = {
+    "avx2", avx2_dot_f32, avx2_l2sq_f32, avx2_cosine_f32, avx2_dot_i8, avx2_l2sq_i8,
+    avx2_dot_q8_0, avx2_dot_q4_0};
+
+// ---- AVX-512 (F + BW) ----
+
+__attribute__((target("avx512f,avx512bw"))) static float avx512_dot_f32(const float* a, const float* b, size_t n) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    __m512 acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+        acc2 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 32), _mm512_loadu_ps(b + i + 32), acc2);
+        acc3 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 48), _mm512_loadu_ps(b + i + 48), acc3);
+    }
+    for (; i + 16 <= n; i += 16) acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    if (i < n) { // masked tail
+        __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), acc1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3)));
+}
+
+__attribute__((target("avx512f,avx512bw"))) static float avx512_l2sq_f32(const float* a, const float* b, size_t n) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i < n; i += 16) {
+        __mmask16 m = n - i >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (n - i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i));
+        acc0 = _mm512_fmadd_ps(d, d, acc0);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx512f,avx512bw"))) static float avx512_cosine_f32(const float* a, const float* b, size_t n) {
+    __m512 ab = _mm512_setzero_ps(), aa = _mm512_setzero_ps(), bb = _mm512_setzero_ps();
+    for (size_t i = 0; i < n; i += 16) {
+        __mmask16 m = n - i >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (n - i)) - 1);
+        __m512 va = _mm512_maskz_loadu_ps(m, a + i), vb = _mm512_maskz_loadu_ps(m, b + i);
+        ab = _mm512_fmadd_ps(va, vb, ab);
+        aa = _mm512_fmadd_ps(va, va, aa);
+        bb = _mm512_fmadd_ps(vb, vb, bb);
+    }
+    float sab = _mm512_reduce_add_ps(ab), saa = _mm512_reduce_add_ps(aa), sbb = _mm512_reduce_add_ps(bb);
+    return (saa > 0 && sbb > 0) ? sab / std::sqrt(saa * sbb) : 0.0f;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static int32_t avx512_dot_i8(const int8_t* a, const int8_t* b, size_t n) {
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512i va = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)));
+        __m512i vb = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(va, vb));
+    }
+    int32_t sum = _mm512_reduce_add_epi32(acc);
+    for (; i < n; ++i) sum += (int32_t)a[i] * b[i];
+    return sum;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static int32_t avx512_l2sq_i8(const int8_t* a, const int8_t* b, size_t n) {
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512i va = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)));
+        __m512i vb = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+        __m512i d = _mm512_sub_epi16(va, vb);
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(d, d));
+    }
+    int32_t sum = _mm512_reduce_add_epi32(acc);
+    for (; i < n; ++i) sum += ((int32_t)a[i] - b[i]) * ((int32_t)a[i] - b[i]);
+    return sum;
+}
+
+// The quantized dots stay on AVX2: a 32-value block fills exactly one
+// 256-bit register, and they are bound by memory bandwidth, not the ALUs
+static const SimdKernels kAvx512Kernels = {
+    "avx512", avx512_dot_f32, avx512_l2sq_f32, avx512_cosine_f32, avx512_dot_i8, avx512_l2sq_i8,
+    avx2_dot_q8_0, avx2_dot_q4_0};
+#endif
+
+// Kernel sets this CPU can run, slowest first
+static std::vector<const SimdKernels*> available_kernels() {
+    std::vector<const SimdKernels*> out{&kScalarKernels};
+#ifdef AISTUDY_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) out.push_back(&kAvx2Kernels);
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) out.push_back(&kAvx512Kernels);
+#endif
+    return out;
+}
+
+// The kernel set in use (chosen on first call)
+static const SimdKernels& simd() {
+    static const SimdKernels* chosen = [] {
+        std::vector<const SimdKernels*> avail = available_kernels();
+        const char* want = std::getenv("AISTUDY_SIMD");
+        if (want && *want) {
+            for (const SimdKernels* k : avail) {
+                if (std::strcmp(k->name, want) == 0) return k;
+            }
+        }
+        return avail.back();
+    }();
+    return *chosen;
+}
+
+// Inner product of two float vectors (dispatched)
+static inline float dot_f32(const float* a, const float* b, size_t n) {
+    return simd().dot_f32(a, b, n);
+}
+
+// ======== SEMANTIC RETRIEVAL =========
+
+std::string openai_post(const std::string& path, const std::string& bodyStr,
+                        long hedgeAfterMs = 0);
+
+// Scales a vector to unit length (zero vectors are left alone)
+static void l2_normalize(float* v, size_t n) {
+    float norm = std::sqrt(dot_f32(v, v, n));
+    if (norm > 0) {
+        for (size_t i = 0; i < n; ++i) v[i] /= norm;
+    }
+}
+
+// Turns texts into unit-length embedding vectors
+class Embedder {
+public:
+    virtual ~Embedder() {}
+    virtual size_t dim() const = 0;
+    // Appends texts.size() * dim() floats to `out`
+    virtual void embed(const std::vector<std::string>& texts, std::vector<float>& out) = 0;
+};
+
+// Local embedding model: signed feature hashing of words and character
+// trigrams into a fixed number of dimensions. No network, microseconds per
+// text, and good enough to find cards that share vocabulary.
+class HashingEmbedder : public Embedder {
+public:
+    explicit HashingEmbedder(size_t dim = 256) : dim_(dim) {}
+
+    size_t dim() const override { return dim_; }
+
+    void embed(const std::vector<std::string>& texts, std::vector<float>& out) override {
+        size_t base = out.size();
+        out.resize(base + texts.size() * dim_, 0.0f);
+        parallel_for(task_pool(), texts.size(), 64, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) embed_one(texts[i], &out[base + i * dim_]);
+        });
+    }
+
+private:
+    // Writes the embedding of `text` into v[0..dim) (zeroed)
+    void embed_one(const std::string& text, float* v) const {
+        std::string word;
+        auto add = [&](uint64_t h, float w) {
+            v[h % dim_] += (h >> 63) ? -w : w; // sign bit reduces collision bias
+        };
+        auto flush_word = [&]() {
+            if (word.empty()) return;
+            add(mix64(fnv1a64(word.data(), word.size())), 1.0f);
+            std::string padded = "#" + word + "#";
+            for (size_t i = 0; i + 3 <= padded.size(); ++i) {
+                add(mix64(fnv1a64(padded.data() + i, 3, 0x51ed270b)), 0.5f);
+            }
+            word.clear();
+        };
+        for (char ch : text) {
+            unsigned char c = static_cast<unsigned char>(ch);
+            if (c >= 'A' && c <= 'Z') c |= 0x20;
+            if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80) word += (char)c;
+            else flush_word();
+        }
+        flush_word();
+
+        // Sublinear term frequency, then unit length for cosine similarity
+        for (size_t i = 0; i < dim_; ++i) {
+            v[i] = v[i] > 0 ? std::log1p(v[i]) : -std::log1p(-v[i]);
+        }
+        l2_normalize(v, dim_);
+    }
+
+    size_t dim_;
+};
+
+// Remote embedding model via the OpenAI /embeddings endpoint (honours
+// OPENAI_BASE_URL, so a local stand-in can serve it)
+class OpenAIEmbedder : public Embedder {
+public:
+    explicit OpenAIEmbedder(size_t dim = 256, std::string model = "text-embedding-3-small")
+        : dim_(dim), model_(std::move(model)) {}
+
+    size_t dim() const override { return dim_; }
+
+    void embed(const std::vector<std::string>& texts, std::vector<float>& out) override {
+        const size_t kBatch = 256; // inputs per request
+        for (size_t start = 0; start < texts.size(); start += kBatch) {
+            size_t end = std::min(texts.size(), start + kBatch);
+            json body;
+            body["model"] = model_;
+            body["dimensions"] = dim_;
+            body["input"] = std::vector<std::string>(texts.begin() + start, texts.begin() + end);
+
+            json res = json::parse(openai_post("/embeddings", body.dump()));
+            const json& data = res.at("data");
+            if (data.size() != end - start) {
+                throw std::runtime_error("Embeddings response has the wrong number of vectors");
+            }
+
+            // Rows come back by index: each of [0, n) exactly once (with
+            // data.size() == n, no repeats means none missing)
+            size_t base = out.size();
+            out.resize(base + (end - start) * dim_, 0.0f);
+            std::vector<bool> seen(end - start, false);
+            for (const auto& item : data) {
+                size_t row = item.at("index").get<size_t>();
+                const json& emb = item.at("embedding");
+                if (row >= end - start || seen[row] || !emb.is_array() || emb.size() != dim_) {
+                    throw std::runtime_error("Malformed embedding in response");
+                }
+                seen[row] = true;
+                float* v = &out[base + row * dim_];
+                for (size_t i = 0; i < dim_; ++i) v[i] = emb[i].get<float>();
+                l2_normalize(v, dim_);
+            }
+        }
+    }
+
+private:
+    size_t dim_;
+    std::string model_;
+};
+
+// Builds the embedder selected with --embedder
+static std::unique_ptr<Embedder> make_embedder(const std::string& name) {
+    if (name == "local") return std::unique_ptr<Embedder>(new HashingEmbedder());
+    if (name == "openai") return std::unique_ptr<Embedder>(new OpenAIEmbedder());
+    throw std::runtime_error("Unknown embedder '" + name + "' (expected local or openai)");
+}
+
+// Approximate nearest-neighbour index over unit vectors (HNSW graph,
+// cosine distance). Level-0 adjacency lives in one flat array; the few
+// nodes on upper levels keep their lists separately.
+// Not thread-safe: searches share a visited-marks buffer.
+class HnswIndex {
+public:
+    typedef std::pair<float, uint32_t> Hit; // (distance, id)
+
+    explicit HnswIndex(size_t dim, size_t M = 16, size_t efConstruction = 100)
+        : dim_(dim), M_(M), maxM0_(2 * M), efConstruction_(efConstruction),
+          levelMult_(1.0 / std::log((double)M)), rng_(1234) {}
+
+    size_t size() const { return levels_.size(); }
+    size_t dim() const { return dim_; }
+    const float* vector(uint32_t id) const { return &data_[(size_t)id * dim_]; }
+
+    // Inserts a vector and returns its id (ids are assigned densely from 0)
+    uint32_t add(const float* vec) {
+        uint32_t id = (uint32_t)levels_.size();
+        std::uniform_real_distribution<double> unif(0.0, 1.0);
+        int level = (int)(-std::log(std::max(unif(rng_), 1e-12)) * levelMult_);
+
+        data_.insert(data_.end(), vec, vec + dim_);
+        levels_.push_back(level);
+        links0_.resize(links0_.size() + maxM0_ + 1, 0);
+        upper_.emplace_back((size_t)level * (M_ + 1), 0);
+        visited_.push_back(0);
+
+        if (id == 0) {
+            entry_ = 0;
+            maxLevel_ = level;
+            return id;
+        }
+
+        // Greedy descent through the levels above the new node
+        uint32_t ep = entry_;
+        float epDist = distance(vec, vector(ep));
+        for (int l = maxLevel_; l > level; --l) greedy_step(vec, ep, epDist, l);
+
+        // Link into every level the node lives on
+        for (int l = std::min(level, maxLevel_); l >= 0; --l) {
+            std::vector<Hit> found = search_layer(vec, ep, efConstruction_, l);
+            std::vector<uint32_t> chosen = select_neighbors(found, M_);
+            set_links(id, l, chosen);
+            for (uint32_t nb : chosen) connect(nb, id, l);
+            ep = found.front().second;
+        }
+
+        if (level > maxLevel_) {
+            maxLevel_ = level;
+            entry_ = id;
+        }
+        return id;
+    }
+
+    // k nearest ids to `query`, closest first; larger `ef` trades speed for recall
+    std::vector<Hit> search(const float* query, size_t k, size_t ef = 64) const {
+        if (levels_.empty()) return {};
+        uint32_t ep = entry_;
+        float epDist = distance(query, vector(ep));
+        for (int l = maxLevel_; l > 0; --l) greedy_step(query, ep, epDist, l);
+
+        std::vector<Hit> found = search_layer(query, ep, std::max(ef, k), 0);
+        if (found.size() > k) found.resize(k);
+        return found;
+    }
+
+private:
+    float distance(const float* a, const float* b) const { return 1.0f - dot_f32(a, b, dim_); }
+
+    // Adjacency list of `id` at `level`: element 0 is the count
+    uint32_t* links(uint32_t id, int level) {
+        if (level == 0) return &links0_[(size_t)id * (maxM0_ + 1)];
+        return &upper_[id][(size_t)(level - 1) * (M_ + 1)];
+    }
+    const uint32_t* links(uint32_t id, int level) const {
+        return const_cast<HnswIndex*>(this)->links(id, level);
+    }
+    size_t max_links(int level) const { return level == 0 ? maxM0_ : M_; }
+
+    void set_links(uint32_t id, int level, const std::vector<uint32_t>& ids) {
+        uint32_t* l = links(id, level);
+        l[0] = (uint32_t)ids.size();
+        std::copy(ids.begin(), ids.end(), l + 1);
+    }
+
+    // Moves `ep` to its closest neighbour at `level` until no neighbour is closer
+    void greedy_step(const float* q, uint32_t& ep, float& epDist, int level) const {
+        bool improved = true;
+        while (improved) {
+            improved = false;
+            const uint32_t* l = links(ep, level);
+            for (uint32_t i = 1; i <= l[0]; ++i) {
+                float d = distance(q, vector(l[i]));
+                if (d < epDist) {
+                    epDist = d;
+                    ep = l[i];
+                    improved = true;
+                }
+            }
+        }
+    }
+
+    // Best-first search of one level; returns up to `ef` hits, closest first
+    std::vector<Hit> search_layer(const float* q, uint32_t ep, size_t ef, int level) const {
+        if (++visitEpoch_ == 0) { // wrapped: reset marks
+            std::fill(visited_.begin(), visited_.end(), 0);
+            visitEpoch_ = 1;
+        }
+        std::priority_queue<Hit, std::vector<Hit>, std::greater<Hit>> candidates; // closest on top
+        std::priority_queue<Hit> results;                                           // farthest on top
+
+        float d0 = distance(q, vector(ep));
+        candidates.emplace(d0, ep);
+        results.emplace(d0, ep);
+        visited_[ep] = visitEpoch_;
+
+        while (!candidates.empty()) {
+            Hit c = candidates.top();
+            if (c.first > results.top().first && results.size() >= ef) break;
+            candidates.pop();
+
+            const uint32_t* l = links(c.second, level);
+            for (uint32_t i = 1; i <= l[0]; ++i) {
+                uint32_t nb = l[i];
+                if (visited_[nb] == visitEpoch_) continue;
+                visited_[nb] = visitEpoch_;
+                float d = distance(q, vector(nb));
+                if (results.size() < ef || d < results.top().first) {
+                    candidates.emplace(d, nb);
+                    results.emplace(d, nb);
+                    if (results.size() > ef) results.pop();
+                }
+            }
+        }
+
+        std::vector<Hit> out(results.size());
+        for (size_t i = out.size(); i-- > 0;) {
+            out[i] = results.top();
+            results.pop();
+        }
+        return out;
+    }
+
+    // HNSW neighbour heuristic: keep a candidate only if it is closer to the
+    // new node than to every neighbour already kept (spreads links out)
+    std::vector<uint32_t> select_neighbors(const std::vector<Hit>& sorted, size_t m) const {
+        std::vector<uint32_t> kept;
+        for (const Hit& h : sorted) {
+            if (kept.size() >= m) break;
+            bool good = true;
+            for (uint32_t k : kept) {
+                if (distance(vector(h.second), vector(k)) < h.first) {
+                    good = false;
+                    break;
+                }
+            }
+            if (good) kept.push_back(h.second);
+        }
+        return kept;
+    }
+
+    // Adds a back-link node -> id, pruning node's list with the heuristic when full
+    void connect(uint32_t node, uint32_t id, int level) {
+        uint32_t* l = links(node, level);
+        size_t maxL = max_links(level);
+        if (l[0] < maxL) {
+            l[++l[0]] = id;
+            return;
+        }
+        std::vector<Hit> cand;
+        cand.reserve(maxL + 1);
+        const float* v = vector(node);
+        for (uint32_t i = 1; i <= l[0]; ++i) cand.emplace_back(distance(v, vector(l[i])), l[i]);
+        cand.emplace_back(distance(v, vector(id)), id);
+        std::sort(cand.begin(), cand.end());
+        set_links(node, level, select_neighbors(cand, maxL));
+    }
+
+    size_t dim_, M_, maxM0_, efConstruction_;
+    double levelMult_;
+    std::mt19937_64 rng_;
+    std::vector<float> data_;                 // vectors, dim_ floats each
+    std::vector<int> levels_;                 // top level of each node
+    std::vector<uint32_t> links0_;            // level-0 lists, (maxM0_ + 1) per node
+    std::vector<std::vector<uint32_t>> upper_; // levels 1.., (M_ + 1) per level
+    uint32_t entry_ = 0;
+    int maxLevel_ = 0;
+    mutable std::vector<uint32_t> visited_;   // visit epoch per node
+    mutable uint32_t visitEpoch_ = 0;
+};
+
+// Every flashcard and summary of the session, embedded and indexed so
+// related material can be looked up by meaning
+class StudyLibrary {
+public:
+    struct Item {
+        enum Kind { Card, Summary } kind;
+        std::string text; // what was embedded
+        int ref;          // deck index for cards
+    };
+
+    explicit StudyLibrary(std::unique_ptr<Embedder> embedder)
+        : embedder_(std::move(embedder)), index_(embedder_->dim()) {}
+
+    // Embeds and indexes cards[first..end); if embedding fails (throws),
+    // none of them are added
+    void add_cards(const std::vector<Flashcard>& cards, size_t first = 0) {
+        std::vector<std::string> texts;
+        for (size_t i = first; i < cards.size(); ++i) texts.push_back(cards[i].question + "\n" + cards[i].answer);
+        uint32_t firstItem = (uint32_t)items_.size();
+        add_items(texts, Item::Card, (int)first);
+        for (size_t i = first; i < cards.size(); ++i) cardItem_[(int)i] = firstItem + (uint32_t)(i - first);
+    }
+
+    void add_summary(const SummaryResult& s) {
+        std::string text = s.summary;
+        for (const auto& kp : s.keyPoints) text += "\n" + kp;
+        add_items({text}, Item::Summary, -1);
+    }
+
+    size_t indexed_cards() const { return cardItem_.size(); }
+
+    // Library items closest in meaning to `text`
+    std::vector<HnswIndex::Hit> search(const std::string& text, size_t k) {
+        std::vector<float> q;
+        embedder_->embed({text}, q);
+        return index_.search(q.data(), k);
+    }
+
+    // Items related to deck card `deckIdx` (the card itself excluded)
+    std::vector<HnswIndex::Hit> related_to_card(int deckIdx, size_t k) {
+        auto it = cardItem_.find(deckIdx);
+        if (it == cardItem_.end()) return {};
+        std::vector<HnswIndex::Hit> hits = index_.search(index_.vector(it->second), k + 1);
+        hits.erase(std::remove_if(hits.begin(), hits.end(),
+                                  [&](const HnswIndex::Hit& h) { return h.second == it->second; }),
+                   hits.end());
+        if (hits.size() > k) hits.resize(k);
+        return hits;
+    }
+
+    const Item& item(uint32_t id) const { return items_[id]; }
+
+private:
+    void add_items(const std::vector<std::string>& texts, Item::Kind kind, int firstRef) {
+        if (texts.empty()) return;
+        std::vector<float> vecs;
+        embedder_->embed(texts, vecs);
+        for (size_t i = 0; i < texts.size(); ++i) {
+            items_.push_back({kind, texts[i], kind == Item::Card ? firstRef + (int)i : -1});
+            index_.add(&vecs[i * embedder_->dim()]);
+        }
+    }
+
+    std::unique_ptr<Embedder> embedder_;
+    HnswIndex index_;
+    std::vector<Item> items_;                     // index id -> item
+    std::unordered_map<int, uint32_t> cardItem_;  // deck index -> index id
+};
+
+// ======== TERMINAL UI HELPERS =========
+
+// Number of terminal columns a UTF-8 byte range occupies (one per code point)
+static size_t utf8_columns(const std::string& s, size_t begin, size_t end) {
+    size_t cols = 0;
+    for (size_t i = begin; i < end && i < s.size(); ++i) {
+        if ((static_cast<unsigned char>(s[i]) & 0xC0) != 0x80) ++cols; // skip continuation bytes
+    }
+    return cols;
+}
+
+// Word-wraps text to `width` columns; embedded newlines start new lines
+static std::vector<std::string> wrap_text(const std::string& text, size_t width) {
+    std::vector<std::string> lines;
+    size_t start = 0;
+    while (true) {
+        size_t nl = text.find('\n', start);
+        std::string para = text.substr(start, nl == std::string::npos ? std::string::npos : nl - start);
+
+        std::string cur;
+        size_t curCols = 0;
+        size_t pos = 0;
+        while (pos < para.size()) {
+            size_t wsEnd = para.find_first_not_of(' ', pos);
+            if (wsEnd == std::string::npos) break;
+            size_t wordEnd = para.find(' ', wsEnd);
+            if (wordEnd == std::string::npos) wordEnd = para.size();
+            std::string word = para.substr(wsEnd, wordEnd - wsEnd);
+            size_t wordCols = utf8_columns(word, 0, word.size());
+            size_t gap = wsEnd - pos; // spacing is kept as written within a line
+
+            if (curCols > 0 && curCols + gap + wordCols > width) {
+                lines.push_back(cur);
+                cur.clear();
+                curCols = 0;
+                gap = 0;
+            }
+            // Hard-break words that can never fit on one line
+            while (wordCols > width) {
+                size_t cut = 0, cols = 0;
+                while (cut < word.size() && cols < width - curCols) {
+                    ++cut;
+                    while (cut < word.size() && (static_cast<unsigned char>(word[cut]) & 0xC0) == 0x80) ++cut;
+                    ++cols;
+                }
+                lines.push_back(cur + word.substr(0, cut));
+                cur.clear();
+                curCols = 0;
+                word.erase(0, cut);
+                wordCols = utf8_columns(word, 0, word.size());
+            }
+            if (gap > 0 && curCols + gap < width) {
+                cur.append(gap, ' ');
+                curCols += gap;
+            }
+            cur += word;
+            curCols += wordCols;
+            pos = wordEnd;
+        }
+        lines.push_back(cur);
+
+        if (nl == std::string::npos) break;
+        start = nl + 1;
+    }
+    return lines;
+}
+
+// Double-buffered terminal renderer.
+// A frame is composed off-screen as a list of lines, diffed against the frame
+// currently on the terminal, and only the changed part of each changed line is
+// sent — all in a single write() per frame.
+class FrameRenderer {
+public:
+    struct Stats {
+        size_t frames = 0;  // frames presented
+        size_t writes = 0;  // write() syscalls issued
+        size_t bytes  = 0;  // bytes written to the terminal
+    };
+
+    explicit FrameRenderer(int fd = STDOUT_FILENO) : fd_(fd) {
+        struct winsize ws;
+        if (ioctl(fd_, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) width_ = ws.ws_col;
+    }
+
+    size_t width() const { return width_; }
+
+    // Starts composing a new frame in the back buffer
+    void begin_frame() { back_.clear(); }
+
+    // Appends one line to the frame, word-wrapped to the terminal width
+    void add(const std::string& text) {
+        for (auto& l : wrap_text(text, width_)) back_.push_back(std::move(l));
+    }
+
+    // Forces the next present() to repaint the whole screen (e.g. after a resize)
+    void invalidate() { valid_ = false; }
+
+    // Diffs the back buffer against the front buffer and flushes the changes
+    void present() {
+        std::cout.flush(); // keep ordering with anything printed through iostreams
+
+        out_.clear();
+        if (!valid_) {
+            out_ += "\033[2J\033[H";
+            front_.clear();
+        }
+
+        for (size_t row = 0; row < back_.size(); ++row) {
+            const std::string& now = back_[row];
+            const std::string* before = row < front_.size() ? &front_[row] : nullptr;
+            if (before && *before == now) continue;
+
+            // First differing byte, moved back to the start of its code point
+            size_t diff = 0;
+            if (before) {
+                size_t limit = std::min(before->size(), now.size());
+                while (diff < limit && (*before)[diff] == now[diff]) ++diff;
+                while (diff > 0 && (static_cast<unsigned char>(now[diff]) & 0xC0) == 0x80) --diff;
+            }
+
+            move_to(row, utf8_columns(now, 0, diff));
+            out_.append(now, diff, std::string::npos);
+            out_ += "\033[K"; // erase whatever the old line had past this point
+        }
+
+        // Park the cursor under the frame and wipe leftovers (old rows, echoed input)
+        move_to(back_.size(), 0);
+        out_ += "\033[J";
+
+        flush_out();
+        front_.swap(back_);
+        valid_ = true;
+        ++stats_.frames;
+    }
+
+    // Clears the screen and forgets the current frame
+    void clear() {
+        std::cout.flush();
+        out_ = "\033[2J\033[H";
+        flush_out();
+        front_.clear();
+        valid_ = true;
+    }
+
+    const Stats& stats() const { return stats_; }
+
+    // The lines of the most recently presented frame
+    const std::vector<std::string>& frame() const { return front_; }
+
+private:
+    void move_to(size_t row, size_t col) {
+        out_ += "\033[" + std::to_string(row + 1) + ";" + std::to_string(col + 1) + "H";
+    }
+
+    void flush_out() {
+        size_t off = 0;
+        while (off < out_.size()) {
+            ssize_t n = write(fd_, out_.data() + off, out_.size() - off);
+            ++stats_.writes;
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break; // terminal gone; nothing sensible to do
+            }
+            off += (size_t)n;
+        }
+        stats_.bytes += out_.size();
+    }
+
+    int fd_;
+    size_t width_ = 80;
+    bool valid_ = false;             // front_ matches what is on screen
+    std::vector<std::string> front_; // frame currently on the terminal
+    std::vector<std::string> back_;  // frame being composed
+    std::string out_;                // escape sequences + text for one write()
+    Stats stats_;
+};
+
+// Footer shown under the card in each input mode
+static const char* kLineModeHelp = "Commands: [f]lip  [n]ext  [p]rev  [r]andom  [j]ump <num>  [s]imilar  [q]uit";
+static const char* kRawModeHelp  = "Keys: [f]lip/space  [n]ext/→  [p]rev/←  [r]andom  [s]imilar  g/G ends  "
+                                   "<num>⏎ jump  [q]uit";
+static const char* kReviewHelp   = "Grade: 1 again  2 hard  3 good  4 easy   [f]lip  [n]ext  [s]imilar  [q]uit";
+
+// Composes a single flashcard (and optionally the answer) into a frame and shows it
+static void display_card(FrameRenderer& screen, const Flashcard& card, int index, int total,
+                         bool showAnswer, const std::string& footer = kLineModeHelp,
+                         const std::string& status = "") {
+    screen.begin_frame();
+    screen.add("Flashcard " + std::to_string(index + 1) + "/" + std::to_string(total));
+    screen.add("-------------------------");
+    screen.add("Q: " + card.question);
+    screen.add("");
+    if (showAnswer) {
+        screen.add("A: " + card.answer);
+    } else {
+        screen.add("A: [hidden] (press 'f' to flip)");
+    }
+    screen.add("");
+    screen.add(footer);
+    if (!status.empty()) screen.add(status);
+    screen.present();
+}
+
+// Optional subsystems the viewer can drive (all may be null)
+struct ViewerExtras {
+    DeckPrefetcher* prefetcher = nullptr; // background card generation
+    SrsScheduler* srs = nullptr;          // review scheduling
+    StudyLibrary* library = nullptr;      // "similar cards" lookups
+};
+
+// Which card is shown and whether it is flipped; shared by both input modes
+struct ViewerState {
+    ViewerState(FlashcardResult& d, const ViewerExtras& x)
+        : deck(d), prefetcher(x.prefetcher), srs(x.srs), library(x.library),
+          rng((unsigned)std::random_device{}()) {
+        if (srs) {
+            activate_new_cards();
+            next_due();
+        }
+    }
+
+    int size() const { return (int)deck.flashcards.size(); }
+
+    void flip() { showAnswer = !showAnswer; }
+
+    // Move by `delta` cards (wraps around)
+    void step(int delta) {
+        idx = ((idx + delta) % size() + size()) % size();
+        showAnswer = false;
+        related.clear();
+    }
+
+    // Jump to a random card
+    void random() {
+        std::uniform_int_distribution<int> dist(0, size() - 1);
+        idx = dist(rng);
+        showAnswer = false;
+        related.clear();
+    }
+
+    // Jump to a 1-based card number; out-of-range numbers are ignored
+    void jump(int number) {
+        if (number >= 1 && number <= size()) {
+            idx = number - 1;
+            showAnswer = false;
+            related.clear();
+        }
+    }
+
+    // Lists the cards (and summary) closest in meaning to the current card.
+    // Cards added since the last lookup are indexed first.
+    // A failed lookup (e.g. the embeddings API) is shown in place of the list.
+    void show_related() {
+        if (!library) return;
+        related.clear();
+        std::vector<HnswIndex::Hit> hits;
+        try {
+            if (library->indexed_cards() < deck.flashcards.size()) {
+                library->add_cards(deck.flashcards, library->indexed_cards());
+            }
+            hits = library->related_to_card(idx, 3);
+        } catch (const std::exception& ex) {
+            std::string err = ex.what();
+            related.push_back("Lookup failed: " + err.substr(0, err.find('\n')));
+            return;
+        }
+        for (const auto& hit : hits) {
+            const StudyLibrary::Item& it = library->item(hit.second);
+            std::string line = it.kind == StudyLibrary::Item::Card
+                                   ? "#" + std::to_string(it.ref + 1) + " " + deck.flashcards[it.ref].question
+                                   : "Summary: " + it.text.substr(0, it.text.find('\n'));
+            related.push_back(line);
+        }
+        if (related.empty()) related.push_back("(no related material)");
+    }
+
+    // Merges cards finished in the background and asks for more when the
+    // user gets close to the end of the deck. Never blocks.
+    void sync_prefetch() {
+        if (!prefetcher) return;
+        size_t added = prefetcher->take(deck.flashcards);
+        if (added) {
+            newCards += added;
+            if (srs) activate_new_cards();
+        }
+        if (idx + 3 >= size()) prefetcher->want_more(deck.flashcards);
+    }
+
+    // Review mode: records the grade for the current card and moves to the
+    // next due one. Grading a hidden card just reveals it first; once every
+    // card is done grades are ignored, so browsing doesn't skew the schedule.
+    void grade(Grade g) {
+        if (!srs) return;
+        if (!showAnswer) {
+            showAnswer = true;
+            return;
+        }
+        if (caughtUp) {
+            next_due(); // a card may have become due meanwhile
+            return;
+        }
+        srs->review(slots[idx], g, now_minute());
+        ++reviewed;
+        next_due();
+    }
+
+    void render(FrameRenderer& screen, const std::string& footer) const {
+        std::string status;
+        if (srs) status = reviewStatus;
+        if (prefetcher) {
+            std::string prefetchStatus = prefetcher->status();
+            if (newCards) {
+                prefetchStatus = "+" + std::to_string(newCards) + " new cards added" +
+                                 (prefetchStatus.empty() ? "" : ". " + prefetchStatus);
+            }
+            if (!prefetchStatus.empty()) status += (status.empty() ? "" : "  ") + prefetchStatus;
+        }
+        if (!related.empty()) {
+            status += (status.empty() ? "" : "\n") + std::string("Related:");
+            for (const auto& r : related) status += "\n  " + r;
+        }
+        display_card(screen, deck.flashcards[idx], idx, size(), showAnswer, footer, status);
+    }
+
+    // Registers cards that have no scheduler slot yet
+    void activate_new_cards() {
+        uint32_t now = now_minute();
+        while (slots.size() < deck.flashcards.size()) {
+            uint32_t slot = srs->activate(card_id(deck.flashcards[slots.size()]), now);
+            slotToCard[slot] = (int)slots.size();
+            slots.push_back(slot);
+        }
+    }
+
+    // Shows the most overdue card, or reports when the next one is due
+    void next_due() {
+        uint32_t now = now_minute();
+        int64_t slot = srs->next_due(now);
+        showAnswer = false;
+        related.clear();
+        caughtUp = slot < 0;
+        if (!caughtUp) {
+            idx = slotToCard[(uint32_t)slot];
+            reviewStatus = "Reviewed " + std::to_string(reviewed) + " this session.";
+        } else {
+            reviewStatus = "All caught up! Next review in " +
+                           format_minutes(srs->earliest_due() - now) + " (browse with n/p).";
+        }
+    }
+
+    FlashcardResult& deck;
+    DeckPrefetcher* prefetcher; // background card generation (may be null)
+    SrsScheduler* srs;          // review scheduler (null = free browsing)
+    StudyLibrary* library;      // semantic index (null = no "similar")
+    std::vector<std::string> related; // lines of the last "similar" lookup
+    std::vector<uint32_t> slots;                  // deck index -> scheduler slot
+    std::unordered_map<uint32_t, int> slotToCard; // scheduler slot -> deck index
+    std::string reviewStatus;   // review progress line
+    size_t reviewed = 0;        // cards graded this session
+    bool caughtUp = false;      // no active card is due
+    int idx = 0;                // current flashcard index
+    bool showAnswer = false;    // whether answer is visible
+    size_t newCards = 0;        // cards merged in from the prefetcher so far
+    std::mt19937 rng;           // RNG for random card
+};
+
+// Collects input-to-render latency samples (microseconds)
+struct LatencyStats {
+    std::vector<double> samples;
+
+    void add(double us) { samples.push_back(us); }
+
+    // Value at quantile q (0..1) of the recorded samples
+    double quantile(double q) {
+        if (samples.empty()) return 0.0;
+        size_t k = (size_t)(q * (samples.size() - 1));
+        std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+        return samples[k];
+    }
+
+    void report(std::ostream& os, const char* label) {
+        if (samples.empty()) return;
+        double mx = *std::max_element(samples.begin(), samples.end());
+        double p50 = quantile(0.50), p99 = quantile(0.99);
+        os << label << ": " << samples.size() << " inputs, input-to-render p50 " << p50
+           << " us, p99 " << p99 << " us, max " << mx << " us\n";
+    }
+};
+
+// ======== RAW TERMINAL INPUT =========
+
+// Puts a terminal into non-canonical, no-echo mode for single-keystroke
+// input and restores the original settings on destruction. ISIG is off too:
+// Ctrl-C arrives as a key (0x03) and quits the viewer normally, so the
+// terminal is restored and review state saved instead of the process dying.
+class RawTerminal {
+public:
+    explicit RawTerminal(int fd) : fd_(fd) {
+        if (!isatty(fd_) || tcgetattr(fd_, &saved_) != 0) return;
+        struct termios raw = saved_;
+        raw.c_lflag &= ~(ICANON | ECHO | IEXTEN | ISIG);
+        raw.c_iflag &= ~(IXON | ICRNL);
+        raw.c_cc[VMIN] = 1;  // block until at least one byte...
+        raw.c_cc[VTIME] = 0; // ...with no inter-byte timer
+        active_ = tcsetattr(fd_, TCSANOW, &raw) == 0; // keep type-ahead
+    }
+    ~RawTerminal() {
+        if (active_) tcsetattr(fd_, TCSAFLUSH, &saved_);
+    }
+    RawTerminal(const RawTerminal&) = delete;
+    RawTerminal& operator=(const RawTerminal&) = delete;
+
+    bool active() const { return active_; }
+
+private:
+    int fd_;
+    bool active_ = false;
+    struct termios saved_;
+};
+
+// Decoded keystroke
+struct KeyEvent {
+    enum Kind { Char, Up, Down, Left, Right, Home, End, PageUp, PageDown, Enter, Backspace, Escape };
+    Kind kind;
+    char ch; // the character for Kind::Char
+};
+
+// Blocks until input is available, then decodes everything that is queued.
+// Returning all pending keys at once lets the viewer apply a burst of
+// auto-repeated keys and render only the final state. Returns false on EOF.
+static bool read_keys(int fd, std::vector<KeyEvent>& keys) {
+    keys.clear();
+    char buf[256];
+    ssize_t n;
+    do {
+        n = read(fd, buf, sizeof(buf));
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return false;
+
+    std::string in(buf, (size_t)n);
+
+    // A lone trailing ESC may be the start of a sequence still in flight
+    if (in.back() == '\033') {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, 30) > 0) {
+            n = read(fd, buf, sizeof(buf));
+            if (n > 0) in.append(buf, (size_t)n);
+        }
+    }
+
+    for (size_t i = 0; i < in.size(); ++i) {
+        char c = in[i];
+        if (c == '\033') {
+            // CSI / SS3 sequences: ESC [ X, ESC O X, ESC [ n ~
+            if (i + 2 < in.size() && (in[i + 1] == '[' || in[i + 1] == 'O')) {
+                size_t j = i + 2;
+                std::string param;
+                while (j < in.size() && in[j] >= '0' && in[j] <= '9') param += in[j++];
+                if (j < in.size()) {
+                    char fin = in[j];
+                    KeyEvent::Kind kind = KeyEvent::Escape;
+                    bool known = true;
+                    switch (fin) {
+                        case 'A': kind = KeyEvent::Up; break;
+                        case 'B': kind = KeyEvent::Down; break;
+                        case 'C': kind = KeyEvent::Right; break;
+                        case 'D': kind = KeyEvent::Left; break;
+                        case 'H': kind = KeyEvent::Home; break;
+                        case 'F': kind = KeyEvent::End; break;
+                        case '~':
+                            if (param == "1" || param == "7") kind = KeyEvent::Home;
+                            else if (param == "4" || param == "8") kind = KeyEvent::End;
+                            else if (param == "5") kind = KeyEvent::PageUp;
+                            else if (param == "6") kind = KeyEvent::PageDown;
+                            else known = false;
+                            break;
+                        default: known = false;
+                    }
+                    if (known) keys.push_back({kind, 0});
+                    i = j;
+                    continue;
+                }
+            }
+            keys.push_back({KeyEvent::Escape, 0});
+        } else if (c == '\r' || c == '\n') {
+            keys.push_back({KeyEvent::Enter, 0});
+        } else if (c == 0x7f || c == 0x08) {
+            keys.push_back({KeyEvent::Backspace, 0});
+        } else {
+            keys.push_back({KeyEvent::Char, c});
+        }
+    }
+    return true;
+}
+
+// Single-keystroke viewer loop. Returns false if raw mode could not be
+// enabled (caller falls back to line mode).
+static bool run_raw_viewer(ViewerState& st, int inFd, const AppOptions& opts) {
+    RawTerminal raw(inFd);
+    if (!raw.active()) return false;
+
+    FrameRenderer screen;
+    LatencyStats latency;
+    std::string digits;             // card number being typed for a jump
+    std::vector<KeyEvent> keys;
+
+    auto footer = [&]() {
+        if (st.srs) return std::string(kReviewHelp);
+        return digits.empty() ? std::string(kRawModeHelp) : "Jump to: " + digits + "_";
+    };
+
+    st.sync_prefetch();
+    st.render(screen, footer());
+    bool quit = false;
+    while (!quit) {
+        // Wait for a key, or for the prefetcher to announce new cards
+        // (re-checks shortly if cards are ready but the worker held the lock)
+        struct pollfd fds[2] = {{inFd, POLLIN, 0}, {-1, POLLIN, 0}};
+        int timeoutMs = -1;
+        if (st.prefetcher) {
+            fds[1].fd = st.prefetcher->wake_fd();
+            if (st.prefetcher->has_ready()) timeoutMs = 10;
+        }
+        if (poll(fds, 2, timeoutMs) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            st.sync_prefetch();
+            st.render(screen, footer());
+            continue;
+        }
+
+        if (!read_keys(inFd, keys)) break; // EOF
+        auto t0 = std::chrono::steady_clock::now();
+
+        for (const KeyEvent& k : keys) {
+            if (st.srs && k.kind == KeyEvent::Char && k.ch >= '1' && k.ch <= '4') {
+                st.grade(static_cast<Grade>(k.ch - '1')); // review mode: digits are grades
+                continue;
+            }
+            if (k.kind == KeyEvent::Char && k.ch >= '0' && k.ch <= '9') {
+                if (digits.size() < 9) digits += k.ch;
+                continue;
+            }
+            switch (k.kind) {
+                case KeyEvent::Enter:
+                    if (!digits.empty()) st.jump(std::atoi(digits.c_str()));
+                    else st.flip();
+                    digits.clear();
+                    break;
+                case KeyEvent::Backspace: if (!digits.empty()) digits.pop_back(); break;
+                case KeyEvent::Escape:    digits.clear(); break;
+                case KeyEvent::Right: case KeyEvent::Down:   st.step(1); break;
+                case KeyEvent::Left:  case KeyEvent::Up:     st.step(-1); break;
+                case KeyEvent::PageDown: st.step(10); break;
+                case KeyEvent::PageUp:   st.step(-10); break;
+                case KeyEvent::Home: st.jump(1); break;
+                case KeyEvent::End:  st.jump(st.size()); break;
+                case KeyEvent::Char:
+                    switch (k.ch) {
+                        case 'f': case ' ': st.flip(); break;
+                        case 'n': case 'l': st.step(1); break;
+                        case 'p': case 'h': st.step(-1); break;
+                        case 'r': st.random(); break;
+                        case 's': st.show_related(); break;
+                        case 'g': st.jump(1); break;
+                        case 'G': st.jump(st.size()); break;
+                        case 'q': case 0x03: case 0x04: quit = true; break; // q, Ctrl-C or Ctrl-D
+                        default: break;
+                    }
+                    break;
+            }
+            if (quit) break;
+        }
+        if (quit) break;
+
+        st.sync_prefetch();
+        st.render(screen, footer());
+        latency.add(std::chrono::duration<double, std::micro>(
+                        std::chrono::steady_clock::now() - t0).count());
+    }
+
+    screen.clear();
+    if (opts.showStats) latency.report(std::cerr, "viewer");
+    return true;
+}
+
+// Line-mode viewer loop: one command per line (used when input isn't a TTY)
+static void run_line_viewer(ViewerState& st, std::istream& in, const AppOptions& opts) {
+    FrameRenderer screen;  // off-screen frame + diff against the terminal
+    LatencyStats latency;
+    std::string cmd;       // user command/input line
+
+    while (true) {
+        // Display current card (merging any cards generated in the background)
+        st.sync_prefetch();
+        st.render(screen, st.srs ? kReviewHelp : kLineModeHelp);
+
+        // Read a command line from user
+        if (!std::getline(in, cmd)) break;       // if EOF, exit
+        if (cmd.empty()) continue;               // ignore empty lines
+        auto t0 = std::chrono::steady_clock::now();
+
+        // Trim leading spaces
+        size_t p = cmd.find_first_not_of(" \t");
+        if (p != std::string::npos) cmd = cmd.substr(p);
+
+        // Review mode: 1-4 (or again/hard/good/easy) grade the current card
+        static const char* kGradeNames[] = {"again", "hard", "good", "easy"};
+        int gradeCmd = -1;
+        for (int g = 0; g < 4; ++g) {
+            if (cmd == kGradeNames[g] || cmd == std::to_string(g + 1)) gradeCmd = g;
+        }
+
+        // Handle supported commands
+        if (st.srs && gradeCmd >= 0) {
+            st.grade(static_cast<Grade>(gradeCmd));
+
+        } else if (cmd == "f" || cmd == "flip") {
+            // Toggle answer visibility
+            st.flip();
+
+        } else if (cmd == "n" || cmd == "next") {
+            // Move to next card (wrap around)
+            st.step(1);
+
+        } else if (cmd == "p" || cmd == "prev") {
+            // Move to previous card (wrap around)
+            st.step(-1);
+
+        } else if (cmd == "r" || cmd == "random") {
+            // Jump to random card
+            st.random();
+
+        } else if (cmd == "s" || cmd == "similar") {
+            // List related cards
+            st.show_related();
+
+        } else if (cmd.size() > 2 && (cmd[0] == 'j' || cmd.rfind("jump", 0) == 0)) {
+            // "jump" command (e.g., "j 3" or "jump 5")
+            std::string numstr;
+            // Extract digits and optional minus sign from the string
+            for (char c : cmd)
+                if ((c >= '0' && c <= '9') || c == '-')
+                    numstr.push_back(c);
+
+            if (!numstr.empty()) {
+                try {
+                    // Only jumps if index is in valid range
+                    st.jump(std::stoi(numstr));
+                } catch (...) {
+                    // Ignore invalid numbers
+                }
+            }
+
+        } else if (cmd == "q" || cmd == "quit") {
+            // Quit viewer
+            break;
+
+        } else {
+            // If the command isn't recognized, try to interpret it as a card number
+            try {
+                st.jump(std::stoi(cmd));
+            } catch (...) {
+                // Unknown input, ignore
+            }
+        }
+
+        if (opts.showStats) {
+            // Time the render of the new state (the loop top would do it anyway)
+            st.render(screen, st.srs ? kReviewHelp : kLineModeHelp);
+            latency.add(std::chrono::duration<double, std::micro>(
+                            std::chrono::steady_clock::now() - t0).count());
+        }
+    }
+    screen.clear();
+    if (opts.showStats) latency.report(std::cerr, "viewer");
+}
+
+// Interactive flashcard viewer for the terminal.
+// Uses single-keystroke raw mode when `inFd` is a terminal, and falls back to
+// line commands read from `in` otherwise (or with --line-mode). Cards produced
+// by a prefetcher are appended to `deck` as they arrive. With a scheduler the
+// viewer runs in review mode and shows due cards first.
+static void run_flashcard_viewer(FlashcardResult& deck, std::istream& in, int inFd,
+                                 const AppOptions& opts, const ViewerExtras& extras = {}) {
+    // If no flashcards, just exit
+    if (deck.flashcards.empty()) {
+        std::cout << "No flashcards to view.\n";
+        return;
+    }
+
+    ViewerState st(deck, extras);
+    if (!opts.lineMode && run_raw_viewer(st, inFd, opts)) return;
+    run_line_viewer(st, in, opts);
+}
+
+// Non-interactive fallback: prints the whole deck when no terminal is available
+static void print_flashcards(const FlashcardResult& deck) {
+    std::cout << "\n=== FLASHCARDS ===\n";
+    for (size_t i = 0; i < deck.flashcards.size(); ++i) {
+        std::cout << (i + 1) << ". Q: " << deck.flashcards[i].question << "\n";
+        std::cout << "   A: " << deck.flashcards[i].answer << "\n";
+    }
+}
+
+// ======== METRICS =========
+
+// Metrics are written through per-thread slots: while a thread holds a
+// slot it is that slot's only writer, so recording is a plain load and
+// store with no locked instruction. Threads beyond kMetricSlots share one
+// extra slot updated with atomic adds. Slots are handed back when a thread
+// exits (the mutex orders the old owner's writes before the new owner's).
+static const int kMetricSlots = 16;
+
+class MetricSlotPool {
+public:
+    static int acquire() {
+        MetricSlotPool& p = instance();
+        std::lock_guard<std::mutex> lock(p.mu_);
+        if (p.free_.empty()) return -1;
+        int slot = p.free_.back();
+        p.free_.pop_back();
+        return slot;
+    }
+    static void release(int slot) {
+        if (slot < 0) return;
+        MetricSlotPool& p = instance();
+        std::lock_guard<std::mutex> lock(p.mu_);
+        p.free_.push_back(slot);
+    }
+
+private:
+    MetricSlotPool() {
+        for (int s = kMetricSlots - 1; s >= 0; --s) free_.push_back(s);
+    }
+    static MetricSlotPool& instance() {
+        static MetricSlotPool* pool = new MetricSlotPool(); // outlives thread_local leases
+        return *pool;
+    }
+
+    std::mutex mu_;
+    std::vector<int> free_;
+};
+
+// This thread's slot (-1 = use the shared one)
+static int metrics_slot() {
+    struct Lease {
+        int slot = MetricSlotPool::acquire();
+        ~Lease() { MetricSlotPool::release(slot); }
+    };
+    thread_local Lease lease;
+    return lease.slot;
+}
+
+// Adds n to a cell, without a locked instruction when this thread owns it
+static inline void slot_add(std::atomic<uint64_t>& cell, uint64_t n, bool owned) {
+    if (owned) cell.store(cell.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    else cell.fetch_add(n, std::memory_order_relaxed);
+}
+
+// Monotonic event counter
+class Counter {
+public:
+    void inc(uint64_t n = 1) {
+        int s = metrics_slot();
+        slot_add(cells_[s >= 0 ? s : kMetricSlots].value, n, s >= 0);
+    }
+    uint64_t value() const {
+        uint64_t total = 0;
+        for (const Cell& c : cells_) total += c.value.load(std::memory_order_relaxed);
+        return total;
+    }
+
+private:
+    struct alignas(64) Cell {   // one cache line per slot: no false sharing
+        std::atomic<uint64_t> value{0};
+    };
+    std::array<Cell, kMetricSlots + 1> cells_;
+};
+
+// HDR-style latency histogram over microseconds: 32 linear sub-buckets per
+// power of two, so any recorded value is known to within ~3%, from 1 us to
+// about 19 hours. Each slot's bucket array is allocated on its first record.
+class Histogram {
+public:
+    static const int kSubBits = 5;
+    static const int kSub = 1 << kSubBits;
+    static const int kBuckets = kSub + 31 * kSub;
+
+    Histogram() {
+        for (auto& s : shards_) s.store(nullptr, std::memory_order_relaxed);
+    }
+    ~Histogram() {
+        for (auto& s : shards_) delete s.load();
+    }
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    void record(uint64_t us) {
+        int s = metrics_slot();
+        Shard& shard = shard_for(s >= 0 ? s : kMetricSlots);
+        slot_add(shard.counts[bucket_of(us)], 1, s >= 0);
+        slot_add(shard.sumUs, us, s >= 0);
+    }
+
+    uint64_t count() const {
+        uint64_t n = 0;
+        for (int b = 0; b < kBuckets; ++b) n += bucket_count(b);
+        return n;
+    }
+    uint64_t sum_us() const {
+        uint64_t total = 0;
+        for (const auto& s : shards_) {
+            if (const Shard* sh = s.load(std::memory_order_acquire)) total += sh->sumUs.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    // Number of recorded values <= us (exact at bucket boundaries)
+    uint64_t count_at_most(uint64_t us) const {
+        uint64_t n = 0;
+        for (int b = 0; b < kBuckets && bucket_low(b) <= us; ++b) n += bucket_count(b);
+        return n;
+    }
+
+    // Value at quantile q (0..1), reported as the top of its bucket
+    uint64_t quantile(double q) const {
+        std::vector<uint64_t> counts(kBuckets);
+        uint64_t total = 0;
+        for (int b = 0; b < kBuckets; ++b) total += counts[b] = bucket_count(b);
+        if (total == 0) return 0;
+        uint64_t rank = std::max<uint64_t>((uint64_t)std::ceil(q * total), 1), seen = 0;
+        for (int b = 0; b < kBuckets; ++b) {
+            seen += counts[b];
+            if (seen >= rank) return bucket_high(b);
+        }
+        return bucket_high(kBuckets - 1);
+    }
+
+private:
+    struct Shard {
+        std::array<std::atomic<uint64_t>, kBuckets> counts{};
+        std::atomic<uint64_t> sumUs{0};
+    };
+
+    Shard& shard_for(int s) {
+        Shard* sh = shards_[s].load(std::memory_order_acquire);
+        if (sh) return *sh;
+        Shard* fresh = new Shard();
+        if (shards_[s].compare_exchange_strong(sh, fresh, std::memory_order_acq_rel)) return *fresh;
+        delete fresh; // the shared slot raced with another thread
+        return *sh;
+    }
+
+    uint64_t bucket_count(int b) const {
+        uint64_t n = 0;
+        for (const auto& s : shards_) {
+            if (const Shard* sh = s.load(std::memory_order_acquire)) n += sh->counts[b].load(std::memory_order_relaxed);
+        }
+        return n;
+    }
+
+    static int bucket_of(uint64_t v) {
+        if (v < (uint64_t)kSub) return (int)v;
+        int shift = 63 - __builtin_clzll(v) - kSubBits;
+        int b = kSub + shift * kSub + (int)((v >> shift) - kSub);
+        return std::min(b, kBuckets - 1);
+    }
+    static uint64_t bucket_low(int b) {
+        if (b < kSub) return (uint64_t)b;
+        int shift = (b - kSub) / kSub;
+        return (uint64_t)(kSub + (b - kSub) % kSub) << shift;
+    }
+    static uint64_t bucket_high(int b) {
+        return b < kSub ? (uint64_t)b : bucket_low(b) + (1ULL << ((b - kSub) / kSub)) - 1;
+    }
+
+    std::array<std::atomic<Shard*>, kMetricSlots + 1> shards_;
+};
+
+// Named metrics, exported in the Prometheus text format. Look a metric up
+// once and keep the reference: registration takes a lock, recording never
+// does.
+class MetricsRegistry {
+public:
+    // `labels` is Prometheus label syntax without braces, e.g. path="/x"
+    Counter& counter(const std::string& name, const std::string& labels, const std::string& help) {
+        std::lock_guard<std::mutex> lock(mu_);
+        for (const auto& e : entries_) {
+            if (e.counter && e.name == name && e.labels == labels) return *e.counter;
+        }
+        counters_.emplace_back();
+        entries_.push_back({name, labels, help, &counters_.back(), nullptr});
+        return counters_.back();
+    }
+
+    // Histogram of microsecond values, exported in seconds
+    Histogram& histogram(const std::string& name, const std::string& labels, const std::string& help) {
+        std::lock_guard<std::mutex> lock(mu_);
+        for (const auto& e : entries_) {
+            if (e.histogram && e.name == name && e.labels == labels) return *e.histogram;
+        }
+        histograms_.emplace_back();
+        entries_.push_back({name, labels, help, nullptr, &histograms_.back()});
+        return histograms_.back();
+    }
+
+    void write_prometheus(std::ostream& os) const {
+        // Bucket bounds for export (the full resolution stays in-process)
+        static const double kBoundsSec[] = {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25,
+                                            0.5, 1, 2.5, 5, 10, 30, 60, 120};
+        std::lock_guard<std::mutex> lock(mu_);
+        std::vector<const Entry*> sorted;
+        for (const auto& e : entries_) sorted.push_back(&e);
+        std::stable_sort(sorted.begin(), sorted.end(),
+                         [](const Entry* a, const Entry* b) { return a->name < b->name; });
+
+        std::string lastName;
+        for (const Entry* e : sorted) {
+            if (e->name != lastName) {
+                os << "# HELP " << e->name << " " << e->help << "\n"
+                   << "# TYPE " << e->name << (e->counter ? " counter\n" : " histogram\n");
+                lastName = e->name;
+            }
+            std::string braced = e->labels.empty() ? "" : "{" + e->labels + "}";
+            if (e->counter) {
+                os << e->name << braced << " " << e->counter->value() << "\n";
+                continue;
+            }
+            std::string sep = e->labels.empty() ? "" : e->labels + ",";
+            for (double le : kBoundsSec) {
+                os << e->name << "_bucket{" << sep << "le=\"" << le << "\"} "
+                   << e->histogram->count_at_most((uint64_t)(le * 1e6)) << "\n";
+            }
+            os << e->name << "_bucket{" << sep << "le=\"+Inf\"} " << e->histogram->count() << "\n"
+               << e->name << "_sum" << braced << " " << e->histogram->sum_us() / 1e6 << "\n"
+               << e->name << "_count" << braced << " " << e->histogram->count() << "\n";
+        }
+    }
+
+    // Writes the Prometheus text to a file (temp file + rename)
+    void write_file(const std::string& path) const {
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            write_prometheus(out);
+            if (!out) throw std::runtime_error("Cannot write metrics file " + tmp);
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("Cannot write metrics file " + path);
+        }
+    }
+
+private:
+    struct Entry {
+        std::string name;
+        std::string labels;
+        std::string help;
+        Counter* counter;
+        Histogram* histogram;
+    };
+
+    mutable std::mutex mu_;
+    std::deque<Counter> counters_;     // deques: references stay valid as they grow
+    std::deque<Histogram> histograms_;
+    std::vector<Entry> entries_;
+};
+
+static MetricsRegistry& metrics() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+// Metrics for one API path, looked up once per request
+struct EndpointMetrics {
+    Counter& requests;
+    Counter& bytesSent;
+    Counter& bytesReceived;
+    Counter& errHttp;
+    Counter& errTimeout;
+    Counter& errCancelled;
+    Counter& errTransport;
+    Histogram& latency;
+
+    Counter& error(const char* kind) {
+        if (std::strcmp(kind, "http") == 0) return errHttp;
+        if (std::strcmp(kind, "timeout") == 0) return errTimeout;
+        if (std::strcmp(kind, "cancelled") == 0) return errCancelled;
+        return errTransport;
+    }
+};
+
+static EndpointMetrics& endpoint_metrics(const std::string& path) {
+    static std::mutex mu;
+    static std::unordered_map<std::string, std::unique_ptr<EndpointMetrics>> byPath;
+    std::lock_guard<std::mutex> lock(mu);
+    std::unique_ptr<EndpointMetrics>& m = byPath[path];
+    if (!m) {
+        MetricsRegistry& r = metrics();
+        std::string l = "path=\"" + path + "\"";
+        auto err = [&](const char* kind) -> Counter& {
+            return r.counter("ai_study_api_errors_total", l + ",kind=\"" + kind + "\"",
+                             "API requests that failed, by cause");
+        };
+        m.reset(new EndpointMetrics{
+            r.counter("ai_study_api_requests_total", l, "API requests started"),
+            r.counter("ai_study_api_sent_bytes_total", l, "Request body bytes sent"),
+            r.counter("ai_study_api_received_bytes_total", l, "Response body bytes received"),
+            err("http"), err("timeout"), err("cancelled"), err("transport"),
+            r.histogram("ai_study_api_request_duration_seconds", l,
+                        "Latency of successful API requests (including hedging)")});
+    }
+    return *m;
+}
+
+// Serves the registry as Prometheus text over HTTP on 127.0.0.1:port from
+// a background thread, for long-running sessions
+class MetricsServer {
+public:
+    explicit MetricsServer(int port) {
+        listenFd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listenFd_ < 0) throw std::runtime_error("metrics: socket() failed");
+        int one = 1;
+        setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        struct sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listenFd_, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd_, 16) != 0) {
+            close(listenFd_);
+            throw std::runtime_error("metrics: cannot listen on port " + std::to_string(port) + ": " +
+                                     std::strerror(errno));
+        }
+        if (pipe2(stop_, O_CLOEXEC) != 0) {
+            close(listenFd_);
+            throw std::runtime_error("metrics: pipe2() failed");
+        }
+        worker_ = std::thread([this] { serve(); });
+    }
+
+    ~MetricsServer() {
+        char b = 1;
+        if (write(stop_[1], &b, 1) < 0) {} // wake the accept loop
+        worker_.join();
+        close(listenFd_);
+        close(stop_[0]);
+        close(stop_[1]);
+    }
+
+private:
+    void serve() {
+        while (true) {
+            struct pollfd fds[2] = {{listenFd_, POLLIN, 0}, {stop_[0], POLLIN, 0}};
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            if (fds[1].revents) return;
+            int fd = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) continue;
+
+            // Any request gets the metrics; read (and ignore) up to the headers' end
+            struct timeval tv = {2, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            std::string req;
+            char buf[1024];
+            while (req.find("\r\n\r\n") == std::string::npos && req.size() < 16384) {
+                ssize_t n = read(fd, buf, sizeof(buf));
+                if (n <= 0) break;
+                req.append(buf, (size_t)n);
+            }
+            std::ostringstream body;
+            metrics().write_prometheus(body);
+            std::string text = body.str();
+            std::string resp = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: " + std::to_string(text.size()) +
+                               "\r\nConnection: close\r\n\r\n" + text;
+            const char* p = resp.data();
+            size_t left = resp.size();
+            while (left > 0) {
+                ssize_t n = send(fd, p, left, MSG_NOSIGNAL);
+                if (n <= 0) break;
+                p += n;
+                left -= (size_t)n;
+            }
+            close(fd);
+        }
+    }
+
+    int listenFd_ = -1;
+    int stop_[2] = {-1, -1};
+    std::thread worker_;
+};
+
+// ======== CURL RESPONSE CALLBACK =========
+
+// Callback that libcurl uses to write incoming HTTP response data into a std::string
+static size_t WriteCallback(void* contents, size_t size, size_t nmemb, void* userp) {
+    size_t totalSize = size * nmemb;
+    std::string* s = static_cast<std::string*>(userp);
+    s->append(static_cast<char*>(contents), totalSize);
+    return totalSize;
+}
+
+// ======== TIMEOUTS, CANCELLATION AND HEDGING =========
+
+// Set by the SIGINT handler while an InterruptGuard is active
+static std::atomic<bool> g_interrupted{false};
+
+static void on_sigint(int) {
+    if (g_interrupted.exchange(true)) {
+        // Second Ctrl-C: stop waiting for a clean shutdown
+        signal(SIGINT, SIG_DFL);
+        raise(SIGINT);
+    }
+}
+
+// While alive, Ctrl-C aborts in-flight API requests (which then throw
+// "Interrupted") instead of killing the process outright
+class InterruptGuard {
+public:
+    InterruptGuard() {
+        struct sigaction sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_sigint;
+        sigemptyset(&sa.sa_mask);
+        active_ = sigaction(SIGINT, &sa, &saved_) == 0;
+    }
+    ~InterruptGuard() { restore(); }
+
+    // Puts the previous SIGINT disposition back early
+    void restore() {
+        if (active_) sigaction(SIGINT, &saved_, nullptr);
+        active_ = false;
+    }
+
+private:
+    struct sigaction saved_;
+    bool active_ = false;
+};
+
+// What the progress callback watches for one transfer
+struct TransferWatch {
+    const std::atomic<bool>* cancel = nullptr; // the requesting thread's cancel flag
+    long idleTimeoutMs = 0;                    // 0 = no idle limit
+    curl_off_t lastBytes = -1;
+    std::chrono::steady_clock::time_point lastActivity = std::chrono::steady_clock::now();
+    bool idleExpired = false;
+};
+
+// Progress callback that abandons a transfer on Ctrl-C, when the requesting
+// thread's cancel flag is raised, or when no bytes have moved for too long
+static int CancelCallback(void* clientp, curl_off_t, curl_off_t dlnow, curl_off_t, curl_off_t ulnow) {
+    auto* watch = static_cast<TransferWatch*>(clientp);
+    if (g_interrupted.load(std::memory_order_relaxed)) return 1; // non-zero aborts
+    if (watch->cancel && watch->cancel->load(std::memory_order_relaxed)) return 1;
+
+    auto now = std::chrono::steady_clock::now();
+    if (dlnow + ulnow != watch->lastBytes) {
+        watch->lastBytes = dlnow + ulnow;
+        watch->lastActivity = now;
+    } else if (watch->idleTimeoutMs > 0 &&
+               now - watch->lastActivity > std::chrono::milliseconds(watch->idleTimeoutMs)) {
+        watch->idleExpired = true;
+        return 1;
+    }
+    return 0;
+}
+
+// Limits applied to every API request (set from the command line)
+struct HttpPolicy {
+    long connectTimeoutMs = 10000;   // TCP + TLS handshake
+    long totalTimeoutMs = 120000;    // whole request (0 = no limit)
+    long idleTimeoutMs = 0;          // abort when no bytes move for this long (0 = off)
+    bool hedge = false;              // duplicate slow chat requests
+    long hedgeAfterMs = 0;           // fixed hedge delay (0 = p95 of that model's latency)
+    bool offlineFallback = true;     // answer locally while the API is unreachable
+    bool offline = false;            // never call the chat API: answer locally
+};
+
+static HttpPolicy& http_policy() {
+    static HttpPolicy policy;
+    return policy;
+}
+
+// How often hedging fired, and how often the duplicate finished first
+struct HedgeStats {
+    Counter& sent = metrics().counter("ai_study_hedges_sent_total", "",
+                                      "Duplicate requests sent because the original was slow");
+    Counter& won = metrics().counter("ai_study_hedges_won_total", "",
+                                     "Hedged requests where the duplicate answered first");
+};
+
+static HedgeStats& hedge_stats() {
+    static HedgeStats stats;
+    return stats;
+}
+
+// ======== MODEL ROUTING =========
+
+// What a chat request is for; routing rules can match on it
+enum class ChatTask { kSummary, kFlashcards, kCombined };
+
+static const char* task_name(ChatTask task) {
+    switch (task) {
+        case ChatTask::kSummary: return "summary";
+        case ChatTask::kFlashcards: return "flashcards";
+        case ChatTask::kCombined: return "combined";
+    }
+    return "?";
+}
+
+// Rough prompt size for routing (about 4 bytes per token for English text)
+static size_t estimate_tokens(const std::string& text) {
+    return (text.size() + 3) / 4;
+}
+
+// One routing rule: requests for `task` whose prompt falls within
+// [minInputTokens, maxInputTokens] are sent to `model`
+struct RouteRule {
+    std::string task = "*";                  // "summary", "flashcards", "combined" or "*"
+    size_t minInputTokens = 0;
+    size_t maxInputTokens = SIZE_MAX;
+    std::string model;
+    int maxTokens = 0;                       // completion cap (0 = API default)
+};
+
+// Where a request goes
+struct RouteChoice {
+    std::string model;
+    int maxTokens = 0;
+};
+
+// Picks a model per request from an ordered rule list (first match wins)
+// and records how each model performs, so the rules can be tuned from data.
+class ModelRouter {
+public:
+    ModelRouter() : rules_(default_rules()) {}
+
+    // Small model for short flashcard jobs, the large one for long
+    // summaries, gpt-4.1-mini for everything else
+    static std::vector<RouteRule> default_rules() {
+        RouteRule shortCards;
+        shortCards.task = "flashcards";
+        shortCards.maxInputTokens = 4000;
+        shortCards.model = "gpt-4.1-nano";
+        shortCards.maxTokens = 2048;
+
+        RouteRule longSummary;
+        longSummary.task = "summary";
+        longSummary.minInputTokens = 32000;
+        longSummary.model = "gpt-4.1";
+        longSummary.maxTokens = 1024;
+
+        RouteRule fallback;
+        fallback.model = "gpt-4.1-mini";
+        return {shortCards, longSummary, fallback};
+    }
+
+    // Replaces the rules with a JSON array read from `path`, e.g.
+    //   [{"task": "flashcards", "max_input_tokens": 4000,
+    //     "model": "gpt-4.1-nano", "max_tokens": 2048},
+    //    {"model": "gpt-4.1-mini"}]
+    void load_rules(const std::string& path) {
+        std::ifstream in(path);
+        if (!in) throw std::runtime_error("Cannot open routing rules " + path);
+        json doc = json::parse(in, nullptr, false);
+        if (!doc.is_array() || doc.empty()) {
+            throw std::runtime_error(path + ": routing rules must be a non-empty JSON array");
+        }
+        std::vector<RouteRule> rules;
+        for (const auto& r : doc) {
+            if (!r.is_object() || !r.contains("model") || !r["model"].is_string()) {
+                throw std::runtime_error(path + ": every routing rule needs a \"model\"");
+            }
+            RouteRule rule;
+            rule.model = r["model"].get<std::string>();
+            rule.task = r.value("task", std::string("*"));
+            if (rule.task != "*" && rule.task != "summary" && rule.task != "flashcards" &&
+                rule.task != "combined") {
+                throw std::runtime_error(path + ": unknown task \"" + rule.task + "\"");
+            }
+            rule.minInputTokens = r.value("min_input_tokens", (size_t)0);
+            rule.maxInputTokens = r.value("max_input_tokens", SIZE_MAX);
+            rule.maxTokens = r.value("max_tokens", 0);
+            rules.push_back(rule);
+        }
+        rules_ = rules;
+    }
+
+    // Appends one JSON line per request (model, task, tokens, latency) to `path`
+    void open_log(const std::string& path) {
+        log_.open(path, std::ios::app);
+        if (!log_) throw std::runtime_error("Cannot open route log " + path);
+    }
+
+    RouteChoice route(ChatTask task, size_t inputTokens) const {
+        for (const auto& rule : rules_) {
+            if (rule.task != "*" && rule.task != task_name(task)) continue;
+            if (inputTokens < rule.minInputTokens || inputTokens > rule.maxInputTokens) continue;
+            return {rule.model, rule.maxTokens};
+        }
+        return {"gpt-4.1-mini", 0};
+    }
+
+    // Called once per finished request (from any thread). `usage` is the
+    // response's usage object, or null when the request failed.
+    void record(const RouteChoice& choice, ChatTask task, size_t inputTokens,
+                const json& usage, double ms, bool ok) {
+        std::lock_guard<std::mutex> lock(mu_);
+        ModelStats& st = stats_[choice.model + " " + task_name(task)];
+        if (!ok) {
+            ++st.errors;
+        } else {
+            st.latencyMs.add(ms);
+            size_t cached = 0;
+            if (usage.is_object()) {
+                st.promptTokens += usage.value("prompt_tokens", (size_t)0);
+                st.completionTokens += usage.value("completion_tokens", (size_t)0);
+                auto details = usage.find("prompt_tokens_details");
+                if (details != usage.end() && details->is_object()) {
+                    cached = details->value("cached_tokens", (size_t)0);
+                }
+            }
+            st.cachedTokens += cached;
+            (cached > 0 ? st.cacheHitMs : st.cacheMissMs).add(ms);
+        }
+        if (log_.is_open()) {
+            json line = {{"model", choice.model}, {"task", task_name(task)},
+                         {"est_input_tokens", inputTokens}, {"ms", ms}, {"ok", ok}};
+            if (usage.is_object()) line["usage"] = usage;
+            log_ << line.dump() << "\n";
+            log_.flush();
+        }
+    }
+
+    // Latency quantile q (ms) of successful requests for this model and
+    // task, or 0 until at least minSamples have been recorded
+    double latency_quantile(const RouteChoice& choice, ChatTask task, double q,
+                            size_t minSamples = 20) {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto it = stats_.find(choice.model + " " + task_name(task));
+        if (it == stats_.end() || it->second.latencyMs.samples.size() < minSamples) return 0;
+        return it->second.latencyMs.quantile(q);
+    }
+
+    // Input and output tokens reported by the API so far, over all models
+    std::pair<size_t, size_t> token_totals() {
+        std::lock_guard<std::mutex> lock(mu_);
+        std::pair<size_t, size_t> totals{0, 0};
+        for (const auto& kv : stats_) {
+            totals.first += kv.second.promptTokens;
+            totals.second += kv.second.completionTokens;
+        }
+        return totals;
+    }
+
+    // Per model and task: requests, failures, latency and token totals
+    void report(std::ostream& os) {
+        std::lock_guard<std::mutex> lock(mu_);
+        std::vector<std::string> keys;
+        for (const auto& kv : stats_) keys.push_back(kv.first);
+        std::sort(keys.begin(), keys.end());
+        for (const auto& key : keys) {
+            ModelStats& st = stats_[key];
+            os << "model " << key << ": " << st.latencyMs.samples.size() << " ok, " << st.errors
+               << " failed, p50 " << st.latencyMs.quantile(0.5) << " ms, p95 "
+               << st.latencyMs.quantile(0.95) << " ms, tokens in/out " << st.promptTokens << "/"
+               << st.completionTokens << "\n";
+            if (st.promptTokens > 0) {
+                os << "  prompt cache: " << 100.0 * st.cachedTokens / st.promptTokens
+                   << "% of input tokens cached, " << st.cacheHitMs.samples.size()
+                   << " requests hit (p50 " << st.cacheHitMs.quantile(0.5) << " ms), "
+                   << st.cacheMissMs.samples.size() << " missed (p50 "
+                   << st.cacheMissMs.quantile(0.5) << " ms)\n";
+            }
+        }
+    }
+
+private:
+    struct ModelStats {
+        LatencyStats latencyMs;
+        size_t errors = 0;
+        size_t promptTokens = 0;
+        size_t completionTokens = 0;
+        size_t cachedTokens = 0;    // usage.prompt_tokens_details.cached_tokens
+        LatencyStats cacheHitMs;    // requests with some cached input
+        LatencyStats cacheMissMs;
+    };
+
+    std::vector<RouteRule> rules_;
+    std::mutex mu_;
+    std::unordered_map<std::string, ModelStats> stats_; // key: "model task"
+    std::ofstream log_;
+};
+
+// The process-wide router (configured from the command line in main)
+static ModelRouter& model_router() {
+    static ModelRouter router;
+    return router;
+}
+
+// ======== CONCURRENCY LIMITER =========
+
+// Caps how many chat requests are in flight at once and adapts the cap the
+// way TCP adapts its congestion window:
+// - latency (TCP Vegas): the lowest recent latency is the no-queueing
+//   baseline, so limit * (1 - minRtt / rtt) estimates how many of our
+//   requests sit in the server's queue. Below alpha queued the limit grows
+//   by about one per round trip, above beta it shrinks by about one.
+// - multiplicative decrease: a 429, 503 or timeout cuts the limit by 30%,
+//   at most once per round trip
+// The limit only grows while callers actually use most of it. The baseline
+// creeps up slowly (~1.5% per 100 requests) so it follows a server that
+// got permanently slower.
+class ConcurrencyLimiter {
+public:
+    enum Outcome { kOk, kOverload, kIgnore };
+
+    ConcurrencyLimiter(double initial = 4, double minLimit = 1, double maxLimit = 64)
+        : limit_(initial), min_(minLimit), max_(maxLimit) {}
+
+    // Waits for a free slot; throws if interrupted or cancelled meanwhile
+    void acquire() {
+        std::unique_lock<std::mutex> lock(mu_);
+        while (inFlight_ >= (int)limit_) {
+            slotFree_.wait_for(lock, std::chrono::milliseconds(100));
+            if (g_interrupted.load() || (t_cancelFlag && t_cancelFlag->load())) {
+                throw std::runtime_error("Interrupted");
+            }
+        }
+        ++inFlight_;
+    }
+
+    // Returns a slot with how its request went (rttMs is used for kOk)
+    void release(double rttMs, Outcome outcome) {
+        std::lock_guard<std::mutex> lock(mu_);
+        bool busy = inFlight_ >= limit_ / 2;
+        --inFlight_;
+        if (outcome == kOk) on_sample(rttMs, busy);
+        else if (outcome == kOverload) on_overload();
+        limit_ = std::min(max_, std::max(min_, limit_));
+        slotFree_.notify_all();
+    }
+
+    // Holds a slot for one request; returned as kIgnore unless done() is called
+    class Permit {
+    public:
+        explicit Permit(ConcurrencyLimiter& limiter) : limiter_(limiter) { limiter_.acquire(); }
+        ~Permit() {
+            if (!done_) limiter_.release(0, kIgnore);
+        }
+        void done(double rttMs, Outcome outcome) {
+            done_ = true;
+            limiter_.release(rttMs, outcome);
+        }
+
+    private:
+        ConcurrencyLimiter& limiter_;
+        bool done_ = false;
+    };
+
+    // Starts over with new bounds (benchmarks compare settings)
+    void reset(double initial, double minLimit, double maxLimit) {
+        std::lock_guard<std::mutex> lock(mu_);
+        limit_ = initial;
+        min_ = minLimit;
+        max_ = maxLimit;
+        minRtt_ = smoothedRtt_ = 0;
+        overloads_ = 0;
+    }
+
+    double limit() {
+        std::lock_guard<std::mutex> lock(mu_);
+        return limit_;
+    }
+    int in_flight() {
+        std::lock_guard<std::mutex> lock(mu_);
+        return inFlight_;
+    }
+    size_t overloads() {
+        std::lock_guard<std::mutex> lock(mu_);
+        return overloads_;
+    }
+
+private:
+    void on_sample(double rttMs, bool busy) {
+        rttMs = std::max(rttMs, 0.1);
+        minRtt_ = minRtt_ == 0 ? rttMs : std::min(rttMs, minRtt_ * 1.00015);
+        smoothedRtt_ = smoothedRtt_ == 0 ? rttMs : smoothedRtt_ + 0.1 * (rttMs - smoothedRtt_);
+
+        double queued = limit_ * (1 - minRtt_ / rttMs);
+        double alpha = std::max(2.0, 3 * std::log10(limit_));
+        double beta = std::max(4.0, 6 * std::log10(limit_));
+        if (queued < alpha && busy) limit_ += 1 / limit_;
+        else if (queued > beta) limit_ -= 1 / limit_;
+    }
+
+    void on_overload() {
+        ++overloads_;
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastCut_ < std::chrono::duration<double, std::milli>(smoothedRtt_)) return;
+        lastCut_ = now;
+        limit_ *= 0.7;
+    }
+
+    std::mutex mu_;
+    std::condition_variable slotFree_;
+    double limit_, min_, max_;
+    int inFlight_ = 0;
+    double minRtt_ = 0, smoothedRtt_ = 0;  // ms
+    std::chrono::steady_clock::time_point lastCut_;
+    size_t overloads_ = 0;
+};
+
+// Limiter shared by all chat requests in this process
+static ConcurrencyLimiter& chat_limiter() {
+    static ConcurrencyLimiter limiter;
+    return limiter;
+}
+
+// ======== CIRCUIT BREAKER =========
+
+// Stops sending chat requests while the API looks down, so callers get an
+// answer (cached or made locally) at once instead of each waiting out a
+// timeout:
+// - closed: requests go out; tripAfter failures in a row (transport
+//   errors, timeouts, 5xx) open the circuit
+// - open: requests fail at once for a cool-down that doubles with every
+//   failed probe (2 s up to 60 s by default)
+// - half-open: when the cool-down ends one request goes out as a probe;
+//   success closes the circuit, failure opens it again
+class CircuitBreaker {
+public:
+    enum State { kClosed, kOpen, kHalfOpen };
+    enum Outcome { kSuccess, kFailure, kIgnore };
+
+    CircuitBreaker(int tripAfter = 5, double coolDownMs = 2000, double maxCoolDownMs = 60000)
+        : tripAfter_(tripAfter), baseCoolDownMs_(coolDownMs), maxCoolDownMs_(maxCoolDownMs),
+          coolDownMs_(coolDownMs) {}
+
+    // True if a request may go out now; it must then be reported to done()
+    bool allow() {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (state_ == kClosed) return true;
+        if (state_ == kOpen && std::chrono::steady_clock::now() >= retryAt_) {
+            state_ = kHalfOpen;
+            probing_ = false;
+        }
+        if (state_ == kHalfOpen && !probing_) {
+            probing_ = true;
+            return true;
+        }
+        rejected_.inc();
+        return false;
+    }
+
+    // Reports how an allowed request went (kIgnore: cancelled, or an error
+    // that says nothing about the endpoint's health)
+    void done(Outcome outcome) {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (outcome == kIgnore) {
+            if (state_ == kHalfOpen) probing_ = false;  // let the next request probe
+            return;
+        }
+        if (outcome == kSuccess) {
+            failures_ = 0;
+            state_ = kClosed;
+            coolDownMs_ = baseCoolDownMs_;
+            return;
+        }
+        if (state_ == kHalfOpen) {
+            coolDownMs_ = std::min(maxCoolDownMs_, 2 * coolDownMs_);
+            open();
+        } else if (state_ == kClosed && ++failures_ >= tripAfter_) {
+            trips_.inc();
+            open();
+        }
+    }
+
+    // Starts over closed with new settings (benchmarks compare them)
+    void reset(int tripAfter, double coolDownMs, double maxCoolDownMs) {
+        std::lock_guard<std::mutex> lock(mu_);
+        tripAfter_ = tripAfter;
+        baseCoolDownMs_ = coolDownMs_ = coolDownMs;
+        maxCoolDownMs_ = maxCoolDownMs;
+        state_ = kClosed;
+        failures_ = 0;
+    }
+
+    State state() {
+        std::lock_guard<std::mutex> lock(mu_);
+        return state_;
+    }
+    uint64_t trips() const { return trips_.value(); }
+    uint64_t rejected() const { return rejected_.value(); }
+
+private:
+    void open() {
+        state_ = kOpen;
+        failures_ = 0;
+        retryAt_ = std::chrono::steady_clock::now() +
+                   std::chrono::microseconds((long long)(coolDownMs_ * 1000));
+    }
+
+    std::mutex mu_;
+    int tripAfter_;
+    double baseCoolDownMs_, maxCoolDownMs_, coolDownMs_;
+    State state_ = kClosed;
+    int failures_ = 0;                             // in a row, while closed
+    bool probing_ = false;                         // half-open probe in flight
+    std::chrono::steady_clock::time_point retryAt_;
+    Counter& trips_ = metrics().counter("ai_study_circuit_trips_total", "",
+                                        "Times repeated API failures opened the circuit");
+    Counter& rejected_ = metrics().counter("ai_study_circuit_rejected_total", "",
+                                           "Chat requests failed fast while the circuit was open");
+};
+
+// Breaker in front of all chat requests in this process
+static CircuitBreaker& chat_breaker() {
+    static CircuitBreaker breaker;
+    return breaker;
+}
+
+// ======== SHARED RESPONSE CACHE =========
+
+// Model replies shared by every process using the same --shared-cache file
+// (several terminals, scripts, a daemon), keyed by model + instructions +
+// user message. The file is mmap'd by all of them:
+//
+//   [Header: sizes, ring head, counters, kLockStripes robust mutexes]
+//   [kBuckets buckets of kWays slots][ring buffer of reply bytes]
+//
+// Readers take no locks: each slot is a seqlock (odd seq = being written)
+// and reply bytes are only trusted if the ring head has not lapped them
+// after they were copied. Inserters lock one stripe of buckets with a
+// process-shared robust mutex (a process that dies mid-insert cannot wedge
+// the others), append the reply to the ring and replace the bucket's oldest
+// slot. Old replies are overwritten as the ring wraps.
+class SharedCache {
+public:
+    static const uint32_t kBuckets = 8192;
+    static const uint32_t kWays = 8;
+    static const uint32_t kLockStripes = 256;
+    static const uint64_t kRingBytes = 64ull << 20;
+
+    explicit SharedCache(const std::string& path) : path_(path) {
+        int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0 && errno == ENOENT) fd = create(path);
+        if (fd < 0) throw std::runtime_error("Cannot open shared cache " + path + ": " + std::strerror(errno));
+        void* p = mmap(nullptr, kFileBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        struct stat st;
+        bool sized = fstat(fd, &st) == 0 && (uint64_t)st.st_size == kFileBytes;
+        close(fd);
+        if (p == MAP_FAILED) throw std::runtime_error("mmap of shared cache failed: " + path);
+        base_ = static_cast<char*>(p);
+        if (!sized || std::memcmp(header().magic, kMagic, sizeof(kMagic)) != 0) {
+            munmap(base_, kFileBytes);
+            throw std::runtime_error(path + " is not a shared cache of this version (delete it to start over)");
+        }
+    }
+    ~SharedCache() { munmap(base_, kFileBytes); }
+    SharedCache(const SharedCache&) = delete;
+    SharedCache& operator=(const SharedCache&) = delete;
+
+    // Lock-free lookup; false on a miss (or a reply overwritten meanwhile)
+    bool get(const std::string& key, std::string& value) {
+        uint64_t k[2];
+        hash_key(key, k);
+        Slot* bucket = bucket_of(k);
+        for (uint32_t w = 0; w < kWays; ++w) {
+            uint64_t pos;
+            uint32_t len;
+            if (!read_slot(bucket[w], k, pos, len)) continue;
+            if (copy_out(pos, len, value)) {
+                header().hits.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+            break;
+        }
+        header().misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    void put(const std::string& key, const std::string& value) {
+        if (value.size() > kRingBytes / 16) return;  // would evict too much at once
+        uint64_t k[2];
+        hash_key(key, k);
+        Slot* bucket = bucket_of(k);
+        Header& h = header();
+        StripeLock lock(*this, (uint32_t)(k[0] % kBuckets) % kLockStripes);
+
+        // Replace this key's slot, else an empty one, else the oldest
+        Slot* victim = &bucket[0];
+        for (uint32_t w = 0; w < kWays; ++w) {
+            Slot& s = bucket[w];
+            if (s.key0.load(std::memory_order_relaxed) == k[0] && s.key1.load(std::memory_order_relaxed) == k[1]) {
+                victim = &s;
+                break;
+            }
+            if (s.pos.load(std::memory_order_relaxed) < victim->pos.load(std::memory_order_relaxed)) victim = &s;
+        }
+
+        // Reserve ring space first: readers of what it overwrites see the
+        // head move before they could see the new bytes
+        uint64_t pos = h.head.fetch_add(value.size() + 1, std::memory_order_relaxed) + 1;
+        std::atomic_thread_fence(std::memory_order_release);
+        uint64_t at = pos % kRingBytes;
+        size_t first = std::min<uint64_t>(value.size(), kRingBytes - at);
+        std::memcpy(ring() + at, value.data(), first);
+        std::memcpy(ring(), value.data() + first, value.size() - first);
+
+        uint32_t seq = victim->seq.load(std::memory_order_relaxed);
+        victim->seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        victim->key0.store(k[0], std::memory_order_relaxed);
+        victim->key1.store(k[1], std::memory_order_relaxed);
+        victim->pos.store(pos, std::memory_order_relaxed);
+        victim->len.store((uint32_t)value.size(), std::memory_order_relaxed);
+        victim->seq.store(seq + 2, std::memory_order_release);
+        h.inserts.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Counts over every process using the file
+    uint64_t hits() const { return header().hits.load(); }
+    uint64_t misses() const { return header().misses.load(); }
+    uint64_t inserts() const { return header().inserts.load(); }
+
+private:
+    static constexpr char kMagic[8] = {'A', 'I', 'S', 'H', 'C', '0', '0', '1'};
+
+    struct Header {
+        char magic[8];
+        std::atomic<uint64_t> head;     // ring bytes ever reserved
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+        std::atomic<uint64_t> inserts;
+        pthread_mutex_t locks[kLockStripes];
+    };
+
+    // pos 0 = empty (the ring starts at 1)
+    struct Slot {
+        std::atomic<uint32_t> seq;
+        std::atomic<uint32_t> len;
+        std::atomic<uint64_t> key0;
+        std::atomic<uint64_t> key1;
+        std::atomic<uint64_t> pos;
+    };
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared-memory atomics must be lock-free");
+
+    static const uint64_t kHeaderBytes = (sizeof(Header) + 4095) & ~4095ull;
+    static const uint64_t kSlotBytes = (uint64_t)kBuckets * kWays * sizeof(Slot);
+    static const uint64_t kFileBytes = kHeaderBytes + kSlotBytes + kRingBytes;
+
+    // Holds one stripe's mutex; recovers it if its owner died
+    struct StripeLock {
+        StripeLock(SharedCache& c, uint32_t stripe) : m(&c.header().locks[stripe]) {
+            int rc = pthread_mutex_lock(m);
+            if (rc != 0 && rc != EOWNERDEAD) throw std::runtime_error("shared cache: lock failed");
+            if (rc == EOWNERDEAD) {
+                // The owner died mid-insert: empty any half-written slot
+                for (uint32_t b = stripe; b < kBuckets; b += kLockStripes) {
+                    for (uint32_t w = 0; w < kWays; ++w) {
+                        Slot& s = c.slots()[b * kWays + w];
+                        uint32_t seq = s.seq.load();
+                        if (seq & 1) {
+                            s.pos.store(0);
+                            s.key0.store(0);
+                            s.key1.store(0);
+                            s.seq.store(seq + 1);
+                        }
+                    }
+                }
+                pthread_mutex_consistent(m);
+            }
+        }
+        ~StripeLock() { pthread_mutex_unlock(m); }
+        pthread_mutex_t* m;
+    };
+
+    // Builds an initialized file under a temporary name and links it into
+    // place, so no process ever maps a half-initialized cache
+    static int create(const std::string& path) {
+        std::string tmp = path + ".XXXXXX";
+        int fd = mkostemp(&tmp[0], O_CLOEXEC);
+        if (fd < 0) return -1;
+        if (ftruncate(fd, (off_t)kFileBytes) != 0) {
+            close(fd);
+            unlink(tmp.c_str());
+            return -1;
+        }
+        void* p = mmap(nullptr, kHeaderBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            unlink(tmp.c_str());
+            return -1;
+        }
+        Header* h = new (p) Header();
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        for (auto& m : h->locks) pthread_mutex_init(&m, &attr);
+        pthread_mutexattr_destroy(&attr);
+        std::memcpy(h->magic, kMagic, sizeof(kMagic));
+        munmap(p, kHeaderBytes);  // the slot table is all zeros: every slot empty
+
+        // Whoever links first wins; the others use the winner's file
+        int rc = link(tmp.c_str(), path.c_str());
+        unlink(tmp.c_str());
+        if (rc != 0) {
+            close(fd);
+            return errno == EEXIST ? open(path.c_str(), O_RDWR | O_CLOEXEC) : -1;
+        }
+        return fd;
+    }
+
+    static void hash_key(const std::string& key, uint64_t k[2]) {
+        k[0] = fnv1a64(key.data(), key.size());
+        k[1] = mix64(k[0] ^ fnv1a64(key.data(), key.size(), 0x9e3779b97f4a7c15ULL));
+        if (k[0] == 0 && k[1] == 0) k[1] = 1;
+    }
+
+    // Consistent snapshot of a slot holding key k
+    static bool read_slot(const Slot& s, const uint64_t k[2], uint64_t& pos, uint32_t& len) {
+        for (int spins = 0; spins < 100000; ++spins) {
+            uint32_t seq = s.seq.load(std::memory_order_acquire);
+            if (seq & 1) continue;  // an insert is a few stores: spin
+            bool match = s.key0.load(std::memory_order_relaxed) == k[0] &&
+                         s.key1.load(std::memory_order_relaxed) == k[1];
+            pos = s.pos.load(std::memory_order_relaxed);
+            len = s.len.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (s.seq.load(std::memory_order_relaxed) == seq) return match && pos != 0;
+        }
+        return false;  // its writer died mid-insert; the next insert cleans up
+    }
+
+    // Copies a reply out of the ring; false if the ring lapped it
+    bool copy_out(uint64_t pos, uint32_t len, std::string& value) {
+        const Header& h = header();
+        if (h.head.load(std::memory_order_acquire) > pos + kRingBytes) return false;
+        value.resize(len);
+        uint64_t at = pos % kRingBytes;
+        size_t first = std::min<uint64_t>(len, kRingBytes - at);
+        std::memcpy(&value[0], ring() + at, first);
+        std::memcpy(&value[0] + first, ring(), len - first);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return h.head.load(std::memory_order_relaxed) <= pos + kRingBytes;
+    }
+
+    Header& header() const { return *reinterpret_cast<Header*>(base_); }
+    Slot* slots() const { return reinterpret_cast<Slot*>(base_ + kHeaderBytes); }
+    Slot* bucket_of(const uint64_t k[2]) const { return slots() + (k[0] % kBuckets) * kWays; }
+    char* ring() const { return base_ + kHeaderBytes + kSlotBytes; }
+
+    std::string path_;
+    char* base_ = nullptr;
+};
+
+// The --shared-cache in use (null without one)
+static std::unique_ptr<SharedCache>& shared_cache() {
+    static std::unique_ptr<SharedCache> cache;
+    return cache;
+}
+
+// ======== LOCAL MODEL =========
+
+// A small llama-architecture model run on the CPU (--local-model FILE), in
+// place of the chat API, for machines without network access. Weights
+// are read from a GGUF file, memory-mapped so they cost page cache rather
+// than heap and are shared between processes. Supported tensor types are
+// F32, F16, Q8_0 and Q4_0 (k-quant files need requantizing, e.g.
+// `llama-quantize --pure model.gguf out.gguf Q4_0`); the tokenizer must be
+// SentencePiece ("llama"), as in Llama 2, Mistral and TinyLlama.
+//
+// Matrix-vector products run on the quantized weights directly: the
+// activations are quantized to Q8_0 once per matrix and each weight row
+// is dotted against them with the SIMD kernels, rows spread over the task
+// pool. Prompt tokens go through in batches, so each weight row is read
+// once per batch rather than once per token. The KV cache is kept between
+// requests, and a new prompt only evaluates what follows the longest
+// prefix it shares with the cached tokens; the instructions come first
+// and are byte-identical across requests, so they are evaluated once.
+
+// GGUF tensor types handled here
+enum GgufType : uint32_t { kGgufF32 = 0, kGgufF16 = 1, kGgufQ4_0 = 2, kGgufQ8_0 = 8 };
+
+// A weight matrix in the mapped file: `rows` rows of `cols` values
+struct QMatrix {
+    uint32_t type = kGgufF32;
+    size_t rows = 0, cols = 0;
+    size_t rowBytes = 0;
+    const uint8_t* data = nullptr;
+
+    const uint8_t* row(size_t r) const { return data + r * rowBytes; }
+};
+
+// Bytes taken by n values (n a multiple of 32 for the block types)
+static size_t gguf_bytes(uint32_t type, size_t n) {
+    switch (type) {
+        case kGgufF32: return n * 4;
+        case kGgufF16: return n * 2;
+        case kGgufQ4_0: return n / kQuantBlock * sizeof(BlockQ4_0);
+        case kGgufQ8_0: return n / kQuantBlock * sizeof(BlockQ8_0);
+    }
+    return 0;
+}
+
+// Sequential reader over the GGUF header; throws at the end of the data
+class GgufReader {
+public:
+    GgufReader(const uint8_t* data, size_t size) : p_(data), begin_(data), end_(data + size) {}
+
+    template <typename T>
+    T get() {
+        need(sizeof(T));
+        T v;
+        std::memcpy(&v, p_, sizeof v);
+        p_ += sizeof v;
+        return v;
+    }
+
+    std::string str() {
+        uint64_t n = get<uint64_t>();
+        need(n);
+        std::string s(reinterpret_cast<const char*>(p_), n);
+        p_ += n;
+        return s;
+    }
+
+    // A metadata value of GGUF type `type` (arrays of scalars or strings)
+    json value(uint32_t type) {
+        switch (type) {
+            case 0: return get<uint8_t>();
+            case 1: return get<int8_t>();
+            case 2: return get<uint16_t>();
+            case 3: return get<int16_t>();
+            case 4: return get<uint32_t>();
+            case 5: return get<int32_t>();
+            case 6: return get<float>();
+            case 7: return get<uint8_t>() != 0;
+            case 8: return str();
+            case 9: {
+                uint32_t elemType = get<uint32_t>();
+                uint64_t n = get<uint64_t>();
+                if (n > (uint64_t)(end_ - p_)) throw std::runtime_error("GGUF array is longer than the file");
+                json arr = json::array();
+                for (uint64_t i = 0; i < n; ++i) arr.push_back(value(elemType));
+                return arr;
+            }
+            case 10: return get<uint64_t>();
+            case 11: return get<int64_t>();
+            case 12: return get<double>();
+        }
+        throw std::runtime_error("unknown GGUF metadata type " + std::to_string(type));
+    }
+
+    size_t offset() const { return (size_t)(p_ - begin_); }
+
+private:
+    void need(uint64_t n) {
+        if (n > (uint64_t)(end_ - p_)) throw std::runtime_error("truncated GGUF file");
+    }
+
+    const uint8_t* p_;
+    const uint8_t* begin_;
+    const uint8_t* end_;
+};
+
+class LocalModel {
+public:
+    // Maps and checks the model; the context holds at most maxContext
+    // tokens (less if the model was trained on fewer)
+    explicit LocalModel(const std::string& path, size_t maxContext = 4096) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw std::runtime_error("Cannot open model " + path + ": " + std::strerror(errno));
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < 32) {
+            close(fd);
+            throw std::runtime_error(path + " is not a GGUF model");
+        }
+        mapBytes_ = (size_t)st.st_size;
+        void* map = mmap(nullptr, mapBytes_, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) throw std::runtime_error("Cannot map model " + path + ": " + std::strerror(errno));
+        map_ = static_cast<const uint8_t*>(map);
+        try {
+            load(path, maxContext);
+        } catch (...) {
+            munmap(const_cast<uint8_t*>(map_), mapBytes_);
+            throw;
+        }
+    }
+
+    ~LocalModel() { munmap(const_cast<uint8_t*>(map_), mapBytes_); }
+
+    LocalModel(const LocalModel&) = delete;
+    LocalModel& operator=(const LocalModel&) = delete;
+
+    // Reply to a system + user message pair, decoded greedily up to
+    // maxTokens. stop() is polled between tokens; when it returns true the
+    // reply so far is returned. Requests are served one at a time.
+    std::string chat(const std::string& system, const std::string& user, size_t maxTokens,
+                     const std::function<bool()>& stop) {
+        std::lock_guard<std::mutex> lock(mu_);
+        return decode(generate(encode_chat(system, user), maxTokens, stop, true));
+    }
+
+    // The chat prompt as tokens, in the template the vocabulary implies
+    // (ChatML, Zephyr or Llama 2 [INST])
+    std::vector<int32_t> encode_chat(const std::string& system, const std::string& user) const {
+        std::vector<std::pair<std::string, bool>> parts;  // text, is a control token
+        if (tokenIds_.count("<|im_start|>")) {
+            parts = {{"<|im_start|>", true}, {"system\n" + system, false}, {"<|im_end|>", true},
+                     {"\n", false}, {"<|im_start|>", true}, {"user\n" + user, false},
+                     {"<|im_end|>", true}, {"\n", false}, {"<|im_start|>", true}, {"assistant\n", false}};
+        } else if (tokenIds_.count("<|user|>")) {
+            parts = {{"<|system|>", true}, {"\n" + system, false}, {"</s>", true}, {"\n", false},
+                     {"<|user|>", true}, {"\n" + user, false}, {"</s>", true}, {"\n", false},
+                     {"<|assistant|>", true}, {"\n", false}};
+        } else {
+            parts = {{"[INST] <<SYS>>\n" + system + "\n<</SYS>>\n\n" + user + " [/INST]", false}};
+        }
+        std::vector<int32_t> tokens;
+        if (addBos_) tokens.push_back(bos_);
+        bool afterControl = true;
+        for (const auto& part : parts) {
+            if (part.second) {
+                tokens.push_back(tokenIds_.at(part.first));
+            } else {
+                // SentencePiece marks word starts with a space, so text at the
+                // start or after a control token gets one
+                encode(afterControl ? " " + part.first : part.first, tokens);
+            }
+            afterControl = part.second;
+        }
+        return tokens;
+    }
+
+    // Greedy continuation of `prompt` (at most maxTokens; with
+    // stopAtEos, up to the first end-of-turn token). Reuses the cached
+    // keys and values of the longest common prefix with the last call.
+    std::vector<int32_t> generate(const std::vector<int32_t>& prompt, size_t maxTokens,
+                                  const std::function<bool()>& stop, bool stopAtEos) {
+        if (prompt.empty()) throw std::runtime_error("empty prompt");
+        if (prompt.size() >= context_) {
+            throw std::runtime_error("prompt is " + std::to_string(prompt.size()) +
+                                     " tokens; the local model's context holds " + std::to_string(context_));
+        }
+        size_t common = 0;
+        while (common < cached_.size() && common < prompt.size() && cached_[common] == prompt[common]) ++common;
+        if (common == prompt.size()) --common;  // the last prompt token is run again for its logits
+        cached_.resize(common);
+        stats_.promptTokens += prompt.size();
+        stats_.reusedTokens += common;
+
+        auto t0 = std::chrono::steady_clock::now();
+        for (size_t at = common; at < prompt.size(); at += kBatch) {
+            if (stop && stop()) return {};
+            size_t n = std::min(kBatch, prompt.size() - at);
+            eval(&prompt[at], n);
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        stats_.prefillSeconds += std::chrono::duration<double>(t1 - t0).count();
+
+        std::vector<int32_t> out;
+        while (out.size() < maxTokens && cached_.size() < context_) {
+            int32_t next = (int32_t)(std::max_element(logits_.begin(), logits_.end()) - logits_.begin());
+            if (stopAtEos && stopTokens_.count(next)) break;
+            out.push_back(next);
+            if ((stop && stop()) || out.size() == maxTokens) break;
+            eval(&next, 1);
+        }
+        stats_.generatedTokens += out.size();
+        stats_.decodeSeconds += seconds_between(t1, std::chrono::steady_clock::now());
+        return out;
+    }
+
+    // Text of generated tokens (control tokens dropped)
+    std::string decode(const std::vector<int32_t>& tokens) const {
+        std::string out;
+        for (int32_t t : tokens) {
+            const std::string& piece = pieces_[t];
+            if (tokenTypes_[t] == kTokenByte && piece.size() == 6) {
+                out += (char)std::strtol(piece.substr(3, 2).c_str(), nullptr, 16);
+            } else if (tokenTypes_[t] != kTokenControl) {
+                for (size_t i = 0; i < piece.size(); ++i) {
+                    if (piece.compare(i, 3, kSpaceMark) == 0) {
+                        out += ' ';
+                        i += 2;
+                    } else {
+                        out += piece[i];
+                    }
+                }
+            }
+        }
+        return out;
+    }
+
+    // Forget the cached prompt (the next request evaluates everything)
+    void clear_cache() {
+        std::lock_guard<std::mutex> lock(mu_);
+        cached_.clear();
+    }
+
+    // Runs the matrix products on `pool` (default: task_pool())
+    void set_pool(TaskPool& pool) { pool_ = &pool; }
+
+    struct Stats {
+        uint64_t promptTokens = 0;
+        uint64_t reusedTokens = 0;     // prompt tokens found in the KV cache
+        uint64_t generatedTokens = 0;
+        double prefillSeconds = 0;
+        double decodeSeconds = 0;
+    };
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mu_);
+        return stats_;
+    }
+
+    const std::string& description() const { return description_; }
+    size_t context() const { return context_; }
+    size_t mapped_bytes() const { return mapBytes_; }
+    // Keys and values held for the cached tokens
+    size_t cache_bytes() const { return cached_.size() * layersCount_ * kvDim_ * 2 * sizeof(float); }
+
+private:
+    static constexpr size_t kBatch = 32;       // prompt tokens per forward pass
+    static constexpr const char* kSpaceMark = "\xe2\x96\x81";  // U+2581, SentencePiece's space
+    enum TokenType { kTokenNormal = 1, kTokenUnknown = 2, kTokenControl = 3, kTokenUser = 4, kTokenByte = 6 };
+
+    struct Layer {
+        const float* attnNorm = nullptr;
+        const float* ffnNorm = nullptr;
+        QMatrix q, k, v, o, gate, up, down;
+    };
+
+    static double seconds_between(std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b) {
+        return std::chrono::duration<double>(b - a).count();
+    }
+
+    void load(const std::string& path, size_t maxContext) {
+        GgufReader r(map_, mapBytes_);
+        if (r.get<uint32_t>() != 0x46554747) throw std::runtime_error(path + " is not a GGUF model");
+        uint32_t version = r.get<uint32_t>();
+        if (version < 2) throw std::runtime_error(path + ": GGUF version " + std::to_string(version) + " is too old");
+        uint64_t tensorCount = r.get<uint64_t>(), kvCount = r.get<uint64_t>();
+        json meta = json::object();
+        for (uint64_t i = 0; i < kvCount; ++i) {
+            std::string key = r.str();
+            meta[key] = r.value(r.get<uint32_t>());
+        }
+        struct TensorInfo {
+            std::vector<uint64_t> dims;
+            uint32_t type;
+            uint64_t offset;
+        };
+        std::unordered_map<std::string, TensorInfo> infos;
+        for (uint64_t i = 0; i < tensorCount; ++i) {
+            std::string name = r.str();
+            TensorInfo info;
+            uint32_t nDims = r.get<uint32_t>();
+            if (nDims > 4) throw std::runtime_error("GGUF tensor " + name + " has too many dimensions");
+            for (uint32_t d = 0; d < nDims; ++d) info.dims.push_back(r.get<uint64_t>());
+            info.type = r.get<uint32_t>();
+            info.offset = r.get<uint64_t>();
+            infos[name] = info;
+        }
+        uint64_t alignment = meta.value("general.alignment", 32u);
+        if (alignment == 0 || alignment > mapBytes_) throw std::runtime_error(path + ": bad general.alignment");
+        size_t dataStart = (r.offset() + alignment - 1) / alignment * alignment;
+
+        std::string arch = meta.value("general.architecture", std::string());
+        if (arch != "llama") {
+            throw std::runtime_error(path + ": architecture \"" + arch + "\" is not supported (only llama)");
+        }
+        auto hparam = [&](const std::string& key) -> uint64_t {
+            auto it = meta.find("llama." + key);
+            if (it == meta.end() || !it->is_number_integer() || it->get<int64_t>() < 0) throw std::runtime_error(path + ": missing llama." + key);
+            return it->get<uint64_t>();
+        };
+        dim_ = hparam("embedding_length");
+        layersCount_ = hparam("block_count");
+        ffDim_ = hparam("feed_forward_length");
+        heads_ = hparam("attention.head_count");
+        kvHeads_ = meta.contains("llama.attention.head_count_kv") ? hparam("attention.head_count_kv") : heads_;
+        if (heads_ == 0 || kvHeads_ == 0 || dim_ % heads_ != 0 || heads_ % kvHeads_ != 0) {
+            throw std::runtime_error(path + ": inconsistent attention head counts");
+        }
+        headDim_ = dim_ / heads_;
+        kvDim_ = headDim_ * kvHeads_;
+        ropeDims_ = meta.contains("llama.rope.dimension_count") ? hparam("rope.dimension_count") : headDim_;
+        if (ropeDims_ % 2 != 0 || ropeDims_ > headDim_) {
+            throw std::runtime_error(path + ": llama.rope.dimension_count must be even and at most the head size");
+        }
+        ropeBase_ = meta.value("llama.rope.freq_base", 10000.0f);
+        normEps_ = meta.value("llama.attention.layer_norm_rms_epsilon", 1e-5f);
+        uint64_t trained = meta.contains("llama.context_length") ? hparam("context_length") : 2048;
+        context_ = (size_t)std::min<uint64_t>(trained, maxContext);
+
+        auto tensor = [&](const std::string& name, std::vector<uint64_t> dims) {
+            auto it = infos.find(name);
+            if (it == infos.end()) throw std::runtime_error(path + ": missing tensor " + name);
+            const TensorInfo& info = it->second;
+            if (info.dims != dims) throw std::runtime_error(path + ": tensor " + name + " has unexpected shape");
+            if (info.type != kGgufF32 && info.type != kGgufF16 && info.type != kGgufQ4_0 && info.type != kGgufQ8_0) {
+                throw std::runtime_error(path + ": tensor " + name + " uses GGUF type " + std::to_string(info.type) +
+                                         "; only F32, F16, Q4_0 and Q8_0 are supported");
+            }
+            QMatrix m;
+            m.type = info.type;
+            m.cols = (size_t)dims[0];
+            m.rows = dims.size() > 1 ? (size_t)dims[1] : 1;
+            if (m.type != kGgufF32 && m.type != kGgufF16 && m.cols % kQuantBlock != 0) {
+                throw std::runtime_error(path + ": tensor " + name + " rows are not whole blocks");
+            }
+            m.rowBytes = gguf_bytes(m.type, m.cols);
+            // (in this order so that no sum or product can wrap around)
+            if (m.rowBytes == 0 || dataStart > mapBytes_ || info.offset > mapBytes_ - dataStart ||
+                m.rows > (mapBytes_ - dataStart - info.offset) / m.rowBytes) {
+                throw std::runtime_error(path + ": tensor " + name + " runs past the end of the file");
+            }
+            m.data = map_ + dataStart + info.offset;
+            return m;
+        };
+        auto norm = [&](const std::string& name) {
+            QMatrix m = tensor(name, {dim_});
+            if (m.type != kGgufF32) throw std::runtime_error(path + ": norm " + name + " is not F32");
+            return reinterpret_cast<const float*>(m.data);
+        };
+
+        // Tokenizer
+        if (meta.value("tokenizer.ggml.model", std::string()) != "llama") {
+            throw std::runtime_error(path + ": only SentencePiece (\"llama\") tokenizers are supported");
+        }
+        const json& tokens = meta.at("tokenizer.ggml.tokens");
+        vocab_ = tokens.size();
+        pieces_.reserve(vocab_);
+        for (const auto& t : tokens) pieces_.push_back(t.get<std::string>());
+        scores_.assign(vocab_, 0.0f);
+        tokenTypes_.assign(vocab_, kTokenNormal);
+        if (meta.contains("tokenizer.ggml.scores")) {
+            for (size_t i = 0; i < vocab_; ++i) scores_[i] = meta["tokenizer.ggml.scores"][i].get<float>();
+        }
+        if (meta.contains("tokenizer.ggml.token_type")) {
+            for (size_t i = 0; i < vocab_; ++i) tokenTypes_[i] = meta["tokenizer.ggml.token_type"][i].get<int32_t>();
+        }
+        for (size_t i = 0; i < vocab_; ++i) {
+            tokenIds_.emplace(pieces_[i], (int32_t)i);
+            if (tokenTypes_[i] == kTokenByte && pieces_[i].size() == 6) {
+                byteTokens_[std::strtol(pieces_[i].substr(3, 2).c_str(), nullptr, 16) & 0xff] = (int32_t)i;
+            }
+        }
+        bos_ = meta.value("tokenizer.ggml.bos_token_id", 1);
+        unknown_ = meta.value("tokenizer.ggml.unknown_token_id", 0);
+        addBos_ = meta.value("tokenizer.ggml.add_bos_token", true);
+        if (bos_ < 0 || (size_t)bos_ >= vocab_ || unknown_ < 0 || (size_t)unknown_ >= vocab_) {
+            throw std::runtime_error(path + ": BOS or unknown token id outside the vocabulary");
+        }
+        stopTokens_.insert(meta.value("tokenizer.ggml.eos_token_id", 2));
+        for (const char* end : {"</s>", "<|im_end|>", "<|endoftext|>"}) {
+            auto it = tokenIds_.find(end);
+            if (it != tokenIds_.end()) stopTokens_.insert(it->second);
+        }
+
+        // Weights
+        embeddings_ = tensor("token_embd.weight", {dim_, vocab_});
+        outputNorm_ = norm("output_norm.weight");
+        output_ = infos.count("output.weight") ? tensor("output.weight", {dim_, vocab_}) : embeddings_;
+        for (size_t l = 0; l < layersCount_; ++l) {
+            std::string p = "blk." + std::to_string(l) + ".";
+            Layer layer;
+            layer.attnNorm = norm(p + "attn_norm.weight");
+            layer.ffnNorm = norm(p + "ffn_norm.weight");
+            layer.q = tensor(p + "attn_q.weight", {dim_, dim_});
+            layer.k = tensor(p + "attn_k.weight", {dim_, kvDim_});
+            layer.v = tensor(p + "attn_v.weight", {dim_, kvDim_});
+            layer.o = tensor(p + "attn_output.weight", {dim_, dim_});
+            layer.gate = tensor(p + "ffn_gate.weight", {dim_, ffDim_});
+            layer.up = tensor(p + "ffn_up.weight", {dim_, ffDim_});
+            layer.down = tensor(p + "ffn_down.weight", {ffDim_, dim_});
+            layers_.push_back(layer);
+        }
+        madvise(const_cast<uint8_t*>(map_), mapBytes_, MADV_WILLNEED);
+
+        // Rotary embedding frequencies
+        for (size_t i = 0; i < ropeDims_ / 2; ++i) {
+            ropeFreq_.push_back(std::pow(ropeBase_, -2.0f * (float)i / (float)ropeDims_));
+        }
+        logits_.assign(vocab_, 0.0f);
+        // Never value-initialized: pages are only committed as positions fill
+        keys_.reset(new float[layersCount_ * context_ * kvDim_]);
+        values_.reset(new float[layersCount_ * context_ * kvDim_]);
+
+        std::string name = meta.value("general.name", std::string());
+        std::ostringstream desc;
+        desc << (name.empty() ? path : name) << ": " << layersCount_ << " layers, dim " << dim_ << ", "
+             << heads_ << "/" << kvHeads_ << " heads, vocab " << vocab_ << ", context " << context_;
+        description_ = desc.str();
+    }
+
+    // SentencePiece BPE: start from UTF-8 characters and keep merging the
+    // adjacent pair whose concatenation is the best-scoring vocabulary
+    // entry; what never becomes a token is spelled with byte tokens
+    void encode(const std::string& raw, std::vector<int32_t>& out) const {
+        std::string text;
+        for (char c : raw) {
+            if (c == ' ') text += kSpaceMark;
+            else text += c;
+        }
+        struct Symbol {
+            int prev, next;
+            size_t begin, len;
+        };
+        std::vector<Symbol> sym;
+        for (size_t i = 0; i < text.size();) {
+            unsigned char c = (unsigned char)text[i];
+            size_t len = c < 0x80 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+            len = std::min(len, text.size() - i);
+            sym.push_back({(int)sym.size() - 1, (int)sym.size() + 1, i, len});
+            i += len;
+        }
+        if (sym.empty()) return;
+        sym.back().next = -1;
+
+        struct Pair {
+            int left, right;
+            float score;
+            size_t len;
+            bool operator<(const Pair& o) const { return score < o.score || (score == o.score && left > o.left); }
+        };
+        std::priority_queue<Pair> queue;
+        auto try_pair = [&](int left, int right) {
+            if (left < 0 || right < 0) return;
+            size_t len = sym[left].len + sym[right].len;
+            auto it = tokenIds_.find(text.substr(sym[left].begin, len));
+            if (it != tokenIds_.end()) queue.push({left, right, scores_[it->second], len});
+        };
+        for (size_t i = 1; i < sym.size(); ++i) try_pair((int)i - 1, (int)i);
+        while (!queue.empty()) {
+            Pair p = queue.top();
+            queue.pop();
+            Symbol& left = sym[p.left];
+            Symbol& right = sym[p.right];
+            // Skip pairs made stale by an earlier merge
+            if (left.len == 0 || right.len == 0 || left.len + right.len != p.len) continue;
+            left.len += right.len;
+            right.len = 0;
+            left.next = right.next;
+            if (right.next >= 0) sym[right.next].prev = p.left;
+            try_pair(left.prev, p.left);
+            try_pair(p.left, left.next);
+        }
+        for (int i = 0; i >= 0; i = sym[i].next) {
+            std::string piece = text.substr(sym[i].begin, sym[i].len);
+            auto it = tokenIds_.find(piece);
+            if (it != tokenIds_.end()) {
+                out.push_back(it->second);
+                continue;
+            }
+            for (unsigned char c : piece) out.push_back(byteTokens_[c] >= 0 ? byteTokens_[c] : unknown_);
+        }
+    }
+
+    // Row r of the embedding table as floats
+    void embedding(int32_t token, float* out) const {
+        if (token < 0 || (size_t)token >= vocab_) throw std::runtime_error("token id out of range");
+        const uint8_t* row = embeddings_.row((size_t)token);
+        switch (embeddings_.type) {
+            case kGgufF32:
+                std::memcpy(out, row, dim_ * sizeof(float));
+                break;
+            case kGgufF16:
+                for (size_t i = 0; i < dim_; ++i) out[i] = fp16_to_f32(reinterpret_cast<const uint16_t*>(row)[i]);
+                break;
+            case kGgufQ8_0:
+                for (size_t b = 0; b < dim_ / kQuantBlock; ++b) {
+                    const BlockQ8_0& blk = reinterpret_cast<const BlockQ8_0*>(row)[b];
+                    for (size_t j = 0; j < kQuantBlock; ++j) out[b * kQuantBlock + j] = fp16_to_f32(blk.d) * blk.qs[j];
+                }
+                break;
+            case kGgufQ4_0:
+                for (size_t b = 0; b < dim_ / kQuantBlock; ++b) {
+                    const BlockQ4_0& blk = reinterpret_cast<const BlockQ4_0*>(row)[b];
+                    float d = fp16_to_f32(blk.d);
+                    for (size_t j = 0; j < kQuantBlock / 2; ++j) {
+                        out[b * kQuantBlock + j] = d * ((blk.qs[j] & 0xf) - 8);
+                        out[b * kQuantBlock + j + 16] = d * ((blk.qs[j] >> 4) - 8);
+                    }
+                }
+                break;
+        }
+    }
+
+    // out[t * w.rows + r] = row r of w . x[t * w.cols ...], for n tokens
+    void matmul(const QMatrix& w, const float* x, size_t n, float* out) {
+        const SimdKernels& k = simd();
+        size_t blocks = w.cols / kQuantBlock;
+        if (w.type == kGgufQ8_0 || w.type == kGgufQ4_0) {
+            quantized_.resize(n * blocks);
+            for (size_t t = 0; t < n; ++t) quantize_q8_0(x + t * w.cols, &quantized_[t * blocks], w.cols);
+        }
+        const BlockQ8_0* xq = quantized_.data();
+        parallel_for(*pool_, w.rows, 16, [&](size_t begin, size_t end) {
+            for (size_t r = begin; r < end; ++r) {
+                const uint8_t* row = w.row(r);
+                for (size_t t = 0; t < n; ++t) {
+                    float v;
+                    switch (w.type) {
+                        case kGgufQ8_0:
+                            v = k.dot_q8_0(reinterpret_cast<const BlockQ8_0*>(row), xq + t * blocks, blocks);
+                            break;
+                        case kGgufQ4_0:
+                            v = k.dot_q4_0(reinterpret_cast<const BlockQ4_0*>(row), xq + t * blocks, blocks);
+                            break;
+                        case kGgufF16: {
+                            const uint16_t* h = reinterpret_cast<const uint16_t*>(row);
+                            const float* xt = x + t * w.cols;
+                            v = 0;
+                            for (size_t i = 0; i < w.cols; ++i) v += fp16_to_f32(h[i]) * xt[i];
+                            break;
+                        }
+                        default:
+                            v = k.dot_f32(reinterpret_cast<const float*>(row), x + t * w.cols, w.cols);
+                    }
+                    out[t * w.rows + r] = v;
+                }
+            }
+        });
+    }
+
+    // Start of one KV head's keys (or values) in a layer
+    size_t cache_offset(size_t layer, size_t kvHead) const {
+        return (layer * kvHeads_ + kvHead) * context_ * headDim_;
+    }
+
+    void rms_norm(const float* x, const float* weight, float* out) const {
+        double ss = 0;
+        for (size_t i = 0; i < dim_; ++i) ss += (double)x[i] * x[i];
+        float scale = 1.0f / std::sqrt((float)(ss / dim_) + normEps_);
+        for (size_t i = 0; i < dim_; ++i) out[i] = x[i] * scale * weight[i];
+    }
+
+    // Rotates adjacent pairs of each head by position (GGUF stores llama's
+    // q/k weights permuted for this "normal" rotary layout)
+    void rope(float* v, size_t heads, size_t pos) const {
+        for (size_t h = 0; h < heads; ++h) {
+            float* head = v + h * headDim_;
+            for (size_t i = 0; i < ropeDims_ / 2; ++i) {
+                float angle = (float)pos * ropeFreq_[i];
+                float c = std::cos(angle), s = std::sin(angle);
+                float a = head[2 * i], b = head[2 * i + 1];
+                head[2 * i] = a * c - b * s;
+                head[2 * i + 1] = a * s + b * c;
+            }
+        }
+    }
+
+    // Runs n tokens through the model at the next cache positions, leaving
+    // the last token's next-token logits in logits_
+    void eval(const int32_t* tokens, size_t n) {
+        size_t start = cached_.size();
+        x_.resize(n * dim_);
+        norm_.resize(n * dim_);
+        q_.resize(n * dim_);
+        k_.resize(n * kvDim_);
+        v_.resize(n * kvDim_);
+        att_.resize(n * dim_);
+        proj_.resize(n * dim_);
+        gate_.resize(n * ffDim_);
+        up_.resize(n * ffDim_);
+        for (size_t t = 0; t < n; ++t) embedding(tokens[t], &x_[t * dim_]);
+
+        for (size_t l = 0; l < layersCount_; ++l) {
+            const Layer& layer = layers_[l];
+            for (size_t t = 0; t < n; ++t) rms_norm(&x_[t * dim_], layer.attnNorm, &norm_[t * dim_]);
+            matmul(layer.q, norm_.data(), n, q_.data());
+            matmul(layer.k, norm_.data(), n, k_.data());
+            matmul(layer.v, norm_.data(), n, v_.data());
+            for (size_t t = 0; t < n; ++t) {
+                rope(&q_[t * dim_], heads_, start + t);
+                rope(&k_[t * kvDim_], kvHeads_, start + t);
+                for (size_t h = 0; h < kvHeads_; ++h) {
+                    size_t at = cache_offset(l, h) + (start + t) * headDim_;
+                    std::memcpy(&keys_[at], &k_[t * kvDim_ + h * headDim_], headDim_ * sizeof(float));
+                    std::memcpy(&values_[at], &v_[t * kvDim_ + h * headDim_], headDim_ * sizeof(float));
+                }
+            }
+
+            // Causal attention, one task per (token, head)
+            parallel_for(*pool_, n * heads_, 1, [&](size_t begin, size_t end) {
+                thread_local std::vector<float> scores;
+                float scale = 1.0f / std::sqrt((float)headDim_);
+                for (size_t job = begin; job < end; ++job) {
+                    size_t t = job / heads_, h = job % heads_;
+                    size_t positions = start + t + 1;
+                    const float* q = &q_[t * dim_ + h * headDim_];
+                    const float* keys = &keys_[cache_offset(l, h / (heads_ / kvHeads_))];
+                    const float* values = &values_[cache_offset(l, h / (heads_ / kvHeads_))];
+                    scores.resize(positions);
+                    float best = -std::numeric_limits<float>::infinity();
+                    for (size_t p = 0; p < positions; ++p) {
+                        scores[p] = dot_f32(q, keys + p * headDim_, headDim_) * scale;
+                        best = std::max(best, scores[p]);
+                    }
+                    // Weights under e^-60 become exactly 0: left alone they turn
+                    // denormal, which is slower by orders of magnitude
+                    float total = 0;
+                    for (size_t p = 0; p < positions; ++p) {
+                        float d = scores[p] - best;
+                        total += scores[p] = d < -60 ? 0.0f : std::exp(d);
+                    }
+                    float* out = &att_[t * dim_ + h * headDim_];
+                    std::fill(out, out + headDim_, 0.0f);
+                    for (size_t p = 0; p < positions; ++p) {
+                        if (scores[p] == 0) continue;
+                        const float* v = values + p * headDim_;
+                        float weight = scores[p] / total;
+                        for (size_t i = 0; i < headDim_; ++i) out[i] += weight * v[i];
+                    }
+                }
+            });
+            matmul(layer.o, att_.data(), n, proj_.data());
+            for (size_t i = 0; i < n * dim_; ++i) x_[i] += proj_[i];
+
+            // SwiGLU feed-forward
+            for (size_t t = 0; t < n; ++t) rms_norm(&x_[t * dim_], layer.ffnNorm, &norm_[t * dim_]);
+            matmul(layer.gate, norm_.data(), n, gate_.data());
+            matmul(layer.up, norm_.data(), n, up_.data());
+            for (size_t i = 0; i < n * ffDim_; ++i) gate_[i] = gate_[i] / (1.0f + std::exp(-gate_[i])) * up_[i];
+            matmul(layer.down, gate_.data(), n, proj_.data());
+            for (size_t i = 0; i < n * dim_; ++i) x_[i] += proj_[i];
+        }
+
+        rms_norm(&x_[(n - 1) * dim_], outputNorm_, norm_.data());
+        matmul(output_, norm_.data(), 1, logits_.data());
+        cached_.insert(cached_.end(), tokens, tokens + n);
+    }
+
+    const uint8_t* map_ = nullptr;
+    size_t mapBytes_ = 0;
+    std::string description_;
+    TaskPool* pool_ = &task_pool();
+    mutable std::mutex mu_;                    // one request at a time
+    Stats stats_;
+
+    // Hyperparameters
+    size_t dim_ = 0, layersCount_ = 0, ffDim_ = 0, heads_ = 0, kvHeads_ = 0;
+    size_t headDim_ = 0, kvDim_ = 0, ropeDims_ = 0, vocab_ = 0, context_ = 0;
+    float ropeBase_ = 10000, normEps_ = 1e-5f;
+    std::vector<float> ropeFreq_;
+
+    // Tokenizer
+    std::vector<std::string> pieces_;
+    std::vector<float> scores_;
+    std::vector<int32_t> tokenTypes_;
+    std::unordered_map<std::string, int32_t> tokenIds_;
+    std::array<int32_t, 256> byteTokens_ = [] {
+        std::array<int32_t, 256> a;
+        a.fill(-1);
+        return a;
+    }();
+    std::unordered_set<int32_t> stopTokens_;
+    int32_t bos_ = 1, unknown_ = 0;
+    bool addBos_ = true;
+
+    // Weights (in the mapping)
+    QMatrix embeddings_, output_;
+    const float* outputNorm_ = nullptr;
+    std::vector<Layer> layers_;
+
+    // KV cache, [layer][kv head][position][head dim], so attention reads
+    // each head's keys and values contiguously
+    std::vector<int32_t> cached_;              // tokens whose keys/values are cached
+    std::unique_ptr<float[]> keys_, values_;
+
+    // Scratch activations for one batch
+    std::vector<float> x_, norm_, q_, k_, v_, att_, proj_, gate_, up_, logits_;
+    std::vector<BlockQ8_0> quantized_;
+};
+
+// The --local-model in use (null: the chat API answers)
+static std::unique_ptr<LocalModel>& local_model() {
+    static std::unique_ptr<LocalModel> model;
+    return model;
+}
+
+// ======== CORE OPENAI CALLER =========
+
+// Full URL of an API endpoint path such as "/chat/completions".
+// OPENAI_BASE_URL (e.g. http://127.0.0.1:8080/v1) points the client at a
+// proxy or a local stand-in server instead of api.openai.com.
+static std::string openai_url(const std::string& path) {
+    const char* base = std::getenv("OPENAI_BASE_URL");
+    std::string url = base && *base ? base : "https://api.openai.com/v1";
+    while (!url.empty() && url.back() == '/') url.pop_back();
+    return url + path;
+}
+
+using CurlHandle = std::unique_ptr<CURL, decltype(&curl_easy_cleanup)>;
+
+// Connection pool, DNS cache and TLS sessions shared by every transfer
+// (including background and daemon threads), so a request after the first
+// reuses a warm keep-alive connection instead of a fresh TCP+TLS handshake
+class CurlShare {
+public:
+    static CURLSH* get() {
+        static CurlShare* share = new CurlShare(); // in use until exit
+        return share->sh_;
+    }
+
+private:
+    CurlShare() : sh_(curl_share_init()) {
+        if (!sh_) throw std::runtime_error("Failed to init curl share handle");
+        curl_share_setopt(sh_, CURLSHOPT_LOCKFUNC, lock);
+        curl_share_setopt(sh_, CURLSHOPT_UNLOCKFUNC, unlock);
+        curl_share_setopt(sh_, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(sh_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        curl_share_setopt(sh_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(sh_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+    static void lock(CURL*, curl_lock_data data, curl_lock_access, void* self) {
+        static_cast<CurlShare*>(self)->locks_[data].lock();
+    }
+    static void unlock(CURL*, curl_lock_data data, void* self) {
+        static_cast<CurlShare*>(self)->locks_[data].unlock();
+    }
+
+    CURLSH* sh_;
+    std::mutex locks_[CURL_LOCK_DATA_LAST];
+};
+
+// A configured POST transfer writing its response into *out. The URL,
+// headers, body and watch must outlive the handle.
+static CurlHandle make_post_handle(const std::string& url, curl_slist* headers,
+                                   const std::string& bodyStr, std::string* out,
+                                   TransferWatch* watch) {
+    CurlHandle curl(curl_easy_init(), curl_easy_cleanup);
+    if (!curl) {
+        throw std::runtime_error("Failed to init curl");
+    }
+    const HttpPolicy& policy = http_policy();
+
+    // Configure CURL options
+    curl_easy_setopt(curl.get(), CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl.get(), CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl.get(), CURLOPT_POSTFIELDS, bodyStr.c_str());
+    curl_easy_setopt(curl.get(), CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)bodyStr.size());
+    curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, WriteCallback); // callback for incoming data
+    curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, out);               // store data in *out
+    curl_easy_setopt(curl.get(), CURLOPT_SHARE, CurlShare::get());      // warm connections
+
+    // Timeouts (no SIGALRM: requests also run on background threads)
+    curl_easy_setopt(curl.get(), CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl.get(), CURLOPT_CONNECTTIMEOUT_MS, policy.connectTimeoutMs);
+    curl_easy_setopt(curl.get(), CURLOPT_TIMEOUT_MS, policy.totalTimeoutMs);
+
+    // Ctrl-C, background workers' cancel flags and the idle limit abort
+    // the transfer from the progress callback
+    watch->cancel = t_cancelFlag;
+    watch->idleTimeoutMs = policy.idleTimeoutMs;
+    curl_easy_setopt(curl.get(), CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl.get(), CURLOPT_XFERINFOFUNCTION, CancelCallback);
+    curl_easy_setopt(curl.get(), CURLOPT_XFERINFODATA, watch);
+    return curl;
+}
+
+// A failed API request; `kind` ("http", "timeout", "cancelled" or
+// "transport") is what the error metrics are broken down by
+struct ApiError : std::runtime_error {
+    ApiError(const char* kind, const std::string& what, long status = 0)
+        : std::runtime_error(what), kind(kind), status(status) {}
+    const char* kind;
+    long status;  // HTTP status for kind "http"
+};
+
+// True for failures meaning the API is down or unreachable, as opposed to
+// cancellations, rate limiting or something wrong with the request itself
+static bool api_unreachable(const ApiError& ex) {
+    return std::strcmp(ex.kind, "unavailable") == 0 || std::strcmp(ex.kind, "timeout") == 0 ||
+           std::strcmp(ex.kind, "transport") == 0 || ex.status >= 500;
+}
+
+// Checks how a transfer ended; throws on transport errors, cancellation
+// and non-2xx HTTP status codes
+static void check_transfer(CURL* curl, CURLcode res, const std::string& response,
+                           const TransferWatch& watch) {
+    if (res == CURLE_ABORTED_BY_CALLBACK && g_interrupted.load()) {
+        throw ApiError("cancelled", "Interrupted");
+    }
+    if (res == CURLE_ABORTED_BY_CALLBACK && watch.idleExpired) {
+        throw ApiError("timeout", "Request timed out: no data for " +
+                                  std::to_string(watch.idleTimeoutMs) + " ms");
+    }
+    if (res != CURLE_OK) {
+        throw ApiError(res == CURLE_OPERATION_TIMEDOUT ? "timeout"
+                       : res == CURLE_ABORTED_BY_CALLBACK ? "cancelled" : "transport",
+                       std::string("curl_easy_perform() failed: ") + curl_easy_strerror(res));
+    }
+
+    // Check HTTP status code
+    long httpCode = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
+    if (httpCode < 200 || httpCode >= 300) {
+        throw ApiError("http", "OpenAI API returned HTTP code " +
+                                 std::to_string(httpCode) +
+                                 "\nResponse: " + response, httpCode);
+    }
+}
+
+// Runs a request and, if it has not finished after hedgeAfterMs, a
+// duplicate alongside it; returns whichever succeeds first and abandons the
+// other. A failure before the duplicate is sent is not retried.
+static std::string hedged_post(const std::string& url, curl_slist* headers,
+                               const std::string& bodyStr, long hedgeAfterMs) {
+    struct Transfers {
+        CURLM* multi = curl_multi_init();
+        CurlHandle easy[2] = {{nullptr, curl_easy_cleanup}, {nullptr, curl_easy_cleanup}};
+        bool attached[2] = {false, false};
+        ~Transfers() {
+            // Removing an unfinished transfer closes its connection
+            for (int i = 0; i < 2; ++i) {
+                if (attached[i]) curl_multi_remove_handle(multi, easy[i].get());
+            }
+            curl_multi_cleanup(multi);
+        }
+    } t;
+    if (!t.multi) throw std::runtime_error("Failed to init curl multi handle");
+
+    std::string response[2];
+    TransferWatch watch[2];
+    std::string firstError;
+    const char* firstKind = "transport";
+    int launched = 0, finished = 0;
+    auto launch = [&] {
+        t.easy[launched] = make_post_handle(url, headers, bodyStr, &response[launched], &watch[launched]);
+        curl_multi_add_handle(t.multi, t.easy[launched].get());
+        t.attached[launched] = true;
+        ++launched;
+    };
+    launch();
+    auto start = std::chrono::steady_clock::now();
+
+    while (true) {
+        int running = 0;
+        curl_multi_perform(t.multi, &running);
+
+        int queued = 0;
+        while (CURLMsg* msg = curl_multi_info_read(t.multi, &queued)) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            int which = msg->easy_handle == t.easy[0].get() ? 0 : 1;
+            CURLcode res = msg->data.result;
+            curl_multi_remove_handle(t.multi, msg->easy_handle);
+            t.attached[which] = false;
+            ++finished;
+            try {
+                check_transfer(t.easy[which].get(), res, response[which], watch[which]);
+                if (which == 1) hedge_stats().won.inc();
+                return response[which];
+            } catch (const ApiError& ex) {
+                if (g_interrupted.load()) throw;
+                if (firstError.empty()) {
+                    firstError = ex.what();
+                    firstKind = ex.kind;
+                }
+            }
+        }
+        if (finished == launched) throw ApiError(firstKind, firstError);
+
+        // Sleep until there is network activity, the hedge is due, or it is
+        // time to look at the cancel flags again
+        long waitMs = 100;
+        if (launched == 1) {
+            long elapsedMs = (long)std::chrono::duration<double, std::milli>(
+                                 std::chrono::steady_clock::now() - start).count();
+            if (elapsedMs >= hedgeAfterMs) {
+                launch();
+                hedge_stats().sent.inc();
+                continue;
+            }
+            waitMs = std::min(waitMs, hedgeAfterMs - elapsedMs);
+        }
+        curl_multi_poll(t.multi, nullptr, 0, (int)waitMs, nullptr);
+    }
+}
+
+// POSTs a JSON body to an OpenAI API path and returns the raw response body.
+// With hedgeAfterMs > 0 a duplicate request is raced against a slow one.
+// Throws on transport errors, timeouts, Ctrl-C and non-2xx HTTP status codes.
+std::string openai_post(const std::string& path, const std::string& bodyStr,
+                        long hedgeAfterMs) {
+    // Grab API key from environment variable
+    const char* envKey = std::getenv("OPENAI_API_KEY");
+    if (!envKey) {
+        throw std::runtime_error("OPENAI_API_KEY environment variable not set.");
+    }
+    std::string apiKey = envKey;
+
+    std::string url = openai_url(path);
+
+    // Set HTTP headers (JSON + Authorization)
+    std::string authHeader = "Authorization: Bearer " + apiKey;
+    struct curl_slist* headerList = nullptr;
+    headerList = curl_slist_append(headerList, "Content-Type: application/json");
+    headerList = curl_slist_append(headerList, authHeader.c_str());
+    std::unique_ptr<curl_slist, decltype(&curl_slist_free_all)> headers(headerList, curl_slist_free_all);
+
+    EndpointMetrics& m = endpoint_metrics(path);
+    m.requests.inc();
+    m.bytesSent.inc(bodyStr.size());
+    auto t0 = std::chrono::steady_clock::now();
+
+    std::string readBuffer;  // will hold full HTTP response
+    try {
+        if (hedgeAfterMs > 0) {
+            readBuffer = hedged_post(url, headers.get(), bodyStr, hedgeAfterMs);
+        } else {
+            TransferWatch watch;
+            CurlHandle curl = make_post_handle(url, headers.get(), bodyStr, &readBuffer, &watch);
+
+            // Perform the HTTP POST
+            CURLcode res = curl_easy_perform(curl.get());
+            check_transfer(curl.get(), res, readBuffer, watch);
+        }
+    } catch (const ApiError& ex) {
+        m.error(ex.kind).inc();
+        throw;
+    }
+    m.latency.record((uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - t0).count());
+    m.bytesReceived.inc(readBuffer.size());
+
+    // Return raw JSON response string
+    return readBuffer;
+}
+
+// Pulls the assistant's text out of a Chat Completions response
+static std::string chat_message_content(const json& resJson) {
+    std::string content;
+    // choices[0].message.content, checked step by step: a reply of another
+    // shape is an error, not an out-of-range access on a const json
+    const json* message = nullptr;
+    auto choices = resJson.find("choices");
+    if (choices != resJson.end() && choices->is_array() && !choices->empty() && choices->front().is_object()) {
+        auto it = choices->front().find("message");
+        if (it != choices->front().end() && it->is_object()) message = &*it;
+    }
+    if (!message || !message->contains("content")) {
+        throw std::runtime_error("Unexpected content format in OpenAI response.");
+    }
+    const json& msgContent = message->at("content");
+
+    if (msgContent.is_string()) {
+        content = msgContent.get<std::string>();
+    } else if (msgContent.is_array()) {
+        // In case the API returns content as an array of parts
+        for (const auto& part : msgContent) {
+            if (part.is_object() && part.contains("text") && part.at("text").is_string()) {
+                content += part.at("text").get<std::string>();
+            }
+        }
+    } else {
+        throw std::runtime_error("Unexpected content format in OpenAI response.");
+    }
+    return content;
+}
+
+// Replies generated by a --local-model when the route sets no limit
+static const size_t kLocalMaxTokens = 1024;
+
+// Chat Completions request body: the fixed instructions as the system
+// message, then the per-request content
+static json chat_request_body(const std::string& instructions, const std::string& userContent,
+                              const RouteChoice& choice) {
+    json body;
+    body["model"] = choice.model;      // model name
+    body["messages"] = {               // stable prefix first, then the variable part
+        {
+            {"role", "system"},
+            {"content", instructions}
+        },
+        {
+            {"role", "user"},
+            {"content", userContent}
+        }
+    };
+    if (choice.maxTokens > 0) body["max_tokens"] = choice.maxTokens;
+    return body;
+}
+
+// Sends fixed instructions (system message) plus per-request content (user
+// message) to the Chat Completions API, using the model the router picks
+// for this task and prompt size, and returns the assistant's reply text.
+// Keeping the instructions first and byte-identical lets the server reuse
+// its cached prefix across requests (and the local model its KV cache).
+std::string call_openai_chat(const std::string& instructions, const std::string& userContent,
+                             ChatTask task) {
+    ModelRouter& router = model_router();
+    size_t inputTokens = estimate_tokens(instructions) + estimate_tokens(userContent);
+    RouteChoice choice = router.route(task, inputTokens);
+
+    // With --local-model nothing goes over the network
+    if (LocalModel* local = local_model().get()) {
+        bool cancelled = false;
+        std::string reply = local->chat(instructions, userContent,
+                                        choice.maxTokens > 0 ? (size_t)choice.maxTokens : kLocalMaxTokens, [&] {
+            return cancelled = g_interrupted.load() || (t_cancelFlag && t_cancelFlag->load());
+        });
+        if (cancelled) throw ApiError("cancelled", "Interrupted");
+        return reply;
+    }
+
+    // Another process (or an earlier run) may already have this reply
+    SharedCache* shared = shared_cache().get();
+    std::string sharedKey;
+    if (shared) {
+        sharedKey = choice.model + '\0' + std::to_string(choice.maxTokens) + '\0' + instructions +
+                    '\0' + userContent;
+        std::string cached;
+        if (shared->get(sharedKey, cached)) return cached;
+    }
+
+    // Build JSON payload to send to OpenAI
+    json body = chat_request_body(instructions, userContent, choice);
+
+    // Hedge once the request is slower than 95% of this model's recent ones
+    long hedgeAfterMs = 0;
+    const HttpPolicy& policy = http_policy();
+    if (policy.hedge) {
+        hedgeAfterMs = policy.hedgeAfterMs > 0
+                           ? policy.hedgeAfterMs
+                           : (long)std::ceil(router.latency_quantile(choice, task, 0.95));
+    }
+
+    // Fail at once if the API has been down (without queueing for a slot),
+    // then wait for a slot under the adaptive in-flight limit (not timed)
+    CircuitBreaker& breaker = chat_breaker();
+    if (!breaker.allow()) {
+        throw ApiError("unavailable", "OpenAI API unavailable (circuit open after repeated failures)");
+    }
+    std::unique_ptr<ConcurrencyLimiter::Permit> permit;
+    try {
+        permit.reset(new ConcurrencyLimiter::Permit(chat_limiter()));
+    } catch (...) {
+        breaker.done(CircuitBreaker::kIgnore);  // interrupted while waiting
+        throw;
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    auto elapsedMs = [&] {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    };
+    json resJson;
+    try {
+        resJson = json::parse(openai_post("/chat/completions", body.dump(), hedgeAfterMs));
+    } catch (const ApiError& ex) {
+        // Rate limiting, overload and timeouts mean "fewer requests at once"
+        bool overload = (ex.status == 429 || ex.status == 503 || std::strcmp(ex.kind, "timeout") == 0);
+        permit->done(0, overload ? ConcurrencyLimiter::kOverload : ConcurrencyLimiter::kIgnore);
+        // Any other HTTP error still means the endpoint is up
+        breaker.done(api_unreachable(ex) ? CircuitBreaker::kFailure
+                     : ex.status == 429 || std::strcmp(ex.kind, "http") != 0 ? CircuitBreaker::kIgnore
+                     : CircuitBreaker::kSuccess);
+        // A cancelled request says nothing about the model
+        if (!g_interrupted.load() && !(t_cancelFlag && t_cancelFlag->load())) {
+            router.record(choice, task, inputTokens, nullptr, elapsedMs(), false);
+        }
+        throw;
+    } catch (...) {
+        breaker.done(CircuitBreaker::kIgnore);
+        router.record(choice, task, inputTokens, nullptr, elapsedMs(), false);
+        throw;
+    }
+    permit->done(elapsedMs(), ConcurrencyLimiter::kOk);
+    breaker.done(CircuitBreaker::kSuccess);
+    router.record(choice, task, inputTokens, resJson.value("usage", json()), elapsedMs(), true);
+
+    std::string content = chat_message_content(resJson);
+    if (shared) shared->put(sharedKey, content);
+    return content;
+}
+
+// ======== OFFLINE STUDY AIDS =========
+
+// Summaries and flashcards worked out from the text alone, in
+// milliseconds: --offline, the --preview shown while the API works, and the
+// fallback while the API is unreachable. Everything is extractive (the
+// text's own sentences), so it is rougher than the model's output; results
+// are flagged `offline` and never memoized.
+
+static const char* const kStopwords[] = {
+        "the", "and", "for", "are", "but", "not", "you", "all", "any", "can", "had", "her", "was",
+        "one", "our", "out", "has", "him", "his", "how", "its", "may", "new", "now", "see", "two",
+        "who", "did", "get", "let", "say", "she", "too", "use", "that", "with", "have", "this",
+        "will", "your", "from", "they", "been", "were", "said", "each", "which", "their", "there",
+        "what", "about", "would", "these", "other", "into", "more", "some", "could", "them",
+        "than", "then", "also", "when", "where", "while", "such", "only", "very", "most", "many",
+        "much", "over", "both", "just", "those", "because", "being", "does", "after", "before",
+        "between", "through", "during", "under", "again", "same", "should", "must", "like"};
+
+static bool is_stopword(const std::string& w) {
+    static const std::unordered_set<std::string> kStop(std::begin(kStopwords), std::end(kStopwords));
+    return kStop.count(w) != 0;
+}
+
+// Lower-case words of 3+ letters that are not stopwords
+static std::vector<std::string> content_words(const std::string& sentence) {
+    std::vector<std::string> words;
+    std::string w;
+    for (size_t i = 0; i <= sentence.size(); ++i) {
+        unsigned char c = i < sentence.size() ? (unsigned char)sentence[i] : ' ';
+        if (std::isalnum(c) || c >= 0x80 || (c == '-' && !w.empty())) {
+            w += (char)std::tolower(c);
+            continue;
+        }
+        while (!w.empty() && w.back() == '-') w.pop_back();
+        if (w.size() >= 3 && !is_stopword(w)) words.push_back(w);
+        w.clear();
+    }
+    return words;
+}
+
+// Splits text into sentences at . ! ? followed by whitespace, at blank
+// lines and before list items or headings; runs of whitespace become one
+// space and list/heading markers are dropped. Fragments with fewer than
+// two words of 3+ letters are not sentences.
+static std::vector<std::string> split_sentences(const std::string& text) {
+    static const std::unordered_set<std::string> kAbbrev = {
+        "e.g.", "i.e.", "etc.", "vs.", "dr.", "mr.", "mrs.", "ms.", "fig.", "no.", "approx."};
+    std::vector<std::string> out;
+    std::string cur;
+    auto flush = [&] {
+        while (!cur.empty() && cur.back() == ' ') cur.pop_back();
+        size_t b = cur.find_first_not_of(" -*#>\xe2\x80\xa2");  // markers, incl. U+2022
+        int words = 0, run = 0;
+        for (size_t i = 0; i <= cur.size() && words < 2; ++i) {
+            if (i < cur.size() && std::isalpha((unsigned char)cur[i])) {
+                ++run;
+                continue;
+            }
+            if (run >= 3) ++words;
+            run = 0;
+        }
+        if (b != std::string::npos && words >= 2) out.push_back(cur.substr(b));
+        cur.clear();
+    };
+    for (size_t i = 0; i < text.size(); ++i) {
+        char c = text[i];
+        if (c == '\n') {
+            size_t next = text.find_first_not_of(" \t\r", i + 1);
+            if (next == std::string::npos || text[next] == '\n' || text[next] == '-' ||
+                text[next] == '*' || text[next] == '#' || (unsigned char)text[next] == 0xe2) {
+                flush();
+                continue;
+            }
+        }
+        if (std::isspace((unsigned char)c)) {
+            if (!cur.empty() && cur.back() != ' ') cur += ' ';
+            continue;
+        }
+        cur += c;
+        if ((c == '.' || c == '!' || c == '?') &&
+            (i + 1 == text.size() || std::isspace((unsigned char)text[i + 1]))) {
+            size_t sp = cur.rfind(' ');
+            std::string last = cur.substr(sp == std::string::npos ? 0 : sp + 1);
+            std::transform(last.begin(), last.end(), last.begin(), ::tolower);
+            bool initial = last.size() == 2 && std::isalpha((unsigned char)last[0]);
+            if (!kAbbrev.count(last) && !initial) flush();
+        }
+    }
+    flush();
+    return out;
+}
+
+// A sentence as a TF-IDF vector: (term id, weight) pairs sorted by term
+// id, scaled to unit length
+struct SparseVector {
+    std::vector<uint32_t> terms;
+    std::vector<float> weights;
+};
+
+static float sparse_dot(const SparseVector& a, const SparseVector& b) {
+    float dot = 0;
+    size_t i = 0, j = 0;
+    while (i < a.terms.size() && j < b.terms.size()) {
+        if (a.terms[i] < b.terms[j]) ++i;
+        else if (a.terms[i] > b.terms[j]) ++j;
+        else dot += a.weights[i++] * b.weights[j++];
+    }
+    return dot;
+}
+
+// LexRank: PageRank over a graph linking each sentence to its most similar
+// ones (TF-IDF cosine). The graph is kept sparse so multi-megabyte texts
+// stay fast:
+// - similarities are accumulated from an inverted index that stores each
+//   term's weight with the sentence, over the sentence's kScanTerms
+//   heaviest terms (most of a TF-IDF vector's mass): exact for terms in at
+//   most kMaxScan sentences, while a more common term has a strided sample
+//   of its sentences scanned and scaled up, so a sentence costs
+//   O(kScanTerms * kMaxScan) however large the text
+// - up to kNeighbours at or above kMinSimilarity become edges, which are
+//   then made symmetric
+// - power iteration with damping 0.85 until the scores move less than
+//   1e-6 in total (at most 100 rounds)
+// Building the graph and each iteration run on the task pool.
+static std::vector<double> lexrank(const std::vector<SparseVector>& vecs, size_t numTerms) {
+    const size_t kScanTerms = 6, kMaxScan = 32, kNeighbours = 10;
+    const float kMinSimilarity = 0.1f;
+    const double kDamping = 0.85;
+    size_t n = vecs.size();
+    if (n == 0) return {};
+
+    // Inverted index: (sentence, weight) for each term (CSR)
+    struct Posting {
+        uint32_t sentence;
+        float weight;
+    };
+    std::vector<uint32_t> postStart(numTerms + 1, 0);
+    for (const auto& v : vecs) {
+        for (uint32_t t : v.terms) ++postStart[t + 1];
+    }
+    for (size_t t = 0; t < numTerms; ++t) postStart[t + 1] += postStart[t];
+    std::vector<Posting> postings(postStart[numTerms]);
+    std::vector<uint32_t> fill(postStart.begin(), postStart.end() - 1);
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t k = 0; k < vecs[i].terms.size(); ++k) {
+            postings[fill[vecs[i].terms[k]]++] = {(uint32_t)i, vecs[i].weights[k]};
+        }
+    }
+
+    // Each sentence's strongest neighbours
+    struct Edge {
+        uint32_t from, to;
+        float weight;
+    };
+    std::vector<std::vector<Edge>> rows(n);
+    parallel_for(task_pool(), n, 1024, [&](size_t begin, size_t end) {
+        std::vector<float> similarity(n, 0.0f);
+        std::vector<uint32_t> touched;
+        std::vector<std::pair<float, uint32_t>> ranked;
+        std::vector<size_t> heaviest;
+        for (size_t i = begin; i < end; ++i) {
+            const SparseVector& v = vecs[i];
+            heaviest.resize(v.terms.size());
+            for (size_t k = 0; k < heaviest.size(); ++k) heaviest[k] = k;
+            if (heaviest.size() > kScanTerms) {
+                std::partial_sort(heaviest.begin(), heaviest.begin() + kScanTerms, heaviest.end(),
+                                  [&](size_t a, size_t b) { return v.weights[a] > v.weights[b]; });
+                heaviest.resize(kScanTerms);
+            }
+            for (size_t k : heaviest) {
+                uint32_t t = v.terms[k];
+                size_t df = postStart[t + 1] - postStart[t];
+                size_t stride = (df + kMaxScan - 1) / kMaxScan;
+                float scale = v.weights[k] * (float)stride;
+                for (size_t p = postStart[t] + i % stride; p < postStart[t + 1]; p += stride) {
+                    uint32_t j = postings[p].sentence;
+                    if (similarity[j] == 0.0f) touched.push_back(j);
+                    similarity[j] += scale * postings[p].weight;
+                }
+            }
+            ranked.clear();
+            for (uint32_t j : touched) {
+                if (j != i && similarity[j] >= kMinSimilarity) ranked.emplace_back(similarity[j], j);
+                similarity[j] = 0.0f;
+            }
+            touched.clear();
+            auto stronger = [](const std::pair<float, uint32_t>& a, const std::pair<float, uint32_t>& b) {
+                return a.first > b.first || (a.first == b.first && a.second < b.second);
+            };
+            if (ranked.size() > kNeighbours) {
+                std::nth_element(ranked.begin(), ranked.begin() + kNeighbours, ranked.end(), stronger);
+                ranked.resize(kNeighbours);
+            }
+            for (const auto& r : ranked) {
+                rows[i].push_back({(uint32_t)i, r.second, std::min(r.first, 1.0f)});
+            }
+        }
+    });
+
+    // Symmetric adjacency (CSR by counting), each undirected edge once per
+    // endpoint: a pair that chose each other is listed twice, so rows are
+    // sorted and deduplicated
+    std::vector<size_t> fillAt(n + 1, 0);
+    for (const auto& row : rows) {
+        for (const Edge& e : row) {
+            ++fillAt[e.from + 1];
+            ++fillAt[e.to + 1];
+        }
+    }
+    for (size_t i = 0; i < n; ++i) fillAt[i + 1] += fillAt[i];
+    std::vector<Edge> edges(fillAt[n]);
+    std::vector<size_t> rowEnd(fillAt.begin(), fillAt.end() - 1);
+    for (const auto& row : rows) {
+        for (const Edge& e : row) {
+            edges[rowEnd[e.from]++] = e;
+            edges[rowEnd[e.to]++] = {e.to, e.from, e.weight};
+        }
+    }
+    std::vector<size_t> adjStart(n + 1, 0);
+    std::vector<double> strength(n, 0);  // sum of a sentence's edge weights
+    size_t kept = 0;
+    for (size_t i = 0; i < n; ++i) {
+        auto first = edges.begin() + fillAt[i], last = edges.begin() + rowEnd[i];
+        std::sort(first, last, [](const Edge& a, const Edge& b) { return a.to < b.to; });
+        for (auto e = first; e != last; ++e) {
+            if (e != first && e->to == (e - 1)->to) continue;
+            strength[i] += e->weight;
+            edges[kept++] = *e;
+        }
+        adjStart[i + 1] = kept;
+    }
+    edges.resize(kept);
+
+    // Power iteration; sentences without edges spread their score evenly
+    std::vector<double> score(n, 1.0 / n), next(n);
+    for (int round = 0; round < 100; ++round) {
+        double isolated = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (strength[i] == 0) isolated += score[i];
+        }
+        double base = (1 - kDamping) / n + kDamping * isolated / n;
+        parallel_for(task_pool(), n, 1024, [&](size_t begin, size_t end) {
+            for (size_t j = begin; j < end; ++j) {
+                double sum = 0;
+                for (size_t e = adjStart[j]; e < adjStart[j + 1]; ++e) {
+                    sum += score[edges[e].to] * edges[e].weight / strength[edges[e].to];
+                }
+                next[j] = base + kDamping * sum;
+            }
+        });
+        double moved = 0;
+        for (size_t i = 0; i < n; ++i) moved += std::fabs(next[i] - score[i]);
+        score.swap(next);
+        if (moved < 1e-6) break;
+    }
+    return score;
+}
+
+// Sentences with an importance score each (LexRank) and their TF-IDF vectors
+struct ScoredSentences {
+    std::vector<std::string> sentences;
+    std::vector<double> scores;
+    std::vector<SparseVector> vectors;
+};
+
+static ScoredSentences score_sentences(const std::string& text) {
+    ScoredSentences st;
+    st.sentences = split_sentences(text);
+    size_t n = st.sentences.size();
+    std::vector<std::vector<std::string>> words(n);
+    parallel_for(task_pool(), n, 256, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) words[i] = content_words(st.sentences[i]);
+    });
+
+    // Term ids, and in how many sentences each term occurs
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<std::vector<uint32_t>> termIds(n);
+    std::vector<uint32_t> df;
+    for (size_t i = 0; i < n; ++i) {
+        for (const auto& w : words[i]) {
+            auto it = ids.find(w);
+            if (it == ids.end()) {
+                it = ids.emplace(w, (uint32_t)ids.size()).first;
+                df.push_back(0);
+            }
+            termIds[i].push_back(it->second);
+        }
+        std::sort(termIds[i].begin(), termIds[i].end());
+        for (size_t k = 0; k < termIds[i].size(); ++k) {
+            if (k == 0 || termIds[i][k] != termIds[i][k - 1]) ++df[termIds[i][k]];
+        }
+    }
+
+    // Weights (1 + log tf) * log(n / df), scaled to unit length
+    st.vectors.resize(n);
+    parallel_for(task_pool(), n, 256, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            SparseVector& v = st.vectors[i];
+            const auto& t = termIds[i];
+            double norm = 0;
+            for (size_t k = 0; k < t.size();) {
+                size_t run = 1;
+                while (k + run < t.size() && t[k + run] == t[k]) ++run;
+                float w = (float)((1 + std::log((double)run)) * std::log((double)n / df[t[k]]));
+                if (w > 0) {
+                    v.terms.push_back(t[k]);
+                    v.weights.push_back(w);
+                    norm += (double)w * w;
+                }
+                k += run;
+            }
+            for (float& w : v.weights) w = (float)(w / std::sqrt(norm));
+        }
+    });
+    st.scores = lexrank(st.vectors, ids.size());
+    return st;
+}
+
+// Cue phrases and keyphrases are found in one pass over the raw text (no
+// sentence splitting), so definitions and cloze cards come out at hundreds
+// of MB/s and stay cheap however long the notes are.
+
+// Aho-Corasick automaton over lower-cased bytes, compiled to a full DFA:
+// one table lookup per input byte, whatever the number of patterns
+class CueMatcher {
+public:
+    explicit CueMatcher(const std::vector<std::string>& patterns) {
+        std::vector<std::array<int32_t, 256>> go(1);
+        go[0].fill(-1);
+        output_.push_back(-1);
+        for (size_t p = 0; p < patterns.size(); ++p) {
+            int32_t s = 0;
+            for (char ch : patterns[p]) {
+                unsigned char c = (unsigned char)std::tolower((unsigned char)ch);
+                if (go[s][c] < 0) {
+                    go[s][c] = (int32_t)go.size();
+                    go.emplace_back();
+                    go.back().fill(-1);
+                    output_.push_back(-1);
+                }
+                s = go[s][c];
+            }
+            output_[s] = (int32_t)p;
+        }
+
+        // Breadth-first: failure links, outputs inherited through them
+        // (longest pattern first) and the missing transitions filled in
+        size_t states = go.size();
+        next_.assign(states * 256, 0);
+        suffixOutput_.assign(states, -1);
+        std::vector<int32_t> fail(states, 0), queue;
+        for (int c = 0; c < 256; ++c) {
+            int32_t t = go[0][c];
+            if (t > 0) queue.push_back(t);
+            next_[c] = (uint16_t)std::max(t, 0);
+        }
+        for (size_t q = 0; q < queue.size(); ++q) {
+            int32_t s = queue[q];
+            int32_t f = fail[s];
+            suffixOutput_[s] = output_[f] >= 0 ? f : suffixOutput_[f];
+            for (int c = 0; c < 256; ++c) {
+                int32_t t = go[s][c];
+                if (t > 0) {
+                    fail[t] = next_[f * 256 + c];
+                    queue.push_back(t);
+                    next_[s * 256 + c] = (uint16_t)t;
+                } else {
+                    next_[s * 256 + c] = next_[f * 256 + c];
+                }
+            }
+        }
+        // Upper-case bytes behave like their lower-case letters
+        for (size_t s = 0; s < states; ++s) {
+            for (int c = 'A'; c <= 'Z'; ++c) next_[s * 256 + c] = next_[s * 256 + (c | 0x20)];
+        }
+        reports_.resize(states);
+        for (size_t s = 0; s < states; ++s) reports_[s] = output_[s] >= 0 || suffixOutput_[s] >= 0;
+    }
+
+    // Calls onMatch(pattern, endOffset) for every occurrence of every
+    // pattern; onMatch returns false to stop the scan
+    template <class OnMatch>
+    void scan(const char* data, size_t n, OnMatch&& onMatch) const {
+        uint32_t s = 0;
+        for (size_t i = 0; i < n; ++i) {
+            s = next_[s * 256 + (unsigned char)data[i]];
+            if (!reports_[s]) continue;
+            for (int32_t t = output_[s] >= 0 ? (int32_t)s : suffixOutput_[s]; t >= 0; t = suffixOutput_[t]) {
+                if (!onMatch((size_t)output_[t], i + 1)) return;
+            }
+        }
+    }
+
+private:
+    std::vector<uint16_t> next_;        // [state * 256 + byte] -> state
+    std::vector<int32_t> output_;       // pattern ending exactly here, or -1
+    std::vector<int32_t> suffixOutput_; // nearest suffix state with an output, or -1
+    std::vector<uint8_t> reports_;      // any output here or down the suffix chain
+};
+
+// True if the '.' at text[dot] ends an abbreviation like "e.g." or "U."
+static bool abbreviation_dot(const std::string& text, size_t dot) {
+    return dot >= 2 && std::isalpha((unsigned char)text[dot - 1]) &&
+           (text[dot - 2] == '.' || text[dot - 2] == ' ');
+}
+
+// Where the sentence around `at` starts: just after . ! ? + whitespace, a
+// blank line or a line starting a list item, or the text start. npos when
+// that is more than maxBack bytes away.
+static size_t sentence_begin(const std::string& text, size_t at, size_t maxBack) {
+    for (size_t b = at; b > 0 && at - b <= maxBack; --b) {
+        char c = text[b - 1];
+        if ((c == '.' || c == '!' || c == '?') && std::isspace((unsigned char)text[b]) &&
+            !(c == '.' && abbreviation_dot(text, b - 1))) {
+            return b;
+        }
+        if (c == '\n') {
+            size_t prev = text.find_last_not_of(" \t\r", b - 2 < b ? b - 2 : 0);
+            if (b < 2 || prev == std::string::npos || text[prev] == '\n') return b;
+            if (text[b] == '-' || text[b] == '*' || text[b] == '#') return b;
+        }
+    }
+    return at <= maxBack ? 0 : std::string::npos;
+}
+
+// Where the sentence containing `at` ends (past its . ! ?; "e.g." style
+// abbreviations do not end it), or npos when not within maxForward bytes
+static size_t sentence_end(const std::string& text, size_t at, size_t maxForward) {
+    size_t limit = std::min(text.size(), at + maxForward);
+    for (size_t e = at; e < limit; ++e) {
+        char c = text[e];
+        if (c == '\n' && e + 1 < text.size() && text[e + 1] == '\n') return e;
+        if (c != '.' && c != '!' && c != '?') continue;
+        if (e + 1 < text.size() && !std::isspace((unsigned char)text[e + 1])) continue;
+        if (!(c == '.' && abbreviation_dot(text, e))) return e + 1;
+    }
+    return limit == text.size() ? limit : std::string::npos;
+}
+
+// text[begin, end) with whitespace runs collapsed and the ends trimmed
+static std::string collapse_spaces(const std::string& text, size_t begin, size_t end) {
+    std::string out;
+    out.reserve(end - begin);
+    for (size_t i = begin; i < end; ++i) {
+        if (std::isspace((unsigned char)text[i])) {
+            if (!out.empty() && out.back() != ' ') out += ' ';
+        } else {
+            out += text[i];
+        }
+    }
+    if (!out.empty() && out.back() == ' ') out.pop_back();
+    return out;
+}
+
+// A definition found in the text, with the sentence it came from
+struct DefinitionMatch {
+    Definition def;
+    std::string sentence;
+    bool plural;
+};
+
+// Definitions marked by cue phrases: "X is defined as / refers to / is a /
+// means ... Y" and the reverse "Y is called / is known as X". The term
+// must be at most five words, not a pronoun, without , ; : ( ). At most
+// one per sentence and per term; stops after maxCount.
+static std::vector<DefinitionMatch> extract_definitions(const std::string& text, size_t maxCount) {
+    struct Cue {
+        const char* pattern;
+        size_t keep;     // trailing bytes of the pattern that stay in the definition ("a ")
+        bool termAfter;  // "... is called TERM"
+        bool plural;
+    };
+    static const Cue kCues[] = {
+        {" is defined as ", 0, false, false}, {" are defined as ", 0, false, true},
+        {" refers to ", 0, false, false},     {" refer to ", 0, false, true},
+        {" is a ", 2, false, false},          {" is an ", 3, false, false},
+        {" is the ", 4, false, false},        {" are ", 0, false, true},
+        {" means ", 0, false, false},         {" is called ", 0, true, false},
+        {" are called ", 0, true, true},      {" is known as ", 0, true, false},
+        {" are known as ", 0, true, true}};
+    static const CueMatcher matcher = [] {
+        std::vector<std::string> patterns;
+        for (const Cue& c : kCues) patterns.push_back(c.pattern);
+        return CueMatcher(patterns);
+    }();
+    static const std::unordered_set<std::string> kNotTerms = {
+        "it", "this", "that", "there", "he", "she", "they", "these", "those", "which", "what",
+        "here", "we", "you", "i", "one", "each", "all", "some", "many", "most", "there's", "it's"};
+    const size_t kMaxTermBytes = 80, kMaxSentenceBytes = 600;
+
+    auto valid_term = [&](std::string& term) {
+        term = term.substr(std::min(term.size(), term.find_first_not_of("-*#> ")));
+        if (term.empty() || std::count(term.begin(), term.end(), ' ') > 4) return false;
+        if (term.find_first_of(",;:()\"") != std::string::npos) return false;
+        std::string first = term.substr(0, term.find(' '));
+        std::transform(first.begin(), first.end(), first.begin(), ::tolower);
+        if (kNotTerms.count(first)) return false;
+        if (first == "the" || first == "a" || first == "an") term[0] = (char)std::tolower((unsigned char)term[0]);
+        return std::any_of(term.begin(), term.end(), [](char c) { return std::isalpha((unsigned char)c); });
+    };
+
+    std::vector<DefinitionMatch> found;
+    std::unordered_set<std::string> terms;
+    size_t lastSentence = std::string::npos;
+    matcher.scan(text.data(), text.size(), [&](size_t p, size_t end) {
+        const Cue& cue = kCues[p];
+        size_t cueBegin = end - std::strlen(cue.pattern);
+        size_t b = sentence_begin(text, cueBegin, cue.termAfter ? kMaxSentenceBytes : kMaxTermBytes);
+        if (b == std::string::npos || b == lastSentence || b == cueBegin) return true;
+        size_t e = sentence_end(text, end, kMaxSentenceBytes);
+        if (e == std::string::npos) return true;
+        size_t defEnd = e > end && (text[e - 1] == '.' || text[e - 1] == '!' || text[e - 1] == '?') ? e - 1 : e;
+
+        DefinitionMatch m;
+        m.plural = cue.plural;
+        if (cue.termAfter) {
+            m.def.term = collapse_spaces(text, end, defEnd);
+            m.def.definition = collapse_spaces(text, b, cueBegin);
+        } else {
+            m.def.term = collapse_spaces(text, b, cueBegin);
+            m.def.definition = collapse_spaces(text, end - cue.keep, defEnd);
+        }
+        if (!valid_term(m.def.term) || content_words(m.def.definition).empty()) return true;
+        std::string key = m.def.term;
+        std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+        if (!terms.insert(key).second) return true;
+        m.sentence = collapse_spaces(text, b, e);
+        lastSentence = b;
+        found.push_back(std::move(m));
+        return found.size() < maxCount;
+    });
+    return found;
+}
+
+// A candidate key phrase: as in RAKE, a run of one to four content words
+// between stopwords or punctuation. Scored by how often its words occur in
+// the whole text (their mean count) times 1 + log(how often the phrase
+// itself occurs), so recurring terms beat one-off wording.
+struct Keyphrase {
+    std::string phrase;  // as first written in the text (whitespace collapsed)
+    double score;
+    size_t count;
+    size_t words;
+    size_t firstAt;      // byte offsets of the first and last occurrence
+    size_t lastAt;
+};
+
+// The maxCount best key phrases of `text`, in one pass over the bytes.
+// Words are counted exactly in an open-addressed table keyed by 64-bit
+// hash. Phrases go to a fixed table of 4-way buckets that fits in cache,
+// kept as a Misra-Gries summary: a new phrase meeting a full bucket
+// decrements its counts and takes the first slot that reaches zero, so
+// phrases that recur survive while one-offs make room (counts are then
+// lower bounds; exact for texts with fewer phrases than slots).
+static std::vector<Keyphrase> extract_keyphrases(const std::string& text, size_t maxCount) {
+    const size_t kMaxPhraseWords = 4, kPhraseBuckets = 1u << 14, kWays = 4;
+    const uint64_t kFnvBasis = 1469598103934665603ULL, kFnvPrime = 1099511628211ULL;
+    struct WordStat {
+        uint64_t key = 0;
+        uint64_t freq = 0;
+    };
+    struct PhraseStat {
+        uint64_t key = 0;
+        uint32_t count = 0;
+        uint32_t bytes = 0;
+        uint64_t firstAt = 0;
+        uint64_t lastAt = 0;
+    };
+    // Byte classes: 1 = word byte, 2 = whitespace, 0 = punctuation;
+    // lower[] folds ASCII case
+    static const std::array<uint8_t, 256> kClass = [] {
+        std::array<uint8_t, 256> c{};
+        for (int b = 0; b < 256; ++b) {
+            c[b] = std::isalnum(b) || b >= 0x80 || b == '-' || b == '\'' ? 1 : std::isspace(b) ? 2 : 0;
+        }
+        return c;
+    }();
+    static const std::array<uint8_t, 256> kLower = [] {
+        std::array<uint8_t, 256> l{};
+        for (int b = 0; b < 256; ++b) l[b] = (uint8_t)(b >= 'A' && b <= 'Z' ? b | 0x20 : b);
+        return l;
+    }();
+    // Stopword hashes in a small open-addressed set
+    static const std::vector<uint64_t> kStopSet = [&] {
+        std::vector<uint64_t> set(512, 0);
+        for (const char* w : kStopwords) {
+            uint64_t h = kFnvBasis;
+            for (const char* p = w; *p; ++p) h = (h ^ (uint8_t)*p) * kFnvPrime;
+            h |= 1;
+            size_t i = (size_t)mix64(h) & 511;
+            while (set[i]) i = (i + 1) & 511;
+            set[i] = h;
+        }
+        return set;
+    }();
+    auto stopword = [&](uint64_t h) {
+        for (size_t i = (size_t)mix64(h) & 511;; i = (i + 1) & 511) {
+            if (kStopSet[i] == h) return true;
+            if (kStopSet[i] == 0) return false;
+        }
+    };
+
+    std::vector<WordStat> words(1u << 14);
+    size_t wordCount = 0;
+    auto word_slot = [&](uint64_t key) {
+        size_t mask = words.size() - 1;
+        size_t i = (size_t)mix64(key) & mask;
+        while (words[i].key != key && words[i].key != 0) i = (i + 1) & mask;
+        return &words[i];
+    };
+
+    std::vector<PhraseStat> phrases(kPhraseBuckets * kWays);
+    uint64_t phraseWords[kMaxPhraseWords];
+    size_t phraseLen = 0, phraseBegin = 0, phraseEnd = 0;
+
+    auto end_phrase = [&] {
+        if (phraseLen == 0 || phraseLen > kMaxPhraseWords) {
+            phraseLen = 0;
+            return;
+        }
+        uint64_t key = kFnvBasis;
+        for (size_t k = 0; k < phraseLen; ++k) key = mix64(key ^ phraseWords[k]);
+        key |= 1;
+        PhraseStat* bucket = &phrases[((size_t)key & (kPhraseBuckets - 1)) * kWays];
+        PhraseStat* hit = nullptr;
+        for (size_t w = 0; w < kWays && !hit; ++w) {
+            if (bucket[w].key == key || bucket[w].count == 0) hit = &bucket[w];
+        }
+        if (!hit) {
+            for (size_t w = 0; w < kWays; ++w) {
+                if (--bucket[w].count == 0 && !hit) hit = &bucket[w];
+            }
+        }
+        if (hit) {
+            if (hit->key != key || hit->count == 0) {
+                *hit = {key, 0, (uint32_t)(phraseEnd - phraseBegin), phraseBegin, phraseBegin};
+            }
+            ++hit->count;
+            hit->lastAt = phraseBegin;
+        }
+        phraseLen = 0;
+    };
+
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(text.data());
+    size_t n = text.size();
+    for (size_t i = 0; i < n;) {
+        uint8_t cls = kClass[data[i]];
+        if (cls != 1) {
+            // Whitespace continues a phrase (but not a blank line); anything else ends it
+            if (cls == 0 || (data[i] == '\n' && i + 1 < n && data[i + 1] == '\n')) end_phrase();
+            ++i;
+            continue;
+        }
+        size_t begin = i;
+        uint64_t h = kFnvBasis;
+        bool letters = false;
+        for (; i < n && kClass[data[i]] == 1; ++i) {
+            letters = letters || data[i] > '9';
+            h = (h ^ kLower[data[i]]) * kFnvPrime;
+        }
+        h |= 1;  // never 0 (the empty-slot key)
+        if (i - begin < 3 || !letters || stopword(h)) {
+            end_phrase();
+            continue;
+        }
+        WordStat* w = word_slot(h);
+        if (w->key == 0) {
+            w->key = h;
+            if (++wordCount * 2 > words.size()) {
+                auto old = std::move(words);
+                words.assign(old.size() * 2, WordStat());
+                for (const auto& e : old) {
+                    if (e.key) *word_slot(e.key) = e;
+                }
+                w = word_slot(h);
+            }
+        }
+        ++w->freq;
+        if (phraseLen == 0) phraseBegin = begin;
+        if (phraseLen < kMaxPhraseWords) phraseWords[phraseLen] = h;
+        ++phraseLen;
+        phraseEnd = i;
+    }
+    end_phrase();
+
+    // Score what survived (recurring phrases only, unless the text is short)
+    size_t minCount = n > 65536 ? 2 : 1;
+    std::vector<Keyphrase> out;
+    for (const auto& ph : phrases) {
+        if (ph.count < minCount) continue;
+        double freq = 0;
+        size_t words_ = 0;
+        // Re-hash the phrase's words from its first occurrence
+        for (size_t i = ph.firstAt, end = ph.firstAt + ph.bytes; i < end; ++words_) {
+            while (i < end && kClass[data[i]] == 2) ++i;
+            uint64_t h = kFnvBasis;
+            for (; i < end && kClass[data[i]] == 1; ++i) h = (h ^ kLower[data[i]]) * kFnvPrime;
+            freq += (double)word_slot(h | 1)->freq;
+        }
+        double score = freq / std::max<size_t>(words_, 1) * (1 + std::log((double)ph.count));
+        out.push_back({collapse_spaces(text, ph.firstAt, ph.firstAt + ph.bytes), score, ph.count, words_,
+                       ph.firstAt, ph.lastAt});
+    }
+    size_t top = std::min(out.size(), maxCount);
+    std::partial_sort(out.begin(), out.begin() + top, out.end(), [](const Keyphrase& a, const Keyphrase& b) {
+        return a.score > b.score || (a.score == b.score && a.firstAt < b.firstAt);
+    });
+    out.resize(top);
+    return out;
+}
+
+// Summary from the best-scoring sentences (about 120 words, in text
+// order), key points from the next best, definitions from cue phrases. A
+// sentence too similar (cosine > 0.5) to one already taken is skipped.
+static SummaryResult offline_summary(const std::string& text) {
+    ScoredSentences st = score_sentences(text);
+    // Only the top few hundred can be needed, even with repeats skipped
+    std::vector<size_t> order(st.sentences.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    size_t top = std::min<size_t>(order.size(), 256);
+    std::partial_sort(order.begin(), order.begin() + top, order.end(), [&](size_t a, size_t b) {
+        return st.scores[a] > st.scores[b] || (st.scores[a] == st.scores[b] && a < b);
+    });
+    order.resize(top);
+
+    std::vector<size_t> picked, points;
+    size_t words = 0;
+    for (size_t r = 0; r < order.size() && points.size() < 5; ++r) {
+        size_t i = order[r];
+        bool repeat = false;
+        for (size_t p : picked) repeat = repeat || sparse_dot(st.vectors[i], st.vectors[p]) > 0.5f;
+        for (size_t p : points) repeat = repeat || sparse_dot(st.vectors[i], st.vectors[p]) > 0.5f;
+        if (repeat) continue;
+        size_t n = std::count(st.sentences[i].begin(), st.sentences[i].end(), ' ') + 1;
+        if (words < 120 && picked.size() < 6) {
+            picked.push_back(i);
+            words += n;
+        } else {
+            points.push_back(i);
+        }
+    }
+    std::sort(picked.begin(), picked.end());
+    std::sort(points.begin(), points.end());
+
+    SummaryResult result;
+    result.offline = true;
+    for (size_t i : picked) result.summary += (result.summary.empty() ? "" : " ") + st.sentences[i];
+    for (size_t i : points) result.keyPoints.push_back(st.sentences[i]);
+    for (auto& m : extract_definitions(text, 20)) result.definitions.push_back(std::move(m.def));
+    return result;
+}
+
+// Up to 15 cards: one per definition found, then fill-in-the-blank cards
+// for the best key phrases of up to three words, each blanked out of the
+// sentence where it first (or else last) appears; one card per sentence
+static FlashcardResult offline_flashcards(const std::string& text,
+                                          const std::vector<std::string>& avoidQuestions = {}) {
+    const size_t kMaxCards = 15;
+    std::unordered_set<std::string> avoid(avoidQuestions.begin(), avoidQuestions.end());
+    FlashcardResult result;
+    result.offline = true;
+    auto add = [&](const std::string& q, const std::string& a) {
+        if (result.flashcards.size() >= kMaxCards || !avoid.insert(q).second) return false;
+        result.flashcards.push_back({q, a});
+        return true;
+    };
+
+    std::unordered_set<std::string> usedSentences;
+    for (const auto& m : extract_definitions(text, kMaxCards)) {
+        if (add((m.plural ? "What are " : "What is ") + m.def.term + "?", m.sentence)) {
+            usedSentences.insert(m.sentence);
+        }
+    }
+
+    for (const auto& kp : extract_keyphrases(text, 4 * kMaxCards)) {
+        if (result.flashcards.size() >= kMaxCards) break;
+        if (kp.words > 3) continue;
+        for (size_t occurrence : {kp.firstAt, kp.lastAt}) {
+            size_t b = sentence_begin(text, occurrence, 400);
+            size_t e = b == std::string::npos ? b : sentence_end(text, occurrence, 400);
+            if (e == std::string::npos) continue;
+            std::string sentence = collapse_spaces(text, b, e);
+            if (usedSentences.count(sentence)) continue;
+            // The phrase starts right after the text before it (plus the
+            // space collapsed between them); it is blanked as written there
+            std::string before = collapse_spaces(text, b, occurrence);
+            size_t at = before.size() + (before.empty() ? 0 : 1);
+            std::string written = sentence.substr(std::min(at, sentence.size()), kp.phrase.size());
+            if (strcasecmp(written.c_str(), kp.phrase.c_str()) != 0) continue;
+            std::string question = sentence;
+            question.replace(at, kp.phrase.size(), "_____");
+            if (content_words(question).size() < 2) continue;  // too little left to go on
+            if (add("Fill in the blank: " + question, written)) usedSentences.insert(sentence);
+            break;
+        }
+    }
+    return result;
+}
+
+// Whether a failed chat request should be answered locally instead
+// (counted for the metrics)
+static bool use_offline_fallback(const ApiError& ex) {
+    static Counter& fallbacks = metrics().counter("ai_study_offline_fallbacks_total", "",
+                                                  "Results made locally because the API was unreachable");
+    if (!http_policy().offlineFallback || !api_unreachable(ex)) return false;
+    fallbacks.inc();
+    return true;
+}
+
+// ======== AI LOGIC: SUMMARY =========
+
+// Fixed instructions, sent as the system message so every summary request
+// starts with the same bytes (and can hit the server's prompt cache)
+static const char* kSummaryInstructions = R"(
+You are an AI study assistant.
+
+TASK:
+1. Read the following text.
+2. Write a concise summary (150–250 words) in simple language.
+3. List 3–5 key points.
+4. If there are definitions, include them in your own words.
+
+Return ONLY valid JSON with this structure:
+{
+  "summary": "string",
+  "key_points": ["string", "string"],
+  "definitions": [
+    {"term": "string", "definition": "string"}
+  ]
+}
+
+The TEXT is in the user message.
+)";
+
+// Fills a SummaryResult from the model's JSON reply
+static SummaryResult parse_summary(const json& summaryJson) {
+    SummaryResult result;
+    result.summary = summaryJson.value("summary", "");
+    result.offline = summaryJson.value("offline", false);
+
+    // Key points list
+    if (summaryJson.contains("key_points") && summaryJson["key_points"].is_array()) {
+        for (auto& kp : summaryJson["key_points"]) {
+            result.keyPoints.push_back(kp.get<std::string>());
+        }
+    }
+
+    // Definitions list
+    if (summaryJson.contains("definitions") && summaryJson["definitions"].is_array()) {
+        for (auto& d : summaryJson["definitions"]) {
+            Definition def;
+            def.term = d.value("term", "");
+            def.definition = d.value("definition", "");
+            result.definitions.push_back(def);
+        }
+    }
+
+    return result;
+}
+
+// Sends text to OpenAI with a prompt asking for:
+// - summary
+// - key points
+// - definitions
+// and parses the JSON result into SummaryResult (made locally instead if
+// the API is unreachable)
+SummaryResult summarize_content(const std::string& text) {
+    if (http_policy().offline) return offline_summary(text);
+
+    // Call OpenAI and get the assistant's message content
+    std::string content;
+    try {
+        content = call_openai_chat(kSummaryInstructions, "TEXT:\n" + text, ChatTask::kSummary);
+    } catch (const ApiError& ex) {
+        if (!use_offline_fallback(ex)) throw;
+        return offline_summary(text);
+    }
+
+    // Extract pure JSON block from the content (removes ```json fences, text, etc.)
+    std::string jsonText = extract_json_block(content);
+
+    // Parse the assistant message content as JSON
+    return parse_summary(json::parse(jsonText));
+}
+
+// ======== AI LOGIC: FLASHCARDS =========
+
+// Fixed flashcard instructions (the system message; see kSummaryInstructions)
+static const char* kFlashcardInstructions = R"(
+You are an AI that creates study flashcards.
+
+Given the TEXT below, create 10–20 flashcards that help a student study.
+
+Rules:
+- Questions should be clear and specific.
+- Answers should be brief (1–3 sentences).
+- Mix definitions, concepts, and reasoning questions.
+
+Return ONLY valid JSON with this structure:
+{
+  "flashcards": [
+    {"question": "string", "answer": "string"}
+  ]
+}
+
+The TEXT is in the user message.
+)";
+
+// Fills a FlashcardResult from the model's JSON reply
+static FlashcardResult parse_flashcards(const json& fcJson) {
+    FlashcardResult result;
+    result.offline = fcJson.value("offline", false);
+    // Extract flashcards from JSON array
+    if (fcJson.contains("flashcards") && fcJson["flashcards"].is_array()) {
+        for (auto& fc : fcJson["flashcards"]) {
+            Flashcard card;
+            card.question = fc.value("question", "");
+            card.answer   = fc.value("answer", "");
+            result.flashcards.push_back(card);
+        }
+    }
+    return result;
+}
+
+// Sends text to OpenAI asking it to generate a JSON list of flashcards.
+// Questions in `avoidQuestions` (cards the student already has) are listed
+// in the prompt so the model produces new material. Made locally instead if
+// the API is unreachable.
+FlashcardResult generate_flashcards(const std::string& text,
+                                    const std::vector<std::string>& avoidQuestions) {
+    if (http_policy().offline) return offline_flashcards(text, avoidQuestions);
+
+    // The avoid list only grows by appending, so it goes before the text:
+    // consecutive prefetch requests then share the longest possible prefix
+    std::string userMessage;
+    if (!avoidQuestions.empty()) {
+        userMessage += "The student already has these questions. Do not repeat or rephrase them:\n";
+        for (const auto& q : avoidQuestions) userMessage += "- " + q + "\n";
+        userMessage += "\n";
+    }
+    userMessage += "TEXT:\n";
+    userMessage += text;
+
+    // Call OpenAI and get the assistant's message content
+    std::string content;
+    try {
+        content = call_openai_chat(kFlashcardInstructions, userMessage, ChatTask::kFlashcards);
+    } catch (const ApiError& ex) {
+        if (!use_offline_fallback(ex)) throw;
+        return offline_flashcards(text, avoidQuestions);
+    }
+
+    // Extract and parse the JSON block
+    std::string jsonText = extract_json_block(content);
+    return parse_flashcards(json::parse(jsonText));
+}
+
+// ======== AI LOGIC: COMBINED =========
+
+// Summary and flashcard instructions in one, for a single request that
+// uploads the study text only once
+static const char* kCombinedInstructions = R"(
+You are an AI study assistant.
+
+TASK:
+1. Read the TEXT in the user message.
+2. Write a concise summary (150–250 words) in simple language.
+3. List 3–5 key points.
+4. If there are definitions, include them in your own words.
+5. Create 10–20 flashcards that help a student study:
+   - Questions should be clear and specific.
+   - Answers should be brief (1–3 sentences).
+   - Mix definitions, concepts, and reasoning questions.
+
+Return ONLY valid JSON with this structure:
+{
+  "summary": "string",
+  "key_points": ["string", "string"],
+  "definitions": [
+    {"term": "string", "definition": "string"}
+  ],
+  "flashcards": [
+    {"question": "string", "answer": "string"}
+  ]
+}
+)";
+
+// Summary and flashcards for `text` from one API request (mode 3 without
+// chunking), parsed into the same structs the separate calls return
+static void summarize_and_generate(const std::string& text, SummaryResult& summary,
+                                   FlashcardResult& cards) {
+    if (http_policy().offline) {
+        summary = offline_summary(text);
+        cards = offline_flashcards(text);
+        return;
+    }
+    std::string content;
+    try {
+        content = call_openai_chat(kCombinedInstructions, "TEXT:\n" + text, ChatTask::kCombined);
+    } catch (const ApiError& ex) {
+        if (!use_offline_fallback(ex)) throw;
+        summary = offline_summary(text);
+        cards = offline_flashcards(text);
+        return;
+    }
+    json reply = json::parse(extract_json_block(content));
+    summary = parse_summary(reply);
+    cards = parse_flashcards(reply);
+}
+
+// ======== INPUT INGESTION =========
+
+// Size of each read() when draining pipes/terminals (1 MiB per syscall)
+static const size_t kReadChunk = 1 << 20;
+
+// Reads everything from an open file descriptor into a single string.
+// Regular files are mmap'ed and copied once into a buffer sized from fstat();
+// pipes and terminals are drained with large read() calls into a buffer that
+// grows geometrically, so there is no per-line reallocation.
+static std::string read_all_fd(int fd) {
+    std::string out;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size_t size = (size_t)st.st_size;
+        void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, size, MADV_SEQUENTIAL);
+            out.assign(static_cast<const char*>(map), size);
+            munmap(map, size);
+            return out;
+        }
+        // mmap refused (unusual filesystem): fall back to read() below
+        out.reserve(size + 1);
+    }
+
+    size_t used = 0;
+    out.resize(std::max(out.capacity(), kReadChunk));
+    while (true) {
+        if (out.size() - used < kReadChunk) out.resize(out.size() * 2);
+
+        ssize_t n = read(fd, &out[used], out.size() - used);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(std::string("read() failed: ") + std::strerror(errno));
+        }
+        if (n == 0) break; // EOF
+        used += (size_t)n;
+    }
+    out.resize(used);
+    return out;
+}
+
+// Reads a whole file given by path (see read_all_fd for the strategy)
+static std::string read_input_file(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open input file '" + path + "': " + std::strerror(errno));
+    }
+    try {
+        std::string text = read_all_fd(fd);
+        close(fd);
+        return text;
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+}
+
+// Interactive line reader: reads one line, and keeps reading while the text
+// ends in a backslash (manual "multiline" mode). Returns "" if nothing was entered.
+static std::string read_text_lines(std::istream& in) {
+    std::string userText;
+    std::string line;
+
+    // Read the first line; an empty first line is treated as no input
+    if (!std::getline(in, line) || line.empty()) return "";
+
+    // Start building userText with the first line
+    userText += line;
+
+    // If the user ends a line with a backslash '\',
+    // keep reading additional lines and append them.
+    while (!userText.empty() && userText.back() == '\\') {
+        // Remove the trailing backslash and add a newline
+        userText.pop_back();
+        userText += '\n';
+
+        if (!std::getline(in, line)) break;
+
+        // Stop if line is empty (user pressed Enter)
+        if (line.empty()) break;
+
+        // Append the newly read line
+        userText += line;
+    }
+
+    return userText;
+}
+
+// ======== CHUNK MEMOIZATION =========
+
+// Content-defined chunking (FastCDC, normalized) so that editing a few
+// paragraphs of a long note only changes the chunks around the edit. Cut
+// points depend on a rolling gear hash of the bytes, not on their offset.
+static const size_t kCdcMinChunk = 2 * 1024;
+static const size_t kCdcAvgChunk = 8 * 1024;
+static const size_t kCdcMaxChunk = 32 * 1024;
+
+static const std::array<uint64_t, 256>& gear_table() {
+    static const std::array<uint64_t, 256> table = [] {
+        std::array<uint64_t, 256> t;
+        for (size_t i = 0; i < t.size(); ++i) t[i] = mix64(0x6765617200000000ULL + i);
+        return t;
+    }();
+    return table;
+}
+
+// Length of the chunk starting at data[0] (n bytes remain). Uses a
+// stricter mask before the average size and a looser one after it, which
+// keeps chunk sizes close to the average.
+static size_t cdc_cut(const unsigned char* data, size_t n) {
+    if (n <= kCdcMinChunk) return n;
+    const std::array<uint64_t, 256>& gear = gear_table();
+    // 15 / 11 one-bits at the top of the hash (avg 8 KiB = 2^13)
+    const uint64_t maskSmall = ((1ULL << 15) - 1) << 49;
+    const uint64_t maskLarge = ((1ULL << 11) - 1) << 53;
+    size_t normal = std::min(kCdcAvgChunk, n);
+    size_t end = std::min(kCdcMaxChunk, n);
+
+    uint64_t fp = 0;
+    size_t i = kCdcMinChunk;
+    for (; i < normal; ++i) {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & maskSmall)) return i + 1;
+    }
+    for (; i < end; ++i) {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & maskLarge)) return i + 1;
+    }
+    return end;
+}
+
+// Bytes cdc_next() may look at: a maximal chunk plus the snap distance
+static const size_t kCdcWindow = kCdcMaxChunk + 256 + 4;
+
+// Length of the next chunk of text[0..n). The cut is moved forward to the
+// next whitespace (or at least off a UTF-8 continuation byte) so no word is
+// split between two prompts. Gives the same answer for any n >= kCdcWindow,
+// so a stream can be chunked through a window of that size.
+static size_t cdc_next(const char* text, size_t n) {
+    const auto* data = reinterpret_cast<const unsigned char*>(text);
+    size_t cut = cdc_cut(data, n);
+    size_t limit = std::min(n, cut + 256);
+    size_t snap = cut;
+    while (snap < limit && text[snap - 1] != '\n' && text[snap - 1] != ' ') ++snap;
+    if (snap == limit && snap < n) {
+        snap = cut;
+        while (snap < std::min(n, cut + 4) && (data[snap] & 0xC0) == 0x80) ++snap;
+    }
+    return snap;
+}
+
+// Splits text into content-defined chunks (see cdc_next)
+static std::vector<std::string> cdc_chunks(const std::string& text) {
+    std::vector<std::string> chunks;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t len = cdc_next(text.data() + pos, text.size() - pos);
+        chunks.push_back(text.substr(pos, len));
+        pos += len;
+    }
+    return chunks;
+}
+
+// The same chunks as cdc_chunks(), read incrementally from a file
+// descriptor, so a file of any size is chunked in O(kCdcWindow) memory
+class CdcReader {
+public:
+    explicit CdcReader(int fd) : fd_(fd) {}
+
+    // Next chunk; false at end of input
+    bool next(std::string& chunk) {
+        while (!eof_ && buf_.size() - pos_ < kCdcWindow) fill();
+        if (pos_ == buf_.size()) return false;
+        size_t len = cdc_next(buf_.data() + pos_, buf_.size() - pos_);
+        chunk.assign(buf_, pos_, len);
+        pos_ += len;
+        offset_ += len;
+        return true;
+    }
+
+    // Byte offset of the next chunk in the input
+    uint64_t offset() const { return offset_; }
+
+private:
+    void fill() {
+        buf_.erase(0, pos_);  // keep only the unread tail
+        pos_ = 0;
+        size_t used = buf_.size();
+        buf_.resize(used + kReadBlock);
+        ssize_t n;
+        do {
+            n = read(fd_, &buf_[used], kReadBlock);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) throw std::runtime_error(std::string("read() failed: ") + std::strerror(errno));
+        buf_.resize(used + (size_t)n);
+        if (n == 0) eof_ = true;
+    }
+
+    static const size_t kReadBlock = 256 * 1024;
+
+    int fd_;
+    std::string buf_;
+    size_t pos_ = 0;
+    uint64_t offset_ = 0;
+    bool eof_ = false;
+};
+
+// Somewhere to keep per-chunk results between runs, keyed by
+// ResultStore::key(kind, chunk text)
+class ResultStore {
+public:
+    // Bump when the prompts change so stale entries are ignored
+    static const int kMemoVersion = 1;
+
+    virtual ~ResultStore() {}
+
+    // Looks up a stored result; counts a hit or a miss
+    virtual bool load(const std::string& key, json& out) = 0;
+    virtual void store(const std::string& key, const json& value) = 0;
+
+    // Cache key for `text` used for `kind` ("summary", "flashcards", ...)
+    static std::string key(const std::string& kind, const std::string& text) {
+        std::string tag = kind + "/" + std::to_string(kMemoVersion) + "/";
+        uint64_t h1 = fnv1a64(text.data(), text.size(), fnv1a64(tag.data(), tag.size()));
+        uint64_t h2 = mix64(h1 ^ fnv1a64(text.data(), text.size(), 0x9e3779b97f4a7c15ULL));
+        char buf[40];
+        snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long)h1, (unsigned long long)h2);
+        return kind + "-" + buf;
+    }
+
+    size_t hits() const { return hits_; }
+    size_t misses() const { return misses_; }
+
+protected:
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+};
+
+// Per-chunk results on disk: one JSON file per (kind, chunk content)
+class ChunkMemo : public ResultStore {
+public:
+    explicit ChunkMemo(const std::string& dir) : dir_(dir) {
+        if (mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::runtime_error("Cannot create chunk cache " + dir_ + ": " + std::strerror(errno));
+        }
+    }
+
+    bool load(const std::string& key, json& out) override {
+        std::ifstream in(path(key));
+        if (in) {
+            json doc = json::parse(in, nullptr, false);
+            if (!doc.is_discarded()) {
+                out = doc;
+                ++hits_;
+                return true;
+            }
+        }
+        ++misses_;
+        return false;
+    }
+
+    // Written to a temp file and renamed, so a crash never leaves half an entry
+    void store(const std::string& key, const json& value) override {
+        std::string tmp = path(key) + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            out << value.dump();
+            if (!out) throw std::runtime_error("Cannot write chunk cache entry " + tmp);
+        }
+        if (std::rename(tmp.c_str(), path(key).c_str()) != 0) {
+            throw std::runtime_error("Cannot write chunk cache entry " + path(key));
+        }
+    }
+
+private:
+    std::string path(const std::string& key) const { return dir_ + "/" + key + ".json"; }
+
+    std::string dir_;
+};
+
+// CRC-32 (IEEE) for journal records, slicing-by-8 (little-endian hosts)
+static uint32_t crc32(const char* data, size_t len) {
+    static const std::vector<std::array<uint32_t, 256>> tables = [] {
+        std::vector<std::array<uint32_t, 256>> t(8);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int k = 1; k < 8; ++k) t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+        }
+        return t;
+    }();
+    const auto& t = tables;
+    uint32_t c = 0xFFFFFFFFu;
+    const auto* p = reinterpret_cast<const unsigned char*>(data);
+    for (; len >= 8; len -= 8, p += 8) {
+        uint32_t lo, hi;
+        std::memcpy(&lo, p, 4);
+        std::memcpy(&hi, p + 4, 4);
+        lo ^= c;
+        c = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+            t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+    for (; len > 0; --len, ++p) c = t[0][(c ^ *p) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+// Append-only write-ahead journal of results. Every result is written the
+// moment its request completes, so a crash loses nothing that was paid for
+// and a rerun resumes from the last committed record. fsync() is batched
+// (every kSyncEvery records or kSyncMs, and on close): a process crash
+// loses nothing, a power cut at most the last batch.
+//
+// File: "AIJ1", then records of [u32 length][u32 crc32][key '\0' JSON].
+// A torn or corrupt tail is cut off when the journal is opened.
+class ResultJournal : public ResultStore {
+public:
+    static const size_t kSyncEvery = 64;
+    static const int kSyncMs = 100;
+
+    explicit ResultJournal(const std::string& path) : path_(path) {
+        fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ < 0) throw std::runtime_error("Cannot open journal " + path + ": " + std::strerror(errno));
+
+        auto t0 = std::chrono::steady_clock::now();
+        log_ = read_all_fd(fd_);
+        size_t good = recover();
+        if (good != log_.size()) {
+            // Drop the torn tail so new records follow the last good one
+            if (ftruncate(fd_, (off_t)good) != 0) {
+                throw std::runtime_error("Cannot truncate journal " + path + ": " + std::strerror(errno));
+            }
+            dropped_ = log_.size() - good;
+            log_.resize(good);
+        }
+        if (good == 0) {
+            write_all(kMagic, 4);
+            log_ = kMagic;
+        }
+        lseek(fd_, 0, SEEK_END);
+        recoverSeconds_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    }
+
+    ~ResultJournal() {
+        if (fd_ < 0) return;
+        if (unsynced_ > 0) fdatasync(fd_);
+        close(fd_);
+    }
+
+    bool load(const std::string& key, json& out) override {
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            const char* body = &log_[it->second.first];
+            json doc = json::parse(body, body + it->second.second, nullptr, false);
+            if (!doc.is_discarded()) {
+                out = doc;
+                ++hits_;
+                return true;
+            }
+        }
+        ++misses_;
+        return false;
+    }
+
+    void store(const std::string& key, const json& value) override {
+        std::string body = value.dump();
+        std::string rec(8, '\0');
+        rec += key;
+        rec += '\0';
+        rec += body;
+        uint32_t len = (uint32_t)(rec.size() - 8), crc = crc32(&rec[8], len);
+        std::memcpy(&rec[0], &len, 4);
+        std::memcpy(&rec[4], &crc, 4);
+        write_all(rec.data(), rec.size()); // one write(): the record is in the page cache now
+        entries_[key] = {log_.size() + rec.size() - body.size(), body.size()};
+        log_ += rec;
+
+        auto now = std::chrono::steady_clock::now();
+        if (unsynced_++ == 0) firstUnsynced_ = now;
+        if (unsynced_ >= kSyncEvery || now - firstUnsynced_ >= std::chrono::milliseconds(kSyncMs)) sync();
+    }
+
+    // Forces everything written so far to stable storage
+    void sync() {
+        if (unsynced_ == 0) return;
+        if (fdatasync(fd_) != 0) throw std::runtime_error("fdatasync failed on journal " + path_);
+        unsynced_ = 0;
+        ++syncs_;
+    }
+
+    size_t recovered() const { return recovered_; }
+    size_t dropped_bytes() const { return dropped_; }
+    double recover_seconds() const { return recoverSeconds_; }
+    size_t syncs() const { return syncs_; }
+
+private:
+    static constexpr const char* kMagic = "AIJ1";
+
+    // Indexes every intact record in log_; returns the length of the valid prefix
+    size_t recover() {
+        const std::string& data = log_;
+        if (data.empty()) return 0;
+        if (data.size() < 4 || data.compare(0, 4, kMagic) != 0) {
+            throw std::runtime_error(path_ + " is not a results journal");
+        }
+        size_t pos = 4;
+        while (pos + 8 <= data.size()) {
+            uint32_t len, crc;
+            std::memcpy(&len, &data[pos], 4);
+            std::memcpy(&crc, &data[pos + 4], 4);
+            if (len > data.size() - pos - 8) break;              // torn write
+            const char* payload = &data[pos + 8];
+            if (crc32(payload, len) != crc) break;               // corrupt
+            const char* sep = static_cast<const char*>(std::memchr(payload, '\0', len));
+            if (!sep) break;
+            size_t bodyStart = (size_t)(sep + 1 - data.data());
+            entries_[std::string(payload, sep)] = {bodyStart, pos + 8 + len - bodyStart};
+            ++recovered_;
+            pos += 8 + len;
+        }
+        return pos;
+    }
+
+    void write_all(const char* p, size_t n) {
+        while (n > 0) {
+            ssize_t w = write(fd_, p, n);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error("Cannot append to journal " + path_ + ": " + std::strerror(errno));
+            }
+            p += w;
+            n -= (size_t)w;
+        }
+    }
+
+    std::string path_;
+    int fd_ = -1;
+    std::string log_;                                    // the journal's bytes, as on disk
+    std::unordered_map<std::string, std::pair<size_t, size_t>> entries_; // key -> JSON (offset, length) in log_
+    size_t unsynced_ = 0;
+    std::chrono::steady_clock::time_point firstUnsynced_;
+    size_t syncs_ = 0;
+    size_t recovered_ = 0;
+    size_t dropped_ = 0;
+    double recoverSeconds_ = 0;
+};
+
+static json summary_to_json(const SummaryResult& s) {
+    json j = {{"summary", s.summary}, {"key_points", s.keyPoints}, {"definitions", json::array()}};
+    for (const auto& d : s.definitions) {
+        j["definitions"].push_back({{"term", d.term}, {"definition", d.definition}});
+    }
+    if (s.offline) j["offline"] = true;
+    return j;
+}
+
+static json flashcards_to_json(const FlashcardResult& f) {
+    json j = {{"flashcards", json::array()}};
+    for (const auto& c : f.flashcards) {
+        j["flashcards"].push_back({{"question", c.question}, {"answer", c.answer}});
+    }
+    if (f.offline) j["offline"] = true;
+    return j;
+}
+
+// Memo keys for one chunk: [0] summary (or combined), [1] flashcards.
+// `combined` only applies when both are wanted.
+static std::array<std::string, 2> chunk_keys(const std::string& chunk, bool wantSummary,
+                                             bool wantCards, bool combined) {
+    std::array<std::string, 2> keys;
+    if (combined) {
+        keys[0] = ResultStore::key("combined", chunk);
+        return keys;
+    }
+    if (wantSummary) keys[0] = ResultStore::key("summary", chunk);
+    if (wantCards) keys[1] = ResultStore::key("flashcards", chunk);
+    return keys;
+}
+
+// Results for one chunk as JSON (summary fields and/or "flashcards"),
+// from `memo` when it has them, otherwise from the API (and then stored;
+// results made offline are not, so a later run asks the API again)
+static json study_chunk(const std::string& chunk, const std::array<std::string, 2>& keys,
+                        bool wantSummary, bool wantCards, bool combined, ResultStore& memo) {
+    json result = json::object(), entry;
+    if (combined) {
+        if (memo.load(keys[0], entry)) return entry;
+        SummaryResult s;
+        FlashcardResult f;
+        summarize_and_generate(chunk, s, f);
+        result = summary_to_json(s);
+        result["flashcards"] = flashcards_to_json(f)["flashcards"];
+        if (!s.offline) memo.store(keys[0], result);
+        return result;
+    }
+    if (wantSummary) {
+        if (!memo.load(keys[0], entry)) {
+            entry = summary_to_json(summarize_content(chunk));
+            if (!entry.value("offline", false)) memo.store(keys[0], entry);
+        }
+        result = entry;
+    }
+    if (wantCards) {
+        if (!memo.load(keys[1], entry)) {
+            entry = flashcards_to_json(generate_flashcards(chunk));
+            if (!entry.value("offline", false)) memo.store(keys[1], entry);
+        }
+        result["flashcards"] = entry["flashcards"];
+        if (entry.value("offline", false)) result["offline"] = true;
+    }
+    return result;
+}
+
+// Summary and/or flashcards for `text`, worked out per content-defined
+// chunk with results memoized in `memo`: a rerun after an edit (or after a
+// crash, with a journal) only sends the chunks that have no result yet.
+// Per-chunk cards are concatenated; per-chunk summaries are merged by one
+// more (also memoized) summary request.
+static void memoized_study(const std::string& text, bool wantSummary, bool wantCards,
+                           bool combined, ResultStore& memo, SummaryResult& summary,
+                           FlashcardResult& cards) {
+    std::vector<std::string> chunks = cdc_chunks(text);
+    std::vector<SummaryResult> partSummaries;
+    combined = combined && wantSummary && wantCards;
+
+    // Hash every chunk up front (a rerun of a long text is mostly lookups)
+    std::vector<std::array<std::string, 2>> keys(chunks.size());
+    parallel_for(task_pool(), chunks.size(), 4, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; ++c) keys[c] = chunk_keys(chunks[c], wantSummary, wantCards, combined);
+    });
+
+    for (size_t c = 0; c < chunks.size(); ++c) {
+        json result = study_chunk(chunks[c], keys[c], wantSummary, wantCards, combined, memo);
+        if (wantSummary) partSummaries.push_back(parse_summary(result));
+        if (wantCards) {
+            FlashcardResult f = parse_flashcards(result);
+            cards.flashcards.insert(cards.flashcards.end(), f.flashcards.begin(), f.flashcards.end());
+            cards.offline = cards.offline || f.offline;
+        }
+    }
+
+    if (!wantSummary) return;
+    if (partSummaries.size() == 1) {
+        summary = partSummaries[0];
+        return;
+    }
+    // Merge the section summaries into one
+    std::string merged = "The study text was long, so here are summaries of its sections in order.\n";
+    for (size_t i = 0; i < partSummaries.size(); ++i) {
+        const SummaryResult& p = partSummaries[i];
+        merged += "\nSECTION " + std::to_string(i + 1) + ":\n" + p.summary + "\n";
+        for (const auto& kp : p.keyPoints) merged += "- " + kp + "\n";
+        for (const auto& d : p.definitions) merged += d.term + ": " + d.definition + "\n";
+    }
+    std::string k = ResultStore::key("merge", merged);
+    json entry;
+    if (memo.load(k, entry)) {
+        summary = parse_summary(entry);
+    } else {
+        summary = summarize_content(merged);
+        if (!summary.offline) memo.store(k, summary_to_json(summary));
+    }
+    for (const auto& p : partSummaries) summary.offline = summary.offline || p.offline;
+}
+
+// ======== DAEMON MODE =========
+
+// `--serve SOCKET` keeps one process running with warm connections, loaded
+// routing rules and a resident result cache; `--daemon SOCKET` hands the
+// job to it instead of calling the API itself.
+//
+// Protocol (Unix stream socket, any number of jobs per connection): every
+// message is a frame of [u32 body length, little-endian][u8 type][body].
+// Requests: 'S' summary, 'F' flashcards, 'B' both, 'C' both from one
+// combined request; the body is the study text. Replies: 'R' with the
+// result JSON ({summary, key_points, definitions, flashcards}) or 'E' with
+// an error message.
+
+static const uint32_t kMaxFrame = 256u << 20;
+
+// Reads exactly n bytes; false on EOF or error
+static bool read_exact(int fd, char* p, size_t n) {
+    while (n > 0) {
+        ssize_t got = read(fd, p, n);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        p += got;
+        n -= (size_t)got;
+    }
+    return true;
+}
+
+static void write_frame(int fd, char type, const std::string& body) {
+    if (body.size() > kMaxFrame) throw std::runtime_error("daemon: message too large");
+    uint32_t len = (uint32_t)body.size();
+    char header[5] = {(char)(len & 0xff), (char)((len >> 8) & 0xff), (char)((len >> 16) & 0xff),
+                      (char)(len >> 24), type};
+    // Header and body in one syscall: small frames go out as one segment
+    struct iovec iov[2] = {{header, sizeof(header)}, {(void*)body.data(), body.size()}};
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    size_t left = sizeof(header) + body.size();
+    while (left > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) throw std::runtime_error(std::string("daemon: write failed: ") + std::strerror(errno));
+        left -= (size_t)n;
+        for (auto& v : iov) {  // skip what was sent
+            size_t used = std::min((size_t)n, v.iov_len);
+            v.iov_base = (char*)v.iov_base + used;
+            v.iov_len -= used;
+            n -= (ssize_t)used;
+        }
+    }
+}
+
+// Reads one frame; false on a clean EOF before its header
+static bool read_frame(int fd, char& type, std::string& body) {
+    unsigned char header[5];
+    if (!read_exact(fd, (char*)header, sizeof(header))) return false;
+    uint32_t len = header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24);
+    if (len > kMaxFrame) throw std::runtime_error("daemon: frame too large");
+    type = (char)header[4];
+    body.resize(len);
+    if (!read_exact(fd, &body[0], len)) throw std::runtime_error("daemon: connection closed mid-frame");
+    return true;
+}
+
+static struct sockaddr_un unix_address(const std::string& path) {
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) throw std::runtime_error("Socket path too long: " + path);
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return addr;
+}
+
+// Request frame type for a mode (1/2/3) and --combined
+static char job_type(int mode, bool combined) {
+    return mode == 1 ? 'S' : mode == 2 ? 'F' : combined ? 'C' : 'B';
+}
+
+// The daemon's result cache: in memory, shared by all connections, and
+// written through to --chunk-cache / --journal when one is given
+class ResidentStore : public ResultStore {
+public:
+    static const size_t kMaxEntries = 4096;
+
+    explicit ResidentStore(ResultStore* backing) : backing_(backing) {}
+
+    bool load(const std::string& key, json& out) override {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            out = it->second;
+            ++hits_;
+            return true;
+        }
+        if (backing_ && backing_->load(key, out)) {
+            insert(key, out);
+            ++hits_;
+            return true;
+        }
+        ++misses_;
+        return false;
+    }
+
+    void store(const std::string& key, const json& value) override {
+        std::lock_guard<std::mutex> lock(mu_);
+        insert(key, value);
+        if (backing_) backing_->store(key, value);
+    }
+
+    size_t lookups() {
+        std::lock_guard<std::mutex> lock(mu_);
+        return hits_ + misses_;
+    }
+
+private:
+    // Oldest entries go first once the cache is full
+    void insert(const std::string& key, const json& value) {
+        if (!entries_.emplace(key, value).second) return;
+        order_.push_back(key);
+        if (order_.size() > kMaxEntries) {
+            entries_.erase(order_.front());
+            order_.pop_front();
+        }
+    }
+
+    ResultStore* backing_;
+    std::mutex mu_;
+    std::unordered_map<std::string, json> entries_;
+    std::deque<std::string> order_;
+};
+
+// Serves study jobs on a Unix socket, one thread per client connection
+class StudyDaemon {
+public:
+    StudyDaemon(const std::string& path, ResultStore* backing) : path_(path), memo_(backing) {
+        struct sockaddr_un addr = unix_address(path);
+        listenFd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listenFd_ < 0) throw std::runtime_error("daemon: socket() failed");
+
+        // A socket file nobody answers on is left over from a crash
+        if (connect(listenFd_, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            close(listenFd_);
+            throw std::runtime_error("A daemon is already serving " + path);
+        }
+        close(listenFd_);
+        struct stat st;
+        if (lstat(path.c_str(), &st) == 0) {
+            // Never remove anything but a socket (e.g. a mistyped notes file)
+            if (!S_ISSOCK(st.st_mode)) throw std::runtime_error("daemon: " + path + " exists and is not a socket");
+            unlink(path.c_str());
+        } else if (errno != ENOENT) {
+            throw std::runtime_error("daemon: cannot check " + path + ": " + std::strerror(errno));
+        }
+
+        listenFd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        mode_t oldMask = umask(077);  // study text is private: owner-only socket
+        int rc = bind(listenFd_, (struct sockaddr*)&addr, sizeof(addr));
+        umask(oldMask);
+        if (rc != 0 || listen(listenFd_, 64) != 0) {
+            close(listenFd_);
+            throw std::runtime_error("daemon: cannot listen on " + path + ": " + std::strerror(errno));
+        }
+        if (pipe2(stop_, O_CLOEXEC) != 0) {
+            close(listenFd_);
+            throw std::runtime_error("daemon: pipe2() failed");
+        }
+    }
+
+    ~StudyDaemon() {
+        close(listenFd_);
+        unlink(path_.c_str());
+        close(stop_[0]);
+        close(stop_[1]);
+    }
+
+    // Accepts clients until stop() or Ctrl-C / SIGTERM, then waits for the
+    // jobs in flight (which Ctrl-C cancels)
+    void serve() {
+        while (!g_interrupted.load()) {
+            struct pollfd fds[2] = {{listenFd_, POLLIN, 0}, {stop_[0], POLLIN, 0}};
+            // Signals may land on a client thread: look at the flag regularly
+            int ready = poll(fds, 2, 250);
+            if (ready < 0 && errno != EINTR) break;
+            if (ready <= 0) continue;
+            if (fds[1].revents) break;
+            int fd = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) continue;
+
+            std::lock_guard<std::mutex> lock(mu_);
+            clients_.push_back(fd);
+            std::thread([this, fd] { serve_client(fd); }).detach();
+        }
+
+        // Wake clients blocked waiting for their next job
+        std::unique_lock<std::mutex> lock(mu_);
+        for (int fd : clients_) shutdown(fd, SHUT_RD);
+        done_.wait(lock, [this] { return clients_.empty(); });
+    }
+
+    void stop() {
+        char b = 1;
+        if (write(stop_[1], &b, 1) < 0) {}
+    }
+
+    size_t jobs() const { return jobs_.load(); }
+    ResidentStore& cache() { return memo_; }
+
+private:
+    void serve_client(int fd) {
+        try {
+            char type;
+            std::string text;
+            while (read_frame(fd, type, text)) {
+                std::string reply;
+                char replyType = 'R';
+                try {
+                    reply = run_job(type, text).dump();
+                } catch (const std::exception& ex) {
+                    replyType = 'E';
+                    reply = ex.what();
+                }
+                ++jobs_;
+                write_frame(fd, replyType, reply);
+            }
+        } catch (const std::exception&) {
+            // Client went away or sent garbage: drop the connection
+        }
+        close(fd);
+        std::lock_guard<std::mutex> lock(mu_);
+        clients_.erase(std::find(clients_.begin(), clients_.end(), fd));
+        if (clients_.empty()) done_.notify_all();
+    }
+
+    json run_job(char type, const std::string& text) {
+        if (type != 'S' && type != 'F' && type != 'B' && type != 'C') {
+            throw std::runtime_error(std::string("unknown job type '") + type + "'");
+        }
+        SummaryResult s;
+        FlashcardResult f;
+        memoized_study(text, type != 'F', type != 'S', type == 'C', memo_, s, f);
+        json result = summary_to_json(s);
+        result["flashcards"] = flashcards_to_json(f)["flashcards"];
+        if (f.offline) result["offline"] = true;
+        return result;
+    }
+
+    std::string path_;
+    ResidentStore memo_;
+    int listenFd_ = -1;
+    int stop_[2] = {-1, -1};
+    std::mutex mu_;
+    std::condition_variable done_;
+    std::vector<int> clients_;
+    std::atomic<size_t> jobs_{0};
+};
+
+// Client side: connects to a daemon (reused for several jobs)
+class DaemonClient {
+public:
+    explicit DaemonClient(const std::string& path) {
+        struct sockaddr_un addr = unix_address(path);
+        fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd_ < 0 || connect(fd_, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            std::string why = std::strerror(errno);
+            if (fd_ >= 0) close(fd_);
+            throw std::runtime_error("Cannot reach the daemon at " + path + ": " + why +
+                                     " (start one with --serve " + path + ")");
+        }
+    }
+    ~DaemonClient() { close(fd_); }
+    DaemonClient(const DaemonClient&) = delete;
+    DaemonClient& operator=(const DaemonClient&) = delete;
+
+    // Runs one job (see job_type) and fills whichever results it produced
+    void study(char type, const std::string& text, SummaryResult& summary, FlashcardResult& cards) {
+        write_frame(fd_, type, text);
+        char replyType;
+        std::string body;
+        if (!read_frame(fd_, replyType, body)) throw std::runtime_error("The daemon closed the connection");
+        if (replyType == 'E') throw std::runtime_error(body);
+        json result = json::parse(body);
+        if (type != 'F') summary = parse_summary(result);
+        if (type != 'S') cards = parse_flashcards(result);
+    }
+
+private:
+    int fd_ = -1;
+};
+
+// Runs --serve until Ctrl-C / SIGTERM
+static void run_daemon(const std::string& path, ResultStore* backing, bool showStats) {
+    InterruptGuard interruptGuard;
+    struct sigaction sa, savedTerm;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigint;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, &savedTerm);
+
+    StudyDaemon daemon(path, backing);
+    std::cerr << "Serving study jobs on " << path << " (Ctrl-C to stop)\n";
+    daemon.serve();
+    sigaction(SIGTERM, &savedTerm, nullptr);
+
+    ResidentStore& cache = daemon.cache();
+    std::cerr << "Daemon stopped after " << daemon.jobs() << " jobs\n";
+    if (showStats) {
+        std::cerr << "chunk results: " << cache.hits() << " of " << cache.lookups()
+                  << " lookups reused\n";
+        model_router().report(std::cerr);
+    }
+}
+
+// ======== BATCH PIPELINE =========
+
+// `--batch LIST` studies every file named in LIST as a stream of
+// content-defined chunks through three stages joined by bounded queues:
+//
+//   reader thread -> chunks -> N network workers -> results -> writer
+//
+// A full queue stops the stage feeding it (or, with --shed, the reader
+// drops chunks and reports them), so memory stays flat however large the
+// corpus is. Output is one JSON line per chunk, in completion order.
+
+struct BatchItem {
+    uint32_t file = 0;
+    uint64_t index = 0;   // chunk number within the file
+    uint64_t offset = 0;  // byte offset within the file
+    size_t bytes = 0;
+    std::string text;     // the chunk (dropped once worked on)
+    std::string result;   // JSON object text from the work stage
+    std::string error;
+    bool shed = false;
+};
+
+struct PipelineStats {
+    uint64_t chunks = 0;
+    uint64_t bytes = 0;
+    uint64_t shed = 0;
+    uint64_t failed = 0;
+    double seconds = 0;
+};
+
+// Runs produce() on a reader thread, work() on `workers` threads and emit()
+// on the calling thread until produce() returns false. Items produced with
+// an error skip the work stage. An exception from produce() stops the
+// pipeline and is rethrown once it has drained; one from emit() stops every
+// stage at once and is rethrown once the threads have been joined.
+static PipelineStats run_pipeline(const std::function<bool(BatchItem&)>& produce,
+                                  const std::function<void(BatchItem&)>& work,
+                                  const std::function<void(const BatchItem&)>& emit,
+                                  size_t workers, bool shed) {
+    workers = std::max<size_t>(workers, 1);
+    MpmcQueue<BatchItem> chunks(2 * workers);
+    MpmcQueue<BatchItem> results(4 * workers);
+    std::exception_ptr readError;
+    std::atomic<size_t> working{workers};
+    std::atomic<bool> stop{false};
+    auto t0 = std::chrono::steady_clock::now();
+
+    std::thread reader([&] {
+        try {
+            BatchItem item;
+            while (!g_interrupted.load() && !stop.load() && produce(item)) {
+                if (!shed) {
+                    chunks.push(std::move(item));
+                } else if (!chunks.try_push(item)) {
+                    item.text.clear();
+                    item.text.shrink_to_fit();
+                    item.shed = true;
+                    results.push(std::move(item));
+                }
+                item = BatchItem();
+            }
+        } catch (...) {
+            readError = std::current_exception();
+        }
+        chunks.close();
+    });
+
+    std::vector<std::thread> pool;
+    for (size_t w = 0; w < workers; ++w) {
+        pool.emplace_back([&] {
+            BatchItem item;
+            while (chunks.pop(item)) {
+                try {
+                    if (item.error.empty() && !stop.load()) work(item);
+                } catch (const std::exception& ex) {
+                    item.error = ex.what();
+                }
+                item.text.clear();
+                item.text.shrink_to_fit();
+                results.push(std::move(item));
+            }
+            if (--working == 0) results.close();
+        });
+    }
+
+    PipelineStats stats;
+    BatchItem item;
+    std::exception_ptr emitError;
+    try {
+        while (results.pop(item)) {
+            ++stats.chunks;
+            stats.bytes += item.bytes;
+            if (item.shed) ++stats.shed;
+            if (!item.error.empty()) ++stats.failed;
+            emit(item);
+        }
+    } catch (...) {
+        // Closing both queues releases a reader or worker blocked on a
+        // full one; the threads must finish before they can be destroyed
+        emitError = std::current_exception();
+        stop = true;
+        chunks.close();
+        results.close();
+    }
+    reader.join();
+    for (auto& t : pool) t.join();
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    if (emitError) std::rethrow_exception(emitError);
+    if (readError) std::rethrow_exception(readError);
+    return stats;
+}
+
+// Peak resident memory of this process so far, in MiB
+static double peak_rss_mib() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss / 1024.0;
+}
+
+// The paths listed in `listPath`, one per line ("-" = stdin)
+static std::vector<std::string> read_batch_list(const std::string& listPath) {
+    std::vector<std::string> files;
+    std::ifstream listFile;
+    if (listPath != "-") {
+        listFile.open(listPath);
+        if (!listFile) throw std::runtime_error("Cannot open batch list " + listPath);
+    }
+    std::istream& list = listPath == "-" ? std::cin : listFile;
+    std::string line;
+    while (std::getline(list, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (!line.empty()) files.push_back(line);
+    }
+    return files;
+}
+
+// --batch: paths come from `listPath` (one per line, "-" = stdin); results
+// go to `out` as JSON lines
+static PipelineStats run_batch(const std::string& listPath, int mode, bool combined, size_t workers,
+                               bool shed, ResultStore& memo, std::ostream& out) {
+    std::vector<std::string> files = read_batch_list(listPath);
+
+    bool wantSummary = mode != 2, wantCards = mode != 1;
+    combined = combined && wantSummary && wantCards;
+
+    // Reader state: the open file and its chunker
+    size_t nextFile = 0;
+    int fd = -1;
+    std::unique_ptr<CdcReader> chunker;
+    uint64_t index = 0;
+    auto produce = [&](BatchItem& item) {
+        while (true) {
+            if (chunker) {
+                uint64_t offset = chunker->offset();
+                if (chunker->next(item.text)) {
+                    item.offset = offset;
+                    item.file = (uint32_t)(nextFile - 1);
+                    item.index = index++;
+                    item.bytes = item.text.size();
+                    return true;
+                }
+                chunker.reset();
+                close(fd);
+            }
+            if (nextFile == files.size()) return false;
+            fd = open(files[nextFile].c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                // Reported on the file's line; the rest of the batch goes on
+                item.file = (uint32_t)nextFile++;
+                item.error = std::string("cannot open: ") + std::strerror(errno);
+                return true;
+            }
+            ++nextFile;
+            chunker.reset(new CdcReader(fd));
+            index = 0;
+        }
+    };
+
+    auto work = [&](BatchItem& item) {
+        json result = study_chunk(item.text, chunk_keys(item.text, wantSummary, wantCards, combined),
+                                  wantSummary, wantCards, combined, memo);
+        item.result = result.dump();
+    };
+
+    auto emit = [&](const BatchItem& item) {
+        json line = {{"file", files[item.file]}, {"chunk", item.index}, {"offset", item.offset},
+                     {"bytes", item.bytes}};
+        if (item.shed) line["shed"] = true;
+        else if (!item.error.empty()) line["error"] = item.error;
+        else line["result"] = json::parse(item.result);
+        out << line.dump() << '\n';
+    };
+
+    try {
+        PipelineStats stats = run_pipeline(produce, work, emit, workers, shed);
+        if (chunker) close(fd);
+        out.flush();
+        return stats;
+    } catch (...) {
+        if (chunker) close(fd);
+        throw;
+    }
+}
+
+// ======== BULK SUBMISSION =========
+
+// `--batch LIST --bulk` sends the same per-chunk requests through the
+// Batch API instead of one synchronous call each: they are written as
+// JSONL request lines, uploaded (POST /files), submitted (POST /batches)
+// and polled (GET /batches/ID) until done; the results file (GET
+// /files/ID/content) is parsed as it downloads into the same summary and
+// flashcard JSON that --batch prints. Batch requests are billed at a
+// discount and finish within 24 hours, which suits overnight runs over a
+// large corpus. Chunks whose results are memoized are printed at once and
+// not submitted.
+//
+// Each request's custom_id is "file:chunk:offset:bytes:memo key", so a
+// result can be matched to its chunk without any saved state:
+// `--bulk-resume ID,...` with the same LIST collects batches that an
+// earlier run submitted (--bulk-detach, or one interrupted while waiting).
+
+struct BulkOptions {
+    double pollSeconds = 30;              // between status checks
+    size_t maxRequests = 50000;           // per batch (the API's limit)
+    size_t maxBytes = 190u << 20;         // per uploaded file (the API allows 200 MB)
+    bool detach = false;                  // submit, then return without waiting
+    std::vector<std::string> resume;      // batch ids to collect instead of submitting
+};
+
+using CurlHeaders = std::unique_ptr<curl_slist, decltype(&curl_slist_free_all)>;
+
+// Authorization (and Content-Type, if given) headers for an API call
+static CurlHeaders api_headers(const char* contentType) {
+    const char* envKey = std::getenv("OPENAI_API_KEY");
+    if (!envKey) throw std::runtime_error("OPENAI_API_KEY environment variable not set.");
+    std::string authHeader = std::string("Authorization: Bearer ") + envKey;
+    curl_slist* list = curl_slist_append(nullptr, authHeader.c_str());
+    if (contentType) list = curl_slist_append(list, (std::string("Content-Type: ") + contentType).c_str());
+    return CurlHeaders(list, curl_slist_free_all);
+}
+
+// A transfer to or from the bulk endpoints. Uploads and downloads can be
+// large, so there is no overall time limit: it fails when under 1 byte/s
+// moves for a minute (or the idle limit, if set, passes first).
+static CurlHandle make_bulk_handle(const std::string& url, curl_slist* headers, TransferWatch* watch) {
+    CurlHandle curl(curl_easy_init(), curl_easy_cleanup);
+    if (!curl) throw std::runtime_error("Failed to init curl");
+    const HttpPolicy& policy = http_policy();
+    curl_easy_setopt(curl.get(), CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl.get(), CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl.get(), CURLOPT_SHARE, CurlShare::get());
+    curl_easy_setopt(curl.get(), CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl.get(), CURLOPT_CONNECTTIMEOUT_MS, policy.connectTimeoutMs);
+    curl_easy_setopt(curl.get(), CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(curl.get(), CURLOPT_LOW_SPEED_TIME, 60L);
+    watch->cancel = t_cancelFlag;
+    watch->idleTimeoutMs = policy.idleTimeoutMs;
+    curl_easy_setopt(curl.get(), CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl.get(), CURLOPT_XFERINFOFUNCTION, CancelCallback);
+    curl_easy_setopt(curl.get(), CURLOPT_XFERINFODATA, watch);
+    return curl;
+}
+
+// Runs a bulk transfer with the usual metrics and error checks. `label`
+// is the path in the metrics, without ids.
+static void perform_bulk(CURL* curl, const std::string& label, size_t bytesSent, const std::string& response,
+                         const TransferWatch& watch, const std::function<size_t()>& bytesReceived) {
+    EndpointMetrics& m = endpoint_metrics(label);
+    m.requests.inc();
+    m.bytesSent.inc(bytesSent);
+    auto t0 = std::chrono::steady_clock::now();
+    try {
+        CURLcode res = curl_easy_perform(curl);
+        check_transfer(curl, res, response, watch);
+    } catch (const ApiError& ex) {
+        m.error(ex.kind).inc();
+        throw;
+    }
+    m.latency.record((uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - t0).count());
+    m.bytesReceived.inc(bytesReceived());
+}
+
+// GET of an API path; a successful response body is handed to onData as
+// it arrives (an exception from onData aborts the transfer and is rethrown)
+static void openai_get(const std::string& path, const std::string& label,
+                       const std::function<void(const char*, size_t)>& onData) {
+    struct Sink {
+        CURL* curl;
+        const std::function<void(const char*, size_t)>* onData;
+        std::string errorBody;  // the body of a non-2xx response
+        size_t bytes = 0;
+        std::exception_ptr error;
+    };
+    CurlHeaders headers = api_headers(nullptr);
+    std::string url = openai_url(path);
+    TransferWatch watch;
+    CurlHandle curl = make_bulk_handle(url, headers.get(), &watch);
+    Sink sink;
+    sink.curl = curl.get();
+    sink.onData = &onData;
+    auto write = [](char* data, size_t size, size_t nmemb, void* userp) -> size_t {
+        Sink* s = static_cast<Sink*>(userp);
+        long status = 0;
+        curl_easy_getinfo(s->curl, CURLINFO_RESPONSE_CODE, &status);
+        s->bytes += size * nmemb;
+        if (status < 200 || status >= 300) {
+            if (s->errorBody.size() < 4096) s->errorBody.append(data, size * nmemb);
+            return size * nmemb;
+        }
+        try {
+            (*s->onData)(data, size * nmemb);
+        } catch (...) {
+            s->error = std::current_exception();
+            return 0;  // aborts the transfer
+        }
+        return size * nmemb;
+    };
+    curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, static_cast<size_t (*)(char*, size_t, size_t, void*)>(write));
+    curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &sink);
+    try {
+        perform_bulk(curl.get(), label, 0, sink.errorBody, watch, [&] { return sink.bytes; });
+    } catch (...) {
+        if (sink.error) std::rethrow_exception(sink.error);
+        throw;
+    }
+}
+
+static std::string openai_get(const std::string& path, const std::string& label) {
+    std::string body;
+    openai_get(path, label, [&](const char* data, size_t n) { body.append(data, n); });
+    return body;
+}
+
+// Uploads a file (POST /files, multipart) for `purpose`; returns its id
+static std::string openai_upload(const std::string& filePath, const char* purpose) {
+    CurlHeaders headers = api_headers(nullptr);
+    std::string url = openai_url("/files"), response;
+    TransferWatch watch;
+    CurlHandle curl = make_bulk_handle(url, headers.get(), &watch);
+    std::unique_ptr<curl_mime, decltype(&curl_mime_free)> mime(curl_mime_init(curl.get()), curl_mime_free);
+    curl_mimepart* part = curl_mime_addpart(mime.get());
+    curl_mime_name(part, "purpose");
+    curl_mime_data(part, purpose, CURL_ZERO_TERMINATED);
+    part = curl_mime_addpart(mime.get());
+    curl_mime_name(part, "file");
+    if (curl_mime_filedata(part, filePath.c_str()) != CURLE_OK) throw std::runtime_error("Cannot read " + filePath);
+    curl_mime_filename(part, "requests.jsonl");
+    curl_easy_setopt(curl.get(), CURLOPT_MIMEPOST, mime.get());
+    curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &response);
+    struct stat st;
+    size_t size = stat(filePath.c_str(), &st) == 0 ? (size_t)st.st_size : 0;
+    perform_bulk(curl.get(), "/files", size, response, watch, [&] { return response.size(); });
+    return json::parse(response).at("id").get<std::string>();
+}
+
+// One of a chunk's results, as study_chunk() would store it, from the
+// Chat Completions response `body` for a request of `kind`
+static json bulk_result_part(const std::string& kind, const json& body) {
+    json reply = json::parse(extract_json_block(chat_message_content(body)));
+    if (kind == "flashcards") return flashcards_to_json(parse_flashcards(reply));
+    json part = summary_to_json(parse_summary(reply));
+    if (kind == "combined") part["flashcards"] = flashcards_to_json(parse_flashcards(reply))["flashcards"];
+    return part;
+}
+
+// The Batch API request line for one of a chunk's results; `key` is its
+// memo key, whose prefix names the kind of request
+static std::string bulk_request_line(const std::string& customId, const std::string& key, const std::string& text) {
+    std::string kind = key.substr(0, key.find('-'));
+    const char* instructions = kind == "summary"      ? kSummaryInstructions
+                               : kind == "flashcards" ? kFlashcardInstructions
+                                                      : kCombinedInstructions;
+    ChatTask task = kind == "summary" ? ChatTask::kSummary
+                    : kind == "flashcards" ? ChatTask::kFlashcards : ChatTask::kCombined;
+    std::string userContent = "TEXT:\n" + text;
+    RouteChoice choice = model_router().route(task, estimate_tokens(instructions) + estimate_tokens(userContent));
+    json line = {{"custom_id", customId},
+                 {"method", "POST"},
+                 {"url", "/v1/chat/completions"},
+                 {"body", chat_request_body(instructions, userContent, choice)}};
+    return line.dump();
+}
+
+// Waits `seconds`; throws if interrupted meanwhile
+static void bulk_sleep(double seconds) {
+    auto until = std::chrono::steady_clock::now() +
+                 std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    for (auto now = std::chrono::steady_clock::now(); now < until; now = std::chrono::steady_clock::now()) {
+        if (g_interrupted.load()) throw ApiError("cancelled", "Interrupted");
+        std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(std::chrono::milliseconds(100), until - now));
+    }
+}
+
+// --batch with --bulk: as run_batch(), through the Batch API
+static PipelineStats run_bulk(const std::string& listPath, int mode, bool combined, const BulkOptions& opts,
+                              ResultStore& memo, std::ostream& out) {
+    std::vector<std::string> files = read_batch_list(listPath);
+    bool wantSummary = mode != 2, wantCards = mode != 1;
+    combined = combined && wantSummary && wantCards;
+    const int parts = combined ? 1 : (int)wantSummary + (int)wantCards;
+    auto t0 = std::chrono::steady_clock::now();
+
+    // A chunk waiting for its results
+    struct Chunk {
+        uint32_t file = 0;
+        uint64_t index = 0, offset = 0;
+        size_t bytes = 0;
+        int partsLeft = 0;
+        json result = json::object();
+        std::string error;
+    };
+    PipelineStats stats;
+    auto emit = [&](const Chunk& c) {
+        json line = {{"file", files[c.file]}, {"chunk", c.index}, {"offset", c.offset}, {"bytes", c.bytes}};
+        if (!c.error.empty()) {
+            line["error"] = c.error;
+            ++stats.failed;
+        } else {
+            line["result"] = c.result;
+        }
+        out << line.dump() << '\n';
+        ++stats.chunks;
+        stats.bytes += c.bytes;
+    };
+    auto merge = [](json& result, const json& part) {
+        for (auto it = part.begin(); it != part.end(); ++it) result[it.key()] = it.value();
+    };
+    std::unordered_map<std::string, Chunk> pending;  // by "file:chunk"
+    std::vector<std::string> batchIds = opts.resume;
+    auto joined = [](const std::vector<std::string>& items, const char* sep) {
+        std::string s;
+        for (const auto& item : items) s += (s.empty() ? "" : sep) + item;
+        return s;
+    };
+
+    if (batchIds.empty()) {
+        // Request lines are spooled to a temp file, which is uploaded and
+        // submitted whenever it reaches the per-batch limits
+        std::string spoolPath;
+        std::ofstream spool;
+        size_t spoolRequests = 0, spoolBytes = 0, requests = 0;
+        auto submit = [&] {
+            spool.close();
+            if (!spool) throw std::runtime_error("Cannot write " + spoolPath);
+            std::string fileId;
+            try {
+                fileId = openai_upload(spoolPath, "batch");
+            } catch (...) {
+                unlink(spoolPath.c_str());
+                throw;
+            }
+            unlink(spoolPath.c_str());
+            json request = {{"input_file_id", fileId},
+                            {"endpoint", "/v1/chat/completions"},
+                            {"completion_window", "24h"}};
+            json batch = json::parse(openai_post("/batches", request.dump(), 0));
+            batchIds.push_back(batch.at("id").get<std::string>());
+            std::cerr << "bulk: submitted " << batchIds.back() << " (" << spoolRequests << " requests, "
+                      << spoolBytes / 1048576.0 << " MiB)\n";
+            spoolRequests = spoolBytes = 0;
+        };
+        // A chunk's requests go into the same batch
+        auto add = [&](const std::vector<std::string>& lines) {
+            size_t bytes = 0;
+            for (const auto& l : lines) bytes += l.size() + 1;
+            if (spoolRequests > 0 && (spoolRequests + lines.size() > opts.maxRequests ||
+                                      spoolBytes + bytes > opts.maxBytes)) {
+                submit();
+            }
+            if (spoolRequests == 0) {
+                const char* dir = std::getenv("TMPDIR");
+                std::string tmpl = std::string(dir && *dir ? dir : "/tmp") + "/ai_study_bulk_XXXXXX";
+                int fd = mkstemp(&tmpl[0]);
+                if (fd < 0) throw std::runtime_error("Cannot create a temp file: " + std::string(std::strerror(errno)));
+                close(fd);
+                spoolPath = tmpl;
+                spool.open(spoolPath, std::ios::binary | std::ios::trunc);
+            }
+            for (const auto& l : lines) spool << l << '\n';
+            spoolRequests += lines.size();
+            spoolBytes += bytes;
+            requests += lines.size();
+        };
+
+        try {
+            for (uint32_t f = 0; f < files.size() && !g_interrupted.load(); ++f) {
+                int fd = open(files[f].c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd < 0) {
+                    Chunk c;
+                    c.file = f;
+                    c.error = std::string("cannot open: ") + std::strerror(errno);
+                    emit(c);
+                    continue;
+                }
+                std::unique_ptr<int, void (*)(int*)> closer(&fd, [](int* p) { close(*p); });
+                CdcReader chunker(fd);
+                std::string text;
+                uint64_t offset = 0;
+                for (uint64_t index = 0; chunker.next(text); ++index, offset = chunker.offset()) {
+                    Chunk c;
+                    c.file = f;
+                    c.index = index;
+                    c.offset = offset;
+                    c.bytes = text.size();
+                    // Fully memoized chunks are printed right away
+                    std::array<std::string, 2> keys = chunk_keys(text, wantSummary, wantCards, combined);
+                    bool cached = true;
+                    json entry;
+                    for (const auto& k : keys) {
+                        if (k.empty()) continue;
+                        if (memo.load(k, entry)) merge(c.result, entry);
+                        else cached = false;
+                    }
+                    if (cached) {
+                        emit(c);
+                        continue;
+                    }
+                    c.result = json::object();
+                    c.partsLeft = parts;
+                    std::string prefix = std::to_string(f) + ":" + std::to_string(index) + ":" +
+                                         std::to_string(offset) + ":" + std::to_string(text.size()) + ":";
+                    std::vector<std::string> lines;
+                    for (const auto& k : keys) {
+                        if (!k.empty()) lines.push_back(bulk_request_line(prefix + k, k, text));
+                    }
+                    add(lines);
+                    pending.emplace(std::to_string(f) + ":" + std::to_string(index), std::move(c));
+                }
+            }
+            if (g_interrupted.load()) throw ApiError("cancelled", "Interrupted");
+            if (spoolRequests > 0) submit();
+        } catch (...) {
+            if (spool.is_open()) {
+                spool.close();
+                unlink(spoolPath.c_str());
+            }
+            if (!batchIds.empty()) {
+                std::cerr << "bulk: stopped; batches already submitted: " << joined(batchIds, ",") << "\n";
+            }
+            throw;
+        }
+        if (!batchIds.empty()) {
+            std::cerr << "bulk: " << requests << " requests in " << batchIds.size()
+                      << (batchIds.size() == 1 ? " batch" : " batches") << "; collect them later with --bulk-resume " << joined(batchIds, ",") << "\n";
+        }
+        if (opts.detach) {
+            stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            return stats;
+        }
+    }
+
+    // One line of a results or errors file. A line that does not say which
+    // chunk it is for is skipped (the chunk is then reported as having no
+    // result); anything else wrong with it becomes that chunk's error.
+    size_t unreadable = 0;
+    auto collect = [&](const std::string& text) {
+        json line;
+        std::string id, key;
+        uint32_t file = 0;
+        std::vector<std::string> field;
+        try {
+            line = json::parse(text);
+            id = line.at("custom_id").get<std::string>();
+            for (size_t at = 0, colon; field.size() < 4 && (colon = id.find(':', at)) != std::string::npos; at = colon + 1) {
+                field.push_back(id.substr(at, colon - at));
+            }
+            if (field.size() < 4) throw std::runtime_error("unexpected custom_id \"" + id + "\"");
+            file = (uint32_t)std::stoul(field[0]);
+            if (file >= files.size()) throw std::runtime_error(id + " is not from this batch list");
+            key = id.substr(field[0].size() + field[1].size() + field[2].size() + field[3].size() + 4);
+        } catch (const std::exception& ex) {
+            if (++unreadable <= 3) std::cerr << "bulk: skipped a result line: " << ex.what() << "\n";
+            return;
+        }
+
+        auto it = pending.find(field[0] + ":" + field[1]);
+        if (it == pending.end()) {
+            // Collecting a resumed batch: first sight of this chunk
+            Chunk c;
+            c.file = file;
+            try {
+                c.index = std::stoull(field[1]);
+                c.offset = std::stoull(field[2]);
+                c.bytes = (size_t)std::stoull(field[3]);
+            } catch (const std::exception&) {
+                if (++unreadable <= 3) std::cerr << "bulk: skipped a result line: unexpected custom_id \"" << id << "\"\n";
+                return;
+            }
+            c.partsLeft = parts;
+            it = pending.emplace(field[0] + ":" + field[1], std::move(c)).first;
+        }
+        Chunk& c = it->second;
+        std::string error;
+        try {
+            const json& response = line.value("response", json());
+            const json& lineError = line.value("error", json());
+            if (!lineError.is_null()) {
+                error = lineError.is_object() ? lineError.value("message", lineError.dump()) : lineError.dump();
+            } else if (!response.is_object() || response.value("status_code", 0) != 200) {
+                json body = response.is_object() ? response.value("body", json()) : json();
+                error = "HTTP " + std::to_string(response.is_object() ? response.value("status_code", 0) : 0) + ": " +
+                        (body.is_object() && body.contains("error") && body["error"].is_object()
+                             ? body["error"].value("message", "") : body.dump());
+            } else {
+                json part = bulk_result_part(key.substr(0, key.find('-')), response.at("body"));
+                memo.store(key, part);
+                merge(c.result, part);
+            }
+        } catch (const std::exception& ex) {
+            error = ex.what();
+        }
+        if (!error.empty() && c.error.empty()) c.error = error;
+        if (--c.partsLeft <= 0) {
+            emit(c);
+            pending.erase(it);
+        }
+    };
+    // Results are parsed line by line as they download
+    auto download = [&](const std::string& fileId) {
+        std::string partial;
+        openai_get("/files/" + fileId + "/content", "/files/{id}/content", [&](const char* data, size_t n) {
+            partial.append(data, n);
+            size_t start = 0;
+            for (size_t nl; (nl = partial.find('\n', start)) != std::string::npos; start = nl + 1) {
+                if (nl > start) collect(partial.substr(start, nl - start));
+            }
+            partial.erase(0, start);
+        });
+        if (!partial.empty()) collect(partial);
+        out.flush();
+    };
+
+    // Poll every batch until it ends, collecting each as soon as it does
+    std::vector<std::string> status(batchIds.size()), ended;
+    size_t open = batchIds.size();
+    int transientFailures = 0;
+    try {
+        while (open > 0) {
+            for (size_t i = 0; i < batchIds.size(); ++i) {
+                const std::string& s = status[i];
+                if (s == "completed" || s == "failed" || s == "expired" || s == "cancelled") continue;
+                json batch;
+                try {
+                    batch = json::parse(openai_get("/batches/" + batchIds[i], "/batches/{id}"));
+                    transientFailures = 0;
+                } catch (const ApiError& ex) {
+                    // A flaky connection only delays the next look
+                    if (g_interrupted.load() || !(api_unreachable(ex) || ex.status == 429) || ++transientFailures > 5) throw;
+                    std::cerr << "bulk: " << ex.what() << " (retrying)\n";
+                    continue;
+                }
+                std::string now = batch.value("status", "");
+                const json& counts = batch.value("request_counts", json::object());
+                if (now != status[i]) {
+                    std::cerr << "bulk: " << batchIds[i] << " " << now;
+                    if (counts.value("total", 0) > 0) {
+                        std::cerr << " (" << counts.value("completed", 0) << " of " << counts.value("total", 0)
+                                  << " done, " << counts.value("failed", 0) << " failed)";
+                    }
+                    std::cerr << "\n";
+                }
+                status[i] = now;
+                if (now != "completed" && now != "failed" && now != "expired" && now != "cancelled") continue;
+                --open;
+                for (const char* file : {"output_file_id", "error_file_id"}) {
+                    if (batch.contains(file) && batch[file].is_string()) download(batch[file].get<std::string>());
+                }
+                if (now != "completed") {
+                    std::string why = batchIds[i] + " " + now;
+                    if (batch.contains("errors") && batch["errors"].is_object() &&
+                        batch["errors"].value("data", json::array()).size() > 0) {
+                        why += ": " + batch["errors"]["data"][0].value("message", "");
+                    }
+                    ended.push_back(why);
+                }
+            }
+            if (open > 0) bulk_sleep(opts.pollSeconds);
+        }
+    } catch (...) {
+        std::cerr << "bulk: stopped waiting; collect the results later with --bulk-resume "
+                  << joined(batchIds, ",") << "\n";
+        throw;
+    }
+
+    if (unreadable > 0) std::cerr << "bulk: " << unreadable << " result lines could not be read\n";
+
+    // Requests a failed, expired or cancelled batch never ran (or whose
+    // result lines could not be read)
+    for (auto& p : pending) {
+        p.second.error = ended.empty() ? "no result in the batch output" : "no result (" + joined(ended, "; ") + ")";
+        emit(p.second);
+    }
+    out.flush();
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    return stats;
+}
+
+// ======== COMMAND LINE =========
+
+static void print_usage(const char* argv0) {
+    std::cout << "Usage: " << argv0 << " [options]\n"
+              << "  -i, --input FILE   read study text from FILE ('-' = stdin)\n"
+              << "  -m, --mode N       1 = summary, 2 = flashcards, 3 = both\n"
+              << "      --line-mode    viewer takes Enter-terminated commands\n"
+              << "      --prefetch     keep generating cards in the background while you study\n"
+              << "      --srs FILE     review mode: schedule cards with spaced repetition,\n"
+              << "                     keeping review history in FILE\n"
+              << "      --dedup-threshold T  drop cards whose estimated word-shingle Jaccard\n"
+              << "                     similarity to an earlier card is >= T (default 0.5, 0 = off)\n"
+              << "      --embedder E   embeddings for 'similar': local (hashing, offline) or openai\n"
+              << "      --combined     mode 3: get summary and flashcards from one request\n"
+              << "      --chunk-cache DIR  split the text into content-defined chunks and keep\n"
+              << "                     per-chunk results in DIR; reruns after an edit only\n"
+              << "                     send the chunks that changed\n"
+              << "      --journal FILE like --chunk-cache, but results go to an append-only\n"
+              << "                     journal as each request completes; rerun to resume\n"
+              << "                     after a crash without repeating finished requests\n"
+              << "      --shared-cache FILE  reuse model replies across processes through a\n"
+              << "                     memory-mapped cache file (created on first use, 64 MiB)\n"
+              << "      --batch LIST   study every file listed in LIST (one path per line, '-' =\n"
+              << "                     stdin) chunk by chunk; prints one JSON line per chunk\n"
+              << "      --workers N    concurrent API requests in --batch (default 4)\n"
+              << "      --shed         in --batch, skip chunks (reported as \"shed\") instead of\n"
+              << "                     waiting when the workers fall behind\n"
+              << "      --bulk         in --batch, submit the requests through the Batch API\n"
+              << "                     (discounted, done within 24 h) and wait for the results\n"
+              << "      --bulk-detach  like --bulk, but exit once submitted, printing the ids\n"
+              << "      --bulk-resume IDS  collect the results of batches (comma-separated ids)\n"
+              << "                     submitted earlier from the same --batch LIST\n"
+              << "      --bulk-poll SEC  seconds between batch status checks (default 30)\n"
+              << "      --serve SOCKET stay running as a daemon serving study jobs on a Unix\n"
+              << "                     socket, with warm connections and a resident result cache\n"
+              << "      --daemon SOCKET  hand the job to the daemon on SOCKET instead of calling\n"
+              << "                     the API from this process\n"
+              << "      --routes FILE  model routing rules (JSON array of {task, min_input_tokens,\n"
+              << "                     max_input_tokens, model, max_tokens}; first match wins)\n"
+              << "      --route-log FILE  append one JSON line per API request (model, tokens, ms)\n"
+              << "      --connect-timeout SEC  give up connecting after SEC (default 10)\n"
+              << "      --timeout SEC  give up on a request after SEC (default 120, 0 = never)\n"
+              << "      --idle-timeout SEC  give up when no data arrives for SEC (default off)\n"
+              << "      --hedge        when a request is slower than that model's p95, send a\n"
+              << "                     duplicate and use whichever answers first (costs extra tokens)\n"
+              << "      --hedge-after MS  hedge after a fixed MS instead of the p95\n"
+              << "      --no-fallback  fail when the API is unreachable instead of making a\n"
+              << "                     rough summary and cards from the text locally\n"
+              << "      --offline      never call the API: extract the summary (LexRank) and\n"
+              << "                     cards from the text locally, in milliseconds\n"
+              << "      --preview      print a locally extracted summary while the API works\n"
+              << "      --local-model FILE  generate with a llama-style GGUF model (Q4_0/Q8_0) on\n"
+              << "                     the CPU instead of calling the API\n"
+              << "      --metrics-file FILE  write API metrics (Prometheus text format) at exit\n"
+              << "      --metrics-port N  serve the same metrics at http://127.0.0.1:N/metrics\n"
+              << "      --threads N    threads for CPU-bound work (default: one per core)\n"
+              << "      --stats        print timing statistics (viewer and per-model latency) to stderr\n"
+              << "      --bench NAME   run a built-in benchmark (ingest, render, srs, dedup, ann,\n"
+              << "                     kernels, hedge, combined, cdc, journal, metrics,\n"
+              << "                     daemon, shmcache, pool, mpmc, limiter, breaker,\n"
+              << "                     textrank, extract, llm, bulk)\n"
+              << "  -h, --help         show this help\n"
+              << "\nWhen stdin is not a terminal the whole of stdin is read as the study text.\n";
+}
+
+// Parses argv into AppOptions; throws on malformed options
+static AppOptions parse_args(int argc, char** argv) {
+    AppOptions opts;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        // Fetches the value following an option, or fails if it is missing
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) throw std::runtime_error("Missing value for option " + arg);
+            return argv[++i];
+        };
+
+        if (arg == "-i" || arg == "--input") {
+            opts.inputPath = value();
+        } else if (arg == "-m" || arg == "--mode") {
+            opts.mode = std::atoi(value().c_str());
+            if (opts.mode < 1 || opts.mode > 3) throw std::runtime_error("--mode must be 1, 2 or 3");
+        } else if (arg == "--line-mode") {
+            opts.lineMode = true;
+        } else if (arg == "--prefetch") {
+            opts.prefetch = true;
+        } else if (arg == "--srs") {
+            opts.srsPath = value();
+        } else if (arg == "--dedup-threshold") {
+            opts.dedupThreshold = std::atof(value().c_str());
+            if (opts.dedupThreshold < 0 || opts.dedupThreshold > 1) {
+                throw std::runtime_error("--dedup-threshold must be between 0 and 1");
+            }
+        } else if (arg == "--embedder") {
+            opts.embedder = value();
+            if (opts.embedder != "local" && opts.embedder != "openai") {
+                throw std::runtime_error("--embedder must be local or openai");
+            }
+        } else if (arg == "--combined") {
+            opts.combined = true;
+        } else if (arg == "--chunk-cache") {
+            opts.chunkCacheDir = value();
+        } else if (arg == "--journal") {
+            opts.journalPath = value();
+        } else if (arg == "--shared-cache") {
+            opts.sharedCachePath = value();
+        } else if (arg == "--batch") {
+            opts.batchList = value();
+        } else if (arg == "--workers") {
+            int workers = std::atoi(value().c_str());
+            if (workers < 1) throw std::runtime_error("--workers must be at least 1");
+            opts.workers = (size_t)workers;
+        } else if (arg == "--shed") {
+            opts.shed = true;
+        } else if (arg == "--bulk") {
+            opts.bulk = true;
+        } else if (arg == "--bulk-detach") {
+            opts.bulk = opts.bulkDetach = true;
+        } else if (arg == "--bulk-resume") {
+            opts.bulk = true;
+            opts.bulkResume = value();
+        } else if (arg == "--bulk-poll") {
+            opts.bulkPoll = std::atof(value().c_str());
+            if (opts.bulkPoll <= 0) throw std::runtime_error("--bulk-poll must be positive");
+        } else if (arg == "--serve") {
+            opts.serveSocket = value();
+        } else if (arg == "--daemon") {
+            opts.daemonSocket = value();
+        } else if (arg == "--routes") {
+            opts.routesPath = value();
+        } else if (arg == "--route-log") {
+            opts.routeLogPath = value();
+        } else if (arg == "--connect-timeout" || arg == "--timeout" || arg == "--idle-timeout") {
+            double sec = std::atof(value().c_str());
+            if (sec < 0) throw std::runtime_error(arg + " must not be negative");
+            if (arg == "--connect-timeout") opts.connectTimeout = sec;
+            else if (arg == "--timeout") opts.timeout = sec;
+            else opts.idleTimeout = sec;
+        } else if (arg == "--hedge") {
+            opts.hedge = true;
+        } else if (arg == "--hedge-after") {
+            opts.hedgeAfterMs = std::atol(value().c_str());
+            if (opts.hedgeAfterMs <= 0) throw std::runtime_error("--hedge-after must be positive");
+            opts.hedge = true;
+        } else if (arg == "--no-fallback") {
+            opts.offlineFallback = false;
+        } else if (arg == "--offline") {
+            opts.offline = true;
+        } else if (arg == "--preview") {
+            opts.preview = true;
+        } else if (arg == "--local-model") {
+            opts.localModel = value();
+        } else if (arg == "--metrics-file") {
+            opts.metricsFile = value();
+        } else if (arg == "--metrics-port") {
+            opts.metricsPort = std::atoi(value().c_str());
+            if (opts.metricsPort <= 0 || opts.metricsPort > 65535) {
+                throw std::runtime_error("--metrics-port must be a TCP port number");
+            }
+        } else if (arg == "--threads") {
+            int threads = std::atoi(value().c_str());
+            if (threads < 1) throw std::runtime_error("--threads must be at least 1");
+            opts.threads = (size_t)threads;
+        } else if (arg == "--stats") {
+            opts.showStats = true;
+        } else if (arg == "--bench") {
+            opts.benchName = value();
+            // Everything after the benchmark name belongs to the benchmark
+            while (i + 1 < argc) opts.benchArgs.push_back(argv[++i]);
+        } else if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            std::exit(0);
+        } else {
+            throw std::runtime_error("Unknown option: " + arg + " (see --help)");
+        }
+    }
+    if (!opts.chunkCacheDir.empty() && !opts.journalPath.empty()) {
+        throw std::runtime_error("--chunk-cache and --journal cannot be combined");
+    }
+    if (!opts.serveSocket.empty() && !opts.daemonSocket.empty()) {
+        throw std::runtime_error("--serve and --daemon cannot be combined");
+    }
+    if (!opts.daemonSocket.empty() && (!opts.chunkCacheDir.empty() || !opts.journalPath.empty())) {
+        throw std::runtime_error("with --daemon, give --chunk-cache / --journal to the daemon (--serve)");
+    }
+    if (opts.offline && !opts.daemonSocket.empty()) {
+        throw std::runtime_error("--offline works locally and cannot use --daemon");
+    }
+    if (!opts.localModel.empty() && opts.offline) {
+        throw std::runtime_error("--local-model and --offline cannot be combined");
+    }
+    if (!opts.localModel.empty() && !opts.daemonSocket.empty()) {
+        throw std::runtime_error("with --daemon, give --local-model to the daemon (--serve)");
+    }
+    if (opts.bulk && opts.batchList.empty()) {
+        throw std::runtime_error("--bulk, --bulk-detach and --bulk-resume need --batch LIST");
+    }
+    if (opts.bulk && (opts.shed || opts.offline || !opts.localModel.empty())) {
+        throw std::runtime_error("--bulk submits to the API and cannot be combined with --shed, "
+                                 "--offline or --local-model");
+    }
+    if (opts.bulkDetach && !opts.bulkResume.empty()) {
+        throw std::runtime_error("--bulk-detach and --bulk-resume cannot be combined");
+    }
+    return opts;
+}
+
+// ======== BENCHMARKS =========
+
+// Seconds elapsed since `start`
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Ingestion: legacy getline + backslash loop vs. bulk read of the same file.
+// Args: [MB] (default 100)
+static int bench_ingest(const std::vector<std::string>& args) {
+    size_t megabytes = args.empty() ? 100 : (size_t)std::atol(args[0].c_str());
+    size_t target = megabytes << 20;
+
+    // Build a file of 80-column lines; each ends in '\' so the legacy loop keeps reading
+    char path[] = "/tmp/ai_study_ingestXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) throw std::runtime_error("mkstemp failed");
+    {
+        std::string line(79, 'x');
+        line += "\\\n";
+        std::string block;
+        while (block.size() < (1 << 20)) block += line;
+        for (size_t written = 0; written < target; written += block.size()) {
+            if (write(fd, block.data(), block.size()) != (ssize_t)block.size()) {
+                close(fd);
+                unlink(path);
+                throw std::runtime_error("write failed while building bench file");
+            }
+        }
+        close(fd);
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    std::ifstream in(path);
+    std::string legacy = read_text_lines(in);
+    double legacySec = seconds_since(t0);
+
+    t0 = std::chrono::steady_clock::now();
+    std::string bulk = read_input_file(path);
+    double bulkSec = seconds_since(t0);
+
+    unlink(path);
+
+    double mb = (double)bulk.size() / (1 << 20);
+    std::cout << "ingest " << mb << " MB\n";
+    std::cout << "  getline loop: " << legacySec << " s (" << mb / legacySec << " MB/s)\n";
+    std::cout << "  bulk read:    " << bulkSec << " s (" << mb / bulkSec << " MB/s)\n";
+    std::cout << "  speedup:      " << legacySec / bulkSec << "x\n";
+    return legacy.empty() ? 1 : 0;
+}
+
+// Rendering: syscalls and bytes per frame while flipping through a deck.
+// "before" models the old clear_screen + per-line std::cout output on a
+// line-buffered terminal (one write() per line, full repaint every frame).
+// Args: [frames] (default 1000)
+static int bench_render(const std::vector<std::string>& args) {
+    int frames = args.empty() ? 1000 : std::atoi(args[0].c_str());
+
+    FlashcardResult deck;
+    for (int i = 0; i < 20; ++i) {
+        deck.flashcards.push_back({"What is the role of component " + std::to_string(i) +
+                                       " in the citric acid cycle, and why does it matter?",
+                                   "It catalyses step " + std::to_string(i) +
+                                       ", converting one intermediate into the next."});
+    }
+
+    int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("cannot open /dev/null");
+    FrameRenderer screen(fd);
+
+    size_t oldWrites = 0, oldBytes = 0;
+    int idx = 0;
+    bool showAnswer = false;
+    for (int f = 0; f < frames; ++f) {
+        // Alternate flip / next, the common study pattern
+        if (f % 2) showAnswer = true;
+        else { idx = (idx + 1) % (int)deck.flashcards.size(); showAnswer = false; }
+
+        display_card(screen, deck.flashcards[idx], idx, (int)deck.flashcards.size(), showAnswer);
+
+        oldBytes += std::strlen("\033[2J\033[H");
+        for (const auto& line : screen.frame()) {
+            oldBytes += line.size() + 1;
+            ++oldWrites;
+        }
+    }
+    close(fd);
+
+    const auto& st = screen.stats();
+    std::cout << "render " << frames << " frames\n";
+    std::cout << "  before: " << (double)oldWrites / frames << " write()/frame, "
+              << (double)oldBytes / frames << " bytes/frame\n";
+    std::cout << "  after:  " << (double)st.writes / st.frames << " write()/frame, "
+              << (double)st.bytes / st.frames << " bytes/frame\n";
+    return 0;
+}
+
+// Spaced repetition: simulates daily study over a large collection and
+// reports scheduler cost per review plus save/load of the state file.
+// Args: [cards] (default 1000000) [days] (default 30)
+static int bench_srs(const std::vector<std::string>& args) {
+    size_t cards = args.size() > 0 ? (size_t)std::atol(args[0].c_str()) : 1000000;
+    int days = args.size() > 1 ? std::atoi(args[1].c_str()) : 30;
+
+    std::mt19937_64 rng(42);
+    uint32_t start = now_minute();
+    SrsScheduler srs;
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < cards; ++i) srs.activate(rng(), start);
+    double buildSec = seconds_since(t0);
+
+    // Simulated student: mostly remembers, sometimes forgets
+    std::discrete_distribution<int> answer({10, 5, 80, 5}); // again/hard/good/easy weights
+    size_t reviews = 0;
+    double reviewSec = 0;
+    for (int day = 0; day < days; ++day) {
+        uint32_t now = start + (uint32_t)day * 24 * 60;
+        // Reviews cap out at a realistic session size on the first days
+        size_t budget = std::min<size_t>(cards, 20000);
+        t0 = std::chrono::steady_clock::now();
+        for (size_t n = 0; n < budget; ++n) {
+            int64_t slot = srs.next_due(now);
+            if (slot < 0) break;
+            srs.review((uint32_t)slot, static_cast<Grade>(answer(rng)), now);
+            ++reviews;
+        }
+        reviewSec += seconds_since(t0);
+    }
+
+    char path[] = "/tmp/ai_study_srsXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) throw std::runtime_error("mkstemp failed");
+    close(fd);
+    t0 = std::chrono::steady_clock::now();
+    srs.save(path);
+    double saveSec = seconds_since(t0);
+    struct stat st;
+    stat(path, &st);
+    SrsScheduler loaded;
+    t0 = std::chrono::steady_clock::now();
+    loaded.load(path);
+    double loadSec = seconds_since(t0);
+    unlink(path);
+
+    std::cout << "srs " << cards << " cards, " << days << " simulated days\n";
+    std::cout << "  activate: " << buildSec * 1e9 / cards << " ns/card\n";
+    std::cout << "  reviews:  " << reviews << ", " << reviewSec * 1e9 / std::max<size_t>(reviews, 1)
+              << " ns/review (pick next due + grade + reschedule)\n";
+    std::cout << "  state:    " << st.st_size << " bytes, save " << saveSec * 1e3 << " ms, load "
+              << loadSec * 1e3 << " ms\n";
+    return loaded.size() == cards ? 0 : 1;
+}
+
+// Synthetic flashcards over a 5000-word vocabulary; every tenth card is a
+// light paraphrase (two words replaced) of a random earlier card, whose index
+// is recorded in `source` (-1 for original cards)
+static std::vector<Flashcard> synthetic_cards(size_t n, std::vector<int64_t>* source, uint64_t seed = 7) {
+    std::mt19937_64 rng(seed);
+    auto word = [&]() { return "w" + std::to_string(rng() % 5000); };
+    auto sentence = [&](int words) {
+        std::string s;
+        for (int i = 0; i < words; ++i) s += (i ? " " : "") + word();
+        return s;
+    };
+    std::vector<Flashcard> cards;
+    cards.reserve(n);
+    if (source) source->assign(n, -1);
+    for (size_t i = 0; i < n; ++i) {
+        if (i > 0 && i % 10 == 0) {
+            size_t src = rng() % i;
+            Flashcard c = cards[src];
+            c.question = word() + " " + c.question; // small rewording
+            size_t sp = c.answer.find(' ');
+            c.answer = word() + c.answer.substr(sp == std::string::npos ? 0 : sp);
+            cards.push_back(c);
+            if (source) (*source)[i] = (int64_t)src;
+        } else {
+            cards.push_back({sentence(10) + "?", sentence(15) + "."});
+        }
+    }
+    return cards;
+}
+
+// Dedup: MinHash/LSH over synthetic collections of increasing size, with
+// recall/false-positive counts against the known paraphrases.
+// Args: [max cards] (default 1000000) [threshold] (default 0.5)
+static int bench_dedup(const std::vector<std::string>& args) {
+    size_t maxCards = args.size() > 0 ? (size_t)std::atol(args[0].c_str()) : 1000000;
+    double threshold = args.size() > 1 ? std::atof(args[1].c_str()) : 0.5;
+
+    std::cout << "dedup threshold " << threshold << " (" << kMinHashSize << " hashes, "
+              << lsh_rows_per_band(threshold) << " rows/band)\n";
+    for (size_t n = 10000; n <= maxCards; n *= 10) {
+        std::vector<int64_t> source;
+        std::vector<Flashcard> cards = synthetic_cards(n, &source);
+
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<uint32_t> group = find_near_duplicates(cards, threshold);
+        double sec = seconds_since(t0);
+
+        size_t dups = 0, found = 0, falsePos = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (source[i] >= 0) {
+                ++dups;
+                if (group[i] == group[(size_t)source[i]]) ++found;
+            } else if (group[i] != i) {
+                ++falsePos;
+            }
+        }
+        std::cout << "  " << n << " cards: " << sec * 1e3 << " ms (" << sec * 1e9 / n
+                  << " ns/card), recall " << (double)found / std::max<size_t>(dups, 1)
+                  << ", false merges " << falsePos << "\n";
+    }
+    return 0;
+}
+
+// Unit vectors clustered around random centres (a stand-in for embeddings)
+static std::vector<float> clustered_vectors(size_t n, size_t dim, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::normal_distribution<float> gauss(0.0f, 1.0f);
+    const size_t kClusters = 1000;
+    std::mt19937_64 centreRng(99); // same centres for data and queries
+    std::vector<float> centres(kClusters * dim);
+    for (auto& c : centres) c = gauss(centreRng);
+
+    std::vector<float> out(n * dim);
+    for (size_t i = 0; i < n; ++i) {
+        const float* c = &centres[(rng() % kClusters) * dim];
+        float* v = &out[i * dim];
+        for (size_t d = 0; d < dim; ++d) v[d] = c[d] + 1.5f * gauss(rng);
+        l2_normalize(v, dim);
+    }
+    return out;
+}
+
+// ANN: HNSW build time, query latency and recall@10 against brute force.
+// Args: [vectors] (default 100000) [dim] (default 256)
+static int bench_ann(const std::vector<std::string>& args) {
+    size_t n = args.size() > 0 ? (size_t)std::atol(args[0].c_str()) : 100000;
+    size_t dim = args.size() > 1 ? (size_t)std::atol(args[1].c_str()) : 256;
+    const size_t kQueries = 200, k = 10;
+
+    std::vector<float> data = clustered_vectors(n, dim, 1);
+    std::vector<float> queries = clustered_vectors(kQueries, dim, 2);
+
+    HnswIndex index(dim);
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; ++i) index.add(&data[i * dim]);
+    double buildSec = seconds_since(t0);
+
+    // Exact top-k by brute force
+    std::vector<std::vector<uint32_t>> truth(kQueries);
+    t0 = std::chrono::steady_clock::now();
+    for (size_t q = 0; q < kQueries; ++q) {
+        std::vector<HnswIndex::Hit> all(n);
+        for (size_t i = 0; i < n; ++i) {
+            all[i] = {1.0f - dot_f32(&queries[q * dim], &data[i * dim], dim), (uint32_t)i};
+        }
+        std::partial_sort(all.begin(), all.begin() + k, all.end());
+        for (size_t j = 0; j < k; ++j) truth[q].push_back(all[j].second);
+    }
+    double bruteMs = seconds_since(t0) * 1e3 / kQueries;
+
+    std::cout << "ann " << n << " x " << dim << "d (" << simd().name << "): build " << buildSec << " s ("
+              << buildSec * 1e6 / n << " us/vector), brute force " << bruteMs << " ms/query\n";
+    for (size_t ef : {16, 32, 64, 128, 256}) {
+        LatencyStats lat;
+        size_t hits = 0;
+        for (size_t q = 0; q < kQueries; ++q) {
+            auto qt = std::chrono::steady_clock::now();
+            std::vector<HnswIndex::Hit> res = index.search(&queries[q * dim], k, ef);
+            lat.add(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - qt).count());
+            for (const auto& h : res) {
+                hits += std::count(truth[q].begin(), truth[q].end(), h.second);
+            }
+        }
+        std::cout << "  ef " << ef << ": recall@10 " << (double)hits / (kQueries * k)
+                  << ", p50 " << lat.quantile(0.5) << " us, p99 " << lat.quantile(0.99) << " us\n";
+    }
+    return 0;
+}
+
+// SIMD kernels: throughput of every kernel set this CPU supports, checked
+// against the scalar results. Args: [dim] (default: 64 256 1024 4096)
+static int bench_kernels(const std::vector<std::string>& args) {
+    std::vector<size_t> dims = {64, 256, 1024, 4096};
+    if (!args.empty()) dims = {(size_t)std::atol(args[0].c_str())};
+    std::cout << "kernels: using " << simd().name << "\n";
+
+    std::mt19937_64 rng(5);
+    std::uniform_real_distribution<float> uni(-1.0f, 1.0f);
+    for (size_t dim : dims) {
+        // 64 rows of each operand: stays in cache, so this measures the ALUs
+        const size_t kRows = 64;
+        std::vector<float> fa(kRows * dim), fb(kRows * dim);
+        std::vector<int8_t> ia(kRows * dim), ib(kRows * dim);
+        for (size_t i = 0; i < fa.size(); ++i) {
+            fa[i] = uni(rng);
+            fb[i] = uni(rng);
+            ia[i] = (int8_t)(rng() % 255 - 127);
+            ib[i] = (int8_t)(rng() % 255 - 127);
+        }
+        const size_t reps = std::max<size_t>(1, (size_t)4e8 / (kRows * dim));
+
+        std::cout << "  dim " << dim << ":\n";
+        for (const SimdKernels* k : available_kernels()) {
+            double maxErr = 0;
+            for (size_t r = 0; r < kRows; ++r) {
+                const float* a = &fa[r * dim];
+                const float* b = &fb[r * dim];
+                float ref = kScalarKernels.dot_f32(a, b, dim);
+                maxErr = std::max(maxErr, (double)std::fabs(k->dot_f32(a, b, dim) - ref) / std::max(1.0f, std::fabs(ref)));
+                if (k->dot_i8(&ia[r * dim], &ib[r * dim], dim) != kScalarKernels.dot_i8(&ia[r * dim], &ib[r * dim], dim) ||
+                    k->l2sq_i8(&ia[r * dim], &ib[r * dim], dim) != kScalarKernels.l2sq_i8(&ia[r * dim], &ib[r * dim], dim)) {
+                    throw std::runtime_error(std::string("int8 kernel mismatch in ") + k->name);
+                }
+            }
+
+            // Runs one kernel over all row pairs `reps` times; returns G ops/s
+            auto rate = [&](double opsPerElem, auto&& body) {
+                volatile double sink = 0;
+                auto t0 = std::chrono::steady_clock::now();
+                for (size_t rep = 0; rep < reps; ++rep) {
+                    for (size_t r = 0; r < kRows; ++r) sink = sink + body(r * dim);
+                }
+                return opsPerElem * reps * kRows * dim / seconds_since(t0) / 1e9;
+            };
+            double dot = rate(2, [&](size_t o) { return k->dot_f32(&fa[o], &fb[o], dim); });
+            double l2 = rate(3, [&](size_t o) { return k->l2sq_f32(&fa[o], &fb[o], dim); });
+            double cos = rate(6, [&](size_t o) { return k->cosine_f32(&fa[o], &fb[o], dim); });
+            double dot8 = rate(2, [&](size_t o) { return k->dot_i8(&ia[o], &ib[o], dim); });
+            double l28 = rate(3, [&](size_t o) { return k->l2sq_i8(&ia[o], &ib[o], dim); });
+            std::cout << "    " << k->name << ": f32 dot " << dot << ", l2 " << l2 << ", cosine " << cos
+                      << " GFLOP/s; i8 dot " << dot8 << ", l2 " << l28 << " GOP/s (max rel err "
+                      << maxErr << ")\n";
+        }
+    }
+    return 0;
+}
+
+// Hedging: latency of small chat requests, first plain and then hedged at
+// the plain run's p95. Meant for a stand-in server with injected
+// stragglers (OPENAI_BASE_URL must be set). Args: [requests] (default 300)
+static int bench_hedge(const std::vector<std::string>& args) {
+    size_t n = args.size() > 0 ? (size_t)std::atol(args[0].c_str()) : 300;
+    if (!std::getenv("OPENAI_BASE_URL")) {
+        throw std::runtime_error("bench hedge needs OPENAI_BASE_URL pointing at a test server");
+    }
+    json body = {{"model", "gpt-4.1-mini"},
+                 {"messages", {{{"role", "user"}, {"content", "Reply with {}"}}}}};
+    std::string bodyStr = body.dump();
+
+    auto run = [&](const char* label, long hedgeAfterMs) {
+        LatencyStats lat;
+        uint64_t sent0 = hedge_stats().sent.value(), won0 = hedge_stats().won.value();
+        auto t0 = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < n; ++i) {
+            auto rt = std::chrono::steady_clock::now();
+            openai_post("/chat/completions", bodyStr, hedgeAfterMs);
+            lat.add(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - rt).count());
+        }
+        double wall = seconds_since(t0);
+        std::cout << "  " << label << ": p50 " << lat.quantile(0.5) << " ms, p95 " << lat.quantile(0.95)
+                  << " ms, p99 " << lat.quantile(0.99) << " ms, max " << lat.quantile(1.0)
+                  << " ms; " << hedge_stats().sent.value() - sent0 << " hedges, "
+                  << hedge_stats().won.value() - won0 << " won; " << wall << " s total\n";
+        return lat;
+    };
+
+    std::cout << "hedge: " << n << " requests each\n";
+    LatencyStats plain = run("plain ", 0);
+    long p95 = (long)std::ceil(plain.quantile(0.95));
+    run(("hedged after " + std::to_string(p95) + " ms").c_str(), std::max(1L, p95));
+    return 0;
+}
+
+// Mode 3 as two requests vs one combined request: API-reported tokens and
+// wall time per document. Needs OPENAI_BASE_URL (a test server).
+// Args: [text file] (default: 40 KB of generated text) [runs] (default 5)
+static int bench_combined(const std::vector<std::string>& args) {
+    if (!std::getenv("OPENAI_BASE_URL")) {
+        throw std::runtime_error("bench combined needs OPENAI_BASE_URL pointing at a test server");
+    }
+    std::string text;
+    if (!args.empty()) {
+        text = read_input_file(args[0]);
+    } else {
+        static const char* kWords[] = {"the", "cell", "uses", "energy", "from", "light", "to",
+                                       "build", "sugar", "and", "oxygen", "in", "leaves"};
+        std::mt19937_64 rng(3);
+        while (text.size() < 40000) {
+            for (int w = 0; w < 12; ++w) text += std::string(kWords[rng() % 13]) + " ";
+            text += ".\n";
+        }
+    }
+    int runs = args.size() > 1 ? std::atoi(args[1].c_str()) : 5;
+
+    auto measure = [&](const char* label, const std::function<void()>& once) {
+        std::pair<size_t, size_t> before = model_router().token_totals();
+        auto t0 = std::chrono::steady_clock::now();
+        for (int r = 0; r < runs; ++r) once();
+        double sec = seconds_since(t0) / runs;
+        std::pair<size_t, size_t> after = model_router().token_totals();
+        std::cout << "  " << label << ": " << (after.first - before.first) / runs << " input + "
+                  << (after.second - before.second) / runs << " output tokens, " << sec * 1e3
+                  << " ms per document\n";
+    };
+
+    std::cout << "combined: " << text.size() << "-byte text, " << runs << " runs\n";
+    measure("separate", [&] {
+        summarize_content(text);
+        generate_flashcards(text);
+    });
+    measure("combined", [&] {
+        SummaryResult s;
+        FlashcardResult f;
+        summarize_and_generate(text, s, f);
+    });
+    return 0;
+}
+
+// Paragraphs of made-up study prose (each one different)
+static std::string synthetic_notes(size_t bytes, uint64_t seed) {
+    static const char* kWords[] = {"cells", "divide", "by", "mitosis", "while", "energy", "flows",
+                                   "through", "membranes", "and", "enzymes", "speed", "up",
+                                   "reactions", "in", "the", "nucleus", "of", "every", "plant"};
+    std::mt19937_64 rng(seed);
+    std::string text;
+    while (text.size() < bytes) {
+        size_t sentences = 3 + rng() % 5;
+        for (size_t i = 0; i < sentences; ++i) {
+            size_t words = 6 + rng() % 10;
+            for (size_t w = 0; w < words; ++w) {
+                text += kWords[rng() % 20];
+                text += w + 1 < words ? " " : ". ";
+            }
+        }
+        text += "\n\n";
+    }
+    return text;
+}
+
+// Chunk memoization: FastCDC throughput, how many chunks survive typical
+// edits (vs. fixed-size splitting), and - with OPENAI_BASE_URL set - the
+// time a warm cache saves on the edited text. Args: [KB] (default 200)
+static int bench_cdc(const std::vector<std::string>& args) {
+    size_t kb = args.size() > 0 ? (size_t)std::atol(args[0].c_str()) : 200;
+    std::string big = synthetic_notes(64 << 20, 1);
+    auto t0 = std::chrono::steady_clock::now();
+    size_t count = cdc_chunks(big).size();
+    double sec = seconds_since(t0);
+    std::cout << "cdc: " << (big.size() >> 20) << " MiB in " << count << " chunks ("
+              << big.size() / count << " B avg), " << big.size() / sec / (1 << 20) << " MiB/s\n";
+
+    std::string text = synthetic_notes(kb * 1024, 2);
+    std::string para = synthetic_notes(600, 3);
+    size_t mid = text.find("\n\n", text.size() / 2) + 2;
+    size_t midEnd = text.find("\n\n", mid) + 2;
+    std::vector<std::pair<const char*, std::string>> edits = {
+        {"reword a paragraph", text.substr(0, mid) + "Edited: " + text.substr(mid + 8)},
+        {"insert a paragraph", text.substr(0, mid) + para + text.substr(mid)},
+        {"delete a paragraph", text.substr(0, mid) + text.substr(midEnd)},
+        {"append at the end", text + para},
+    };
+
+    // Fraction of `after`'s chunks that also occur in `before`
+    auto reused = [](const std::vector<std::string>& before, const std::vector<std::string>& after) {
+        std::unordered_map<std::string, int> seen;
+        for (const auto& c : before) ++seen[c];
+        size_t same = 0;
+        for (const auto& c : after) same += seen.count(c);
+        return (double)same / std::max<size_t>(after.size(), 1);
+    };
+    std::vector<std::string> cdcBefore = cdc_chunks(text);
+    std::vector<std::string> fixedBefore = split_into_chunks(text, kCdcAvgChunk);
+    std::cout << "  " << kb << " KB note, " << cdcBefore.size() << " chunks; chunks reused after:\n";
+    for (const auto& e : edits) {
+        std::cout << "    " << e.first << ": content-defined " << 100 * reused(cdcBefore, cdc_chunks(e.second))
+                  << "%, fixed-size " << 100 * reused(fixedBefore, split_into_chunks(e.second, kCdcAvgChunk))
+                  << "%\n";
+    }
+
+    if (!std::getenv("OPENAI_BASE_URL")) return 0;
+
+    // Cold vs warm memoized run on the edited text against the test server
+    char dirTemplate[] = "/tmp/ai-study-cdc-XXXXXX";
+    if (!mkdtemp(dirTemplate)) throw std::runtime_error("mkdtemp failed");
+    std::string warmDir = std::string(dirTemplate) + "/warm", coldDir = std::string(dirTemplate) + "/cold";
+    auto run = [&](const std::string& dir, const std::string& input, size_t& sent) {
+        ChunkMemo memo(dir);
+        SummaryResult s;
+        FlashcardResult f;
+        auto rt = std::chrono::steady_clock::now();
+        memoized_study(input, true, true, false, memo, s, f);
+        sent = memo.misses();
+        return seconds_since(rt);
+    };
+    size_t sent = 0;
+    run(warmDir, text, sent);
+    const std::string& edited = edits[0].second;
+    double cold = run(coldDir, edited, sent);
+    size_t coldSent = sent;
+    double warm = run(warmDir, edited, sent);
+    std::cout << "  after \"" << edits[0].first << "\": cold " << cold << " s (" << coldSent
+              << " requests), warm " << warm << " s (" << sent << " requests), "
+              << 100 * (1 - warm / cold) << "% saved\n";
+    // Both caches: files first, then their directories
+    auto removeEntry = [](const char* p, const struct stat*, int, struct FTW*) { return remove(p); };
+    if (nftw(dirTemplate, removeEntry, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+        std::cerr << "could not remove " << dirTemplate << "\n";
+    }
+    return 0;
+}
+
+// Journal: append cost per result (batched fsync vs. fsync per record vs.
+// none), then recovery time and torn-tail handling on reopen.
+// Args: [entries] (default 100000) [dir] (default /tmp)
+static int bench_journal(const std::vector<std::string>& args) {
+    size_t n = args.size() > 0 ? (size_t)std::atol(args[0].c_str()) : 100000;
+    std::string dir = args.size() > 1 ? args[1] : "/tmp";
+    std::string path = dir + "/ai-study-bench.journal";
+
+    // A typical flashcard result (~1.3 KB of JSON)
+    FlashcardResult sample;
+    for (const Flashcard& c : synthetic_cards(10, nullptr)) sample.flashcards.push_back(c);
+    json value = flashcards_to_json(sample);
+    std::cout << "journal: " << n << " results of " << value.dump().size() << " B in " << dir << "\n";
+
+    auto append = [&](size_t count, bool syncEach) {
+        std::remove(path.c_str());
+        ResultJournal journal(path);
+        auto t0 = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < count; ++i) {
+            journal.store(ResultStore::key("flashcards", std::to_string(i)), value);
+            if (syncEach) journal.sync();
+        }
+        journal.sync();
+        double sec = seconds_since(t0);
+        std::cout << "  " << (syncEach ? "fsync every record" : "batched fsync     ") << ": "
+                  << sec * 1e6 / count << " us/result (" << journal.syncs() << " fsyncs for " << count
+                  << ")\n";
+    };
+    append(std::min<size_t>(n, 2000), true);
+    append(n, false);
+
+    // Recovery: reopen and index everything, then again with a torn tail
+    for (int torn = 0; torn < 2; ++torn) {
+        if (torn) {
+            struct stat st;
+            stat(path.c_str(), &st);
+            if (truncate(path.c_str(), st.st_size - 100) != 0) throw std::runtime_error("truncate failed");
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        ResultJournal journal(path);
+        double sec = seconds_since(t0);
+        json probe;
+        bool ok = journal.load(ResultStore::key("flashcards", "0"), probe) && probe == value;
+        std::cout << "  recovery" << (torn ? " (torn tail)" : "            ") << ": " << journal.recovered()
+                  << " results in " << sec * 1e3 << " ms, dropped " << journal.dropped_bytes()
+                  << " bytes" << (ok ? "" : ", READ BACK FAILED") << "\n";
+    }
+    std::remove(path.c_str());
+    return 0;
+}
+
+// Metrics: cost of recording one event (counter add, histogram record) on
+// 1..N threads hammering the same metric. Args: [events per thread]
+// (default 20000000) [max threads] (default 4)
+static int bench_metrics(const std::vector<std::string>& args) {
+    size_t n = args.size() > 0 ? (size_t)std::atol(args[0].c_str()) : 20000000;
+    int maxThreads = args.size() > 1 ? std::atoi(args[1].c_str()) : 4;
+    Counter counter;
+    std::unique_ptr<Histogram> hist(new Histogram());
+
+    auto run = [&](int threads, auto op) {
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; ++t) {
+            pool.emplace_back([&, t] {
+                for (size_t i = 0; i < n; ++i) op(i * 2654435761u + t);
+            });
+        }
+        for (auto& th : pool) th.join();
+        return seconds_since(t0) * 1e9 / (n * threads);
+    };
+
+    std::cout << "metrics: " << n << " events per thread, " << std::thread::hardware_concurrency()
+              << " CPUs\n";
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        double c = run(threads, [&](size_t) { counter.inc(); });
+        double h = run(threads, [&](size_t i) { hist->record(i % 5000000); });
+        std::cout << "  " << threads << " thread(s): counter " << c << " ns/event, histogram " << h
+                  << " ns/event\n";
+    }
+    uint64_t expected = 0;
+    for (int threads = 1; threads <= maxThreads; threads *= 2) expected += n * threads;
+    std::cout << "  counted " << counter.value() << " / " << hist->count() << " of " << expected
+              << " events\n";
+    std::cout << "  histogram p50 " << hist->quantile(0.5) << " us, p99 " << hist->quantile(0.99)
+              << " us (uniform 0..5000000)\n";
+    return 0;
+}
+
+// Runs this binary with `args` (stdout to /dev/null) and waits for it
+static void run_self(const std::vector<std::string>& args) {
+    std::vector<char*> argv;
+    std::string self = "/proc/self/exe";
+    argv.push_back(&self[0]);
+    for (const auto& a : args) argv.push_back(const_cast<char*>(a.c_str()));
+    argv.push_back(nullptr);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    pid_t pid;
+    int rc = posix_spawn(&pid, self.c_str(), &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) throw std::runtime_error(std::string("posix_spawn failed: ") + std::strerror(rc));
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) throw std::runtime_error("child run failed");
+}
+
+// Per-job latency of a fresh process per job (today's cold start) vs thin
+// clients of a daemon, for new texts and for repeats the daemon has cached.
+// Needs OPENAI_BASE_URL (a test server). Args: [jobs] (default 20)
+static int bench_daemon(const std::vector<std::string>& args) {
+    if (!std::getenv("OPENAI_BASE_URL")) {
+        throw std::runtime_error("bench daemon needs OPENAI_BASE_URL pointing at a test server");
+    }
+    int jobs = args.size() > 0 ? std::atoi(args[0].c_str()) : 20;
+    char dir[] = "/tmp/ai_study_daemon_XXXXXX";
+    if (!mkdtemp(dir)) throw std::runtime_error("mkdtemp failed");
+    std::string sock = std::string(dir) + "/d.sock";
+
+    // One text file per job: each cold job and each first daemon job is new work
+    std::vector<std::string> files;
+    for (int j = 0; j < 3 * jobs; ++j) {
+        files.push_back(std::string(dir) + "/t" + std::to_string(j) + ".txt");
+        std::ofstream(files.back()) << synthetic_notes(3000, 100 + j);
+    }
+
+    StudyDaemon daemon(sock, nullptr);
+    std::thread server([&] { daemon.serve(); });
+
+    auto measure = [&](const char* label, const std::function<void(int)>& job) {
+        LatencyStats lat;
+        for (int j = 0; j < jobs; ++j) {
+            auto t0 = std::chrono::steady_clock::now();
+            job(j);
+            lat.add(seconds_since(t0) * 1e3);
+        }
+        std::cout << "  " << label << ": p50 " << lat.quantile(0.5) << " ms, p95 "
+                  << lat.quantile(0.95) << " ms\n";
+    };
+
+    std::cout << "daemon: " << jobs << " summary jobs of 3000 bytes each\n";
+    measure("cold process per job    ", [&](int j) { run_self({"-m", "1", "-i", files[j]}); });
+    measure("client process -> daemon", [&](int j) {
+        run_self({"--daemon", sock, "-m", "1", "-i", files[jobs + j]});
+    });
+    measure("  same texts again      ", [&](int j) {
+        run_self({"--daemon", sock, "-m", "1", "-i", files[jobs + j]});
+    });
+    DaemonClient client(sock);
+    measure("in-process client frame ", [&](int j) {
+        SummaryResult s;
+        FlashcardResult f;
+        client.study('S', read_input_file(files[2 * jobs + j]), s, f);
+    });
+
+    daemon.stop();
+    server.join();
+    for (const auto& f : files) unlink(f.c_str());
+    rmdir(dir);
+    return 0;
+}
+
+// N processes hammering one shared cache file: lookups of random keys,
+// inserting on a miss, with every value checked against its key.
+// Args: [max processes] (default 8) [ops per process] (default 200000)
+// [distinct keys] (default 20000; ~1.1 KB each, so 60000+ makes the ring wrap)
+static int bench_shmcache(const std::vector<std::string>& args) {
+    int maxProcs = args.size() > 0 ? std::atoi(args[0].c_str()) : 8;
+    long ops = args.size() > 1 ? std::atol(args[1].c_str()) : 200000;
+    int keys = args.size() > 2 ? std::atoi(args[2].c_str()) : 20000;
+    char path[] = "/tmp/ai_study_shm_XXXXXX";
+    int tmpFd = mkstemp(path);
+    if (tmpFd < 0) throw std::runtime_error("mkstemp failed");
+    close(tmpFd);
+
+    std::vector<std::string> keyOf, valueOf;
+    for (int id = 0; id < keys; ++id) {
+        keyOf.push_back("key " + std::to_string(id));
+        valueOf.push_back("value " + std::to_string(id) + ":");
+        valueOf.back().resize(200 + (size_t)(mix64(id) % 1800), (char)('a' + id % 26));
+    }
+
+    std::cout << "shmcache: " << ops << " ops per process over " << keys << " keys, "
+              << std::thread::hardware_concurrency() << " CPUs\n";
+    for (int procs = 1; procs <= maxProcs; procs *= 2) {
+        unlink(path);  // every round starts cold
+        struct Result {
+            double seconds;
+            long hits, bad;
+        };
+        int fds[2];
+        if (pipe(fds) != 0) throw std::runtime_error("pipe failed");
+        auto t0 = std::chrono::steady_clock::now();
+        for (int p = 0; p < procs; ++p) {
+            pid_t pid = fork();
+            if (pid < 0) throw std::runtime_error("fork failed");
+            if (pid > 0) continue;
+
+            SharedCache cache(path);
+            std::mt19937 rng(1000 + p);
+            Result r = {0, 0, 0};
+            std::string got;
+            auto start = std::chrono::steady_clock::now();
+            for (long i = 0; i < ops; ++i) {
+                int id = (int)(rng() % keys);
+                if (cache.get(keyOf[id], got)) {
+                    ++r.hits;
+                    if (got != valueOf[id]) ++r.bad;
+                } else {
+                    cache.put(keyOf[id], valueOf[id]);
+                }
+            }
+            r.seconds = seconds_since(start);
+            if (write(fds[1], &r, sizeof(r)) != (ssize_t)sizeof(r)) _exit(1);
+            _exit(0);
+        }
+        close(fds[1]);
+        Result total = {0, 0, 0};
+        Result r;
+        while (read(fds[0], &r, sizeof(r)) == (ssize_t)sizeof(r)) {
+            total.hits += r.hits;
+            total.bad += r.bad;
+            total.seconds = std::max(total.seconds, r.seconds);
+        }
+        close(fds[0]);
+        while (wait(nullptr) > 0) {}
+        double wall = seconds_since(t0);
+        SharedCache cache(path);
+        std::cout << "  " << procs << " process(es): " << procs * ops / wall / 1e6 << " M ops/s total, "
+                  << wall * 1e9 / (procs * ops) << " ns/op, hit rate "
+                  << 100.0 * total.hits / (procs * ops) << "%, " << cache.inserts() << " inserts, "
+                  << total.bad << " bad values\n";
+    }
+    unlink(path);
+    return 0;
+}
+
+// Scaling of the task pool on a CPU-heavy batch: parse synthetic Chat
+// Completions responses (1-8 cards each), then embed and MinHash every card.
+// Args: [responses] (default 100000) [max threads] (default: cores, at least 4)
+static int bench_pool(const std::vector<std::string>& args) {
+    size_t n = args.size() > 0 ? (size_t)std::atol(args[0].c_str()) : 100000;
+    size_t maxThreads = args.size() > 1 ? (size_t)std::atol(args[1].c_str())
+                                        : std::max(4u, std::thread::hardware_concurrency());
+    std::vector<std::string> responses(n);
+    std::vector<int64_t> source;
+    std::vector<Flashcard> pool = synthetic_cards(8 * 1024, &source);
+    for (size_t i = 0; i < n; ++i) {
+        json cards = json::array();
+        for (size_t c = 0; c < 1 + mix64(i) % 8; ++c) {
+            const Flashcard& card = pool[(i * 8 + c) % pool.size()];
+            cards.push_back({{"question", card.question}, {"answer", card.answer}});
+        }
+        std::string content = "```json\n" + json({{"flashcards", cards}}).dump() + "\n```";
+        responses[i] = json({{"choices", {{{"message", {{"role", "assistant"}, {"content", content}}}}}}}).dump();
+    }
+
+    // Parse + index one response; returns a checksum of what it produced
+    HashingEmbedder embedder;
+    auto process = [&](const std::string& response) {
+        FlashcardResult deck = parse_flashcards(json::parse(extract_json_block(
+            chat_message_content(json::parse(response)))));
+        std::vector<std::string> texts;
+        for (const auto& c : deck.flashcards) texts.push_back(c.question + "\n" + c.answer);
+        std::vector<float> vecs;
+        embedder.embed(texts, vecs);
+        uint64_t sum = 0;
+        std::vector<uint64_t> shingles;
+        MinHashSig sig;
+        for (const auto& c : deck.flashcards) {
+            if (minhash_signature(c, shingles, sig)) sum += fnv1a64((const char*)sig.data(), sizeof(sig));
+        }
+        for (float f : vecs) sum += (uint64_t)(int64_t)(f * 1e6f);
+        return sum;
+    };
+
+    std::cout << "pool: " << n << " responses, " << std::thread::hardware_concurrency() << " CPUs\n";
+    std::vector<uint64_t> sums(n);
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; ++i) sums[i] = process(responses[i]);
+    double serial = seconds_since(t0);
+    uint64_t expected = 0;
+    for (uint64_t v : sums) expected += v;
+    std::cout << "  serial loop: " << serial << " s\n";
+
+    for (size_t threads = 1; threads <= maxThreads; threads *= 2) {
+        TaskPool workers(threads);
+        std::fill(sums.begin(), sums.end(), 0);
+        auto t1 = std::chrono::steady_clock::now();
+        parallel_for(workers, n, 64, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) sums[i] = process(responses[i]);
+        });
+        double sec = seconds_since(t1);
+        uint64_t total = 0;
+        for (uint64_t v : sums) total += v;
+        std::cout << "  " << threads << " thread(s): " << sec << " s, speedup " << serial / sec
+                  << (total == expected ? "" : "  (CHECKSUM MISMATCH)") << "\n";
+    }
+    return 0;
+}
+
+// Bounded queues and the batch pipeline: queue throughput (lock-free ring
+// vs. mutex + deque), then memory use while streaming a large corpus
+// through chunking and hashing, and a network-bound stage that blocks vs.
+// sheds. Args: [corpus GiB] (default 10) [max threads] (default 4)
+static int bench_mpmc(const std::vector<std::string>& args) {
+    double gib = args.size() > 0 ? std::atof(args[0].c_str()) : 10;
+    int maxThreads = args.size() > 1 ? std::atoi(args[1].c_str()) : 4;
+    const uint64_t kItems = 4000000;
+
+    // Simplest blocking alternative, for comparison
+    struct LockedQueue {
+        std::mutex mu;
+        std::condition_variable notFull, notEmpty;
+        std::deque<uint64_t> items;
+        size_t cap;
+        void push(uint64_t v) {
+            std::unique_lock<std::mutex> lock(mu);
+            notFull.wait(lock, [&] { return items.size() < cap; });
+            items.push_back(v);
+            notEmpty.notify_one();
+        }
+        uint64_t pop() {
+            std::unique_lock<std::mutex> lock(mu);
+            notEmpty.wait(lock, [&] { return !items.empty(); });
+            uint64_t v = items.front();
+            items.pop_front();
+            notFull.notify_one();
+            return v;
+        }
+    };
+
+    // P producers and P consumers move kItems through a 1024-slot queue
+    auto run = [&](int pairs, const std::function<void(uint64_t)>& push,
+                   const std::function<uint64_t()>& pop) {
+        std::atomic<uint64_t> sum{0};
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (int p = 0; p < pairs; ++p) {
+            threads.emplace_back([&, p] {
+                for (uint64_t i = p; i < kItems; i += pairs) push(i + 1);
+            });
+            threads.emplace_back([&, p] {
+                uint64_t local = 0;
+                for (uint64_t i = p; i < kItems; i += pairs) local += pop();
+                sum += local;
+            });
+        }
+        for (auto& t : threads) t.join();
+        double sec = seconds_since(t0);
+        if (sum.load() != kItems * (kItems + 1) / 2) throw std::runtime_error("queue lost items");
+        return kItems / sec / 1e6;
+    };
+
+    std::cout << "mpmc: " << std::thread::hardware_concurrency() << " CPUs, " << kItems
+              << " items through a 1024-slot queue\n";
+    for (int pairs = 1; pairs <= maxThreads; pairs *= 2) {
+        MpmcQueue<uint64_t> ring(1024);
+        double lockFree = run(pairs, [&](uint64_t v) { ring.push(v); }, [&] {
+            uint64_t v;
+            while (!ring.pop(v)) {}
+            return v;
+        });
+        LockedQueue locked;
+        locked.cap = 1024;
+        double mutexed = run(pairs, [&](uint64_t v) { locked.push(v); }, [&] { return locked.pop(); });
+        std::cout << "  " << pairs << " producer(s) + " << pairs << " consumer(s): ring " << lockFree
+                  << " M ops/s, mutex+deque " << mutexed << " M ops/s\n";
+    }
+
+    // A corpus file streamed `passes` times stands in for a big collection
+    char path[] = "/tmp/ai_study_corpus_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) throw std::runtime_error("mkstemp failed");
+    const size_t kCorpusMiB = 256;
+    for (size_t mib = 0; mib < kCorpusMiB; ++mib) {
+        std::string block = synthetic_notes(1 << 20, 500 + mib);
+        if (write(fd, block.data(), block.size()) != (ssize_t)block.size()) throw std::runtime_error("write failed");
+    }
+    close(fd);
+
+    // Streams `limit` bytes of chunks (re-reading the file as needed)
+    // through `workers` workers that hash each chunk and then wait workMs
+    auto stream = [&](uint64_t limit, size_t workers, bool shed, int workMs) {
+        uint64_t produced = 0, index = 0;
+        int in = -1;
+        std::unique_ptr<CdcReader> chunker;
+        auto produce = [&](BatchItem& item) {
+            while (produced < limit) {
+                if (chunker && chunker->next(item.text)) {
+                    item.index = index++;
+                    item.bytes = item.text.size();
+                    produced += item.bytes;
+                    return true;
+                }
+                if (chunker) close(in);
+                in = open(path, O_RDONLY | O_CLOEXEC);
+                chunker.reset(new CdcReader(in));
+            }
+            if (chunker) close(in);
+            return false;
+        };
+        auto work = [&](BatchItem& item) {
+            std::array<std::string, 2> keys = chunk_keys(item.text, true, true, false);
+            if (workMs) std::this_thread::sleep_for(std::chrono::milliseconds(workMs));
+            item.result = keys[0];
+        };
+        uint64_t emitted = 0;
+        PipelineStats stats = run_pipeline(produce, work, [&](const BatchItem&) { ++emitted; },
+                                           workers, shed);
+        if (emitted != stats.chunks) throw std::runtime_error("pipeline lost items");
+        return stats;
+    };
+
+    double rssBefore = peak_rss_mib();
+    PipelineStats big = stream((uint64_t)(gib * (1ull << 30)), 4, false, 0);
+    std::cout << "  pipeline, " << big.bytes / double(1ull << 30) << " GiB (" << big.chunks
+              << " chunks, 4 workers hashing): " << big.bytes / big.seconds / (1 << 20)
+              << " MiB/s; peak RSS " << rssBefore << " MiB before, " << peak_rss_mib() << " MiB after\n";
+
+    // A network-bound stage: 2 ms per chunk on 4 workers, 16 MiB of input
+    for (bool shed : {false, true}) {
+        PipelineStats slow = stream(16 << 20, 4, shed, 2);
+        std::cout << "  2 ms/chunk stage, " << (shed ? "shed:  " : "block: ") << slow.chunks
+                  << " chunks in " << slow.seconds << " s, " << slow.shed << " shed; peak RSS "
+                  << peak_rss_mib() << " MiB\n";
+    }
+    unlink(path);
+    return 0;
+}
+
+// Loopback stand-in for the chat API with a fixed number of service slots
+// (changeable at run time): each request holds a slot for serviceMs, up to
+// 2x capacity more wait for one, and the rest get 429 straight away
+class CapacityTestServer {
+public:
+    CapacityTestServer(int capacity, int serviceMs) : capacity_(capacity), serviceMs_(serviceMs) {
+        listenFd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (listenFd_ < 0 || bind(listenFd_, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+            listen(listenFd_, 256) != 0 || getsockname(listenFd_, (struct sockaddr*)&addr, &len) != 0) {
+            throw std::runtime_error("test server: cannot listen");
+        }
+        port_ = ntohs(addr.sin_port);
+        acceptor_ = std::thread([this] { accept_loop(); });
+    }
+
+    ~CapacityTestServer() {
+        stopping_ = true;
+        shutdown(listenFd_, SHUT_RDWR);
+        acceptor_.join();
+        close(listenFd_);
+        std::unique_lock<std::mutex> lock(mu_);
+        for (int fd : conns_) shutdown(fd, SHUT_RDWR);
+        done_.wait(lock, [this] { return conns_.empty(); });
+    }
+
+    int port() const { return port_; }
+
+    void set_capacity(int capacity) {
+        std::lock_guard<std::mutex> lock(mu_);
+        capacity_ = capacity;
+        slot_.notify_all();
+    }
+
+    // While down, requests are read but never answered (an outage that
+    // leaves clients waiting for their timeout)
+    void set_down(bool down) { down_ = down; }
+
+private:
+    void accept_loop() {
+        while (!stopping_) {
+            int fd = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) continue;
+            std::lock_guard<std::mutex> lock(mu_);
+            conns_.push_back(fd);
+            std::thread([this, fd] { serve(fd); }).detach();
+        }
+    }
+
+    void serve(int fd) {
+        std::string in;
+        char buf[16384];
+        while (true) {
+            size_t headerEnd;
+            while ((headerEnd = in.find("\r\n\r\n")) == std::string::npos) {
+                ssize_t n = read(fd, buf, sizeof(buf));
+                if (n <= 0) return finish(fd);
+                in.append(buf, (size_t)n);
+            }
+            std::string headers = in.substr(0, headerEnd);
+            std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+            size_t bodyLen = 0;
+            size_t cl = headers.find("content-length:");
+            if (cl != std::string::npos) bodyLen = std::strtoul(headers.c_str() + cl + 15, nullptr, 10);
+            if (headers.find("expect: 100-continue") != std::string::npos) reply(fd, "HTTP/1.1 100 Continue\r\n\r\n");
+            while (in.size() < headerEnd + 4 + bodyLen) {
+                ssize_t n = read(fd, buf, sizeof(buf));
+                if (n <= 0) return finish(fd);
+                in.append(buf, (size_t)n);
+            }
+            in.erase(0, headerEnd + 4 + bodyLen);
+            if (down_) continue;
+
+            int status = take_slot() ? 200 : 429;
+            std::string body = status == 200
+                ? R"({"choices":[{"message":{"role":"assistant","content":"{\"summary\":\"ok\",\"key_points\":[],\"definitions\":[]}"}}]})"
+                : R"({"error":{"message":"rate limited"}})";
+            reply(fd, "HTTP/1.1 " + std::to_string(status) + (status == 200 ? " OK" : " Too Many Requests") +
+                      "\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) +
+                      "\r\n\r\n" + body);
+        }
+    }
+
+    // Waits for and holds a service slot for serviceMs; false = rejected
+    bool take_slot() {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (busy_ + waiting_ >= 3 * capacity_) return false;
+        ++waiting_;
+        slot_.wait(lock, [this] { return busy_ < capacity_; });
+        --waiting_;
+        ++busy_;
+        lock.unlock();
+        std::this_thread::sleep_for(std::chrono::milliseconds(serviceMs_));
+        lock.lock();
+        --busy_;
+        slot_.notify_one();
+        return true;
+    }
+
+    void reply(int fd, const std::string& data) {
+        if (send(fd, data.data(), data.size(), MSG_NOSIGNAL) < 0) {}
+    }
+
+    void finish(int fd) {
+        close(fd);
+        std::lock_guard<std::mutex> lock(mu_);
+        conns_.erase(std::find(conns_.begin(), conns_.end(), fd));
+        done_.notify_all();
+    }
+
+    int capacity_, serviceMs_;
+    int listenFd_ = -1, port_ = 0;
+    std::atomic<bool> stopping_{false}, down_{false};
+    std::thread acceptor_;
+    std::mutex mu_;
+    std::condition_variable slot_, done_;
+    int busy_ = 0, waiting_ = 0;
+    std::vector<int> conns_;
+};
+
+// Adaptive vs. fixed in-flight limits against a server whose capacity
+// changes mid-run (8 slots, then 3, then 16; 50 ms per request), with a
+// closed loop of clients sending summary requests.
+// Args: [seconds] (default 30) [clients] (default 32)
+static int bench_limiter(const std::vector<std::string>& args) {
+    double seconds = args.size() > 0 ? std::atof(args[0].c_str()) : 30;
+    int clients = args.size() > 1 ? std::atoi(args[1].c_str()) : 32;
+    const int kServiceMs = 50;
+    const int kCapacity[3] = {8, 3, 16};
+
+    CapacityTestServer server(kCapacity[0], kServiceMs);
+    setenv("OPENAI_BASE_URL", ("http://127.0.0.1:" + std::to_string(server.port()) + "/v1").c_str(), 1);
+    setenv("OPENAI_API_KEY", "test", 0);
+
+    auto run = [&](const char* label, double initial, double minLimit, double maxLimit) {
+        chat_limiter().reset(initial, minLimit, maxLimit);
+        server.set_capacity(kCapacity[0]);
+        std::atomic<bool> stop{false};
+        std::mutex mu;
+        LatencyStats lat[3];
+        size_t ok[3] = {0, 0, 0}, rejected[3] = {0, 0, 0};
+        double limitSum[3] = {0, 0, 0};
+        int limitSamples[3] = {0, 0, 0};
+        std::atomic<int> phase{0};
+
+        std::vector<std::thread> pool;
+        for (int c = 0; c < clients; ++c) {
+            pool.emplace_back([&] {
+                while (!stop.load()) {
+                    auto t0 = std::chrono::steady_clock::now();
+                    int ph = phase.load();
+                    try {
+                        summarize_content("The cell is the basic unit of life.");
+                        std::lock_guard<std::mutex> lock(mu);
+                        ++ok[ph];
+                        lat[ph].add(seconds_since(t0) * 1e3);
+                    } catch (const std::exception&) {
+                        {
+                            std::lock_guard<std::mutex> lock(mu);
+                            ++rejected[ph];
+                        }
+                        std::this_thread::sleep_for(std::chrono::milliseconds(10));  // client back-off
+                    }
+                }
+            });
+        }
+
+        std::cout << "  " << label << "\n    limit per second:";
+        auto start = std::chrono::steady_clock::now();
+        for (int tick = 1; seconds_since(start) < seconds; ++tick) {
+            std::this_thread::sleep_until(start + std::chrono::milliseconds(250 * tick));
+            int ph = std::min(2, (int)(seconds_since(start) * 3 / seconds));
+            if (ph != phase.load()) {
+                phase = ph;
+                server.set_capacity(kCapacity[ph]);
+            }
+            limitSum[ph] += chat_limiter().limit();
+            ++limitSamples[ph];
+            if (tick % 4 == 0) std::cout << " " << (int)std::lround(chat_limiter().limit());
+        }
+        stop = true;
+        for (auto& t : pool) t.join();
+        std::cout << "\n";
+        for (int ph = 0; ph < 3; ++ph) {
+            std::cout << "    capacity " << kCapacity[ph] << " (max " << kCapacity[ph] * 1000 / kServiceMs
+                      << "/s): " << ok[ph] / (seconds / 3) << " req/s, p50 " << lat[ph].quantile(0.5)
+                      << " ms, p95 " << lat[ph].quantile(0.95) << " ms, " << rejected[ph]
+                      << " rejected, mean limit " << limitSum[ph] / std::max(1, limitSamples[ph]) << "\n";
+        }
+    };
+
+    std::cout << "limiter: " << clients << " clients, " << seconds << " s, capacity 8 -> 3 -> 16 slots of "
+              << kServiceMs << " ms\n";
+    run("adaptive (start 4)", 4, 1, 64);
+    run(("fixed " + std::to_string(clients) + " in flight").c_str(), clients, clients, clients);
+    run("fixed 4 in flight", 4, 4, 4);
+    return 0;
+}
+
+// Time to an answer through an API outage: clients keep asking for
+// summaries while the loopback server is up, then silent (requests time out
+// after 2 s), then up again; once with the circuit breaker and once with it
+// effectively off. Offline fallback is on in both.
+// Args: [seconds per phase] (default 10) [clients] (default 4)
+static int bench_breaker(const std::vector<std::string>& args) {
+    double phaseSec = args.size() > 0 ? std::atof(args[0].c_str()) : 10;
+    int clients = args.size() > 1 ? std::atoi(args[1].c_str()) : 4;
+    const char* kPhase[3] = {"up", "outage", "recovered"};
+
+    CapacityTestServer server(64, 20);
+    setenv("OPENAI_BASE_URL", ("http://127.0.0.1:" + std::to_string(server.port()) + "/v1").c_str(), 1);
+    setenv("OPENAI_API_KEY", "test", 0);
+    http_policy().totalTimeoutMs = 2000;
+    http_policy().offlineFallback = true;
+    std::string text = synthetic_notes(2000, 5);
+
+    auto run = [&](const char* label, int tripAfter) {
+        chat_breaker().reset(tripAfter, 2000, 60000);
+        server.set_down(false);
+        std::atomic<bool> stop{false};
+        std::atomic<int> phase{0};
+        std::mutex mu;
+        LatencyStats lat[3];
+        size_t offline[3] = {0, 0, 0};
+        double firstOnline = -1;  // seconds after the outage ended
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> pool;
+        for (int c = 0; c < clients; ++c) {
+            pool.emplace_back([&] {
+                while (!stop.load()) {
+                    auto t0 = std::chrono::steady_clock::now();
+                    int ph = phase.load();
+                    SummaryResult r = summarize_content(text);
+                    double ms = seconds_since(t0) * 1e3;
+                    {
+                        std::lock_guard<std::mutex> lock(mu);
+                        lat[ph].add(ms);
+                        if (r.offline) ++offline[ph];
+                        if (ph == 2 && !r.offline && firstOnline < 0) {
+                            firstOnline = seconds_since(start) - 2 * phaseSec;
+                        }
+                    }
+                    std::this_thread::sleep_for(std::chrono::milliseconds(50));  // user reads
+                }
+            });
+        }
+        for (int ph = 1; ph <= 3; ++ph) {
+            std::this_thread::sleep_until(start + std::chrono::milliseconds((long)(ph * phaseSec * 1000)));
+            if (ph == 3) break;
+            phase = ph;
+            server.set_down(ph == 1);
+        }
+        stop = true;
+        for (auto& t : pool) t.join();
+
+        std::cout << "  " << label << "\n";
+        for (int ph = 0; ph < 3; ++ph) {
+            std::cout << "    " << kPhase[ph] << ": " << lat[ph].samples.size() << " answers ("
+                      << offline[ph] << " offline), time to answer p50 " << lat[ph].quantile(0.5)
+                      << " ms, p95 " << lat[ph].quantile(0.95) << " ms, max " << lat[ph].quantile(1.0) << " ms\n";
+        }
+        std::cout << "    first API answer " << firstOnline << " s after recovery\n";
+    };
+
+    std::cout << "breaker: " << clients << " clients, " << phaseSec
+              << " s each up / outage / recovered, 2 s request timeout\n";
+    run("circuit breaker (trip after 5 failures)", 5);
+    run("no breaker", std::numeric_limits<int>::max());
+    return 0;
+}
+
+// Study-like text with a Zipf-distributed vocabulary of `vocab` made-up
+// words (so word frequencies look like prose, unlike synthetic_notes)
+static std::string zipf_notes(size_t bytes, size_t vocab, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<std::string> words(vocab);
+    for (auto& w : words) {
+        size_t len = 3 + rng() % 7;
+        for (size_t i = 0; i < len; ++i) w += (char)('a' + rng() % 26);
+    }
+    std::vector<double> cdf(vocab);
+    double total = 0;
+    for (size_t r = 0; r < vocab; ++r) cdf[r] = total += 1.0 / (r + 1);
+    std::uniform_real_distribution<double> uni(0, total);
+
+    std::string text;
+    while (text.size() < bytes) {
+        size_t sentences = 3 + rng() % 5;
+        for (size_t i = 0; i < sentences; ++i) {
+            size_t n = 8 + rng() % 13;
+            for (size_t k = 0; k < n; ++k) {
+                std::string w = words[std::lower_bound(cdf.begin(), cdf.end(), uni(rng)) - cdf.begin()];
+                if (k == 0) w[0] = (char)std::toupper((unsigned char)w[0]);
+                text += w;
+                text += k + 1 < n ? " " : ". ";
+            }
+        }
+        text += "\n\n";
+    }
+    return text;
+}
+
+// Offline summarizer: segmentation, TF-IDF + LexRank and the whole
+// SummaryResult on a Zipf-vocabulary text and on synthetic_notes (20-word
+// vocabulary: every sentence is similar to every other, the densest case),
+// plus what exact all-pairs similarity would cost instead of the sparse
+// graph. Args: [MB] (default 4)
+static int bench_textrank(const std::vector<std::string>& args) {
+    double mb = args.size() > 0 ? std::atof(args[0].c_str()) : 4;
+    size_t bytes = (size_t)(mb * 1048576);
+    std::cout << "textrank: " << task_pool().threads() << " threads\n";
+
+    struct Input {
+        const char* name;
+        std::string text;
+    } inputs[] = {{"zipf vocabulary (20k words)", zipf_notes(bytes, 20000, 11)},
+                  {"synthetic_notes (20 words)", synthetic_notes(bytes, 11)}};
+    for (const auto& in : inputs) {
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<std::string> sentences = split_sentences(in.text);
+        double splitSec = seconds_since(t0);
+
+        t0 = std::chrono::steady_clock::now();
+        ScoredSentences st = score_sentences(in.text);
+        double scoreSec = seconds_since(t0);
+
+        t0 = std::chrono::steady_clock::now();
+        SummaryResult r = offline_summary(in.text);
+        double summarySec = seconds_since(t0);
+
+        // All-pairs cosine on a sample, scaled to n^2 / 2 pairs
+        size_t sample = std::min<size_t>(st.vectors.size(), 2000);
+        t0 = std::chrono::steady_clock::now();
+        double sink = 0;
+        for (size_t i = 0; i < sample; ++i) {
+            for (size_t j = i + 1; j < sample; ++j) sink += sparse_dot(st.vectors[i], st.vectors[j]);
+        }
+        double pairSec = seconds_since(t0) * ((double)st.vectors.size() * st.vectors.size()) /
+                         std::max(1.0, (double)sample * sample);
+
+        std::cout << "  " << in.name << ": " << in.text.size() / 1048576.0 << " MiB, " << sentences.size()
+                  << " sentences\n"
+                  << "    split " << splitSec * 1e3 << " ms, TF-IDF + LexRank " << scoreSec * 1e3
+                  << " ms, whole summary " << summarySec * 1e3 << " ms ("
+                  << in.text.size() / 1048576.0 / summarySec << " MiB/s), " << r.summary.size()
+                  << " chars\n"
+                  << "    all-pairs similarity instead of the sparse graph: ~" << pairSec << " s"
+                  << (sink < 0 ? "!" : "") << "\n";
+    }
+    return 0;
+}
+
+// Offline extraction: definitions (cue phrases through the Aho-Corasick
+// DFA) against one std::string::find pass per cue over a lower-cased copy,
+// key phrases, and the whole offline deck, on a Zipf-vocabulary text where
+// every 8th sentence carries a definition cue. Args: [MB] (default 64)
+static int bench_extract(const std::vector<std::string>& args) {
+    double mb = args.size() > 0 ? std::atof(args[0].c_str()) : 64;
+    std::string plain = zipf_notes((size_t)(mb * 1048576), 20000, 3);
+    static const char* kInserted[] = {" is defined as", " refers to", " is a", " is called"};
+    std::string text;
+    text.reserve(plain.size() + plain.size() / 40);
+    size_t sentence = 0;
+    bool firstWord = true;  // still in the current sentence's first word
+    for (size_t i = 0; i < plain.size(); ++i) {
+        char c = plain[i];
+        // "Word is defined as ..." in every 8th sentence
+        if (firstWord && c == ' ' && i > 0 && plain[i - 1] != '.' && plain[i - 1] != '\n') {
+            if (sentence % 8 == 0) text += kInserted[(sentence / 8) % 4];
+            firstWord = false;
+        }
+        text += c;
+        if (c == '.') {
+            ++sentence;
+            firstWord = true;
+        }
+    }
+    double size = text.size() / 1048576.0;
+    std::cout << "extract: " << size << " MiB\n";
+
+    auto t0 = std::chrono::steady_clock::now();
+    size_t defs = extract_definitions(text, SIZE_MAX).size();
+    double acSec = seconds_since(t0);
+
+    static const char* kCues[] = {" is defined as ", " are defined as ", " refers to ", " refer to ", " is a ",
+                                  " is an ", " is the ", " are ", " means ", " is called ", " are called ",
+                                  " is known as ", " are known as "};
+    t0 = std::chrono::steady_clock::now();
+    std::string lower = text;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    size_t hits = 0;
+    for (const char* cue : kCues) {
+        for (size_t at = lower.find(cue); at != std::string::npos; at = lower.find(cue, at + 1)) ++hits;
+    }
+    double findSec = seconds_since(t0);
+
+    t0 = std::chrono::steady_clock::now();
+    std::vector<Keyphrase> phrases = extract_keyphrases(text, 60);
+    double kpSec = seconds_since(t0);
+
+    t0 = std::chrono::steady_clock::now();
+    FlashcardResult deck = offline_flashcards(text);
+    double deckSec = seconds_since(t0);
+
+    std::cout << "  definitions, Aho-Corasick: " << acSec * 1e3 << " ms (" << size / acSec << " MiB/s), "
+              << defs << " found\n"
+              << "  cue matches, find() per cue: " << findSec * 1e3 << " ms (" << size / findSec
+              << " MiB/s), " << hits << " matches, no extraction\n"
+              << "  key phrases: " << kpSec * 1e3 << " ms (" << size / kpSec << " MiB/s), best \""
+              << (phrases.empty() ? "" : phrases[0].phrase) << "\"\n"
+              << "  offline deck: " << deckSec * 1e3 << " ms, " << deck.flashcards.size() << " cards\n";
+    return 0;
+}
+
+// Writes a llama-architecture GGUF model with random weights of `type`
+// (Q8_0 or Q4_0): right shape and formats, meaningless output. Its
+// vocabulary has byte tokens, the Zephyr control tokens and the words of
+// synthetic_notes(), so prompts tokenize like real text.
+static void write_synthetic_gguf(const std::string& path, uint32_t type, size_t dim, size_t layers,
+                                 size_t ffDim, size_t heads, size_t kvHeads, size_t vocab) {
+    std::string header;
+    auto put = [&](const void* p, size_t n) { header.append(static_cast<const char*>(p), n); };
+    auto u32 = [&](uint32_t v) { put(&v, 4); };
+    auto u64 = [&](uint64_t v) { put(&v, 8); };
+    auto str = [&](const std::string& s) {
+        u64(s.size());
+        header += s;
+    };
+
+    // Vocabulary
+    std::vector<std::string> tokens = {"<unk>", "<s>", "</s>", "<|system|>", "<|user|>", "<|assistant|>"};
+    std::vector<int32_t> types = {2, 3, 3, 3, 3, 3};
+    for (int b = 0; b < 256; ++b) {
+        char piece[8];
+        std::snprintf(piece, sizeof piece, "<0x%02X>", b);
+        tokens.push_back(piece);
+        types.push_back(6);
+    }
+    const char* kSpace = "\xe2\x96\x81";
+    tokens.push_back(kSpace);
+    for (char c = 'a'; c <= 'z'; ++c) tokens.push_back(std::string(1, c));
+    for (const char* w : {"cells", "divide", "by", "mitosis", "while", "energy", "flows", "through", "membranes",
+                          "and", "enzymes", "speed", "up", "reactions", "in", "the", "nucleus", "of", "every",
+                          "plant", "summarize", "these", "notes", "as", "json"}) {
+        // with every prefix, as SentencePiece only merges into known pieces
+        std::string piece = kSpace;
+        for (const char* c = w; *c; ++c) {
+            piece += *c;
+            if (std::find(tokens.begin(), tokens.end(), piece) == tokens.end()) tokens.push_back(piece);
+        }
+    }
+    for (size_t i = 0; tokens.size() < vocab; ++i) tokens.push_back(kSpace + std::string("w") + std::to_string(i));
+    types.resize(tokens.size(), 1);
+    std::vector<float> scores(tokens.size());
+    for (size_t i = 0; i < tokens.size(); ++i) scores[i] = types[i] == 1 ? (float)tokens[i].size() : 0.0f;
+
+    const size_t kvDim = dim / heads * kvHeads;
+    u32(0x46554747);
+    u32(3);
+    struct Tensor {
+        std::string name;
+        std::vector<uint64_t> dims;
+        uint32_t type;
+    };
+    std::vector<Tensor> tensors = {{"token_embd.weight", {dim, vocab}, type},
+                                   {"output_norm.weight", {dim}, kGgufF32},
+                                   {"output.weight", {dim, vocab}, type}};
+    for (size_t l = 0; l < layers; ++l) {
+        std::string p = "blk." + std::to_string(l) + ".";
+        tensors.push_back({p + "attn_norm.weight", {dim}, kGgufF32});
+        tensors.push_back({p + "ffn_norm.weight", {dim}, kGgufF32});
+        tensors.push_back({p + "attn_q.weight", {dim, dim}, type});
+        tensors.push_back({p + "attn_k.weight", {dim, kvDim}, type});
+        tensors.push_back({p + "attn_v.weight", {dim, kvDim}, type});
+        tensors.push_back({p + "attn_output.weight", {dim, dim}, type});
+        tensors.push_back({p + "ffn_gate.weight", {dim, ffDim}, type});
+        tensors.push_back({p + "ffn_up.weight", {dim, ffDim}, type});
+        tensors.push_back({p + "ffn_down.weight", {ffDim, dim}, type});
+    }
+    u64(tensors.size());
+    u64(12);
+    auto kv_u32 = [&](const std::string& key, uint32_t v) {
+        str(key);
+        u32(4);
+        u32(v);
+    };
+    str("general.architecture");
+    u32(8);
+    str("llama");
+    str("general.name");
+    u32(8);
+    str("synthetic");
+    kv_u32("llama.embedding_length", (uint32_t)dim);
+    kv_u32("llama.block_count", (uint32_t)layers);
+    kv_u32("llama.feed_forward_length", (uint32_t)ffDim);
+    kv_u32("llama.attention.head_count", (uint32_t)heads);
+    kv_u32("llama.attention.head_count_kv", (uint32_t)kvHeads);
+    kv_u32("llama.context_length", 2048);
+    str("tokenizer.ggml.model");
+    u32(8);
+    str("llama");
+    str("tokenizer.ggml.tokens");
+    u32(9);
+    u32(8);
+    u64(tokens.size());
+    for (const auto& t : tokens) str(t);
+    str("tokenizer.ggml.scores");
+    u32(9);
+    u32(6);
+    u64(scores.size());
+    put(scores.data(), scores.size() * 4);
+    str("tokenizer.ggml.token_type");
+    u32(9);
+    u32(5);
+    u64(types.size());
+    put(types.data(), types.size() * 4);
+
+    uint64_t offset = 0;
+    for (const auto& t : tensors) {
+        str(t.name);
+        u32((uint32_t)t.dims.size());
+        for (uint64_t d : t.dims) u64(d);
+        u32(t.type);
+        u64(offset);
+        size_t n = (size_t)t.dims[0] * (t.dims.size() > 1 ? (size_t)t.dims[1] : 1);
+        offset += (gguf_bytes(t.type, n) + 31) / 32 * 32;
+    }
+    header.resize((header.size() + 31) / 32 * 32, '\0');
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) throw std::runtime_error("Cannot write " + path);
+    out.write(header.data(), (std::streamsize)header.size());
+    std::mt19937_64 rng(11);
+    for (const auto& t : tensors) {
+        size_t cols = (size_t)t.dims[0], rows = t.dims.size() > 1 ? (size_t)t.dims[1] : 1;
+        std::string data;
+        if (t.type == kGgufF32) {
+            std::vector<float> ones(cols * rows, 1.0f);
+            data.assign(reinterpret_cast<const char*>(ones.data()), ones.size() * 4);
+        } else {
+            // Values of about 1/sqrt(cols), so activations keep their scale
+            // (embedding rows about 1)
+            double target = t.name == "token_embd.weight" ? 1.0 : 1.0 / std::sqrt((double)cols);
+            size_t blocks = cols * rows / kQuantBlock;
+            if (t.type == kGgufQ8_0) {
+                std::vector<BlockQ8_0> b(blocks);
+                uint16_t d = f32_to_fp16((float)(target / 73.0));  // uniform q: sd 73
+                for (auto& blk : b) {
+                    blk.d = d;
+                    for (auto& q : blk.qs) q = (int8_t)((int)(rng() % 255) - 127);
+                }
+                data.assign(reinterpret_cast<const char*>(b.data()), b.size() * sizeof(BlockQ8_0));
+            } else {
+                std::vector<BlockQ4_0> b(blocks);
+                uint16_t d = f32_to_fp16((float)(target / 4.6));  // uniform q - 8: sd 4.6
+                for (auto& blk : b) {
+                    blk.d = d;
+                    for (auto& q : blk.qs) q = (uint8_t)rng();
+                }
+                data.assign(reinterpret_cast<const char*>(b.data()), b.size() * sizeof(BlockQ4_0));
+            }
+        }
+        data.resize((data.size() + 31) / 32 * 32, '\0');
+        out.write(data.data(), (std::streamsize)data.size());
+    }
+    if (!out.flush()) throw std::runtime_error("Cannot write " + path);
+}
+
+// Local model: quantized kernel accuracy and speed, then prefill and
+// decode tokens/s for 1, 2, 4, ... threads up to the core count, the
+// time a cached prompt prefix saves, and memory. Uses the model given,
+// or synthetic Q8_0 and Q4_0 models (random weights) of about 100M
+// parameters. Args: [model.gguf] [decode tokens] (default 32)
+static int bench_llm(const std::vector<std::string>& args) {
+    size_t decodeTokens = args.size() > 1 ? (size_t)std::atol(args[1].c_str()) : 32;
+
+    // Kernels: each set against the scalar one, and the scalar one against
+    // float math on the dequantized weights
+    {
+        const size_t kCols = 4096, kRows = 64, blocks = kCols / kQuantBlock;
+        std::mt19937_64 rng(3);
+        std::normal_distribution<float> normal(0.0f, 1.0f);
+        std::vector<float> w(kRows * kCols), x(kCols);
+        for (auto& v : w) v = normal(rng);
+        for (auto& v : x) v = normal(rng);
+        std::vector<BlockQ8_0> w8(kRows * blocks), xq(blocks);
+        std::vector<BlockQ4_0> w4(kRows * blocks);
+        quantize_q8_0(w.data(), w8.data(), w.size());
+        quantize_q8_0(x.data(), xq.data(), kCols);
+        for (size_t b = 0; b < w4.size(); ++b) {
+            const float* v = &w[b * kQuantBlock];
+            float amax = 0, signedMax = 0;
+            for (size_t j = 0; j < kQuantBlock; ++j) {
+                if (std::fabs(v[j]) > amax) amax = std::fabs(signedMax = v[j]);
+            }
+            float d = signedMax / -8, id = d != 0 ? 1 / d : 0;
+            w4[b].d = f32_to_fp16(d);
+            for (size_t j = 0; j < kQuantBlock / 2; ++j) {
+                int lo = std::min(15, (int)(v[j] * id + 8.5f)), hi = std::min(15, (int)(v[j + 16] * id + 8.5f));
+                w4[b].qs[j] = (uint8_t)(lo | hi << 4);
+            }
+        }
+        double err8 = 0, err4 = 0, norm = 0;
+        for (size_t r = 0; r < kRows; ++r) {
+            double exact = 0;
+            for (size_t i = 0; i < kCols; ++i) exact += (double)w[r * kCols + i] * x[i];
+            err8 += std::fabs(kScalarKernels.dot_q8_0(&w8[r * blocks], xq.data(), blocks) - exact);
+            err4 += std::fabs(kScalarKernels.dot_q4_0(&w4[r * blocks], xq.data(), blocks) - exact);
+            norm += std::fabs(exact);
+        }
+        std::cout << "llm kernels (" << kCols << "-wide rows): mean relative error vs float, Q8_0 "
+                  << err8 / norm << ", Q4_0 " << err4 / norm << "\n";
+        const size_t reps = 20000;
+        for (const SimdKernels* k : available_kernels()) {
+            for (size_t r = 0; r < kRows; ++r) {
+                float a8 = k->dot_q8_0(&w8[r * blocks], xq.data(), blocks);
+                float b8 = kScalarKernels.dot_q8_0(&w8[r * blocks], xq.data(), blocks);
+                float a4 = k->dot_q4_0(&w4[r * blocks], xq.data(), blocks);
+                float b4 = kScalarKernels.dot_q4_0(&w4[r * blocks], xq.data(), blocks);
+                if (std::fabs(a8 - b8) > 1e-3f * std::max(1.0f, std::fabs(b8)) ||
+                    std::fabs(a4 - b4) > 1e-3f * std::max(1.0f, std::fabs(b4))) {
+                    throw std::runtime_error(std::string("quantized kernel mismatch in ") + k->name);
+                }
+            }
+            auto rate = [&](auto&& body) {
+                volatile float sink = 0;
+                auto t0 = std::chrono::steady_clock::now();
+                for (size_t rep = 0; rep < reps / kRows; ++rep) {
+                    for (size_t r = 0; r < kRows; ++r) sink = sink + body(r);
+                }
+                return (double)(reps / kRows) * kRows * kCols * 2 / seconds_since(t0) / 1e9;
+            };
+            double q8 = rate([&](size_t r) { return k->dot_q8_0(&w8[r * blocks], xq.data(), blocks); });
+            double q4 = rate([&](size_t r) { return k->dot_q4_0(&w4[r * blocks], xq.data(), blocks); });
+            std::cout << "  " << k->name << ": Q8_0 " << q8 << ", Q4_0 " << q4 << " GOP/s (weights in cache)\n";
+        }
+    }
+
+    std::vector<std::pair<std::string, bool>> models;  // path, synthetic
+    if (!args.empty() && args[0] != "-") {
+        models.push_back({args[0], false});
+    } else {
+        for (uint32_t type : {kGgufQ8_0, kGgufQ4_0}) {
+            std::string path = "/tmp/ai_study_bench_" + std::to_string(getpid()) +
+                               (type == kGgufQ8_0 ? "_q8_0.gguf" : "_q4_0.gguf");
+            write_synthetic_gguf(path, type, 1024, 8, 2816, 16, 4, 8192);
+            models.push_back({path, true});
+        }
+    }
+
+    const std::string system = kSummaryInstructions;
+    const std::string user = synthetic_notes(2400, 7);
+    const std::string user2 = synthetic_notes(2400, 8);
+    std::vector<size_t> threadCounts;
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t t = 1; t < cores; t *= 2) threadCounts.push_back(t);
+    threadCounts.push_back(cores);
+
+    for (const auto& m : models) {
+        double rssBefore = peak_rss_mib();
+        LocalModel model(m.first);
+        std::cout << model.description() << "; " << model.mapped_bytes() / 1048576.0 << " MiB mapped\n";
+        std::vector<int32_t> prompt = model.encode_chat(system, user);
+        std::vector<int32_t> reference;
+        for (size_t threads : threadCounts) {
+            TaskPool pool(threads);
+            model.set_pool(pool);
+            model.clear_cache();
+            LocalModel::Stats before = model.stats();
+            std::vector<int32_t> out = model.generate(prompt, decodeTokens, nullptr, false);
+            LocalModel::Stats after = model.stats();
+            if (reference.empty()) reference = out;
+            else if (out != reference) throw std::runtime_error("output differs between thread counts");
+            double prefill = prompt.size() / (after.prefillSeconds - before.prefillSeconds);
+            double decode = out.size() / (after.decodeSeconds - before.decodeSeconds);
+            std::cout << "  " << threads << (threads == 1 ? " thread:  " : " threads: ") << "prefill "
+                      << prefill << " tok/s (" << prompt.size() << " tokens), decode " << decode
+                      << " tok/s, " << model.mapped_bytes() / 1048576.0 * decode / 1024 << " GiB/s of weights\n";
+            model.set_pool(task_pool());
+        }
+
+        // A second request with the same instructions: cold vs. prefix cached
+        std::vector<int32_t> prompt2 = model.encode_chat(system, user2);
+        size_t shared = 0;
+        while (shared < prompt.size() && prompt[shared] == prompt2[shared]) ++shared;
+        auto first_token = [&](bool warm) {
+            model.clear_cache();
+            if (warm) model.generate(prompt, 1, nullptr, false);
+            auto t0 = std::chrono::steady_clock::now();
+            std::vector<int32_t> out = model.generate(prompt2, 1, nullptr, false);
+            return std::make_pair(seconds_since(t0), out);
+        };
+        auto cold = first_token(false), warm = first_token(true);
+        if (cold.second != warm.second) throw std::runtime_error("prefix reuse changed the output");
+        std::cout << "  second request (" << prompt2.size() << " tokens, " << shared
+                  << " shared with the first): first token after " << cold.first * 1e3 << " ms cold, "
+                  << warm.first * 1e3 << " ms with the prefix cached\n";
+        std::cout << "  memory: KV cache " << model.cache_bytes() / 1048576.0 << " MiB, peak RSS "
+                  << peak_rss_mib() << " MiB (" << peak_rss_mib() - rssBefore << " MiB more, weights included)\n";
+        if (m.second) unlink(m.first.c_str());
+    }
+    return 0;
+}
+
+// The stand-in's reply to a chat request: summaries and cards name a hash
+// of the text they were asked about, so a result can be checked against
+// its chunk
+static std::string stand_in_tag(const std::string& text) {
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)fnv1a64(text.data(), text.size()));
+    return hex;
+}
+
+static json stand_in_completion(const json& request) {
+    const json& messages = request.at("messages");
+    std::string system = messages.at(0).value("content", "");
+    std::string user = messages.at(1).value("content", "");
+    std::string tag = stand_in_tag(user.compare(0, 6, "TEXT:\n") == 0 ? user.substr(6) : user);
+    json reply = json::object();
+    if (system != kFlashcardInstructions) {
+        reply["summary"] = "stand-in summary " + tag;
+        reply["key_points"] = {"point " + tag};
+        reply["definitions"] = json::array();
+    }
+    if (system != kSummaryInstructions) {
+        reply["flashcards"] = {{{"question", "stand-in card " + tag}, {"answer", "answer"}}};
+    }
+    return {{"object", "chat.completion"},
+            {"model", request.value("model", "")},
+            {"choices", {{{"index", 0}, {"message", {{"role", "assistant"}, {"content", reply.dump()}}}}}}};
+}
+
+// Loopback stand-in for the Batch API endpoints --bulk uses (files,
+// batches, file content), and for chat completions to compare with
+// --batch. A submitted batch validates for validateMs, then runs its
+// requests at perRequestMs each on a background thread; every failEvery-th
+// request (0 = none) fails with HTTP 500, every garbleEvery-th result line
+// is cut short (unreadable), and with expireAfter set a batch expires after
+// running that many.
+class BatchStandInServer {
+public:
+    BatchStandInServer(int validateMs, double perRequestMs, int chatServiceMs, int port = 0)
+        : validateMs_(validateMs), perRequestMs_(perRequestMs), chatServiceMs_(chatServiceMs) {
+        listenFd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons((uint16_t)port);
+        socklen_t len = sizeof(addr);
+        int one = 1;
+        setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (listenFd_ < 0 || bind(listenFd_, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+            listen(listenFd_, 256) != 0 || getsockname(listenFd_, (struct sockaddr*)&addr, &len) != 0) {
+            throw std::runtime_error("test server: cannot listen");
+        }
+        port_ = ntohs(addr.sin_port);
+        acceptor_ = std::thread([this] { accept_loop(); });
+    }
+
+    ~BatchStandInServer() {
+        stopping_ = true;
+        shutdown(listenFd_, SHUT_RDWR);
+        acceptor_.join();
+        close(listenFd_);
+        for (auto& t : runners_) t.join();
+        std::unique_lock<std::mutex> lock(mu_);
+        for (int fd : conns_) shutdown(fd, SHUT_RDWR);
+        done_.wait(lock, [this] { return conns_.empty(); });
+    }
+
+    int port() const { return port_; }
+    void set_fail_every(size_t n) { failEvery_ = n; }
+    void set_garble_every(size_t n) { garbleEvery_ = n; }
+    void set_expire_after(size_t n) { expireAfter_ = n; }
+
+    // Requests failed or garbled on purpose so far
+    size_t failed() const { return failed_; }
+
+    std::vector<std::string> batch_ids() {
+        std::lock_guard<std::mutex> lock(mu_);
+        std::vector<std::string> ids;
+        for (const auto& b : batches_) ids.push_back(b.first);
+        std::sort(ids.begin(), ids.end(), [](const std::string& a, const std::string& b) {
+            return a.size() != b.size() ? a.size() < b.size() : a < b;
+        });
+        return ids;
+    }
+
+private:
+    struct Batch {
+        std::string inputFile, status = "validating", outputFile, errorFile;
+        size_t total = 0, completed = 0, failed = 0;
+    };
+
+    void accept_loop() {
+        while (!stopping_) {
+            int fd = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) continue;
+            std::lock_guard<std::mutex> lock(mu_);
+            conns_.push_back(fd);
+            std::thread([this, fd] { serve(fd); }).detach();
+        }
+    }
+
+    void serve(int fd) {
+        std::string in;
+        char buf[65536];
+        while (true) {
+            size_t headerEnd;
+            while ((headerEnd = in.find("\r\n\r\n")) == std::string::npos) {
+                ssize_t n = read(fd, buf, sizeof(buf));
+                if (n <= 0) return finish(fd);
+                in.append(buf, (size_t)n);
+            }
+            std::string headers = in.substr(0, headerEnd), lower = headers;
+            std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+            size_t bodyLen = 0;
+            size_t cl = lower.find("content-length:");
+            if (cl != std::string::npos) bodyLen = std::strtoul(lower.c_str() + cl + 15, nullptr, 10);
+            if (lower.find("expect: 100-continue") != std::string::npos) reply(fd, "HTTP/1.1 100 Continue\r\n\r\n");
+            while (in.size() < headerEnd + 4 + bodyLen) {
+                ssize_t n = read(fd, buf, sizeof(buf));
+                if (n <= 0) return finish(fd);
+                in.append(buf, (size_t)n);
+            }
+            std::string body = in.substr(headerEnd + 4, bodyLen);
+            in.erase(0, headerEnd + 4 + bodyLen);
+
+            int status = 200;
+            std::string out;
+            try {
+                out = route(headers, lower, body, status);
+            } catch (const std::exception& ex) {
+                status = 400;
+                out = json{{"error", {{"message", ex.what()}}}}.dump();
+            }
+            reply(fd, "HTTP/1.1 " + std::to_string(status) + (status == 200 ? " OK" : " Error") +
+                      "\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(out.size()) +
+                      "\r\n\r\n" + out);
+        }
+    }
+
+    std::string route(const std::string& headers, const std::string& lower, const std::string& body, int& status) {
+        std::string line = headers.substr(0, headers.find("\r\n"));
+        std::string method = line.substr(0, line.find(' '));
+        std::string path = line.substr(method.size() + 1, line.rfind(' ') - method.size() - 1);
+
+        if (method == "POST" && path == "/v1/chat/completions") {
+            std::this_thread::sleep_for(std::chrono::milliseconds(chatServiceMs_));
+            return stand_in_completion(json::parse(body)).dump();
+        }
+        if (method == "POST" && path == "/v1/files") {
+            // multipart/form-data: the "file" part is the upload
+            size_t at = lower.find("boundary=");
+            if (at == std::string::npos) throw std::runtime_error("not multipart");
+            std::string boundary = "--" + headers.substr(at + 9, headers.find("\r\n", at) - at - 9);
+            size_t part = body.find("name=\"file\"");
+            size_t begin = part == std::string::npos ? part : body.find("\r\n\r\n", part);
+            if (begin == std::string::npos) throw std::runtime_error("no file part");
+            begin += 4;
+            size_t end = body.find("\r\n" + boundary, begin);
+            if (end == std::string::npos) throw std::runtime_error("unterminated file part");
+            std::lock_guard<std::mutex> lock(mu_);
+            std::string id = "file-" + std::to_string(++nextId_);
+            files_[id] = body.substr(begin, end - begin);
+            return json{{"id", id}, {"object", "file"}, {"bytes", end - begin}, {"purpose", "batch"}}.dump();
+        }
+        if (method == "POST" && path == "/v1/batches") {
+            json request = json::parse(body);
+            std::lock_guard<std::mutex> lock(mu_);
+            std::string input = request.value("input_file_id", "");
+            if (!files_.count(input)) {
+                status = 404;
+                return json{{"error", {{"message", "no such file: " + input}}}}.dump();
+            }
+            std::string id = "batch_" + std::to_string(++nextId_);
+            Batch& b = batches_[id];
+            b.inputFile = input;
+            runners_.emplace_back([this, id] { run(id); });
+            return describe(id, b).dump();
+        }
+        std::lock_guard<std::mutex> lock(mu_);
+        if (method == "GET" && path.compare(0, 12, "/v1/batches/") == 0) {
+            auto it = batches_.find(path.substr(12));
+            if (it != batches_.end()) return describe(it->first, it->second).dump();
+        }
+        if (method == "GET" && path.compare(0, 10, "/v1/files/") == 0 && path.size() > 18 &&
+            path.compare(path.size() - 8, 8, "/content") == 0) {
+            auto it = files_.find(path.substr(10, path.size() - 18));
+            if (it != files_.end()) return it->second;
+        }
+        status = 404;
+        return json{{"error", {{"message", "not found: " + method + " " + path}}}}.dump();
+    }
+
+    static json describe(const std::string& id, const Batch& b) {
+        auto fileId = [](const std::string& f) { return f.empty() ? json() : json(f); };
+        return {{"id", id},
+                {"object", "batch"},
+                {"endpoint", "/v1/chat/completions"},
+                {"input_file_id", b.inputFile},
+                {"completion_window", "24h"},
+                {"status", b.status},
+                {"output_file_id", fileId(b.outputFile)},
+                {"error_file_id", fileId(b.errorFile)},
+                {"request_counts", {{"total", b.total}, {"completed", b.completed}, {"failed", b.failed}}}};
+    }
+
+    // Runs a batch's requests, publishing the results when it ends
+    void run(const std::string& id) {
+        std::string input;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            input = files_[batches_[id].inputFile];
+        }
+        std::vector<std::string> lines;
+        std::stringstream ss(input);
+        for (std::string l; std::getline(ss, l);) {
+            if (!l.empty()) lines.push_back(l);
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        while (!stopping_ && seconds_since(t0) * 1e3 < validateMs_) std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            batches_[id].status = "in_progress";
+            batches_[id].total = lines.size();
+        }
+        t0 = std::chrono::steady_clock::now();
+        std::string output, errors;
+        bool expired = false;
+        for (size_t i = 0; i < lines.size() && !stopping_; ++i) {
+            if (expireAfter_ && i == expireAfter_) {
+                expired = true;
+                break;
+            }
+            json request = json::parse(lines[i]);
+            json result = {{"id", "batch_req_" + std::to_string(i)}, {"custom_id", request.value("custom_id", "")}};
+            size_t n = ++requestCount_;
+            bool fail = failEvery_ && n % failEvery_ == 0;
+            if (fail) {
+                ++failed_;
+                result["response"] = {{"status_code", 500},
+                                      {"body", {{"error", {{"message", "stand-in failure"}}}}}};
+                result["error"] = nullptr;
+                errors += result.dump() + "\n";
+            } else {
+                result["response"] = {{"status_code", 200}, {"body", stand_in_completion(request.at("body"))}};
+                result["error"] = nullptr;
+                if (garbleEvery_ && n % garbleEvery_ == 0) {
+                    ++failed_;
+                    output += result.dump().substr(0, 40) + "\n";
+                } else {
+                    output += result.dump() + "\n";
+                }
+            }
+            double due = (double)(i + 1) * perRequestMs_ - seconds_since(t0) * 1e3;
+            if (due > 1) std::this_thread::sleep_for(std::chrono::microseconds((long)(due * 1000)));
+            std::lock_guard<std::mutex> lock(mu_);
+            ++(fail ? batches_[id].failed : batches_[id].completed);
+        }
+        std::lock_guard<std::mutex> lock(mu_);
+        Batch& b = batches_[id];
+        if (!output.empty()) {
+            b.outputFile = "file-" + std::to_string(++nextId_);
+            files_[b.outputFile] = std::move(output);
+        }
+        if (!errors.empty()) {
+            b.errorFile = "file-" + std::to_string(++nextId_);
+            files_[b.errorFile] = std::move(errors);
+        }
+        b.status = expired ? "expired" : "completed";
+    }
+
+    void reply(int fd, const std::string& data) {
+        for (size_t sent = 0; sent < data.size();) {
+            ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) return;
+            sent += (size_t)n;
+        }
+    }
+
+    void finish(int fd) {
+        close(fd);
+        std::lock_guard<std::mutex> lock(mu_);
+        conns_.erase(std::find(conns_.begin(), conns_.end(), fd));
+        done_.notify_all();
+    }
+
+    int validateMs_;
+    double perRequestMs_;
+    int chatServiceMs_;
+    int listenFd_ = -1, port_ = 0;
+    std::atomic<bool> stopping_{false};
+    std::atomic<size_t> failEvery_{0}, garbleEvery_{0}, expireAfter_{0}, requestCount_{0}, failed_{0};
+    std::thread acceptor_;
+    std::vector<std::thread> runners_;
+    std::mutex mu_;
+    std::condition_variable done_;
+    std::vector<int> conns_;
+    uint64_t nextId_ = 0;
+    std::unordered_map<std::string, std::string> files_;
+    std::unordered_map<std::string, Batch> batches_;
+};
+
+// --batch against --bulk on a loopback stand-in of the API: HTTP requests,
+// bytes and time for the same corpus (checking every result against its
+// chunk), a rerun served from the memo, batches split by the per-batch
+// limit with injected failures, submit-then-resume, and an expired batch.
+// Args: [corpus MiB] (default 4); or "serve [port]" to run the stand-in
+// until Ctrl-C, for trying --bulk by hand
+static int bench_bulk(const std::vector<std::string>& args) {
+    if (!args.empty() && args[0] == "serve") {
+        InterruptGuard interruptGuard;
+        BatchStandInServer server(2000, 5, 200, args.size() > 1 ? std::atoi(args[1].c_str()) : 0);
+        std::cout << "stand-in API at http://127.0.0.1:" << server.port()
+                  << "/v1 (set OPENAI_BASE_URL to it); Ctrl-C stops" << std::endl;
+        while (!g_interrupted.load()) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        return 0;
+    }
+    size_t mib = args.size() > 0 ? (size_t)std::atol(args[0].c_str()) : 4;
+    BatchStandInServer server(200, 0.5, 20);
+    setenv("OPENAI_BASE_URL", ("http://127.0.0.1:" + std::to_string(server.port()) + "/v1").c_str(), 1);
+    setenv("OPENAI_API_KEY", "test", 0);
+
+    char dir[] = "/tmp/ai_study_bulk_XXXXXX";
+    if (!mkdtemp(dir)) throw std::runtime_error("mkdtemp failed");
+    std::vector<std::string> files, texts;
+    std::string list = std::string(dir) + "/list.txt";
+    {
+        std::ofstream listOut(list);
+        for (size_t f = 0; f < std::max<size_t>(mib, 1); ++f) {
+            files.push_back(std::string(dir) + "/notes" + std::to_string(f) + ".txt");
+            texts.push_back(synthetic_notes(1 << 20, 300 + f));
+            std::ofstream(files.back()) << texts.back();
+            listOut << files.back() << "\n";
+        }
+    }
+
+    // HTTP requests, bytes sent and received so far, over all endpoints
+    auto traffic = [] {
+        std::array<uint64_t, 3> t = {0, 0, 0};
+        for (const char* path : {"/chat/completions", "/files", "/batches", "/batches/{id}", "/files/{id}/content"}) {
+            EndpointMetrics& m = endpoint_metrics(path);
+            t[0] += m.requests.value();
+            t[1] += m.bytesSent.value();
+            t[2] += m.bytesReceived.value();
+        }
+        return t;
+    };
+    // Checks every line against the chunk it names; returns {ok, errors}
+    auto verify = [&](const std::string& out) {
+        size_t ok = 0, errors = 0;
+        std::stringstream ss(out);
+        for (std::string l; std::getline(ss, l);) {
+            json line = json::parse(l);
+            if (line.contains("error")) {
+                ++errors;
+                continue;
+            }
+            size_t f = std::find(files.begin(), files.end(), line.value("file", "")) - files.begin();
+            std::string tag = stand_in_tag(texts.at(f).substr(line["offset"].get<size_t>(), line["bytes"].get<size_t>()));
+            const json& r = line["result"];
+            if (r.value("summary", "") != "stand-in summary " + tag ||
+                r["flashcards"].at(0).value("question", "") != "stand-in card " + tag) {
+                throw std::runtime_error("bench bulk: wrong result for chunk " + line["chunk"].dump() + " of " + files[f]);
+            }
+            ++ok;
+        }
+        return std::make_pair(ok, errors);
+    };
+    auto report = [&](const char* label, const PipelineStats& st, const std::array<uint64_t, 3>& before,
+                      const std::string& out) {
+        std::array<uint64_t, 3> after = traffic();
+        std::pair<size_t, size_t> v = verify(out);
+        std::cout << "  " << label << ": " << st.chunks << " chunks in " << st.seconds << " s; "
+                  << after[0] - before[0] << " HTTP requests, " << (after[1] - before[1]) / 1048576.0 << " MiB up, "
+                  << (after[2] - before[2]) / 1048576.0 << " MiB down; " << v.first << " results checked, "
+                  << v.second << " errors\n";
+        return v;
+    };
+    BulkOptions bulk;
+    bulk.pollSeconds = 0.25;
+    std::cout << "bulk: " << files.size() << " MiB of notes, summary + flashcards per chunk; stand-in takes "
+              << "20 ms per chat request, 200 ms + 0.5 ms per request for a batch\n";
+
+    // The same corpus synchronously and as one batch
+    {
+        ResidentStore memo(nullptr);
+        std::ostringstream out;
+        std::array<uint64_t, 3> before = traffic();
+        PipelineStats st = run_batch(list, 3, false, 8, false, memo, out);
+        report("--batch, 8 workers", st, before, out.str());
+    }
+    ResidentStore memo(nullptr);
+    {
+        std::ostringstream out;
+        std::array<uint64_t, 3> before = traffic();
+        PipelineStats st = run_bulk(list, 3, false, bulk, memo, out);
+        report("--bulk           ", st, before, out.str());
+        out.str("");
+        before = traffic();
+        st = run_bulk(list, 3, false, bulk, memo, out);
+        report("--bulk rerun     ", st, before, out.str());
+    }
+
+    // Several batches (a chunk's summary and cards stay in the same one),
+    // with every 97th request failing and every 89th result line unreadable
+    size_t failedChunks = 0;
+    {
+        ResidentStore fresh(nullptr);
+        std::ostringstream out;
+        BulkOptions small = bulk;
+        small.maxRequests = 250;
+        server.set_fail_every(97);
+        server.set_garble_every(89);
+        size_t batchesBefore = server.batch_ids().size(), failedBefore = server.failed();
+        std::array<uint64_t, 3> before = traffic();
+        PipelineStats st = run_bulk(list, 3, false, small, fresh, out);
+        failedChunks = report("250 per batch    ", st, before, out.str()).second;
+        std::cout << "    " << server.batch_ids().size() - batchesBefore << " batches, "
+                  << server.failed() - failedBefore << " requests failed or garbled by the stand-in\n";
+        server.set_fail_every(0);
+        server.set_garble_every(0);
+        if (failedChunks == 0 || failedChunks > server.failed() - failedBefore || st.failed != failedChunks) {
+            throw std::runtime_error("bench bulk: failed requests and failed chunks disagree");
+        }
+    }
+
+    // Submit and exit, then collect by batch id from a fresh process state
+    {
+        ResidentStore fresh(nullptr);
+        std::ostringstream out;
+        BulkOptions detach = bulk;
+        detach.detach = true;
+        detach.maxRequests = 500;
+        size_t batchesBefore = server.batch_ids().size();
+        std::array<uint64_t, 3> before = traffic();
+        run_bulk(list, 3, false, detach, fresh, out);
+        std::vector<std::string> ids = server.batch_ids();
+        BulkOptions resume = bulk;
+        resume.resume.assign(ids.begin() + (long)batchesBefore, ids.end());
+        ResidentStore other(nullptr);
+        PipelineStats st = run_bulk(list, 3, false, resume, other, out);
+        if (report("detach + resume  ", st, before, out.str()).first == 0) {
+            throw std::runtime_error("bench bulk: resume collected nothing");
+        }
+    }
+
+    // A batch that expires part way: the chunks it never ran are reported
+    {
+        ResidentStore fresh(nullptr);
+        std::ostringstream out;
+        server.set_expire_after(300);
+        std::array<uint64_t, 3> before = traffic();
+        PipelineStats st = run_bulk(list, 3, false, bulk, fresh, out);
+        report("expires after 300", st, before, out.str());
+        server.set_expire_after(0);
+    }
 
-            // If the user ends a line with a backslash '\',
-            // keep reading additional lines and append them.
-            // This is a manual "multiline" mode.
-            while (!userText.empty() && userText.back() == '\\') {
-                // Remove the trailing backslash and add a newline
-                userText.pop_back();
-                userText += '\n';
+    for (const auto& f : files) unlink(f.c_str());
+    unlink(list.c_str());
+    rmdir(dir);
+    return 0;
+}
+
+// Dispatches --bench NAME to the matching benchmark
+static int run_benchmark(const AppOptions& opts) {
+    if (opts.benchName == "ingest") return bench_ingest(opts.benchArgs);
+    if (opts.benchName == "render") return bench_render(opts.benchArgs);
+    if (opts.benchName == "srs") return bench_srs(opts.benchArgs);
+    if (opts.benchName == "dedup") return bench_dedup(opts.benchArgs);
+    if (opts.benchName == "ann") return bench_ann(opts.benchArgs);
+    if (opts.benchName == "kernels") return bench_kernels(opts.benchArgs);
+    if (opts.benchName == "hedge") return bench_hedge(opts.benchArgs);
+    if (opts.benchName == "combined") return bench_combined(opts.benchArgs);
+    if (opts.benchName == "cdc") return bench_cdc(opts.benchArgs);
+    if (opts.benchName == "journal") return bench_journal(opts.benchArgs);
+    if (opts.benchName == "metrics") return bench_metrics(opts.benchArgs);
+    if (opts.benchName == "daemon") return bench_daemon(opts.benchArgs);
+    if (opts.benchName == "shmcache") return bench_shmcache(opts.benchArgs);
+    if (opts.benchName == "pool") return bench_pool(opts.benchArgs);
+    if (opts.benchName == "mpmc") return bench_mpmc(opts.benchArgs);
+    if (opts.benchName == "limiter") return bench_limiter(opts.benchArgs);
+    if (opts.benchName == "breaker") return bench_breaker(opts.benchArgs);
+    if (opts.benchName == "textrank") return bench_textrank(opts.benchArgs);
+    if (opts.benchName == "extract") return bench_extract(opts.benchArgs);
+    if (opts.benchName == "llm") return bench_llm(opts.benchArgs);
+    if (opts.benchName == "bulk") return bench_bulk(opts.benchArgs);
+    std::cerr << "Unknown benchmark: " << opts.benchName << "\n";
+    return 2;
+}
 
-                if (!std::getline(std::cin, line)) break;
+// ======== DEMO MAIN =========
 
-                // Stop if line is empty (user pressed Enter)
-                if (line.empty()) break;
+// --metrics-file output, written however the run ends
+static void write_metrics_file(const std::string& path) {
+    if (path.empty()) return;
+    try {
+        metrics().write_file(path);
+    } catch (const std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << "\n";
+    }
+}
 
-                // Append the newly read line
-                userText += line;
+// The --chunk-cache or --journal store (null when neither is given)
+static std::unique_ptr<ResultStore> open_result_store(const AppOptions& opts) {
+    if (!opts.journalPath.empty()) {
+        ResultJournal* journal = new ResultJournal(opts.journalPath);
+        std::unique_ptr<ResultStore> memo(journal);
+        if (journal->recovered() > 0 || journal->dropped_bytes() > 0) {
+            std::cerr << "Journal: resuming with " << journal->recovered() << " saved results";
+            if (journal->dropped_bytes() > 0) {
+                std::cerr << " (dropped " << journal->dropped_bytes() << " bytes of an unfinished write)";
             }
+            std::cerr << "\n";
+        }
+        return memo;
+    }
+    if (!opts.chunkCacheDir.empty()) return std::unique_ptr<ResultStore>(new ChunkMemo(opts.chunkCacheDir));
+    return nullptr;
+}
+
+int main(int argc, char** argv) {
+    // Global initialization for libcurl (must be paired with curl_global_cleanup)
+    curl_global_init(CURL_GLOBAL_DEFAULT);
 
-            // Final check: if userText ended up empty, stop
-            if (userText.empty()) {
-                std::cerr << "No text entered. Exiting.\n";
-                curl_global_cleanup();
-                return 0;
+    // No C stdio is used, so iostreams don't need to stay in lockstep with it
+    std::ios::sync_with_stdio(false);
+
+    std::string metricsFile;                      // written however the run ends
+    std::unique_ptr<MetricsServer> metricsServer;
+
+    try {
+        AppOptions opts = parse_args(argc, argv);
+        metricsFile = opts.metricsFile;
+        task_pool_threads() = opts.threads;
+        if (opts.metricsPort) metricsServer.reset(new MetricsServer(opts.metricsPort));
+        HttpPolicy& http = http_policy();
+        http.connectTimeoutMs = (long)(opts.connectTimeout * 1000);
+        http.totalTimeoutMs = (long)(opts.timeout * 1000);
+        http.idleTimeoutMs = (long)(opts.idleTimeout * 1000);
+        http.hedge = opts.hedge;
+        http.hedgeAfterMs = opts.hedgeAfterMs;
+        http.offlineFallback = opts.offlineFallback;
+        http.offline = opts.offline;
+
+        if (!opts.benchName.empty()) {
+            int rc = run_benchmark(opts);
+            curl_global_cleanup();
+            return rc;
+        }
+        if (!opts.routesPath.empty()) model_router().load_rules(opts.routesPath);
+        if (!opts.routeLogPath.empty()) model_router().open_log(opts.routeLogPath);
+        if (!opts.sharedCachePath.empty()) shared_cache().reset(new SharedCache(opts.sharedCachePath));
+        if (!opts.localModel.empty()) {
+            local_model().reset(new LocalModel(opts.localModel));
+            if (opts.showStats) std::cerr << "local model: " << local_model()->description() << "\n";
+        }
+
+        if (!opts.serveSocket.empty()) {
+            std::unique_ptr<ResultStore> backing = open_result_store(opts);
+            run_daemon(opts.serveSocket, backing.get(), opts.showStats);
+            write_metrics_file(metricsFile);
+            curl_global_cleanup();
+            return 0;
+        }
+        if (!opts.batchList.empty()) {
+            InterruptGuard interruptGuard;
+            std::unique_ptr<ResultStore> backing = open_result_store(opts);
+            ResidentStore memo(backing.get());
+            PipelineStats st;
+            if (opts.bulk) {
+                BulkOptions bulk;
+                bulk.pollSeconds = opts.bulkPoll;
+                bulk.detach = opts.bulkDetach;
+                std::stringstream ids(opts.bulkResume);
+                for (std::string id; std::getline(ids, id, ',');) {
+                    if (!id.empty()) bulk.resume.push_back(id);
+                }
+                st = run_bulk(opts.batchList, opts.mode ? opts.mode : 3, opts.combined, bulk, memo, std::cout);
+            } else {
+                st = run_batch(opts.batchList, opts.mode ? opts.mode : 3, opts.combined, opts.workers,
+                               opts.shed, memo, std::cout);
+            }
+            std::cerr << "batch: " << st.chunks << " chunks, " << st.bytes / 1048576.0 << " MiB in "
+                      << st.seconds << " s; " << st.failed << " failed, " << st.shed << " shed, "
+                      << memo.hits() << " reused; peak RSS " << peak_rss_mib() << " MiB\n";
+            if (opts.showStats) {
+                model_router().report(std::cerr);
+                std::cerr << "concurrency limit: " << chat_limiter().limit() << " in flight, "
+                          << chat_limiter().overloads() << " overload replies\n";
             }
+            write_metrics_file(metricsFile);
+            curl_global_cleanup();
+            return st.failed || st.shed ? 1 : 0;
+        }
+
+        // Study text comes from stdin when it is piped/redirected or "--input -"
+        bool stdinIsTty = isatty(STDIN_FILENO);
+        bool textFromStdin = opts.inputPath == "-" || (opts.inputPath.empty() && !stdinIsTty);
+
+        // 1) Ask user what they want the app to do (unless given or not interactive)
+        int choice = opts.mode ? opts.mode : 3;  // default to "both"
+        if (!opts.mode && stdinIsTty && !textFromStdin) {
+            std::cout << "What do you want?\n";
+            std::cout << "1 = Summary only\n";
+            std::cout << "2 = Flashcards only\n";
+            std::cout << "3 = Both summary + flashcards\n";
+            std::cout << "Enter choice (1/2/3): ";
+
+            std::cin >> choice;
+            // Clear leftover newline from the input buffer before using getline()
+            std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        }
+
+        // 2) Read the study text
+        std::string userText;
+        if (textFromStdin) {
+            userText = read_all_fd(STDIN_FILENO);
+        } else if (!opts.inputPath.empty()) {
+            userText = read_input_file(opts.inputPath);
+        } else {
+            std::cout << "\nPaste your study text below.\n";
+            std::cout << "End a line with '\\' to keep typing on the next line.\n";
+            std::cout << "When you're done, press Enter.\n\n";
+            userText = read_text_lines(std::cin);
+        }
+
+        if (userText.find_first_not_of(" \t\r\n") == std::string::npos) {
+            std::cerr << "No text entered. Exiting.\n";
+            curl_global_cleanup();
+            return 0;
+        }
+
+        // 3) Based on user choice, call summary and/or flashcard functions.
+        // Until the viewer starts, Ctrl-C cancels the request in flight.
+        InterruptGuard interruptGuard;
+
+        // --preview: something to read while the API call is in flight. It
+        // is extracted on its own thread (the request starts at once) and
+        // printed when ready; the API's summary waits for it.
+        std::future<void> preview;
+        if (opts.preview && !opts.offline && choice != 2) {
+            preview = std::async(std::launch::async, [&userText, &opts] {
+                auto t0 = std::chrono::steady_clock::now();
+                try {
+                    SummaryResult p = offline_summary(userText);
+                    std::cout << "\n=== PREVIEW (extracted locally; the full summary follows) ===\n"
+                              << p.summary << "\n" << std::flush;
+                    if (opts.showStats) std::cerr << "preview: " << seconds_since(t0) * 1e3 << " ms\n";
+                } catch (const std::exception& ex) {
+                    std::cerr << "(no preview: " << ex.what() << ")\n";
+                }
+            });
         }
 
-        // 3) Based on user choice, call summary and/or flashcard functions
+        // --chunk-cache / --journal: everything is worked out per chunk up
+        // front, reusing the results of chunks already done in earlier runs
+        bool memoized = !opts.chunkCacheDir.empty() || !opts.journalPath.empty();
+        // --daemon: a running daemon does the API work
+        bool remote = !opts.daemonSocket.empty();
+        bool precomputed = memoized || remote;
+
+        // With --prefetch a long text starts from its first chunk; the
+        // remaining chunks are processed while the user studies
+        std::vector<std::string> chunks{userText};
+        if (opts.prefetch && !precomputed) chunks = split_into_chunks(userText, kPrefetchChunkChars);
+
+        // --combined fetches both halves of mode 3 in one request (not when
+        // the text is chunked: the summary has to cover all of it)
+        bool combined = opts.combined && choice == 3 && chunks.size() == 1;
 
         // SUMMARY FLOW
+        SummaryResult s;
+        FlashcardResult f;
+
+        if (memoized) {
+            std::unique_ptr<ResultStore> memo = open_result_store(opts);
+            auto t0 = std::chrono::steady_clock::now();
+            memoized_study(userText, choice != 2, choice != 1, opts.combined, *memo, s, f);
+            if (opts.showStats) {
+                size_t lookups = memo->hits() + memo->misses();
+                std::cerr << "chunk results: " << memo->hits() << " of " << lookups << " lookups reused ("
+                          << 100.0 * memo->hits() / std::max<size_t>(lookups, 1) << "%), "
+                          << memo->misses() << " requests sent, " << seconds_since(t0) << " s\n";
+            }
+        } else if (remote) {
+            DaemonClient daemon(opts.daemonSocket);
+            daemon.study(job_type(choice, opts.combined), userText, s, f);
+        }
+
         if (choice == 1 || choice == 3) {
-            SummaryResult s = summarize_content(userText);
+            if (!precomputed) {
+                if (combined) summarize_and_generate(userText, s, f);
+                else s = summarize_content(userText);
+            }
+            if (preview.valid()) preview.get();
 
             std::cout << "\n=== SUMMARY ===\n" << s.summary << "\n\n";
 
@@ -493,20 +10041,89 @@ int main() {
             for (const auto& d : s.definitions) {
                 std::cout << d.term << ": " << d.definition << "\n";
             }
+            if (s.offline && !opts.offline) std::cerr << "\n(API unreachable: this summary was extracted from the text locally)\n";
         }
 
         // FLASHCARD FLOW
         if (choice == 2 || choice == 3) {
-            FlashcardResult f = generate_flashcards(userText);
-            // Launch interactive viewer only if we actually have flashcards
-            run_flashcard_viewer(f);
+            if (!precomputed && !combined) f = generate_flashcards(chunks[0]);
+            dedup_flashcards(f.flashcards, opts.dedupThreshold);
+            if (f.offline && !opts.offline) std::cerr << "(API unreachable: these flashcards were made from the text locally)\n";
+            std::unique_ptr<DeckPrefetcher> prefetcher;
+            if (opts.prefetch) {
+                prefetcher.reset(new DeckPrefetcher(userText, {chunks.begin() + 1, chunks.end()},
+                                                    opts.dedupThreshold));
+            }
+            std::unique_ptr<SrsScheduler> srs;
+            if (!opts.srsPath.empty()) {
+                srs.reset(new SrsScheduler());
+                srs->load(opts.srsPath);
+            }
+
+            // Semantic index over the deck (and summary) for "similar" lookups
+            // (if embedding fails here, the viewer retries when 's' is pressed)
+            StudyLibrary library(make_embedder(opts.embedder));
+            try {
+                library.add_cards(f.flashcards);
+                if (choice == 3) library.add_summary(s);
+            } catch (const std::exception& ex) {
+                std::cerr << "(similar-card index unavailable: " << ex.what() << ")\n";
+            }
+
+            interruptGuard.restore();
+            ViewerExtras extras;
+            extras.prefetcher = prefetcher.get();
+            extras.srs = srs.get();
+            extras.library = &library;
+
+            if (!textFromStdin) {
+                run_flashcard_viewer(f, std::cin, STDIN_FILENO, opts, extras);
+            } else {
+                // stdin is used up by the text: take viewer commands from the terminal
+                int ttyFd = open("/dev/tty", O_RDWR | O_CLOEXEC);
+                std::ifstream tty("/dev/tty");
+                if (ttyFd >= 0 && tty) run_flashcard_viewer(f, tty, ttyFd, opts, extras);
+                else print_flashcards(f);
+                if (ttyFd >= 0) close(ttyFd);
+            }
+            if (srs) srs->save(opts.srsPath);
         }
 
+        if (opts.showStats) {
+            model_router().report(std::cerr);
+            if (chat_breaker().trips() || chat_breaker().rejected()) {
+                std::cerr << "circuit breaker: opened " << chat_breaker().trips() << " times, "
+                          << chat_breaker().rejected() << " requests failed fast\n";
+            }
+            if (chat_limiter().overloads()) {
+                std::cerr << "concurrency limit: " << chat_limiter().limit() << " in flight after "
+                          << chat_limiter().overloads() << " overload replies\n";
+            }
+            if (SharedCache* shared = shared_cache().get()) {
+                std::cerr << "shared cache (all processes): " << shared->hits() << " hits, "
+                          << shared->misses() << " misses, " << shared->inserts() << " replies stored\n";
+            }
+            if (http.hedge) {
+                std::cerr << "hedging: " << hedge_stats().sent.value() << " duplicates sent, "
+                          << hedge_stats().won.value() << " finished first\n";
+            }
+            if (LocalModel* local = local_model().get()) {
+                LocalModel::Stats ls = local->stats();
+                std::cerr << "local model: " << ls.promptTokens << " prompt tokens (" << ls.reusedTokens
+                          << " reused from the KV cache) at "
+                          << (ls.promptTokens - ls.reusedTokens) / std::max(ls.prefillSeconds, 1e-9) << " tok/s, "
+                          << ls.generatedTokens << " generated at "
+                          << ls.generatedTokens / std::max(ls.decodeSeconds, 1e-9) << " tok/s; KV cache "
+                          << local->cache_bytes() / 1048576.0 << " MiB, peak RSS " << peak_rss_mib() << " MiB\n";
+            }
+        }
     } catch (const std::exception& ex) {
         // If any exception happens (curl, JSON, etc.), print error message
         std::cerr << "Error: " << ex.what() << "\n";
     }
 
+    write_metrics_file(metricsFile);
+
     // Clean up global curl state
     curl_global_cleanup();
     return 0;